@@ -2,124 +2,244 @@
 // SPDX-License-Identifier: MIT
 
 #include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
 
 #include "global_managers_init.hpp"
 #include "device.hpp"
 #include "context.hpp"
+#include "cli_parser.hpp"
 #include "pyrowave_encoder.hpp"
 #include "pyrowave_decoder.hpp"
+#include "pyrowave_common.hpp"
 #include "yuv4mpeg.hpp"
 #include "shaders/slangmosh.hpp"
 
 using namespace Granite;
 using namespace Vulkan;
+using namespace Util;
 
-static std::vector<uint8_t> example_payload;
+struct BenchConfig
+{
+	int width;
+	int height;
+	PyroWave::ChromaSubsampling chroma;
+	float bpp;
+	int precision;
+	bool fragment_path;
+	PyroWave::PayloadPath payload_path;
+};
 
-static void run_decoder_test(Device &device, PyroWave::Decoder &dec, const PyroWave::ViewBuffers &output)
+struct Samples
 {
-	for (uint32_t i = 0; i < 10000; i++)
+	std::vector<double> values;
+
+	void add(double value)
 	{
-		dec.clear();
-		dec.push_packet(example_payload.data(), example_payload.size());
-		if (!dec.decode_is_ready(false))
-			return;
+		values.push_back(value);
+	}
 
-		auto cmd = device.request_command_buffer();
+	double mean() const
+	{
+		double sum = 0.0;
+		for (auto v : values)
+			sum += v;
+		return values.empty() ? 0.0 : sum / double(values.size());
+	}
 
-		cmd->begin_barrier_batch();
-		for (auto &plane: output.planes)
+	// Nearest-rank percentile.
+	double percentile(double p) const
+	{
+		if (values.empty())
+			return 0.0;
+		auto sorted = values;
+		std::sort(sorted.begin(), sorted.end());
+		auto rank = size_t(ceil(p * double(sorted.size())));
+		rank = std::max<size_t>(rank, 1);
+		return sorted[std::min(rank, sorted.size()) - 1];
+	}
+};
+
+enum CPUMetric
+{
+	METRIC_ENCODE_RECORD,
+	METRIC_ENCODE_LATENCY,
+	METRIC_PACKETIZE,
+	METRIC_PUSH_PACKET,
+	METRIC_DECODE_RECORD,
+	METRIC_DECODE_LATENCY,
+	METRIC_COUNT
+};
+
+static const char *cpu_metric_names[METRIC_COUNT] = {
+	"encode_record",
+	"encode_latency",
+	"packetize",
+	"push_packet",
+	"decode_record",
+	"decode_latency",
+};
+
+struct BenchResult
+{
+	BenchConfig config;
+	bool supported = false;
+	size_t target_bytes = 0;
+	double encoded_bytes = 0.0;
+	double num_packets = 0.0;
+	// All in microseconds.
+	Samples cpu[METRIC_COUNT];
+	std::vector<std::pair<std::string, double>> gpu;
+};
+
+struct BenchOptions
+{
+	std::string input_path;
+	std::vector<std::pair<int, int>> resolutions = {
+		{ 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 }, { 7680, 4320 },
+	};
+	std::vector<PyroWave::ChromaSubsampling> chroma = {
+		PyroWave::ChromaSubsampling::Chroma420, PyroWave::ChromaSubsampling::Chroma444,
+	};
+	std::vector<float> bpp = { 1.0f, 2.0f, 4.0f };
+	std::vector<int> precision;
+	std::vector<bool> fragment_path = { false, true };
+	std::vector<PyroWave::PayloadPath> payload_path = { PyroWave::PayloadPath::Auto };
+	size_t packet_size = 1400;
+	unsigned iterations = 200;
+	unsigned warmup = 20;
+	std::string json_path;
+	std::string csv_path;
+};
+
+static double elapsed_us(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+static std::vector<std::string> split_list(const char *str)
+{
+	std::vector<std::string> result;
+	std::string current;
+
+	for (const char *c = str; *c; c++)
+	{
+		if (*c == ',')
 		{
-			if (PyroWave::Decoder::device_prefers_fragment_path(device))
-			{
-				cmd->image_barrier(plane->get_image(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL,
-				                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0,
-				                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-				                   VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
-			}
-			else
-			{
-				cmd->image_barrier(plane->get_image(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
-				                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
-				                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
-			}
+			if (!current.empty())
+				result.push_back(std::move(current));
+			current.clear();
 		}
-		cmd->end_barrier_batch();
+		else
+			current += *c;
+	}
 
-		auto start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-		dec.decode(*cmd, output);
-		auto end_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-		device.register_time_interval("GPU", std::move(start_ts), std::move(end_ts), "Overall Decode");
-		device.submit(cmd);
-		device.next_frame_context();
-		//LOGI("Submitted decoder frame %05u ...\n", i);
+	if (!current.empty())
+		result.push_back(std::move(current));
+	return result;
+}
+
+static const char *chroma_to_string(PyroWave::ChromaSubsampling chroma)
+{
+	return chroma == PyroWave::ChromaSubsampling::Chroma420 ? "420" : "444";
+}
+
+static const char *payload_path_to_string(PyroWave::PayloadPath path)
+{
+	switch (path)
+	{
+	case PyroWave::PayloadPath::StorageBuffer:
+		return "ssbo";
+	case PyroWave::PayloadPath::TexelBuffer:
+		return "texel";
+	case PyroWave::PayloadPath::LinearImage:
+		return "linear";
+	default:
+		return "auto";
 	}
 }
 
-static void run_encoder_test(Device &device,
-                             PyroWave::Encoder &enc,
-                             const PyroWave::ViewBuffers &inputs)
+struct InputFrame
 {
-	BufferCreateInfo buffer_info = {};
-	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	int width = 0;
+	int height = 0;
+	PyroWave::ChromaSubsampling chroma = {};
+	VkFormat format = VK_FORMAT_R8_UNORM;
+	std::vector<uint8_t> planes[3];
+};
 
-	constexpr uint32_t bitstream_size = 500000;
+static bool load_input_frame(const std::string &path, InputFrame &frame)
+{
+	YUV4MPEGFile input;
+	if (!input.open_read(path) || !input.begin_frame())
+		return false;
 
-	buffer_info.size = enc.get_meta_required_size();
-	buffer_info.domain = BufferDomain::Device;
-	auto meta = device.create_buffer(buffer_info);
-	buffer_info.domain = BufferDomain::CachedHost;
-	auto meta_host = device.create_buffer(buffer_info);
+	auto bytes = YUV4MPEGFile::format_to_bytes_per_component(input.get_format());
+	frame.width = input.get_width();
+	frame.height = input.get_height();
+	frame.format = bytes == 2 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM;
+	frame.chroma = YUV4MPEGFile::format_has_subsampling(input.get_format()) ?
+	               PyroWave::ChromaSubsampling::Chroma420 : PyroWave::ChromaSubsampling::Chroma444;
 
-	buffer_info.size = bitstream_size + 2 * enc.get_meta_required_size();
-	buffer_info.domain = BufferDomain::Device;
-	auto bitstream = device.create_buffer(buffer_info);
-	buffer_info.domain = BufferDomain::CachedHost;
-	auto bitstream_host = device.create_buffer(buffer_info);
+	for (int i = 0; i < 3; i++)
+	{
+		int w = frame.width;
+		int h = frame.height;
+		if (i != 0 && frame.chroma == PyroWave::ChromaSubsampling::Chroma420)
+		{
+			w >>= 1;
+			h >>= 1;
+		}
 
-	PyroWave::Encoder::BitstreamBuffers buffers = {};
-	buffers.meta.buffer = meta.get();
-	buffers.meta.size = meta->get_create_info().size;
-	buffers.bitstream.buffer = bitstream.get();
-	buffers.bitstream.size = bitstream->get_create_info().size;
-	buffers.target_size = bitstream_size;
+		frame.planes[i].resize(size_t(w) * h * bytes);
+		if (!input.read(frame.planes[i].data(), frame.planes[i].size()))
+		{
+			LOGE("Failed to read plane.\n");
+			return false;
+		}
+	}
 
-	Fence fence;
+	return true;
+}
+
+// Deterministic content with both smooth gradients and fine detail,
+// so rate control has a mix of cheap and expensive blocks to deal with.
+static void generate_synthetic_frame(InputFrame &frame, int width, int height, PyroWave::ChromaSubsampling chroma)
+{
+	frame.width = width;
+	frame.height = height;
+	frame.chroma = chroma;
+	frame.format = VK_FORMAT_R8_UNORM;
 
-	for (uint32_t i = 0; i < 10000; i++)
+	uint32_t seed = 1;
+	for (int i = 0; i < 3; i++)
 	{
-		auto cmd = device.request_command_buffer(CommandBuffer::Type::AsyncCompute);
-		auto start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-		enc.encode(*cmd, inputs, buffers);
-		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-					 VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
-		auto end_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-		device.register_time_interval("GPU", std::move(start_ts), std::move(end_ts), "Overall Encode");
-		start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-		cmd->copy_buffer(*bitstream_host, *bitstream);
-		cmd->copy_buffer(*meta_host, *meta);
-		cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
-		             VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-					 VK_ACCESS_HOST_READ_BIT);
-		end_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
-		device.register_time_interval("GPU", std::move(start_ts), std::move(end_ts), "Bitstream Readback");
-		fence.reset();
-		device.submit(cmd, &fence);
-		device.next_frame_context();
-		//LOGI("Submitted encoder frame %05u ...\n", i);
-	}
+		int w = width;
+		int h = height;
+		if (i != 0 && chroma == PyroWave::ChromaSubsampling::Chroma420)
+		{
+			w >>= 1;
+			h >>= 1;
+		}
 
-	fence->wait();
+		frame.planes[i].resize(size_t(w) * h);
+		auto *data = frame.planes[i].data();
 
-	PyroWave::Encoder::Packet packet = {};
-	example_payload.resize(500000);
-	auto num_packets = enc.compute_num_packets(device.map_host_buffer(*meta_host, MEMORY_ACCESS_READ_BIT), 500000);
-	(void)num_packets;
-	assert(num_packets == 1);
-	enc.packetize(&packet, 500000, example_payload.data(), example_payload.size(),
-	              device.map_host_buffer(*meta_host, MEMORY_ACCESS_READ_BIT),
-	              device.map_host_buffer(*bitstream_host, MEMORY_ACCESS_READ_BIT));
-	example_payload.resize(packet.size);
+		for (int y = 0; y < h; y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				seed = seed * 1103515245u + 12345u;
+				int v = i == 0 ? (x * 255) / w : 128 + ((y * 64) / h) - 32;
+				if (((x >> 5) ^ (y >> 5)) & 1)
+					v += int((seed >> 16) & 31) - 16;
+				data[y * w + x] = uint8_t(std::min(std::max(v, 0), 255));
+			}
+		}
+	}
 }
 
 struct YCbCrImages
@@ -157,31 +277,8 @@ static YCbCrImages create_ycbcr_images(Device &device, int width, int height, Vk
 	return images;
 }
 
-static void run_vulkan_test(Device &device, const char *in_path)
+static void upload_input_frame(Device &device, const YCbCrImages &inputs, const InputFrame &frame)
 {
-	YUV4MPEGFile input;
-
-	if (!input.open_read(in_path))
-		return;
-
-	auto width = input.get_width();
-	auto height = input.get_height();
-
-	auto fmt = YUV4MPEGFile::format_to_bytes_per_component(input.get_format()) == 2 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM;
-	auto chroma = YUV4MPEGFile::format_has_subsampling(input.get_format()) ? PyroWave::ChromaSubsampling::Chroma420 : PyroWave::ChromaSubsampling::Chroma444;
-	auto inputs = create_ycbcr_images(device, width, height, fmt, chroma);
-
-	PyroWave::Encoder enc;
-	PyroWave::Decoder dec;
-	if (!enc.init(&device, width, height, chroma))
-		return;
-
-	if (!dec.init(&device, width, height, chroma, PyroWave::Decoder::device_prefers_fragment_path(device)))
-		return;
-
-	if (!input.begin_frame())
-		return;
-
 	auto cmd = device.request_command_buffer();
 
 	for (int i = 0; i < 3; i++)
@@ -193,13 +290,8 @@ static void run_vulkan_test(Device &device, const char *in_path)
 
 	for (int i = 0; i < 3; i++)
 	{
-		auto *y = cmd->update_image(*inputs.images[i]);
-		if (!input.read(y, inputs.images[i]->get_width() * inputs.images[i]->get_height()))
-		{
-			LOGE("Failed to read plane.\n");
-			device.submit_discard(cmd);
-			return;
-		}
+		auto *dst = cmd->update_image(*inputs.images[i]);
+		memcpy(dst, frame.planes[i].data(), frame.planes[i].size());
 	}
 
 	for (int i = 0; i < 3; i++)
@@ -210,46 +302,563 @@ static void run_vulkan_test(Device &device, const char *in_path)
 	}
 
 	device.submit(cmd);
+}
 
-	run_encoder_test(device, enc, inputs.views);
+static void drain_frame_contexts(Device &device)
+{
 	for (int i = 0; i < 4; i++)
 		device.next_frame_context();
-	device.timestamp_log([](const std::string &tag, const TimestampIntervalReport &report)
+}
+
+static bool run_config(Device &device, const BenchOptions &options, const InputFrame &frame, BenchResult &result)
+{
+	auto &config = result.config;
+	PyroWave::Configuration::get().set_precision(config.precision);
+	PyroWave::Configuration::get().set_payload_path(config.payload_path);
+
+	PyroWave::Encoder enc;
+	PyroWave::Decoder dec;
+
+	if (!enc.init(&device, config.width, config.height, config.chroma))
 	{
-		LOGI("%s -> %.3f us avg\n", tag.c_str(), report.time_per_frame_context * 1e6);
-	});
-	device.timestamp_log_reset();
+		LOGW("Encoder does not support this configuration, skipping.\n");
+		return false;
+	}
+
+	if (!dec.init(&device, config.width, config.height, config.chroma, config.fragment_path))
+	{
+		LOGW("Decoder does not support this configuration, skipping.\n");
+		return false;
+	}
+
+	auto inputs = create_ycbcr_images(device, config.width, config.height, frame.format, config.chroma);
+	auto outputs = create_ycbcr_images(device, config.width, config.height, frame.format, config.chroma);
+	upload_input_frame(device, inputs, frame);
+
+	result.target_bytes = size_t(double(config.width) * config.height * config.bpp / 8.0);
+
+	BufferCreateInfo buffer_info = {};
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+	buffer_info.size = enc.get_meta_required_size();
+	buffer_info.domain = BufferDomain::Device;
+	auto meta = device.create_buffer(buffer_info);
+	buffer_info.domain = BufferDomain::CachedHost;
+	auto meta_host = device.create_buffer(buffer_info);
+
+	buffer_info.size = result.target_bytes + 2 * enc.get_meta_required_size();
+	buffer_info.domain = BufferDomain::Device;
+	auto bitstream = device.create_buffer(buffer_info);
+	buffer_info.domain = BufferDomain::CachedHost;
+	auto bitstream_host = device.create_buffer(buffer_info);
+
+	PyroWave::Encoder::BitstreamBuffers buffers = {};
+	buffers.meta.buffer = meta.get();
+	buffers.meta.size = meta->get_create_info().size;
+	buffers.bitstream.buffer = bitstream.get();
+	buffers.bitstream.size = bitstream->get_create_info().size;
+	buffers.target_size = result.target_bytes;
+
+	std::vector<uint8_t> payload(bitstream->get_create_info().size);
+	std::vector<PyroWave::Encoder::Packet> packets;
+	std::vector<PyroWave::Decoder::PacketData> packet_data;
+
+	Fence fence;
+	size_t total_bytes = 0;
+	size_t total_packets = 0;
+
+	for (unsigned i = 0; i < options.warmup + options.iterations; i++)
+	{
+		bool measure = i >= options.warmup;
+
+		if (i == options.warmup)
+		{
+			drain_frame_contexts(device);
+			device.timestamp_log_reset();
+		}
+
+		auto encode_start = std::chrono::steady_clock::now();
+		auto cmd = device.request_command_buffer(CommandBuffer::Type::AsyncCompute);
+		if (!enc.encode(*cmd, inputs.views, buffers))
+		{
+			device.submit_discard(cmd);
+			LOGE("Failed to encode.\n");
+			return false;
+		}
+
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		             VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+		cmd->copy_buffer(*bitstream_host, *bitstream);
+		cmd->copy_buffer(*meta_host, *meta);
+		cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		auto encode_recorded = std::chrono::steady_clock::now();
+
+		fence.reset();
+		device.submit(cmd, &fence);
+		fence->wait();
+		auto encode_done = std::chrono::steady_clock::now();
+
+		auto *mapped_meta = device.map_host_buffer(*meta_host, MEMORY_ACCESS_READ_BIT);
+		auto *mapped_bitstream = device.map_host_buffer(*bitstream_host, MEMORY_ACCESS_READ_BIT);
+
+		auto packetize_start = std::chrono::steady_clock::now();
+		packets.resize(enc.compute_num_packets(mapped_meta, options.packet_size));
+		size_t num_packets = enc.packetize(packets.data(), options.packet_size,
+		                                   payload.data(), payload.size(),
+		                                   mapped_meta, mapped_bitstream);
+		auto packetize_done = std::chrono::steady_clock::now();
+
+		packet_data.clear();
+		for (size_t p = 0; p < num_packets; p++)
+			packet_data.push_back({ payload.data() + packets[p].offset, packets[p].size });
+
+		auto push_start = std::chrono::steady_clock::now();
+		dec.clear();
+		for (auto &packet : packet_data)
+		{
+			if (!dec.push_packet(packet.data, packet.size))
+			{
+				LOGE("Failed to push packet.\n");
+				return false;
+			}
+		}
+		auto push_done = std::chrono::steady_clock::now();
+
+		if (!dec.decode_is_ready(false))
+		{
+			LOGE("Decoder did not receive a complete frame.\n");
+			return false;
+		}
+
+		auto decode_start = std::chrono::steady_clock::now();
+		cmd = device.request_command_buffer();
+
+		cmd->begin_barrier_batch();
+		for (auto &plane : outputs.views.planes)
+		{
+			if (config.fragment_path)
+			{
+				cmd->image_barrier(plane->get_image(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL,
+				                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0,
+				                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+				                   VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+			}
+			else
+			{
+				cmd->image_barrier(plane->get_image(), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+				                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+				                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+			}
+		}
+		cmd->end_barrier_batch();
+
+		if (!dec.decode(*cmd, outputs.views))
+		{
+			device.submit_discard(cmd);
+			LOGE("Failed to decode.\n");
+			return false;
+		}
+		auto decode_recorded = std::chrono::steady_clock::now();
+
+		fence.reset();
+		device.submit(cmd, &fence);
+		fence->wait();
+		auto decode_done = std::chrono::steady_clock::now();
 
-	run_decoder_test(device, dec, inputs.views);
-	for (int i = 0; i < 4; i++)
 		device.next_frame_context();
-	device.timestamp_log([](const std::string &tag, const TimestampIntervalReport &report)
+
+		if (!measure)
+			continue;
+
+		result.cpu[METRIC_ENCODE_RECORD].add(elapsed_us(encode_start, encode_recorded));
+		result.cpu[METRIC_ENCODE_LATENCY].add(elapsed_us(encode_start, encode_done));
+		result.cpu[METRIC_PACKETIZE].add(elapsed_us(packetize_start, packetize_done));
+		result.cpu[METRIC_PUSH_PACKET].add(elapsed_us(push_start, push_done));
+		result.cpu[METRIC_DECODE_RECORD].add(elapsed_us(decode_start, decode_recorded));
+		result.cpu[METRIC_DECODE_LATENCY].add(elapsed_us(decode_start, decode_done));
+
+		for (size_t p = 0; p < num_packets; p++)
+			total_bytes += packets[p].size;
+		total_packets += num_packets;
+	}
+
+	drain_frame_contexts(device);
+	device.timestamp_log([&](const std::string &tag, const TimestampIntervalReport &report)
 	{
-		LOGI("%s -> %.3f us avg\n", tag.c_str(), report.time_per_frame_context * 1e6);
+		result.gpu.emplace_back(tag, report.time_per_frame_context * 1e6);
 	});
 	device.timestamp_log_reset();
+	device.wait_idle();
+
+	if (options.iterations)
+	{
+		result.encoded_bytes = double(total_bytes) / options.iterations;
+		result.num_packets = double(total_packets) / options.iterations;
+	}
+
+	return true;
 }
 
-static void run_vulkan_test(const char *in_path)
+static void write_json_string(FILE *file, const char *str)
 {
-	if (!Context::init_loader(nullptr))
+	fputc('"', file);
+	for (const char *c = str; *c; c++)
+	{
+		if (*c == '"' || *c == '\\')
+			fputc('\\', file);
+		if (uint8_t(*c) >= 0x20)
+			fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+static bool write_json(const std::string &path, const char *device_name, const std::vector<BenchResult> &results)
+{
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", path.c_str());
+		return false;
+	}
+
+	fprintf(file, "{\n\t\"device\": ");
+	write_json_string(file, device_name);
+	fprintf(file, ",\n\t\"results\": [");
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto &res = results[i];
+		auto &cfg = res.config;
+
+		fprintf(file, "%s\n\t\t{\n", i ? "," : "");
+		fprintf(file, "\t\t\t\"width\": %d, \"height\": %d, \"chroma\": \"%s\", \"bpp\": %.3f, \"precision\": %d,\n",
+		        cfg.width, cfg.height, chroma_to_string(cfg.chroma), cfg.bpp, cfg.precision);
+		fprintf(file, "\t\t\t\"path\": \"%s\", \"payload\": \"%s\", \"supported\": %s",
+		        cfg.fragment_path ? "fragment" : "compute", payload_path_to_string(cfg.payload_path),
+		        res.supported ? "true" : "false");
+
+		if (res.supported)
+		{
+			fprintf(file, ",\n\t\t\t\"target_bytes\": %zu, \"encoded_bytes\": %.1f, \"packets\": %.1f,\n",
+			        res.target_bytes, res.encoded_bytes, res.num_packets);
+
+			fprintf(file, "\t\t\t\"cpu_us\": {");
+			for (int m = 0; m < METRIC_COUNT; m++)
+			{
+				auto &s = res.cpu[m];
+				fprintf(file, "%s\n\t\t\t\t\"%s\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f }",
+				        m ? "," : "", cpu_metric_names[m],
+				        s.mean(), s.percentile(0.5), s.percentile(0.99), s.percentile(0.999));
+			}
+			fprintf(file, "\n\t\t\t},\n\t\t\t\"gpu_us\": {");
+			for (size_t g = 0; g < res.gpu.size(); g++)
+			{
+				fprintf(file, "%s\n\t\t\t\t", g ? "," : "");
+				write_json_string(file, res.gpu[g].first.c_str());
+				fprintf(file, ": %.3f", res.gpu[g].second);
+			}
+			fprintf(file, "\n\t\t\t}");
+		}
+
+		fprintf(file, "\n\t\t}");
+	}
+
+	fprintf(file, "\n\t]\n}\n");
+	fclose(file);
+	return true;
+}
+
+// Long format, one row per metric, so stages can be pivoted freely in a spreadsheet.
+static bool write_csv(const std::string &path, const std::vector<BenchResult> &results)
+{
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing.\n", path.c_str());
+		return false;
+	}
+
+	fprintf(file, "width,height,chroma,bpp,precision,path,payload,metric,mean_us,p50_us,p99_us,p999_us\n");
+
+	for (auto &res : results)
+	{
+		if (!res.supported)
+			continue;
+
+		auto &cfg = res.config;
+		char prefix[256];
+		snprintf(prefix, sizeof(prefix), "%d,%d,%s,%.3f,%d,%s,%s",
+		         cfg.width, cfg.height, chroma_to_string(cfg.chroma), cfg.bpp, cfg.precision,
+		         cfg.fragment_path ? "fragment" : "compute", payload_path_to_string(cfg.payload_path));
+
+		for (int m = 0; m < METRIC_COUNT; m++)
+		{
+			auto &s = res.cpu[m];
+			fprintf(file, "%s,cpu:%s,%.3f,%.3f,%.3f,%.3f\n", prefix, cpu_metric_names[m],
+			        s.mean(), s.percentile(0.5), s.percentile(0.99), s.percentile(0.999));
+		}
+
+		for (auto &gpu : res.gpu)
+			fprintf(file, "%s,gpu:%s,%.3f,,,\n", prefix, gpu.first.c_str(), gpu.second);
+	}
+
+	fclose(file);
+	return true;
+}
+
+static void print_result(const BenchResult &res)
+{
+	auto &cfg = res.config;
+	LOGI("%dx%d %s %.2f bpp, precision %d, %s, payload %s\n",
+	     cfg.width, cfg.height, chroma_to_string(cfg.chroma), cfg.bpp, cfg.precision,
+	     cfg.fragment_path ? "fragment" : "compute", payload_path_to_string(cfg.payload_path));
+
+	if (!res.supported)
+	{
+		LOGI("  unsupported\n");
 		return;
+	}
 
-	Context ctx;
+	LOGI("  %.0f / %zu bytes in %.1f packets\n", res.encoded_bytes, res.target_bytes, res.num_packets);
+	for (int m = 0; m < METRIC_COUNT; m++)
+	{
+		auto &s = res.cpu[m];
+		LOGI("  CPU %-16s p50 %9.3f us, p99 %9.3f us, p99.9 %9.3f us\n", cpu_metric_names[m],
+		     s.percentile(0.5), s.percentile(0.99), s.percentile(0.999));
+	}
 
-	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0, CONTEXT_CREATION_ENABLE_PUSH_DESCRIPTOR_BIT))
+	for (auto &gpu : res.gpu)
+		LOGI("  GPU %-16s avg %9.3f us\n", gpu.first.c_str(), gpu.second);
+}
+
+static void run_bench(Device &device, const BenchOptions &options)
+{
+	InputFrame input_frame;
+	bool has_input = !options.input_path.empty();
+	if (has_input && !load_input_frame(options.input_path, input_frame))
+	{
+		LOGE("Failed to load %s.\n", options.input_path.c_str());
 		return;
+	}
 
-	Device dev;
-	dev.set_context(ctx);
+	// Sweeps over resolution and chroma only apply to synthetic content.
+	std::vector<std::pair<int, int>> resolutions = options.resolutions;
+	std::vector<PyroWave::ChromaSubsampling> chromas = options.chroma;
+	if (has_input)
+	{
+		resolutions = { { input_frame.width, input_frame.height } };
+		chromas = { input_frame.chroma };
+	}
+
+	std::vector<int> precisions = options.precision;
+	if (precisions.empty())
+		precisions.push_back(PyroWave::Configuration::get().get_precision());
+
+	auto original_precision = PyroWave::Configuration::get().get_precision();
+	auto original_payload_path = PyroWave::Configuration::get().get_payload_path();
+
+	std::vector<BenchResult> results;
+
+	for (auto &res : resolutions)
+	{
+		for (auto chroma : chromas)
+		{
+			InputFrame synthetic_frame;
+			if (!has_input)
+				generate_synthetic_frame(synthetic_frame, res.first, res.second, chroma);
+			const InputFrame &frame = has_input ? input_frame : synthetic_frame;
+
+			for (float bpp : options.bpp)
+			{
+				for (int precision : precisions)
+				{
+					for (bool fragment_path : options.fragment_path)
+					{
+						for (auto payload_path : options.payload_path)
+						{
+							BenchResult result;
+							result.config = { res.first, res.second, chroma, bpp, precision, fragment_path, payload_path };
+							result.supported = run_config(device, options, frame, result);
+							print_result(result);
+							results.push_back(std::move(result));
+						}
+					}
+				}
+			}
+		}
+	}
+
+	PyroWave::Configuration::get().set_precision(original_precision);
+	PyroWave::Configuration::get().set_payload_path(original_payload_path);
 
-	run_vulkan_test(dev, in_path);
+	const char *device_name = device.get_gpu_properties().deviceName;
+	if (!options.json_path.empty())
+		write_json(options.json_path, device_name, results);
+	if (!options.csv_path.empty())
+		write_csv(options.csv_path, results);
+}
+
+static void print_help()
+{
+	LOGI("Usage: pyrowave-bench\n"
+	     "\t[--input <input.y4m>] (first frame is used, overrides --resolutions and --chroma)\n"
+	     "\t[--resolutions 1280x720,1920x1080,...]\n"
+	     "\t[--chroma 420,444]\n"
+	     "\t[--bpp 1,2,4] (target bits per pixel)\n"
+	     "\t[--precision 0,1,2] (default: PYROWAVE_PRECISION)\n"
+	     "\t[--paths compute,fragment]\n"
+	     "\t[--payload auto,ssbo,texel,linear]\n"
+	     "\t[--packet-size <bytes>]\n"
+	     "\t[--iterations <count>]\n"
+	     "\t[--warmup <count>]\n"
+	     "\t[--json <output.json>]\n"
+	     "\t[--csv <output.csv>]\n");
+}
+
+static bool parse_options(BenchOptions &options, int argc, char **argv, bool &help)
+{
+	bool valid = true;
+	CLICallbacks cbs;
+
+	cbs.add("--input", [&](CLIParser &parser) { options.input_path = parser.next_string(); });
+	cbs.add("--resolutions", [&](CLIParser &parser)
+	{
+		options.resolutions.clear();
+		for (auto &res : split_list(parser.next_string()))
+		{
+			int w = 0, h = 0;
+			if (sscanf(res.c_str(), "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+			{
+				LOGE("Invalid resolution: %s\n", res.c_str());
+				valid = false;
+			}
+			else
+				options.resolutions.emplace_back(w, h);
+		}
+	});
+	cbs.add("--chroma", [&](CLIParser &parser)
+	{
+		options.chroma.clear();
+		for (auto &chroma : split_list(parser.next_string()))
+		{
+			if (chroma == "420")
+				options.chroma.push_back(PyroWave::ChromaSubsampling::Chroma420);
+			else if (chroma == "444")
+				options.chroma.push_back(PyroWave::ChromaSubsampling::Chroma444);
+			else
+			{
+				LOGE("Invalid chroma: %s\n", chroma.c_str());
+				valid = false;
+			}
+		}
+	});
+	cbs.add("--bpp", [&](CLIParser &parser)
+	{
+		options.bpp.clear();
+		for (auto &bpp : split_list(parser.next_string()))
+			options.bpp.push_back(strtof(bpp.c_str(), nullptr));
+	});
+	cbs.add("--precision", [&](CLIParser &parser)
+	{
+		options.precision.clear();
+		for (auto &precision : split_list(parser.next_string()))
+			options.precision.push_back(int(strtol(precision.c_str(), nullptr, 0)));
+	});
+	cbs.add("--paths", [&](CLIParser &parser)
+	{
+		options.fragment_path.clear();
+		for (auto &path : split_list(parser.next_string()))
+		{
+			if (path == "compute")
+				options.fragment_path.push_back(false);
+			else if (path == "fragment")
+				options.fragment_path.push_back(true);
+			else
+			{
+				LOGE("Invalid decoder path: %s\n", path.c_str());
+				valid = false;
+			}
+		}
+	});
+	cbs.add("--payload", [&](CLIParser &parser)
+	{
+		options.payload_path.clear();
+		for (auto &path : split_list(parser.next_string()))
+		{
+			if (path == "auto")
+				options.payload_path.push_back(PyroWave::PayloadPath::Auto);
+			else if (path == "ssbo")
+				options.payload_path.push_back(PyroWave::PayloadPath::StorageBuffer);
+			else if (path == "texel")
+				options.payload_path.push_back(PyroWave::PayloadPath::TexelBuffer);
+			else if (path == "linear")
+				options.payload_path.push_back(PyroWave::PayloadPath::LinearImage);
+			else
+			{
+				LOGE("Invalid payload path: %s\n", path.c_str());
+				valid = false;
+			}
+		}
+	});
+	cbs.add("--packet-size", [&](CLIParser &parser) { options.packet_size = parser.next_uint(); });
+	cbs.add("--iterations", [&](CLIParser &parser) { options.iterations = parser.next_uint(); });
+	cbs.add("--warmup", [&](CLIParser &parser) { options.warmup = parser.next_uint(); });
+	cbs.add("--json", [&](CLIParser &parser) { options.json_path = parser.next_string(); });
+	cbs.add("--csv", [&](CLIParser &parser) { options.csv_path = parser.next_string(); });
+	cbs.add("--help", [](CLIParser &parser) { parser.end(); });
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return false;
+
+	help = parser.is_ended_state();
+
+	for (int precision : options.precision)
+	{
+		if (precision < 0 || precision > 2)
+		{
+			LOGE("Precision must be in range [0, 2].\n");
+			valid = false;
+		}
+	}
+
+	if (options.packet_size == 0)
+	{
+		LOGE("Packet size must be non-zero.\n");
+		valid = false;
+	}
+
+	return valid;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 2)
+	BenchOptions options;
+	bool help = false;
+
+	if (!parse_options(options, argc, argv, help))
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+	else if (help)
+	{
+		print_help();
+		return EXIT_SUCCESS;
+	}
+
+	if (!Context::init_loader(nullptr))
 		return EXIT_FAILURE;
 
-	run_vulkan_test(argv[1]);
+	Context ctx;
+
+	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0, CONTEXT_CREATION_ENABLE_PUSH_DESCRIPTOR_BIT))
+		return EXIT_FAILURE;
+
+	Device dev;
+	dev.set_context(ctx);
+
+	run_bench(dev, options);
+	return EXIT_SUCCESS;
 }
@@ -2,71 +2,24 @@
 // SPDX-License-Identifier: MIT
 
 #include <string.h>
+#include <atomic>
+#include <thread>
 
 #include "global_managers_init.hpp"
 #include "device.hpp"
 #include "context.hpp"
+#include "cli_parser.hpp"
+#include "timer.hpp"
 #include "pyrowave_decoder.hpp"
 #include "pyrowave_common.hpp"
 #include "yuv4mpeg.hpp"
+#include "pyrowave_file.hpp"
+#include "work_queue.hpp"
 #include "shaders/slangmosh.hpp"
 
 using namespace Granite;
 using namespace Vulkan;
-
-struct DecodedBuffer
-{
-	BufferHandle planes[3];
-	Fence fence;
-};
-
-static DecodedBuffer run_decoder_frame(CommandBufferHandle &cmd,
-                                       PyroWave::Decoder &dec,
-                                       const PyroWave::ViewBuffers &outputs,
-                                       uint32_t frame_index)
-{
-	auto &device = cmd->get_device();
-	DecodedBuffer decoded;
-
-	for (int i = 0; i < 3; i++)
-	{
-		BufferCreateInfo bufinfo = {};
-		bufinfo.domain = BufferDomain::CachedHost;
-		bufinfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-		bufinfo.size = format_get_layer_size(outputs.planes[i]->get_format(),
-		                                     VK_IMAGE_ASPECT_COLOR_BIT,
-		                                     outputs.planes[i]->get_view_width(),
-		                                     outputs.planes[i]->get_view_height(), 1);
-		decoded.planes[i] = device.create_buffer(bufinfo);
-	}
-
-	dec.decode(*cmd, outputs);
-
-	for (auto &plane : outputs.planes)
-	{
-		cmd->image_barrier(plane->get_image(),
-		                   VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-		                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-		                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
-	}
-
-	for (int i = 0; i < 3; i++)
-	{
-		cmd->copy_image_to_buffer(*decoded.planes[i], outputs.planes[i]->get_image(), 0,
-		                          {}, { outputs.planes[i]->get_view_width(),
-		                                outputs.planes[i]->get_view_height(),
-		                                outputs.planes[i]->get_view_depth() },
-		                          0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
-	}
-
-	cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
-	device.submit(cmd, &decoded.fence);
-	device.next_frame_context();
-
-	LOGI("Submitted frame %06u ...\n", frame_index);
-	return decoded;
-}
+using namespace Util;
 
 struct YCbCrImages
 {
@@ -103,12 +56,79 @@ static YCbCrImages create_ycbcr_images(Device &device, int width, int height, Vk
 	return images;
 }
 
-static bool write_payload(YUV4MPEGFile &file, Device &device, const DecodedBuffer &decoded)
+// One frame in flight. Slots are allocated up front and recycled,
+// so steady state does not create any buffers or images.
+struct DecodeSlot
+{
+	YCbCrImages outputs;
+	BufferHandle planes[3];
+	Fence fence;
+	uint32_t frame_index;
+};
+
+static std::unique_ptr<DecodeSlot> create_decode_slot(Device &device, int width, int height, VkFormat fmt,
+                                                      PyroWave::ChromaSubsampling chroma)
+{
+	std::unique_ptr<DecodeSlot> slot(new DecodeSlot);
+	slot->outputs = create_ycbcr_images(device, width, height, fmt, chroma);
+
+	for (int i = 0; i < 3; i++)
+	{
+		auto *view = slot->outputs.views.planes[i];
+		BufferCreateInfo bufinfo = {};
+		bufinfo.domain = BufferDomain::CachedHost;
+		bufinfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		bufinfo.size = format_get_layer_size(view->get_format(), VK_IMAGE_ASPECT_COLOR_BIT,
+		                                     view->get_view_width(), view->get_view_height(), 1);
+		slot->planes[i] = device.create_buffer(bufinfo);
+		if (!slot->planes[i])
+			return {};
+	}
+
+	return slot;
+}
+
+static void record_decoder_frame(CommandBuffer &cmd, PyroWave::Decoder &dec, DecodeSlot &slot)
+{
+	auto &outputs = slot.outputs.views;
+
+	// The slot is only recycled once its fence has signalled, so no source dependency is needed.
+	for (auto &img : slot.outputs.images)
+	{
+		cmd.image_barrier(*img, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+		                  VK_PIPELINE_STAGE_2_COPY_BIT, 0,
+		                  VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+	}
+
+	dec.decode(cmd, outputs);
+
+	for (auto &plane : outputs.planes)
+	{
+		cmd.image_barrier(plane->get_image(),
+		                  VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		                  VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		                  VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		cmd.copy_image_to_buffer(*slot.planes[i], outputs.planes[i]->get_image(), 0,
+		                         {}, { outputs.planes[i]->get_view_width(),
+		                               outputs.planes[i]->get_view_height(),
+		                               outputs.planes[i]->get_view_depth() },
+		                         0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+	}
+
+	cmd.barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+}
+
+static bool write_payload(YUV4MPEGFile &file, Device &device, const DecodeSlot &slot)
 {
 	if (!file.begin_frame())
 		return false;
 
-	for (auto &plane_ptr : decoded.planes)
+	for (auto &plane_ptr : slot.planes)
 	{
 		auto *plane = device.map_host_buffer(*plane_ptr, MEMORY_ACCESS_READ_BIT);
 		if (!file.write(plane, plane_ptr->get_create_info().size))
@@ -118,25 +138,30 @@ static bool write_payload(YUV4MPEGFile &file, Device &device, const DecodedBuffe
 	return true;
 }
 
-static bool read_payload(FILE *file, PyroWave::Decoder &decoder)
+static bool read_payload(const PyroWaveFileReader &file, size_t &index, PyroWave::Decoder &decoder)
 {
 	std::vector<uint8_t> packetized_data;
-	uint32_t u32_size;
 
-	for (;;)
+	while (index < file.get_num_frames())
 	{
-		if (fread(&u32_size, sizeof(u32_size), 1, file) != 1)
-			return false;
-		packetized_data.resize(u32_size);
-		if (fread(packetized_data.data(), 1, u32_size, file) != u32_size)
-			return false;
+		const void *data = file.map_frame(index);
+		size_t size = file.get_entry(index).size;
+		if (!data)
+		{
+			if (!file.read_frame(index, packetized_data))
+				return false;
+			data = packetized_data.data();
+		}
+		index++;
 
-		if (!decoder.push_packet(packetized_data.data(), packetized_data.size()))
+		if (!decoder.push_packet(data, size))
 			return false;
 
 		if (decoder.decode_is_ready(false))
 			return true;
 	}
+
+	return false;
 }
 
 static const char *format_to_str(YUV4MPEGFile::Format fmt)
@@ -156,46 +181,31 @@ static const char *format_to_str(YUV4MPEGFile::Format fmt)
 	}
 }
 
-static void run_decoder(Device &device, const char *out_path, const char *in_path)
+// main: parses packets, records and submits GPU work,
+// writer: waits for the fence and writes the Y4M frame.
+// The container is memory mapped, so reading needs no separate thread.
+// Up to depth frames are in flight at any time.
+static void run_decoder(Device &device, const char *out_path, const char *in_path, unsigned depth)
 {
-	struct FILEDeleter { void operator()(FILE *file) { if (file) fclose(file); } };
-	std::unique_ptr<FILE, FILEDeleter> infile;
-
-	infile.reset(fopen(in_path, "rb"));
-	if (!infile)
+	PyroWaveFileReader infile;
+	if (!infile.open(in_path))
 	{
 		LOGE("Failed to open input file.\n");
 		return;
 	}
 
-	char magic[9] = {};
-	if (fread(magic, 1, 8, infile.get()) != 8)
-	{
-		LOGE("Failed to read magic.\n");
-		return;
-	}
-
-	if (strcmp(magic, "PYROWAVE") != 0)
-	{
-		LOGE("Invalid magic.\n");
-		return;
-	}
-
-	int32_t u32_params[8];
-	if (fread(u32_params, sizeof(u32_params), 1, infile.get()) != 1)
-	{
-		LOGE("Failed to read parameters.\n");
-		return;
-	}
+	if (!infile.has_index())
+		LOGW("%s has no index, rebuilt %zu frames.\n", in_path, infile.get_num_frames());
 
+	auto &file_params = infile.get_params();
 	PyroWave::Decoder dec;
-	int width = u32_params[0];
-	int height = u32_params[1];
-	auto format = YUV4MPEGFile::Format(u32_params[2]);
-	auto chroma = PyroWave::ChromaSubsampling(u32_params[3]);
-	bool is_full = u32_params[4] != 0;
-	int frame_rate_num = u32_params[5];
-	int frame_rate_den = u32_params[6];
+	int width = file_params.width;
+	int height = file_params.height;
+	auto format = file_params.format;
+	auto chroma = file_params.chroma;
+	bool is_full = file_params.is_full_range != 0;
+	int frame_rate_num = file_params.frame_rate_num;
+	int frame_rate_den = file_params.frame_rate_den;
 	// Unused chroma siting. YUV4MPEG doesn't seem to have proper support for that.
 	if (!dec.init(&device, width, height, chroma))
 		return;
@@ -213,53 +223,73 @@ static void run_decoder(Device &device, const char *out_path, const char *in_pat
 	}
 
 	auto fmt = YUV4MPEGFile::format_to_bytes_per_component(output.get_format()) == 2 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM;
-	auto outputs = create_ycbcr_images(device, width, height, fmt, chroma);
 
-	DecodedBuffer queue[2];
-	uint32_t frame_index = 0;
+	// Otherwise next_frame_context() would throttle us to the default depth.
+	device.init_frame_contexts(depth);
 
-	for (;;)
+	std::vector<std::unique_ptr<DecodeSlot>> slots;
+	WorkQueue<DecodeSlot *> free_slots, submitted_slots;
+
+	for (unsigned i = 0; i < depth; i++)
 	{
-		auto &q = queue[frame_index & 1];
-		if (q.fence)
+		auto slot = create_decode_slot(device, width, height, fmt, chroma);
+		if (!slot)
+		{
+			LOGE("Failed to allocate pipeline slot.\n");
+			return;
+		}
+		free_slots.push(slot.get());
+		slots.push_back(std::move(slot));
+	}
+
+	std::atomic<bool> failed{false};
+	auto start_time = Util::get_current_time_nsecs();
+
+	std::thread writer([&]() {
+		DecodeSlot *slot;
+		while (submitted_slots.pop(slot))
 		{
-			q.fence->wait();
-			q.fence.reset();
-			if (!write_payload(output, device, q))
+			slot->fence->wait();
+			slot->fence.reset();
+
+			if (!failed.load(std::memory_order_relaxed) && !write_payload(output, device, *slot))
 			{
 				LOGE("Failed to write payload.\n");
-				break;
+				failed = true;
 			}
+
+			free_slots.push(slot);
 		}
+	});
+
+	size_t record_index = 0;
+	uint32_t frame_index = 0;
+	DecodeSlot *slot;
 
-		if (!read_payload(infile.get(), dec))
+	while (!failed.load(std::memory_order_relaxed) && free_slots.pop(slot))
+	{
+		if (!read_payload(infile, record_index, dec))
 			break;
 
+		slot->frame_index = frame_index++;
 		auto cmd = device.request_command_buffer();
+		record_decoder_frame(*cmd, dec, *slot);
+		device.submit(cmd, &slot->fence);
+		device.next_frame_context();
 
-		for (auto &img : outputs.images)
-		{
-			cmd->image_barrier(*img, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
-			                   VK_PIPELINE_STAGE_2_COPY_BIT, 0,
-			                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
-		}
-
-		queue[frame_index & 1] = run_decoder_frame(cmd, dec, outputs.views, frame_index);
-		frame_index++;
+		LOGI("Submitted frame %06u ...\n", slot->frame_index);
+		submitted_slots.push(slot);
 	}
 
-	frame_index--;
+	submitted_slots.close();
+	writer.join();
 
-	auto &q = queue[frame_index & 1];
-	if (q.fence)
-	{
-		q.fence->wait();
-		if (!write_payload(output, device, q))
-			LOGE("Failed to write payload.\n");
-	}
+	double elapsed = double(Util::get_current_time_nsecs() - start_time) * 1e-9;
+	LOGI("Decoded %u frames in %.3f s (%.2f fps), pipeline depth %u.\n",
+	     frame_index, elapsed, elapsed > 0.0 ? double(frame_index) / elapsed : 0.0, depth);
 }
 
-static void run_decoder(const char *out_path, const char *in_path)
+static void run_decoder(const char *out_path, const char *in_path, unsigned depth)
 {
 	if (!Context::init_loader(nullptr))
 		return;
@@ -272,16 +302,37 @@ static void run_decoder(const char *out_path, const char *in_path)
 	Device dev;
 	dev.set_context(ctx);
 
-	run_decoder(dev, out_path, in_path);
+	run_decoder(dev, out_path, in_path, depth);
+}
+
+static void print_help()
+{
+	LOGE("Usage: pyrowave-decode <input.pyrowave> <output.y4m>\n"
+	     "\t[--depth <frames in flight>] (default: 3)\n");
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 3)
+	const char *paths[2] = {};
+	unsigned num_positional = 0;
+	unsigned depth = 3;
+
+	CLICallbacks cbs;
+	cbs.add("--depth", [&](CLIParser &parser) { depth = parser.next_uint(); });
+	cbs.add("--help", [](CLIParser &parser) { parser.end(); });
+	cbs.default_handler = [&](const char *arg)
+	{
+		if (num_positional < 2)
+			paths[num_positional] = arg;
+		num_positional++;
+	};
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse() || parser.is_ended_state() || num_positional != 2 || depth == 0)
 	{
-		LOGE("Usage: pyrowave-encode <input.pyrowave> <output.y4m>\n");
-		return EXIT_FAILURE;
+		print_help();
+		return parser.is_ended_state() ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	run_decoder(argv[2], argv[1]);
+	run_decoder(paths[1], paths[0], depth);
 }
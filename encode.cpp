@@ -2,67 +2,23 @@
 // SPDX-License-Identifier: MIT
 
 #include <string.h>
+#include <atomic>
+#include <thread>
 
 #include "global_managers_init.hpp"
 #include "device.hpp"
 #include "context.hpp"
+#include "cli_parser.hpp"
+#include "timer.hpp"
 #include "pyrowave_encoder.hpp"
 #include "yuv4mpeg.hpp"
+#include "pyrowave_file.hpp"
+#include "work_queue.hpp"
 #include "shaders/slangmosh.hpp"
 
 using namespace Granite;
 using namespace Vulkan;
-
-struct EncodedBuffer
-{
-	BufferHandle payload;
-	BufferHandle meta;
-	Fence fence;
-};
-
-static EncodedBuffer run_encoder_frame(CommandBufferHandle &cmd,
-                                       PyroWave::Encoder &enc,
-                                       const PyroWave::ViewBuffers &inputs,
-                                       uint32_t frame_index,
-                                       uint32_t bitstream_size)
-{
-	auto &device = cmd->get_device();
-
-	EncodedBuffer encoded;
-	BufferCreateInfo buffer_info = {};
-	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-	buffer_info.size = enc.get_meta_required_size();
-	buffer_info.domain = BufferDomain::Device;
-	auto meta = device.create_buffer(buffer_info);
-	buffer_info.domain = BufferDomain::CachedHost;
-	encoded.meta = device.create_buffer(buffer_info);
-
-	buffer_info.size = bitstream_size + 2 * enc.get_meta_required_size();
-	buffer_info.domain = BufferDomain::Device;
-	auto bitstream = device.create_buffer(buffer_info);
-	buffer_info.domain = BufferDomain::CachedHost;
-	encoded.payload = device.create_buffer(buffer_info);
-
-	PyroWave::Encoder::BitstreamBuffers buffers = {};
-	buffers.meta.buffer = meta.get();
-	buffers.meta.size = meta->get_create_info().size;
-	buffers.bitstream.buffer = bitstream.get();
-	buffers.bitstream.size = bitstream->get_create_info().size;
-	buffers.target_size = bitstream_size;
-
-	enc.encode(*cmd, inputs, buffers);
-	cmd->copy_buffer(*encoded.payload, *bitstream);
-	cmd->copy_buffer(*encoded.meta, *meta);
-	cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
-	             VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-	             VK_ACCESS_HOST_READ_BIT);
-	device.submit(cmd, &encoded.fence);
-	device.next_frame_context();
-
-	LOGI("Submitted frame %06u ...\n", frame_index);
-	return encoded;
-}
+using namespace Util;
 
 struct YCbCrImages
 {
@@ -99,51 +55,143 @@ static YCbCrImages create_ycbcr_images(Device &device, int width, int height, Vk
 	return images;
 }
 
-static bool write_payload(FILE *file, PyroWave::Encoder &encoder, Device &device, const Buffer &payload, const Buffer &meta)
+// One frame in flight. Slots are allocated up front and recycled,
+// so steady state does not create any buffers or images.
+struct EncodeSlot
 {
-	auto *mapped_payload = device.map_host_buffer(payload, MEMORY_ACCESS_READ_BIT);
-	auto *mapped_meta = device.map_host_buffer(meta, MEMORY_ACCESS_READ_BIT);
+	// Written directly by the reader thread, then copied into the input images.
+	BufferHandle staging;
+	size_t plane_offsets[3];
+	size_t plane_sizes[3];
+	YCbCrImages inputs;
 
-	std::vector<uint8_t> packetized_data(payload.get_create_info().size);
+	BufferHandle meta;
+	BufferHandle meta_host;
+	BufferHandle bitstream;
+	BufferHandle payload_host;
+	std::vector<uint8_t> packetized;
 
-	PyroWave::Encoder::Packet packet = {};
-	if (encoder.packetize(&packet, payload.get_create_info().size,
-	                      packetized_data.data(), packetized_data.size(),
-	                      mapped_meta, mapped_payload) != 1)
+	Fence fence;
+	uint32_t frame_index;
+};
+
+static std::unique_ptr<EncodeSlot> create_encode_slot(Device &device, PyroWave::Encoder &enc, const YUV4MPEGFile &input,
+                                                      VkFormat fmt, PyroWave::ChromaSubsampling chroma,
+                                                      uint32_t bitstream_size)
+{
+	std::unique_ptr<EncodeSlot> slot(new EncodeSlot);
+
+	size_t staging_size = 0;
+	for (int i = 0; i < 3; i++)
 	{
-		LOGE("Something went terribly wrong ...\n");
-		std::terminate();
+		slot->plane_offsets[i] = staging_size;
+		slot->plane_sizes[i] = input.get_plane_size(i);
+		staging_size += slot->plane_sizes[i];
 	}
 
-	uint32_t u32_size = packet.size;
-	if (fwrite(&u32_size, sizeof(u32_size), 1, file) != 1)
-		return false;
-	return fwrite(packetized_data.data() + packet.offset, 1, packet.size, file) == packet.size;
+	BufferCreateInfo buffer_info = {};
+	buffer_info.domain = BufferDomain::Host;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.size = staging_size;
+	slot->staging = device.create_buffer(buffer_info);
+
+	slot->inputs = create_ycbcr_images(device, input.get_width(), input.get_height(), fmt, chroma);
+
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.size = enc.get_meta_required_size();
+	buffer_info.domain = BufferDomain::Device;
+	slot->meta = device.create_buffer(buffer_info);
+	buffer_info.domain = BufferDomain::CachedHost;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	slot->meta_host = device.create_buffer(buffer_info);
+
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.size = bitstream_size + 2 * enc.get_meta_required_size();
+	buffer_info.domain = BufferDomain::Device;
+	slot->bitstream = device.create_buffer(buffer_info);
+	buffer_info.domain = BufferDomain::CachedHost;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	slot->payload_host = device.create_buffer(buffer_info);
+
+	slot->packetized.resize(buffer_info.size);
+
+	if (!slot->staging || !slot->meta || !slot->meta_host || !slot->bitstream || !slot->payload_host)
+		return {};
+
+	return slot;
 }
 
-static void run_encoder(Device &device, const char *out_path, const char *in_path, uint32_t bitstream_size)
+static void record_encoder_frame(CommandBuffer &cmd, PyroWave::Encoder &enc, EncodeSlot &slot, uint32_t bitstream_size)
 {
-	YUV4MPEGFile input;
+	for (auto &img : slot.inputs.images)
+	{
+		// The slot is only recycled once its fence has signalled, so no source dependency is needed.
+		cmd.image_barrier(*img, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		                  0, 0,
+		                  VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+	}
 
-	if (!input.open_read(in_path))
+	for (int i = 0; i < 3; i++)
 	{
-		LOGE("Failed to open input file.\n");
-		return;
+		auto &img = *slot.inputs.images[i];
+		cmd.copy_buffer_to_image(img, *slot.staging, slot.plane_offsets[i],
+		                         {}, { img.get_width(), img.get_height(), 1 },
+		                         0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+	}
+
+	for (auto &img : slot.inputs.images)
+	{
+		cmd.image_barrier(*img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		                  VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		                  VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
 	}
 
-	struct FILEDeleter { void operator()(FILE *file) { if (file) fclose(file); } };
-	std::unique_ptr<FILE, FILEDeleter> out;
+	PyroWave::Encoder::BitstreamBuffers buffers = {};
+	buffers.meta.buffer = slot.meta.get();
+	buffers.meta.size = slot.meta->get_create_info().size;
+	buffers.bitstream.buffer = slot.bitstream.get();
+	buffers.bitstream.size = slot.bitstream->get_create_info().size;
+	buffers.target_size = bitstream_size;
+
+	enc.encode(cmd, slot.inputs.views, buffers);
+	cmd.copy_buffer(*slot.payload_host, *slot.bitstream);
+	cmd.copy_buffer(*slot.meta_host, *slot.meta);
+	cmd.barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+}
+
+static bool write_payload(PyroWaveFileWriter &file, const PyroWave::Encoder &encoder, Device &device,
+                          EncodeSlot &slot, uint64_t timestamp_ns)
+{
+	auto *mapped_payload = device.map_host_buffer(*slot.payload_host, MEMORY_ACCESS_READ_BIT);
+	auto *mapped_meta = device.map_host_buffer(*slot.meta_host, MEMORY_ACCESS_READ_BIT);
 
-	out.reset(fopen(out_path, "wb"));
-	if (!out)
+	PyroWave::Encoder::Packet packet = {};
+	if (encoder.packetize(&packet, slot.payload_host->get_create_info().size,
+	                      slot.packetized.data(), slot.packetized.size(),
+	                      mapped_meta, mapped_payload) != 1)
 	{
-		LOGE("Failed to open output file.\n");
-		return;
+		LOGE("Something went terribly wrong ...\n");
+		std::terminate();
 	}
 
-	if (fwrite("PYROWAVE", 1, 8, out.get()) != 8)
+	return file.write_frame(slot.packetized.data() + packet.offset, packet.size, slot.frame_index, timestamp_ns);
+}
+
+// Three stages, each on its own thread:
+// reader: Y4M -> free slot staging buffer,
+// main: records and submits GPU work,
+// writer: waits for the fence, packetizes and writes the container.
+// Up to depth frames are in flight at any time.
+static void run_encoder(Device &device, const char *out_path, const char *in_path,
+                        uint32_t bitstream_size, unsigned depth)
+{
+	YUV4MPEGFile input;
+
+	if (!input.open_read(in_path))
 	{
-		LOGE("Failed to write magic.\n");
+		LOGE("Failed to open input file.\n");
 		return;
 	}
 
@@ -152,88 +200,123 @@ static void run_encoder(Device &device, const char *out_path, const char *in_pat
 	auto fmt = YUV4MPEGFile::format_to_bytes_per_component(input.get_format()) == 2 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM;
 	auto chroma = YUV4MPEGFile::format_has_subsampling(input.get_format()) ? PyroWave::ChromaSubsampling::Chroma420 : PyroWave::ChromaSubsampling::Chroma444;
 
-	int32_t u32_params[8] = {
-		width, height, int(input.get_format()), int(chroma), input.is_full_range(),
+	PyroWaveFileParams params = {
+		width, height, input.get_format(), chroma, input.is_full_range(),
 		input.get_frame_rate_num(), input.get_frame_rate_den(), 0 /* placeholder for unknown chroma siting */
 	};
 
-	if (fwrite(u32_params, sizeof(u32_params), 1, out.get()) != 1)
+	PyroWaveFileWriter out;
+	if (!out.open(out_path, params))
 	{
-		LOGE("Failed to write u32 params.\n");
+		LOGE("Failed to open output file.\n");
 		return;
 	}
 
-	auto inputs = create_ycbcr_images(device, width, height, fmt, chroma);
+	// Y4M has no per-frame timestamps, derive them from the frame rate.
+	const auto get_timestamp_ns = [&](uint32_t index) -> uint64_t {
+		if (params.frame_rate_num <= 0 || params.frame_rate_den <= 0)
+			return 0;
+		return uint64_t(index) * 1000000000ull * uint64_t(params.frame_rate_den) / uint64_t(params.frame_rate_num);
+	};
 
 	PyroWave::Encoder enc;
 	if (!enc.init(&device, width, height, chroma))
 		return;
 
-	EncodedBuffer queue[2];
-	uint32_t frame_index = 0;
+	// Otherwise next_frame_context() would throttle us to the default depth.
+	device.init_frame_contexts(depth);
 
-	for (;;)
+	std::vector<std::unique_ptr<EncodeSlot>> slots;
+	WorkQueue<EncodeSlot *> free_slots, loaded_slots, submitted_slots;
+
+	for (unsigned i = 0; i < depth; i++)
 	{
-		auto &q = queue[frame_index & 1];
-		if (q.fence)
+		auto slot = create_encode_slot(device, enc, input, fmt, chroma, bitstream_size);
+		if (!slot)
 		{
-			q.fence->wait();
-			q.fence.reset();
-			if (!write_payload(out.get(), enc, device, *q.payload, *q.meta))
-			{
-				LOGE("Failed to write payload.\n");
-				break;
-			}
+			LOGE("Failed to allocate pipeline slot.\n");
+			return;
 		}
+		free_slots.push(slot.get());
+		slots.push_back(std::move(slot));
+	}
 
-		if (!input.begin_frame())
-			break;
+	std::atomic<bool> failed{false};
+	auto start_time = Util::get_current_time_nsecs();
 
-		auto cmd = device.request_command_buffer();
+	std::thread reader([&]() {
+		EncodeSlot *slot;
+		uint32_t frame_index = 0;
 
-		for (auto &img : inputs.images)
+		while (!failed.load(std::memory_order_relaxed) && free_slots.pop(slot))
 		{
-			cmd->image_barrier(*img, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			                   0, 0,
-			                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
-		}
+			if (!input.begin_frame())
+				break;
 
-		for (auto &img : inputs.images)
-		{
-			auto *y = cmd->update_image(*img);
-			if (!input.read(y, img->get_width() * img->get_height()))
+			auto *mapped = static_cast<uint8_t *>(device.map_host_buffer(*slot->staging, MEMORY_ACCESS_WRITE_BIT));
+			bool ok = true;
+			for (int i = 0; i < 3 && ok; i++)
+				ok = input.read(mapped + slot->plane_offsets[i], slot->plane_sizes[i]);
+			device.unmap_host_buffer(*slot->staging, MEMORY_ACCESS_WRITE_BIT);
+
+			if (!ok)
 			{
 				LOGE("Failed to read plane.\n");
-				device.submit_discard(cmd);
 				break;
 			}
+
+			slot->frame_index = frame_index++;
+			loaded_slots.push(slot);
 		}
 
-		for (auto &img : inputs.images)
+		loaded_slots.close();
+	});
+
+	std::thread writer([&]() {
+		EncodeSlot *slot;
+		while (submitted_slots.pop(slot))
 		{
-			cmd->image_barrier(*img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-			                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
-			                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
-		}
+			slot->fence->wait();
+			slot->fence.reset();
 
-		queue[frame_index & 1] = run_encoder_frame(cmd, enc, inputs.views, frame_index, bitstream_size);
-		frame_index++;
-	}
+			if (!failed.load(std::memory_order_relaxed) &&
+			    !write_payload(out, enc, device, *slot, get_timestamp_ns(slot->frame_index)))
+			{
+				LOGE("Failed to write payload.\n");
+				failed = true;
+			}
 
-	frame_index--;
+			free_slots.push(slot);
+		}
+	});
 
-	auto &q = queue[frame_index & 1];
-	if (q.fence)
+	EncodeSlot *slot;
+	uint32_t num_frames = 0;
+	while (loaded_slots.pop(slot))
 	{
-		q.fence->wait();
-		q.fence.reset();
-		if (!write_payload(out.get(), enc, device, *q.payload, *q.meta))
-			LOGE("Failed to write payload.\n");
+		auto cmd = device.request_command_buffer();
+		record_encoder_frame(*cmd, enc, *slot, bitstream_size);
+		device.submit(cmd, &slot->fence);
+		device.next_frame_context();
+
+		LOGI("Submitted frame %06u ...\n", slot->frame_index);
+		submitted_slots.push(slot);
+		num_frames++;
 	}
+
+	submitted_slots.close();
+	reader.join();
+	writer.join();
+
+	if (!out.close())
+		LOGE("Failed to write index.\n");
+
+	double elapsed = double(Util::get_current_time_nsecs() - start_time) * 1e-9;
+	LOGI("Encoded %u frames in %.3f s (%.2f fps), pipeline depth %u.\n",
+	     num_frames, elapsed, elapsed > 0.0 ? double(num_frames) / elapsed : 0.0, depth);
 }
 
-static void run_encoder(const char *out_path, const char *in_path, uint32_t bytes_per_frame)
+static void run_encoder(const char *out_path, const char *in_path, uint32_t bytes_per_frame, unsigned depth)
 {
 	if (!Context::init_loader(nullptr))
 		return;
@@ -246,16 +329,37 @@ static void run_encoder(const char *out_path, const char *in_path, uint32_t byte
 	Device dev;
 	dev.set_context(ctx);
 
-	run_encoder(dev, out_path, in_path, bytes_per_frame);
+	run_encoder(dev, out_path, in_path, bytes_per_frame, depth);
+}
+
+static void print_help()
+{
+	LOGE("Usage: pyrowave-encode <input.y4m> <output.pyrowave> <bytes_per_frame>\n"
+	     "\t[--depth <frames in flight>] (default: 3)\n");
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 4)
+	const char *paths[3] = {};
+	unsigned num_positional = 0;
+	unsigned depth = 3;
+
+	CLICallbacks cbs;
+	cbs.add("--depth", [&](CLIParser &parser) { depth = parser.next_uint(); });
+	cbs.add("--help", [](CLIParser &parser) { parser.end(); });
+	cbs.default_handler = [&](const char *arg)
+	{
+		if (num_positional < 3)
+			paths[num_positional] = arg;
+		num_positional++;
+	};
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse() || parser.is_ended_state() || num_positional != 3 || depth == 0)
 	{
-		LOGE("Usage: pyrowave-encode <input.y4m> <output.pyrowave> <bytes_per_frame>\n");
-		return EXIT_FAILURE;
+		print_help();
+		return parser.is_ended_state() ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	run_encoder(argv[2], argv[1], strtoul(argv[3], nullptr, 0));
+	run_encoder(paths[1], paths[0], strtoul(paths[2], nullptr, 0), depth);
 }
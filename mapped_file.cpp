@@ -0,0 +1,110 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	unmap();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+{
+	*this = std::move(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+	if (this != &other)
+	{
+		unmap();
+		ptr = other.ptr;
+		length = other.length;
+		other.ptr = nullptr;
+		other.length = 0;
+	}
+
+	return *this;
+}
+
+bool MappedFile::map(const std::string &path)
+{
+	unmap();
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+	                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(handle);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(handle);
+	if (!mapping)
+		return false;
+
+	// The view holds a reference to the mapping object.
+	void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		return false;
+
+	ptr = static_cast<const uint8_t *>(view);
+	length = size_t(size.QuadPart);
+#else
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat s = {};
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *view = mmap(nullptr, size_t(s.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED)
+		return false;
+
+	// Files are mostly consumed front to back.
+	madvise(view, size_t(s.st_size), MADV_SEQUENTIAL);
+
+	ptr = static_cast<const uint8_t *>(view);
+	length = size_t(s.st_size);
+#endif
+
+	return true;
+}
+
+void MappedFile::unmap()
+{
+	if (ptr)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(ptr);
+#else
+		munmap(const_cast<uint8_t *>(ptr), length);
+#endif
+	}
+
+	ptr = nullptr;
+	length = 0;
+}
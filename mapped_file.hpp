@@ -0,0 +1,31 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only memory mapping of a whole regular file.
+// Pipes, character devices and empty files cannot be mapped.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(MappedFile &&other) noexcept;
+	MappedFile &operator=(MappedFile &&other) noexcept;
+	MappedFile(const MappedFile &) = delete;
+	void operator=(const MappedFile &) = delete;
+
+	bool map(const std::string &path);
+	void unmap();
+
+	const uint8_t *data() const { return ptr; }
+	size_t size() const { return length; }
+	explicit operator bool() const { return ptr != nullptr; }
+
+private:
+	const uint8_t *ptr = nullptr;
+	size_t length = 0;
+};
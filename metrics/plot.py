@@ -7,7 +7,42 @@ import sys
 import csv
 import os
 
+# Per-frame CSV as written by pyrowave-psnr --csv.
+def plot_frames(path):
+    metric_name = {
+            'psnr_y' : 'PSNR (Y)',
+            'psnr' : 'PSNR',
+            'ssim_y' : 'SSIM (Y)',
+            'ssim' : 'SSIM',
+            'ms_ssim' : 'MS-SSIM' }
+
+    with open(path) as f:
+        reader = csv.DictReader(f)
+        cols = [col for col in metric_name if col in reader.fieldnames]
+        frames = []
+        results = dict()
+        for col in cols:
+            results[col] = []
+        for row in reader:
+            frames.append(int(row['frame']))
+            for col in cols:
+                results[col].append(float(row[col]))
+
+    base = os.path.splitext(path)[0]
+    for col in cols:
+        fig = go.Figure()
+        fig.add_trace(go.Scatter(x = frames, y = results[col], name = metric_name[col]))
+        fig.update_traces(mode = 'lines')
+        fig.update_xaxes(title_text = 'frame')
+        fig.update_yaxes(title_text = metric_name[col])
+        fig.update_layout(title = os.path.basename(path))
+        fig.write_image(base + '_' + col + '.png')
+
 def main():
+    if os.path.isfile(sys.argv[1]):
+        plot_frames(sys.argv[1])
+        return
+
     codecs = ['h264_nvenc', 'hevc_nvenc', 'av1_nvenc', 'pyrowave']
     cols = ['xpsnr', 'ssim', 'ssimulacra2', 'vmaf', 'vmafneg']
 
@@ -0,0 +1,251 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+
+// Loopback throughput and latency benchmark for pyrowave-net.
+// Synthetic frames are used, so this measures the transport alone, without any GPU work.
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "pyrowave_net.hpp"
+#include "cli_parser.hpp"
+#include "logging.hpp"
+
+using namespace Util;
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+	unsigned num_frames = 600;
+	unsigned frame_size = 200000;
+	unsigned mtu = 1400;
+	unsigned fps = 60;
+	// Mbit/s, 0 disables pacing.
+	unsigned pacing_rate = 0;
+	unsigned pacing_burst = 64 * 1024;
+	bool gso = true;
+	bool gro = true;
+	// Emulate packetize(), which cuts packets at code block boundaries, rather than sending full packets.
+	bool variable_sizes = false;
+};
+
+// Written at the start of every packet, so the receiver can attribute it.
+struct BenchPacketHeader
+{
+	uint32_t frame_index;
+	uint32_t packet_index;
+	int64_t send_time_ns;
+};
+
+struct FrameStats
+{
+	int64_t send_time_ns;
+	int64_t last_arrival_ns;
+	uint32_t packets_sent;
+	uint32_t packets_received;
+};
+
+static int64_t time_ns(Clock::time_point t)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+static void build_frame(const BenchOptions &options, std::mt19937 &rng,
+                        std::vector<uint8_t> &payload, std::vector<PyroWave::Encoder::Packet> &packets)
+{
+	payload.resize(options.frame_size);
+	packets.clear();
+
+	// Code blocks are a multiple of 4 bytes, and a packet is cut when the next block does not fit.
+	std::uniform_int_distribution<unsigned> cut(options.mtu * 3 / 16, options.mtu / 4);
+
+	size_t offset = 0;
+	while (offset < payload.size())
+	{
+		size_t size = options.variable_sizes ? size_t(cut(rng)) * 4 : options.mtu;
+		size = std::max(size, sizeof(BenchPacketHeader));
+		size = std::min(size, payload.size() - offset);
+		packets.push_back({ offset, size });
+		offset += size;
+	}
+
+	// The final packet must also carry a header.
+	if (packets.back().size < sizeof(BenchPacketHeader))
+	{
+		if (packets.size() > 1)
+		{
+			packets.pop_back();
+			packets.back().size = payload.size() - packets.back().offset;
+		}
+		else
+			payload.resize(sizeof(BenchPacketHeader));
+	}
+}
+
+static void print_help()
+{
+	LOGE("Usage: pyrowave-net-bench\n"
+	     "\t[--frames <count>] (default: 600)\n"
+	     "\t[--frame-size <bytes>] (default: 200000)\n"
+	     "\t[--mtu <bytes>] (default: 1400)\n"
+	     "\t[--fps <rate>] (default: 60, 0 sends as fast as possible)\n"
+	     "\t[--pacing-rate <Mbit/s>] (default: 0, disabled)\n"
+	     "\t[--pacing-burst <bytes>] (default: 65536)\n"
+	     "\t[--variable-sizes]\n"
+	     "\t[--no-gso]\n"
+	     "\t[--no-gro]\n");
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+
+	CLICallbacks cbs;
+	cbs.add("--frames", [&](CLIParser &parser) { options.num_frames = parser.next_uint(); });
+	cbs.add("--frame-size", [&](CLIParser &parser) { options.frame_size = parser.next_uint(); });
+	cbs.add("--mtu", [&](CLIParser &parser) { options.mtu = parser.next_uint(); });
+	cbs.add("--fps", [&](CLIParser &parser) { options.fps = parser.next_uint(); });
+	cbs.add("--pacing-rate", [&](CLIParser &parser) { options.pacing_rate = parser.next_uint(); });
+	cbs.add("--pacing-burst", [&](CLIParser &parser) { options.pacing_burst = parser.next_uint(); });
+	cbs.add("--variable-sizes", [&](CLIParser &) { options.variable_sizes = true; });
+	cbs.add("--no-gso", [&](CLIParser &) { options.gso = false; });
+	cbs.add("--no-gro", [&](CLIParser &) { options.gro = false; });
+	cbs.add("--help", [](CLIParser &parser) { parser.end(); });
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse() || parser.is_ended_state() ||
+	    options.num_frames == 0 || options.mtu < 64 || options.mtu > 65000 || options.frame_size == 0)
+	{
+		print_help();
+		return parser.is_ended_state() ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	PyroWave::UDPReceiver receiver;
+	PyroWave::UDPReceiver::Options rx_options;
+	rx_options.address = "127.0.0.1";
+	rx_options.max_datagram_size = options.mtu;
+	rx_options.gro = options.gro;
+	if (!receiver.init(rx_options))
+		return EXIT_FAILURE;
+
+	PyroWave::UDPSender sender;
+	PyroWave::UDPSender::Options tx_options;
+	tx_options.address = "127.0.0.1";
+	tx_options.port = receiver.get_port();
+	tx_options.pacing_rate = uint64_t(options.pacing_rate) * 1000000 / 8;
+	tx_options.pacing_burst = options.pacing_burst;
+	tx_options.gso = options.gso;
+	if (!sender.init(tx_options))
+		return EXIT_FAILURE;
+
+	std::vector<FrameStats> frames(options.num_frames);
+	std::atomic<bool> sender_done{false};
+
+	std::thread receive_thread([&]() {
+		std::vector<PyroWave::Decoder::PacketData> packets;
+		auto last_packet = Clock::now();
+
+		// Keep draining for a while after the sender finished, to pick up stragglers.
+		while (!sender_done.load(std::memory_order_acquire) ||
+		       Clock::now() - last_packet < std::chrono::milliseconds(200))
+		{
+			if (!receiver.receive(packets, 10))
+				break;
+
+			if (packets.empty())
+				continue;
+
+			last_packet = Clock::now();
+			int64_t now = time_ns(last_packet);
+
+			for (auto &packet : packets)
+			{
+				BenchPacketHeader header;
+				if (packet.size < sizeof(header))
+					continue;
+				memcpy(&header, packet.data, sizeof(header));
+				if (header.frame_index >= frames.size())
+					continue;
+
+				auto &frame = frames[header.frame_index];
+				frame.packets_received++;
+				frame.last_arrival_ns = now;
+			}
+		}
+	});
+
+	std::mt19937 rng(1);
+	std::vector<uint8_t> payload;
+	std::vector<PyroWave::Encoder::Packet> packets;
+
+	auto start = Clock::now();
+	for (unsigned i = 0; i < options.num_frames; i++)
+	{
+		if (options.fps)
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(int64_t(i) * 1000000000ll / options.fps));
+
+		build_frame(options, rng, payload, packets);
+
+		auto &frame = frames[i];
+		frame.send_time_ns = time_ns(Clock::now());
+		frame.packets_sent = uint32_t(packets.size());
+
+		for (size_t p = 0; p < packets.size(); p++)
+		{
+			BenchPacketHeader header = { i, uint32_t(p), frame.send_time_ns };
+			memcpy(payload.data() + packets[p].offset, &header, sizeof(header));
+		}
+
+		if (!sender.send_frame(payload.data(), packets.data(), packets.size()))
+			break;
+	}
+	auto send_done = Clock::now();
+
+	sender_done.store(true, std::memory_order_release);
+	receive_thread.join();
+
+	uint64_t packets_sent = 0, packets_received = 0;
+	unsigned complete_frames = 0;
+	std::vector<double> latencies;
+
+	for (auto &frame : frames)
+	{
+		packets_sent += frame.packets_sent;
+		packets_received += std::min(frame.packets_received, frame.packets_sent);
+		if (frame.packets_sent && frame.packets_received >= frame.packets_sent)
+		{
+			complete_frames++;
+			latencies.push_back(1e-6 * double(frame.last_arrival_ns - frame.send_time_ns));
+		}
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	const auto percentile = [&](unsigned p) {
+		return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)];
+	};
+
+	auto &tx = sender.get_stats();
+	auto &rx = receiver.get_stats();
+	double elapsed = std::chrono::duration<double>(send_done - start).count();
+
+	LOGI("Sent %llu packets (%.3f Gbit/s, %.0f packets/s) in %llu syscalls, %llu GSO datagrams.\n",
+	     static_cast<unsigned long long>(tx.packets),
+	     elapsed > 0.0 ? double(tx.bytes) * 8e-9 / elapsed : 0.0,
+	     elapsed > 0.0 ? double(tx.packets) / elapsed : 0.0,
+	     static_cast<unsigned long long>(tx.syscalls),
+	     static_cast<unsigned long long>(tx.gso_datagrams));
+	LOGI("Received %llu packets in %llu syscalls, %llu coalesced by GRO.\n",
+	     static_cast<unsigned long long>(rx.packets),
+	     static_cast<unsigned long long>(rx.syscalls),
+	     static_cast<unsigned long long>(rx.gro_packets));
+	LOGI("Loss: %.4f %%, %u / %u frames complete.\n",
+	     packets_sent ? 100.0 * double(packets_sent - packets_received) / double(packets_sent) : 0.0,
+	     complete_frames, options.num_frames);
+	LOGI("Frame latency (first send to last packet received): p50 %.3f ms, p99 %.3f ms, max %.3f ms.\n",
+	     percentile(50), percentile(99), latencies.empty() ? 0.0 : latencies.back());
+}
@@ -2,116 +2,887 @@
 // SPDX-License-Identifier: MIT
 
 #include "yuv4mpeg.hpp"
+#include "cli_parser.hpp"
 #include <stdint.h>
+#include <string.h>
 #include <cmath>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#if defined(__SSE3__)
+#include <pmmintrin.h>
+#define PSNR_SIMD_SSE 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PSNR_SIMD_NEON 1
+#endif
+
+using namespace Util;
+
+// Minimal 4-wide float vector, so the SSIM kernels are written once.
+// Without SIMD support, this falls back to plain scalar code.
+namespace Vec
+{
+#if PSNR_SIMD_SSE
+using F4 = __m128;
+static inline F4 load(const float *p) { return _mm_loadu_ps(p); }
+static inline void store(float *p, F4 v) { _mm_storeu_ps(p, v); }
+static inline F4 splat(float v) { return _mm_set1_ps(v); }
+static inline F4 add(F4 a, F4 b) { return _mm_add_ps(a, b); }
+static inline F4 sub(F4 a, F4 b) { return _mm_sub_ps(a, b); }
+static inline F4 mul(F4 a, F4 b) { return _mm_mul_ps(a, b); }
+static inline F4 div(F4 a, F4 b) { return _mm_div_ps(a, b); }
+// { a0 + a1, a2 + a3, b0 + b1, b2 + b3 }
+static inline F4 pairwise_add(F4 a, F4 b) { return _mm_hadd_ps(a, b); }
+#elif PSNR_SIMD_NEON
+using F4 = float32x4_t;
+static inline F4 load(const float *p) { return vld1q_f32(p); }
+static inline void store(float *p, F4 v) { vst1q_f32(p, v); }
+static inline F4 splat(float v) { return vdupq_n_f32(v); }
+static inline F4 add(F4 a, F4 b) { return vaddq_f32(a, b); }
+static inline F4 sub(F4 a, F4 b) { return vsubq_f32(a, b); }
+static inline F4 mul(F4 a, F4 b) { return vmulq_f32(a, b); }
+static inline F4 div(F4 a, F4 b) { return vdivq_f32(a, b); }
+static inline F4 pairwise_add(F4 a, F4 b) { return vpaddq_f32(a, b); }
+#else
+struct F4 { float v[4]; };
+#define VEC_OP(name, expr) \
+	static inline F4 name(F4 a, F4 b) { F4 r; for (int i = 0; i < 4; i++) r.v[i] = expr; return r; }
+static inline F4 load(const float *p) { F4 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+static inline void store(float *p, F4 v) { memcpy(p, v.v, sizeof(v.v)); }
+static inline F4 splat(float v) { return { { v, v, v, v } }; }
+VEC_OP(add, a.v[i] + b.v[i])
+VEC_OP(sub, a.v[i] - b.v[i])
+VEC_OP(mul, a.v[i] * b.v[i])
+VEC_OP(div, a.v[i] / b.v[i])
+#undef VEC_OP
+static inline F4 pairwise_add(F4 a, F4 b)
+{
+	return { { a.v[0] + a.v[1], a.v[2] + a.v[3], b.v[0] + b.v[1], b.v[2] + b.v[3] } };
+}
+#endif
+
+// { sum(a), sum(b), sum(c), sum(d) }
+static inline F4 transpose_add(F4 a, F4 b, F4 c, F4 d)
+{
+	return pairwise_add(pairwise_add(a, b), pairwise_add(c, d));
+}
+
+static inline float reduce_add(F4 v)
+{
+	float tmp[4];
+	store(tmp, v);
+	return (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+}
+}
+
+static uint64_t squared_error_8bit(const uint8_t *a, const uint8_t *b, size_t count)
+{
+	uint64_t error = 0;
+	size_t i = 0;
+
+#if PSNR_SIMD_SSE
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc64 = zero;
+
+	while (i + 16 <= count)
+	{
+		// Each iteration adds at most 4 * 255^2 per 32-bit lane, flush well before that can overflow.
+		size_t block_end = std::min<size_t>(count & ~size_t(15), i + 16 * 4096);
+		__m128i acc32 = zero;
+
+		for (; i < block_end; i += 16)
+		{
+			__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+			__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+			__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+			__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+			acc32 = _mm_add_epi32(acc32, _mm_madd_epi16(lo, lo));
+			acc32 = _mm_add_epi32(acc32, _mm_madd_epi16(hi, hi));
+		}
+
+		acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(acc32, zero));
+		acc64 = _mm_add_epi64(acc64, _mm_unpackhi_epi32(acc32, zero));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc64);
+	error = lanes[0] + lanes[1];
+#elif PSNR_SIMD_NEON
+	uint64x2_t acc64 = vdupq_n_u64(0);
+
+	while (i + 16 <= count)
+	{
+		size_t block_end = std::min<size_t>(count & ~size_t(15), i + 16 * 4096);
+		uint32x4_t acc32 = vdupq_n_u32(0);
+
+		for (; i < block_end; i += 16)
+		{
+			uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+			acc32 = vpadalq_u16(acc32, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+			acc32 = vpadalq_u16(acc32, vmull_high_u8(d, d));
+		}
+
+		acc64 = vpadalq_u32(acc64, acc32);
+	}
+
+	error = vaddvq_u64(acc64);
+#endif
+
+	for (; i < count; i++)
+	{
+		int d = int(a[i]) - int(b[i]);
+		error += uint64_t(d * d);
+	}
+
+	return error;
+}
+
+static uint64_t squared_error_16bit(const uint16_t *a, const uint16_t *b, size_t count)
+{
+	uint64_t error = 0;
+	size_t i = 0;
+
+#if PSNR_SIMD_SSE
+	// Squares of 16-bit differences need the full 32 bits, so widen to 64-bit every iteration.
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc64 = zero;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+		__m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+		__m128i sq_lo = _mm_mullo_epi16(d, d);
+		__m128i sq_hi = _mm_mulhi_epu16(d, d);
+		__m128i sq0 = _mm_unpacklo_epi16(sq_lo, sq_hi);
+		__m128i sq1 = _mm_unpackhi_epi16(sq_lo, sq_hi);
+		acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(sq0, zero));
+		acc64 = _mm_add_epi64(acc64, _mm_unpackhi_epi32(sq0, zero));
+		acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(sq1, zero));
+		acc64 = _mm_add_epi64(acc64, _mm_unpackhi_epi32(sq1, zero));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc64);
+	error = lanes[0] + lanes[1];
+#elif PSNR_SIMD_NEON
+	uint64x2_t acc64 = vdupq_n_u64(0);
+
+	for (; i + 8 <= count; i += 8)
+	{
+		uint16x8_t d = vabdq_u16(vld1q_u16(a + i), vld1q_u16(b + i));
+		acc64 = vpadalq_u32(acc64, vmull_u16(vget_low_u16(d), vget_low_u16(d)));
+		acc64 = vpadalq_u32(acc64, vmull_high_u16(d, d));
+	}
+
+	error = vaddvq_u64(acc64);
+#endif
+
+	for (; i < count; i++)
+	{
+		int64_t d = int64_t(a[i]) - int64_t(b[i]);
+		error += uint64_t(d * d);
+	}
+
+	return error;
+}
+
+struct PlaneF
+{
+	std::vector<float> data;
+	int width = 0;
+	int height = 0;
+};
+
+// Normalize to [0, 1] so that the same SSIM constants work for every bit depth.
+static void convert_plane(PlaneF &plane, const void *src, int width, int height, int bytes_per_component)
+{
+	plane.width = width;
+	plane.height = height;
+	plane.data.resize(size_t(width) * height);
+	size_t count = plane.data.size();
+
+	if (bytes_per_component == 2)
+	{
+		auto *s = static_cast<const uint16_t *>(src);
+		for (size_t i = 0; i < count; i++)
+			plane.data[i] = float(s[i]) * (1.0f / 65535.0f);
+	}
+	else
+	{
+		auto *s = static_cast<const uint8_t *>(src);
+		for (size_t i = 0; i < count; i++)
+			plane.data[i] = float(s[i]) * (1.0f / 255.0f);
+	}
+}
+
+static void downsample_plane(PlaneF &dst, const PlaneF &src)
+{
+	dst.width = src.width / 2;
+	dst.height = src.height / 2;
+	dst.data.resize(size_t(dst.width) * dst.height);
+
+	const auto quarter = Vec::splat(0.25f);
+
+	for (int y = 0; y < dst.height; y++)
+	{
+		const float *row0 = src.data.data() + size_t(2 * y) * src.width;
+		const float *row1 = row0 + src.width;
+		float *out = dst.data.data() + size_t(y) * dst.width;
+		int x = 0;
+
+		for (; x + 4 <= dst.width; x += 4)
+		{
+			auto v0 = Vec::add(Vec::load(row0 + 2 * x), Vec::load(row1 + 2 * x));
+			auto v1 = Vec::add(Vec::load(row0 + 2 * x + 4), Vec::load(row1 + 2 * x + 4));
+			Vec::store(out + x, Vec::mul(Vec::pairwise_add(v0, v1), quarter));
+		}
+
+		for (; x < dst.width; x++)
+			out[x] = 0.25f * (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1]);
+	}
+}
+
+struct SSIMResult
+{
+	double ssim;
+	// Contrast-structure term only, used by MS-SSIM.
+	double cs;
+};
+
+// Same formulation as x264 and FFmpeg: 4x4 block sums, combined into overlapping 8x8 windows with a stride of 4.
+// This keeps scores directly comparable with ffmpeg -lavfi ssim.
+static constexpr float SSIM_C1 = 0.01f * 0.01f * 64.0f;
+static constexpr float SSIM_C2 = 0.03f * 0.03f * 64.0f * 63.0f;
+
+struct SSIMScratch
+{
+	std::vector<float> columns[4];
+	std::vector<float> blocks[2][4];
+};
+
+// Sums of a, b, a^2 + b^2 and a * b over each 4x4 block in a row of blocks.
+static void compute_block_sums(SSIMScratch &scratch, const PlaneF &a, const PlaneF &b, int block_y, float * const *sums)
+{
+	int width = a.width;
+	int blocks_x = width / 4;
+
+	for (auto &col : scratch.columns)
+		col.resize(width);
+
+	float *col_a = scratch.columns[0].data();
+	float *col_b = scratch.columns[1].data();
+	float *col_ss = scratch.columns[2].data();
+	float *col_ab = scratch.columns[3].data();
+
+	const float *rows_a = a.data.data() + size_t(block_y * 4) * width;
+	const float *rows_b = b.data.data() + size_t(block_y * 4) * width;
+
+	int x = 0;
+	for (; x + 4 <= width; x += 4)
+	{
+		auto sa = Vec::splat(0.0f);
+		auto sb = sa, sss = sa, sab = sa;
+
+		for (int r = 0; r < 4; r++)
+		{
+			auto va = Vec::load(rows_a + r * width + x);
+			auto vb = Vec::load(rows_b + r * width + x);
+			sa = Vec::add(sa, va);
+			sb = Vec::add(sb, vb);
+			sss = Vec::add(sss, Vec::add(Vec::mul(va, va), Vec::mul(vb, vb)));
+			sab = Vec::add(sab, Vec::mul(va, vb));
+		}
+
+		Vec::store(col_a + x, sa);
+		Vec::store(col_b + x, sb);
+		Vec::store(col_ss + x, sss);
+		Vec::store(col_ab + x, sab);
+	}
+
+	// Columns past the last whole block are never used.
+	const float *cols[4] = { col_a, col_b, col_ss, col_ab };
+
+	for (int i = 0; i < 4; i++)
+	{
+		const float *col = cols[i];
+		float *out = sums[i];
+		int bx = 0;
+
+		for (; bx + 4 <= blocks_x; bx += 4)
+		{
+			Vec::store(out + bx, Vec::transpose_add(
+					Vec::load(col + 4 * bx + 0), Vec::load(col + 4 * bx + 4),
+					Vec::load(col + 4 * bx + 8), Vec::load(col + 4 * bx + 12)));
+		}
+
+		for (; bx < blocks_x; bx++)
+			out[bx] = col[4 * bx + 0] + col[4 * bx + 1] + col[4 * bx + 2] + col[4 * bx + 3];
+	}
+}
+
+static inline void ssim_window(float s1, float s2, float ss, float s12, float &ssim, float &cs)
+{
+	float vars = ss * 64.0f - s1 * s1 - s2 * s2;
+	float covar = s12 * 64.0f - s1 * s2;
+	cs = (2.0f * covar + SSIM_C2) / (vars + SSIM_C2);
+	ssim = cs * (2.0f * s1 * s2 + SSIM_C1) / (s1 * s1 + s2 * s2 + SSIM_C1);
+}
+
+static SSIMResult compute_ssim(SSIMScratch &scratch, const PlaneF &a, const PlaneF &b)
+{
+	int blocks_x = a.width / 4;
+	int blocks_y = a.height / 4;
+
+	if (blocks_x < 2 || blocks_y < 2)
+		return { 1.0, 1.0 };
+
+	for (auto &row : scratch.blocks)
+		for (auto &sums : row)
+			sums.resize(blocks_x);
+
+	float *rows[2][4];
+	for (int r = 0; r < 2; r++)
+		for (int i = 0; i < 4; i++)
+			rows[r][i] = scratch.blocks[r][i].data();
+
+	const auto c1 = Vec::splat(SSIM_C1);
+	const auto c2 = Vec::splat(SSIM_C2);
+	const auto sixty_four = Vec::splat(64.0f);
+	const auto two = Vec::splat(2.0f);
+
+	double total_ssim = 0.0;
+	double total_cs = 0.0;
+	int windows_x = blocks_x - 1;
+
+	compute_block_sums(scratch, a, b, 0, rows[0]);
+
+	for (int by = 1; by < blocks_y; by++)
+	{
+		compute_block_sums(scratch, a, b, by, rows[1]);
+
+		auto acc_ssim = Vec::splat(0.0f);
+		auto acc_cs = acc_ssim;
+		int x = 0;
+
+		for (; x + 4 <= windows_x; x += 4)
+		{
+			Vec::F4 w[4];
+			for (int i = 0; i < 4; i++)
+			{
+				w[i] = Vec::add(Vec::add(Vec::load(rows[0][i] + x), Vec::load(rows[0][i] + x + 1)),
+				                Vec::add(Vec::load(rows[1][i] + x), Vec::load(rows[1][i] + x + 1)));
+			}
+
+			auto s1s2 = Vec::mul(w[0], w[1]);
+			auto s1s1_s2s2 = Vec::add(Vec::mul(w[0], w[0]), Vec::mul(w[1], w[1]));
+			auto vars = Vec::sub(Vec::mul(w[2], sixty_four), s1s1_s2s2);
+			auto covar = Vec::sub(Vec::mul(w[3], sixty_four), s1s2);
+			auto cs = Vec::div(Vec::add(Vec::mul(two, covar), c2), Vec::add(vars, c2));
+			auto l = Vec::div(Vec::add(Vec::mul(two, s1s2), c1), Vec::add(s1s1_s2s2, c1));
+			acc_ssim = Vec::add(acc_ssim, Vec::mul(l, cs));
+			acc_cs = Vec::add(acc_cs, cs);
+		}
+
+		float row_ssim = Vec::reduce_add(acc_ssim);
+		float row_cs = Vec::reduce_add(acc_cs);
+
+		for (; x < windows_x; x++)
+		{
+			float w[4];
+			for (int i = 0; i < 4; i++)
+				w[i] = rows[0][i][x] + rows[0][i][x + 1] + rows[1][i][x] + rows[1][i][x + 1];
+
+			float ssim, cs;
+			ssim_window(w[0], w[1], w[2], w[3], ssim, cs);
+			row_ssim += ssim;
+			row_cs += cs;
+		}
+
+		total_ssim += row_ssim;
+		total_cs += row_cs;
+
+		for (int i = 0; i < 4; i++)
+			std::swap(rows[0][i], rows[1][i]);
+	}
+
+	double num_windows = double(windows_x) * double(blocks_y - 1);
+	return { total_ssim / num_windows, total_cs / num_windows };
+}
+
+// Wang, Simoncelli, Bovik, "Multi-scale structural similarity for image quality assessment".
+static constexpr double MS_SSIM_WEIGHTS[] = { 0.0448, 0.2856, 0.3001, 0.2363, 0.1333 };
+static constexpr int MS_SSIM_SCALES = int(sizeof(MS_SSIM_WEIGHTS) / sizeof(MS_SSIM_WEIGHTS[0]));
+
+struct MSSSIMScratch
+{
+	PlaneF scales[2][2];
+};
+
+// The inputs are consumed as the first scale.
+// If the image is too small for all scales, the weights of the scales that were computed are renormalized.
+static double compute_ms_ssim(SSIMScratch &scratch, MSSSIMScratch &ms, const PlaneF &a, const PlaneF &b)
+{
+	const PlaneF *cur_a = &a;
+	const PlaneF *cur_b = &b;
+
+	double log_sum = 0.0;
+	double weight_sum = 0.0;
+
+	for (int scale = 0; scale < MS_SSIM_SCALES; scale++)
+	{
+		auto result = compute_ssim(scratch, *cur_a, *cur_b);
+
+		bool last = scale + 1 == MS_SSIM_SCALES || cur_a->width / 2 < 8 || cur_a->height / 2 < 8;
+		double term = std::max(last ? result.ssim : result.cs, 0.0);
+		double weight = MS_SSIM_WEIGHTS[scale];
+
+		if (term == 0.0)
+			return 0.0;
+
+		log_sum += weight * std::log(term);
+		weight_sum += weight;
+
+		if (last)
+			break;
+
+		auto &next = ms.scales[scale & 1];
+		downsample_plane(next[0], *cur_a);
+		downsample_plane(next[1], *cur_b);
+		cur_a = &next[0];
+		cur_b = &next[1];
+	}
+
+	return std::exp(log_sum / weight_sum);
+}
+
+struct FrameLayout
+{
+	int width[3];
+	int height[3];
+	size_t plane_size[3];
+	int bytes_per_component;
+	double peak;
+};
+
+struct FrameData
+{
+	unsigned index = 0;
+	std::vector<uint8_t> planes[2][3];
+};
+
+struct FrameResult
+{
+	uint64_t squared_error[3] = {};
+	double ssim[3] = {};
+	double ms_ssim = 0.0;
+	bool valid = false;
+};
+
+struct MetricOptions
+{
+	std::string paths[2];
+	std::string csv_path;
+	unsigned num_threads = 0;
+	bool ssim = true;
+};
+
+// The main thread reads frames, workers compute metrics.
+// Frame buffers are recycled so memory is bounded regardless of clip length.
+class FrameQueue
+{
+public:
+	explicit FrameQueue(unsigned num_frames)
+	{
+		for (unsigned i = 0; i < num_frames; i++)
+			free_frames.emplace_back(new FrameData);
+	}
+
+	std::unique_ptr<FrameData> acquire()
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [this]() { return !free_frames.empty(); });
+		auto frame = std::move(free_frames.back());
+		free_frames.pop_back();
+		return frame;
+	}
+
+	void release(std::unique_ptr<FrameData> frame)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		free_frames.push_back(std::move(frame));
+		cond.notify_all();
+	}
+
+	void push(std::unique_ptr<FrameData> frame)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		ready_frames.push_back(std::move(frame));
+		cond.notify_all();
+	}
+
+	// Returns nullptr once the reader is done and everything is consumed.
+	std::unique_ptr<FrameData> pop()
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [this]() { return !ready_frames.empty() || done; });
+		if (ready_frames.empty())
+			return {};
+		auto frame = std::move(ready_frames.front());
+		ready_frames.erase(ready_frames.begin());
+		return frame;
+	}
+
+	void finish()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		done = true;
+		cond.notify_all();
+	}
+
+private:
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<std::unique_ptr<FrameData>> free_frames;
+	std::vector<std::unique_ptr<FrameData>> ready_frames;
+	bool done = false;
+};
+
+static void compute_frame_metrics(const FrameLayout &layout, const FrameData &frame, bool ssim,
+                                  FrameResult &result, SSIMScratch &scratch, MSSSIMScratch &ms, PlaneF planes[2])
+{
+	for (int i = 0; i < 3; i++)
+	{
+		const void *a = frame.planes[0][i].data();
+		const void *b = frame.planes[1][i].data();
+		size_t count = size_t(layout.width[i]) * layout.height[i];
+
+		if (layout.bytes_per_component == 2)
+		{
+			result.squared_error[i] = squared_error_16bit(
+					static_cast<const uint16_t *>(a), static_cast<const uint16_t *>(b), count);
+		}
+		else
+		{
+			result.squared_error[i] = squared_error_8bit(
+					static_cast<const uint8_t *>(a), static_cast<const uint8_t *>(b), count);
+		}
+
+		if (ssim)
+		{
+			convert_plane(planes[0], a, layout.width[i], layout.height[i], layout.bytes_per_component);
+			convert_plane(planes[1], b, layout.width[i], layout.height[i], layout.bytes_per_component);
+			result.ssim[i] = compute_ssim(scratch, planes[0], planes[1]).ssim;
+
+			// MS-SSIM is conventionally reported for luma only.
+			if (i == 0)
+				result.ms_ssim = compute_ms_ssim(scratch, ms, planes[0], planes[1]);
+		}
+	}
+
+	result.valid = true;
+}
+
+static double psnr(double peak_signal, double error)
+{
+	return 10.0 * std::log10(peak_signal / error);
+}
+
+static double frame_psnr(const FrameLayout &layout, const uint64_t *squared_error, int component)
+{
+	double peak = layout.peak * layout.peak;
+	if (component < 0)
+	{
+		double total_peak = 0.0;
+		double total_error = 0.0;
+		for (int i = 0; i < 3; i++)
+		{
+			total_peak += peak * double(layout.width[i]) * double(layout.height[i]);
+			total_error += double(squared_error[i]);
+		}
+		return psnr(total_peak, total_error);
+	}
+	else
+		return psnr(peak * double(layout.width[component]) * double(layout.height[component]), double(squared_error[component]));
+}
+
+// Weighted by number of samples, like FFmpeg's "All" score.
+static double frame_ssim(const FrameLayout &layout, const double *ssim)
+{
+	double total = 0.0;
+	double weight = 0.0;
+	for (int i = 0; i < 3; i++)
+	{
+		double w = double(layout.width[i]) * double(layout.height[i]);
+		total += ssim[i] * w;
+		weight += w;
+	}
+	return total / weight;
+}
+
+static void print_help()
+{
+	fprintf(stderr, "Usage: pyrowave-psnr a.y4m b.y4m\n"
+	                "\t[--threads <count>] (default: number of hardware threads)\n"
+	                "\t[--csv <per-frame.csv>]\n"
+	                "\t[--psnr-only] (skip SSIM and MS-SSIM)\n");
+}
+
+static bool parse_options(MetricOptions &options, int argc, char **argv, bool &help)
+{
+	unsigned num_paths = 0;
+	CLICallbacks cbs;
+
+	cbs.add("--threads", [&](CLIParser &parser) { options.num_threads = parser.next_uint(); });
+	cbs.add("--csv", [&](CLIParser &parser) { options.csv_path = parser.next_string(); });
+	cbs.add("--psnr-only", [&](CLIParser &) { options.ssim = false; });
+	cbs.add("--help", [](CLIParser &parser) { parser.end(); });
+	cbs.default_handler = [&](const char *arg)
+	{
+		if (num_paths < 2)
+			options.paths[num_paths] = arg;
+		num_paths++;
+	};
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse())
+		return false;
+
+	help = parser.is_ended_state();
+	if (help)
+		return true;
+
+	if (num_paths != 2)
+	{
+		fprintf(stderr, "Need exactly two input files.\n");
+		return false;
+	}
+
+	return true;
+}
 
 int main(int argc, char **argv)
 {
-	if (argc != 3)
+	MetricOptions options;
+	bool help = false;
+
+	if (!parse_options(options, argc, argv, help))
 	{
-		fprintf(stderr, "Usage: a.y4m b.y4m\n");
+		print_help();
 		return EXIT_FAILURE;
 	}
 
-	YUV4MPEGFile a, b;
+	if (help)
+	{
+		print_help();
+		return EXIT_SUCCESS;
+	}
 
-	if (!a.open_read(argv[1]))
+	YUV4MPEGFile files[2];
+
+	for (int i = 0; i < 2; i++)
 	{
-		fprintf(stderr, "Failed to open %s.\n", argv[1]);
-		return EXIT_FAILURE;
+		if (!files[i].open_read(options.paths[i]))
+		{
+			fprintf(stderr, "Failed to open %s.\n", options.paths[i].c_str());
+			return EXIT_FAILURE;
+		}
 	}
 
-	if (!b.open_read(argv[2]))
+	auto &a = files[0];
+	auto &b = files[1];
+
+	if (a.get_width() != b.get_width() || a.get_height() != b.get_height() || a.get_format() != b.get_format())
 	{
-		fprintf(stderr, "Failed to open %s.\n", argv[2]);
+		fprintf(stderr, "Mismatch in parameters (%d, %d, format %d) != (%d, %d, format %d)\n",
+		        a.get_width(), a.get_height(), int(a.get_format()),
+		        b.get_width(), b.get_height(), int(b.get_format()));
 		return EXIT_FAILURE;
 	}
 
-	if (a.get_width() != b.get_width() || a.get_height() != b.get_height())
+	FrameLayout layout = {};
+	layout.bytes_per_component = YUV4MPEGFile::format_to_bytes_per_component(a.get_format());
+	// 16-bit formats are rescaled to the full 16-bit range on read.
+	layout.peak = layout.bytes_per_component == 2 ? 65535.0 : 255.0;
+
+	for (int i = 0; i < 3; i++)
 	{
-		fprintf(stderr, "Mismatch in parameters (%d, %d) != (%d, %d)\n",
-				a.get_width(), a.get_height(), b.get_width(), b.get_height());
-		return EXIT_FAILURE;
+		layout.width[i] = a.get_width();
+		layout.height[i] = a.get_height();
+		if (i != 0 && YUV4MPEGFile::format_has_subsampling(a.get_format()))
+		{
+			layout.width[i] >>= 1;
+			layout.height[i] >>= 1;
+		}
+		layout.plane_size[i] = size_t(layout.width[i]) * layout.height[i] * layout.bytes_per_component;
 	}
 
-	int num_luma_pixels = a.get_width() * a.get_height();
-	int num_chroma_pixels = (a.get_width() / 2) * (a.get_height() / 2);
-	std::unique_ptr<uint8_t[]> Y[2] = {
-			std::unique_ptr<uint8_t[]>(new uint8_t[num_luma_pixels]),
-			std::unique_ptr<uint8_t[]>(new uint8_t[num_luma_pixels]) };
+	unsigned num_threads = options.num_threads ? options.num_threads : std::thread::hardware_concurrency();
+	num_threads = std::max(num_threads, 1u);
 
-	std::unique_ptr<uint8_t[]> Cb[2] = {
-			std::unique_ptr<uint8_t[]>(new uint8_t[num_chroma_pixels]),
-			std::unique_ptr<uint8_t[]>(new uint8_t[num_chroma_pixels]) };
+	FrameQueue queue(num_threads * 2);
+	std::vector<FrameResult> results;
+	std::mutex results_lock;
 
-	std::unique_ptr<uint8_t[]> Cr[2] = {
-			std::unique_ptr<uint8_t[]>(new uint8_t[num_chroma_pixels]),
-			std::unique_ptr<uint8_t[]>(new uint8_t[num_chroma_pixels]) };
+	std::vector<std::thread> workers;
+	workers.reserve(num_threads);
 
-	uint64_t total_peak_signal[3] = {};
-	uint64_t total_error[3] = {};
-	uint64_t frame_peak_signal[3] = {};
-	uint64_t frame_error[3] = {};
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		workers.emplace_back([&]()
+		{
+			SSIMScratch scratch;
+			MSSSIMScratch ms;
+			PlaneF planes[2];
+
+			while (auto frame = queue.pop())
+			{
+				FrameResult result;
+				compute_frame_metrics(layout, *frame, options.ssim, result, scratch, ms, planes);
+
+				{
+					std::lock_guard<std::mutex> holder{results_lock};
+					if (results.size() <= frame->index)
+						results.resize(frame->index + 1);
+					results[frame->index] = result;
+				}
 
-	for (;;)
+				queue.release(std::move(frame));
+			}
+		});
+	}
+
+	for (unsigned index = 0; ; index++)
 	{
 		if (!a.begin_frame() || !b.begin_frame())
 			break;
 
-		if (!a.read(Y[0].get(), num_luma_pixels))
-			break;
-		if (!b.read(Y[1].get(), num_luma_pixels))
-			break;
+		auto frame = queue.acquire();
+		frame->index = index;
 
-		if (!a.read(Cb[0].get(), num_chroma_pixels))
-			break;
-		if (!b.read(Cb[1].get(), num_chroma_pixels))
-			break;
+		bool ok = true;
+		for (int i = 0; i < 3 && ok; i++)
+		{
+			for (int f = 0; f < 2 && ok; f++)
+			{
+				frame->planes[f][i].resize(layout.plane_size[i]);
+				ok = files[f].read(frame->planes[f][i].data(), layout.plane_size[i]);
+			}
+		}
 
-		if (!a.read(Cr[0].get(), num_chroma_pixels))
-			break;
-		if (!b.read(Cr[1].get(), num_chroma_pixels))
+		if (!ok)
+		{
+			queue.release(std::move(frame));
 			break;
+		}
 
-		for (int i = 0; i < 3; i++)
-			frame_error[i] = 0;
+		queue.push(std::move(frame));
+	}
 
-		for (int i = 0; i < num_luma_pixels; i++)
+	queue.finish();
+	for (auto &worker : workers)
+		worker.join();
+
+	std::unique_ptr<FILE, decltype(&fclose)> csv{nullptr, &fclose};
+	if (!options.csv_path.empty())
+	{
+		csv.reset(fopen(options.csv_path.c_str(), "w"));
+		if (!csv)
 		{
-			int dY = Y[0][i] - Y[1][i];
-			dY *= dY;
-			frame_error[0] += dY;
+			fprintf(stderr, "Failed to open %s for writing.\n", options.csv_path.c_str());
+			return EXIT_FAILURE;
 		}
 
-		for (int i = 0; i < num_chroma_pixels; i++)
+		if (options.ssim)
+			fprintf(csv.get(), "frame,psnr_y,psnr_cb,psnr_cr,psnr,ssim_y,ssim_cb,ssim_cr,ssim,ms_ssim\n");
+		else
+			fprintf(csv.get(), "frame,psnr_y,psnr_cb,psnr_cr,psnr\n");
+	}
+
+	uint64_t total_error[3] = {};
+	double total_ssim[3] = {};
+	double total_ms_ssim = 0.0;
+	unsigned num_frames = 0;
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto &result = results[i];
+		if (!result.valid)
+			continue;
+
+		if (options.ssim)
+		{
+			fprintf(stderr, "Frame %zu: PSNR: (Y) %4.4f dB, (Cb) %4.4f dB, (Cr) %4.4f dB, SSIM: (Y) %.6f, (Cb) %.6f, (Cr) %.6f, MS-SSIM: %.6f\n",
+			        i,
+			        frame_psnr(layout, result.squared_error, 0),
+			        frame_psnr(layout, result.squared_error, 1),
+			        frame_psnr(layout, result.squared_error, 2),
+			        result.ssim[0], result.ssim[1], result.ssim[2], result.ms_ssim);
+		}
+		else
 		{
-			int dCb = Cb[0][i] - Cb[1][i];
-			int dCr = Cr[0][i] - Cr[1][i];
-			dCb *= dCb;
-			dCr *= dCr;
-			frame_error[1] += dCb;
-			frame_error[2] += dCr;
+			fprintf(stderr, "Frame %zu: PSNR: (Y) %4.4f dB, (Cb) %4.4f dB, (Cr) %4.4f dB\n",
+			        i,
+			        frame_psnr(layout, result.squared_error, 0),
+			        frame_psnr(layout, result.squared_error, 1),
+			        frame_psnr(layout, result.squared_error, 2));
 		}
 
-		frame_peak_signal[0] = num_luma_pixels * 255ull * 255ull;
-		frame_peak_signal[1] = num_chroma_pixels * 255ull * 255ull;
-		frame_peak_signal[2] = num_chroma_pixels * 255ull * 255ull;
+		if (csv)
+		{
+			fprintf(csv.get(), "%zu,%.4f,%.4f,%.4f,%.4f",
+			        i,
+			        frame_psnr(layout, result.squared_error, 0),
+			        frame_psnr(layout, result.squared_error, 1),
+			        frame_psnr(layout, result.squared_error, 2),
+			        frame_psnr(layout, result.squared_error, -1));
 
-		fprintf(stderr, "PSNR: (Y) %4.4f dB, (Cb) %4.4f dB, (Cr) %4.4f dB\n",
-		        10.0 * std::log10(double(frame_peak_signal[0]) / double(frame_error[0])),
-		        10.0 * std::log10(double(frame_peak_signal[1]) / double(frame_error[1])),
-		        10.0 * std::log10(double(frame_peak_signal[2]) / double(frame_error[2])));
+			if (options.ssim)
+			{
+				fprintf(csv.get(), ",%.6f,%.6f,%.6f,%.6f,%.6f",
+				        result.ssim[0], result.ssim[1], result.ssim[2],
+				        frame_ssim(layout, result.ssim), result.ms_ssim);
+			}
 
-		for (int i = 0; i < 3; i++)
+			fprintf(csv.get(), "\n");
+		}
+
+		for (int c = 0; c < 3; c++)
 		{
-			total_peak_signal[i] += frame_peak_signal[i];
-			total_error[i] += frame_error[i];
+			total_error[c] += result.squared_error[c];
+			total_ssim[c] += result.ssim[c];
 		}
+		total_ms_ssim += result.ms_ssim;
+		num_frames++;
 	}
 
+	if (!num_frames)
+	{
+		fprintf(stderr, "No frames were compared.\n");
+		return EXIT_FAILURE;
+	}
+
+	// Overall PSNR is computed from the total error, not averaged per frame.
+	double peak = layout.peak * layout.peak * double(num_frames);
 	fprintf(stderr, "Overall PSNR: (Y) %4.4f dB, (Cb) %4.4f dB, (Cr) %4.4f dB\n",
-	        10.0 * std::log10(double(total_peak_signal[0]) / double(total_error[0])),
-	        10.0 * std::log10(double(total_peak_signal[1]) / double(total_error[1])),
-	        10.0 * std::log10(double(total_peak_signal[2]) / double(total_error[2])));
+	        psnr(peak * double(layout.width[0]) * double(layout.height[0]), double(total_error[0])),
+	        psnr(peak * double(layout.width[1]) * double(layout.height[1]), double(total_error[1])),
+	        psnr(peak * double(layout.width[2]) * double(layout.height[2]), double(total_error[2])));
+
+	if (options.ssim)
+	{
+		for (auto &s : total_ssim)
+			s /= double(num_frames);
+		fprintf(stderr, "Overall SSIM: (Y) %.6f, (Cb) %.6f, (Cr) %.6f, (All) %.6f, MS-SSIM: %.6f\n",
+		        total_ssim[0], total_ssim[1], total_ssim[2], frame_ssim(layout, total_ssim),
+		        total_ms_ssim / double(num_frames));
+	}
 
-}
\ No newline at end of file
+	return EXIT_SUCCESS;
+}
@@ -19,7 +19,7 @@ extern "C" {
 // API and ABI is not considered stable until MAJOR version hits 1!
 
 #define PYROWAVE_API_VERSION_MAJOR 0
-#define PYROWAVE_API_VERSION_MINOR 4
+#define PYROWAVE_API_VERSION_MINOR 17
 #define PYROWAVE_API_VERSION_PATCH 0
 
 #if !defined(PYROWAVE_PUBLIC_API)
@@ -59,14 +59,50 @@ typedef enum pyrowave_chroma_subsampling
 {
 	PYROWAVE_CHROMA_SUBSAMPLING_420 = 0,
 	PYROWAVE_CHROMA_SUBSAMPLING_444 = 1,
+	// Chroma is only subsampled horizontally. Width must be even.
+	// Not supported with the fragment path.
+	PYROWAVE_CHROMA_SUBSAMPLING_422 = 2,
 	PYROWAVE_CHROMA_SUBSAMPLING_INT_MAX = 0x7fffffff
 } pyrowave_chroma_subsampling;
 
+typedef enum pyrowave_wavelet_transform
+{
+	PYROWAVE_WAVELET_TRANSFORM_CDF97 = 0,
+	// Reversible integer transform. Lossless for 8-bit content when the rate allows,
+	// near-lossless when rate control has to drop bit-planes.
+	// Only 8-bit input is accepted; encoding 10-bit or 16-bit planes returns PYROWAVE_ERROR_INVALID_ARGUMENT.
+	// Not supported with the fragment path.
+	PYROWAVE_WAVELET_TRANSFORM_LEGALL53 = 1,
+	PYROWAVE_WAVELET_TRANSFORM_INT_MAX = 0x7fffffff
+} pyrowave_wavelet_transform;
+
+typedef enum pyrowave_ycbcr_transform
+{
+	PYROWAVE_YCBCR_TRANSFORM_BT709 = 0,
+	PYROWAVE_YCBCR_TRANSFORM_BT2020 = 1,
+	PYROWAVE_YCBCR_TRANSFORM_INT_MAX = 0x7fffffff
+} pyrowave_ycbcr_transform;
+
+typedef enum pyrowave_ycbcr_range
+{
+	PYROWAVE_YCBCR_RANGE_FULL = 0,
+	PYROWAVE_YCBCR_RANGE_LIMITED = 1,
+	PYROWAVE_YCBCR_RANGE_INT_MAX = 0x7fffffff
+} pyrowave_ycbcr_range;
+
+typedef enum pyrowave_chroma_siting
+{
+	PYROWAVE_CHROMA_SITING_CENTER = 0,
+	PYROWAVE_CHROMA_SITING_LEFT = 1,
+	PYROWAVE_CHROMA_SITING_INT_MAX = 0x7fffffff
+} pyrowave_chroma_siting;
+
 typedef struct pyrowave_encoder_opaque *pyrowave_encoder;
 typedef struct pyrowave_decoder_opaque *pyrowave_decoder;
 typedef struct pyrowave_device_opaque *pyrowave_device;
 typedef struct pyrowave_sync_object_opaque *pyrowave_sync_object;
 typedef struct pyrowave_image_opaque *pyrowave_image;
+typedef struct pyrowave_resource_pool_opaque *pyrowave_resource_pool;
 
 // Used to dynamically detect any API/ABI incompatibility.
 // This entry point is stable.
@@ -166,6 +202,55 @@ PYROWAVE_PUBLIC_API pyrowave_result pyrowave_create_device_by_compat(
 PYROWAVE_PUBLIC_API void
 pyrowave_device_report_performance_stats(pyrowave_device device, pyrowave_message_cb cb, void *userdata, bool reset);
 
+// CPU timing of API entry points, for attributing end-to-end latency.
+// Only available if the library was built with PYROWAVE_INSTRUMENTATION. Otherwise the hooks compile to nothing.
+typedef enum pyrowave_timing_event
+{
+	// Recording and submitting an encode.
+	PYROWAVE_TIMING_EVENT_ENCODE_RECORD = 0,
+	// Blocking on an encode to complete, first call after encode which needs the result.
+	PYROWAVE_TIMING_EVENT_ENCODE_FENCE_WAIT = 1,
+	PYROWAVE_TIMING_EVENT_PACKETIZE = 2,
+	// One sample per call to either pyrowave_decoder_push_packet or pyrowave_decoder_push_packets.
+	PYROWAVE_TIMING_EVENT_PUSH_PACKET = 3,
+	// Recording and submitting a decode.
+	PYROWAVE_TIMING_EVENT_DECODE_SUBMIT = 4,
+	// Blocking on a CPU buffer readback to complete.
+	PYROWAVE_TIMING_EVENT_DECODE_FENCE_WAIT = 5,
+	PYROWAVE_TIMING_EVENT_COUNT,
+	PYROWAVE_TIMING_EVENT_INT_MAX = 0x7fffffff
+} pyrowave_timing_event;
+
+#define PYROWAVE_TIMING_HISTOGRAM_BUCKETS 128
+
+typedef struct pyrowave_timing_histogram
+{
+	uint64_t count;
+	uint64_t total_ns;
+	// Log-linear buckets with 4 buckets per power of two.
+	// Bucket i covers durations below pyrowave_timing_histogram_bucket_upper_bound_ns(i).
+	uint64_t buckets[PYROWAVE_TIMING_HISTOGRAM_BUCKETS];
+} pyrowave_timing_histogram;
+
+// Timing is process global and disabled by default, even if built in.
+// Returns false if the library was not built with instrumentation.
+PYROWAVE_PUBLIC_API bool pyrowave_set_timing_enabled(bool enable);
+
+// Aggregates samples from all threads since the last reset.
+// Returns PYROWAVE_ERROR_NOT_IMPLEMENTED if the library was not built with instrumentation.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_get_timing_histogram(pyrowave_timing_event event, pyrowave_timing_histogram *histogram, bool reset);
+
+// Exclusive upper bound. The last bucket is unbounded and returns UINT64_MAX.
+PYROWAVE_PUBLIC_API uint64_t pyrowave_timing_histogram_bucket_upper_bound_ns(uint32_t bucket);
+
+// percentile is in [0, 1]. Returns the upper bound of the bucket which contains the percentile, or 0 if empty.
+PYROWAVE_PUBLIC_API uint64_t
+pyrowave_timing_histogram_percentile_ns(const pyrowave_timing_histogram *histogram, double percentile);
+
+// Reports mean and percentiles for every event through the callback.
+PYROWAVE_PUBLIC_API void pyrowave_report_timing_stats(pyrowave_message_cb cb, void *userdata, bool reset);
+
 // Out pointers can be NULL, in which case nothing is written to them.
 PYROWAVE_PUBLIC_API void pyrowave_device_get_vk_device_handles(
 	pyrowave_device device,
@@ -204,6 +289,28 @@ pyrowave_device_confirm_interop_support(pyrowave_device device);
 PYROWAVE_PUBLIC_API void pyrowave_device_destroy(pyrowave_device device);
 ////
 
+// Resource pool API
+// Caches the images and buffers of destroyed encoders and decoders, so that creating another one
+// with the same parameters takes them over instead of allocating.
+// Encoders and decoders which exist at the same time never share resources.
+// Resources only become available for reuse once the GPU work submitted before their owner was destroyed has completed.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_resource_pool_create(pyrowave_device device, pyrowave_resource_pool *pool);
+
+// Device memory held by resources which are ready to be reused, in bytes.
+PYROWAVE_PUBLIC_API uint64_t
+pyrowave_resource_pool_get_idle_memory_size(pyrowave_resource_pool pool);
+
+// Frees all idle resources.
+PYROWAVE_PUBLIC_API void
+pyrowave_resource_pool_clear(pyrowave_resource_pool pool);
+
+// All encoders and decoders using the pool must have been destroyed before destroying the pool,
+// and the pool must be destroyed before its device.
+PYROWAVE_PUBLIC_API void
+pyrowave_resource_pool_destroy(pyrowave_resource_pool pool);
+////
+
 // External sync API
 // On Windows, this is a HANDLE reinterpreted as uintptr_t.
 // On POSIX, it's a file descriptor int casted to uintptr_t.
@@ -355,18 +462,60 @@ PYROWAVE_PUBLIC_API void pyrowave_image_destroy(pyrowave_image image);
 typedef struct pyrowave_encoder_create_info
 {
 	pyrowave_device device;
-	// For 420 subsampling, must be even.
+	// For 420 subsampling, must be even. For 422 subsampling, width must be even.
 	int width;
 	int height;
 	pyrowave_chroma_subsampling chroma;
+	// 0 selects PYROWAVE_DEFAULT_DECOMPOSITION_LEVELS, otherwise
+	// must be in [PYROWAVE_MIN_DECOMPOSITION_LEVELS, PYROWAVE_MAX_DECOMPOSITION_LEVELS].
+	// Fewer levels reduce padding overhead for small images.
+	// Non-default level counts are signalled in the bitstream.
+	int decomposition_levels;
+	// Non-default transforms are signalled in the bitstream.
+	pyrowave_wavelet_transform transform;
+	// Upper bound for device_local_size as reported by pyrowave_encoder_query_memory_requirements()
+	// for the maximum_bitstream_size of every encode, 0 is unlimited.
+	// The payload scratch shrinks from its worst case size to fit, so with a tight budget the encoder
+	// can drop arbitrary blocks before rate control, see pyrowave_frame_stats::payload_overflow_bytes.
+	// Fails with PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY if the fixed resources alone do not fit,
+	// and an encode fails if the bitstream buffers for its rate do not fit.
+	uint64_t memory_budget;
+	// If non-NULL, images and buffers are allocated through the pool and returned to it on destruction.
+	// Must have been created for the same device.
+	pyrowave_resource_pool pool;
+	// If non-zero, every block is split into two SNR layers. The base layer drops this many of the lowest bit-planes
+	// and decodes on its own, and the enhancement layer carries them. Packets never mix layers,
+	// see pyrowave_get_packet_layer(). Must be at most PYROWAVE_MAX_ENHANCEMENT_PLANES.
+	// Signalled in the bitstream.
+	int enhancement_planes;
+	// If non-zero and smaller than height, the frame is split into horizontal slices of this many rows,
+	// which are encoded one at a time with pyrowave_encoder_encode_slice_gpu_synchronous() or
+	// pyrowave_encoder_encode_slice_cpu_synchronous(), e.g. as soon as the rows of a slice are rendered.
+	// Must be a multiple of 1 << decomposition_levels, and at least 4 << decomposition_levels.
+	// Signalled in the bitstream.
+	int slice_height;
 } pyrowave_encoder_create_info;
 
+typedef struct pyrowave_memory_requirements
+{
+	// Not counting alignment or tiling padding.
+	uint64_t device_local_size;
+	uint64_t host_visible_size;
+} pyrowave_memory_requirements;
+
 typedef struct pyrowave_packet
 {
 	size_t offset;
 	size_t size;
 } pyrowave_packet;
 
+// Layout is compatible with struct iovec.
+typedef struct pyrowave_packet_data
+{
+	const void *data;
+	size_t size;
+} pyrowave_packet_data;
+
 typedef struct pyrowave_sync_point
 {
 	// Can be VK_NULL_HANDLE, in which case it means "no sync".
@@ -387,8 +536,9 @@ typedef struct pyrowave_gpu_external_reference
 
 typedef struct pyrowave_gpu_buffers
 {
-	// All 3 planes must be provided. For NV12 images, pass in the same plane for Cb and Cr, but use swizzle
-	// to select R and G planes to fake a YUV420P image.
+	// All 3 planes must be provided. For NV12, P010, P016, NV16 or P210 images, pass in the same plane for Cb and Cr,
+	// but use swizzle to select R and G planes to fake a YUV420P or YUV422P image.
+	// 10-bit and 16-bit planes are sampled directly, so no conversion pass is needed.
 	// Very slightly less efficient, but should barely be measurable.
 	// pyrowave_image_get_image_view() can be used as a helper to fill these in.
 	pyrowave_image_view planes[3];
@@ -414,6 +564,19 @@ typedef enum pyrowave_cpu_buffer_format
 	PYROWAVE_CPU_BUFFER_FORMAT_NV12 = 0, // 2 planes. Y packed in 8bpp, then CbCr packed in 16bpp. Only supported for encoding.
 	PYROWAVE_CPU_BUFFER_FORMAT_YUV420P = 1, // 3 planes. Y, Cb, Cr packed into separate planes. Native format for pyrowave.
 	PYROWAVE_CPU_BUFFER_FORMAT_YUV444P = 2, // 3 planes. Y, Cb, Cr packed into separate planes. Native format for pyrowave.
+	// High bit-depth variants use one native-endian uint16_t per component, normalized to the full 16-bit range.
+	// Row strides must be a multiple of the texel size.
+	PYROWAVE_CPU_BUFFER_FORMAT_P010 = 3, // Like NV12, but 10 bits stored in the MSBs of 16 bits. Only supported for encoding.
+	PYROWAVE_CPU_BUFFER_FORMAT_P016 = 4, // Like NV12, but 16 bits per component. Only supported for encoding.
+	PYROWAVE_CPU_BUFFER_FORMAT_YUV420P16 = 5, // Like YUV420P, but 16 bits per component.
+	PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16 = 6, // Like YUV444P, but 16 bits per component.
+	// 4:2:2 variants. Chroma planes are half width, but full height.
+	PYROWAVE_CPU_BUFFER_FORMAT_YUV422P = 7, // 3 planes. Y, Cb, Cr packed into separate planes. Native format for pyrowave.
+	PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16 = 8, // Like YUV422P, but 16 bits per component.
+	PYROWAVE_CPU_BUFFER_FORMAT_NV16 = 9, // Like NV12, but 4:2:2. Only supported for encoding.
+	PYROWAVE_CPU_BUFFER_FORMAT_P210 = 10, // Like P010, but 4:2:2. Only supported for encoding.
+	// 1 plane of packed RGBA8 UNORM. Alpha is ignored. Only supported by pyrowave_encoder_encode_rgb_cpu_synchronous.
+	PYROWAVE_CPU_BUFFER_FORMAT_RGBA8 = 11,
 	PYROWAVE_CPU_BUFFER_FORMAT_INT_MAX = 0x7fffffff
 } pyrowave_cpu_buffer_format;
 
@@ -432,16 +595,38 @@ typedef struct pyrowave_cpu_buffer
 	pyrowave_cpu_buffer_format format;
 } pyrowave_cpu_buffer;
 
+typedef struct pyrowave_color_conversion
+{
+	pyrowave_ycbcr_transform transform;
+	pyrowave_ycbcr_range range;
+	// Only relevant for 420 and 422 subsampling.
+	pyrowave_chroma_siting siting;
+} pyrowave_color_conversion;
+
 typedef struct pyrowave_rate_control
 {
 	// Very basic, target bitstream for an image must not exceed this size.
 	size_t maximum_bitstream_size;
+	// With SNR layers, the base layer alone must not exceed this size. 0 only bounds both layers together.
+	// Must not be larger than maximum_bitstream_size.
+	size_t maximum_base_layer_size;
 } pyrowave_rate_control;
 
 // The entry points for encoder are not thread safe. Application must ensure synchronization.
 PYROWAVE_PUBLIC_API pyrowave_result
 pyrowave_encoder_create(const pyrowave_encoder_create_info *info, pyrowave_encoder *encoder);
 
+// Computes the memory an encoder created with info uses, without creating it, e.g. for admission control.
+// info->device and info->memory_budget are ignored, and device can be NULL.
+// rate_control is the largest maximum_bitstream_size which will be used.
+// If NULL, the largest bitstream size which makes sense for the resolution is assumed.
+// Includes the per-frame bitstream buffers for the rate, and their host-visible readback copies.
+// Stats readback is not included.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_query_memory_requirements(const pyrowave_encoder_create_info *info,
+                                           const pyrowave_rate_control *rate_control,
+                                           pyrowave_memory_requirements *requirements);
+
 // Synchronous encode API. For low-latency use cases, overlapping frames in encode is meaningless
 // due to latency and the encoder is so fast anyway. This function will not block, but subsequent functions will.
 // Calling an encode operation with synchronous API clobbers any previous encoded frame.
@@ -466,6 +651,42 @@ PYROWAVE_PUBLIC_API pyrowave_result
 pyrowave_encoder_encode_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
                                         const pyrowave_rate_control *rate_control);
 
+// In slice mode, the full frame encode functions fail, and every slice of a frame is encoded on its own instead.
+// All slices of a frame must be encoded, starting with slice 0. buffers cover the full frame,
+// but only the rows of slice_index are read. rate_control applies to the slice alone.
+// Like a full frame, every slice must be packetized before the next encode.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_encode_slice_gpu_synchronous(pyrowave_encoder encoder,
+                                              const pyrowave_gpu_sync_operation *acquire,
+                                              const pyrowave_gpu_sync_operation *release,
+                                              const pyrowave_gpu_buffers *buffers,
+                                              int slice_index,
+                                              const pyrowave_rate_control *rate_control);
+
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_encode_slice_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
+                                              int slice_index, const pyrowave_rate_control *rate_control);
+
+// Same as pyrowave_encoder_encode_gpu_synchronous, except that the input is a single RGB(A) image,
+// and RGB to YCbCr conversion and chroma subsampling are fused into the first DWT pass,
+// which avoids a separate color conversion pass. Not supported in slice mode.
+// The view must be a non-sRGB color format, e.g. BGRA8 or RGB10A2 UNORM. Alpha is ignored. Swizzle is ignored.
+// The image must support VK_IMAGE_USAGE_SAMPLED_BIT. Synchronization rules are the same as for YCbCr planes.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_encode_gpu_rgb_synchronous(pyrowave_encoder encoder,
+                                            const pyrowave_gpu_sync_operation *acquire,
+                                            const pyrowave_gpu_sync_operation *release,
+                                            const pyrowave_image_view *rgb,
+                                            const pyrowave_color_conversion *conversion,
+                                            const pyrowave_rate_control *rate_control);
+
+// buffers must be PYROWAVE_CPU_BUFFER_FORMAT_RGBA8.
+// A command buffer must not be set on pyrowave_device.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_encode_rgb_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
+                                            const pyrowave_color_conversion *conversion,
+                                            const pyrowave_rate_control *rate_control);
+
 // Can only be called after a successful encoding operation and result is only valid for that particular frame.
 // Computes the number of network packets required if each packet can consume a provided number of bytes.
 PYROWAVE_PUBLIC_API pyrowave_result
@@ -476,6 +697,62 @@ PYROWAVE_PUBLIC_API pyrowave_result
 pyrowave_encoder_packetize(pyrowave_encoder encoder, pyrowave_packet *packets, size_t packet_boundary,
                            size_t *out_packets, void *bitstream, size_t size);
 
+#define PYROWAVE_NUM_COMPONENTS 3
+#define PYROWAVE_DEFAULT_DECOMPOSITION_LEVELS 5
+#define PYROWAVE_MIN_DECOMPOSITION_LEVELS 3
+#define PYROWAVE_MAX_DECOMPOSITION_LEVELS 7
+#define PYROWAVE_MAX_ENHANCEMENT_PLANES 8
+// Size of the level dimension in pyrowave_frame_stats. Levels beyond the encoder's level count are zero.
+#define PYROWAVE_NUM_DECOMPOSITION_LEVELS PYROWAVE_MAX_DECOMPOSITION_LEVELS
+#define PYROWAVE_NUM_BANDS_PER_LEVEL 4
+
+typedef struct pyrowave_band_stats
+{
+	// Includes block headers.
+	size_t bytes;
+	// In 32x32 blocks.
+	uint32_t num_blocks;
+	uint32_t num_non_zero_blocks;
+	// Bit-planes dropped by rate control on top of the base quantizer, per 32x32 block.
+	uint32_t min_quant;
+	uint32_t max_quant;
+	float mean_quant;
+	// Squared error after rate control, as estimated by the encoder in the wavelet domain.
+	float distortion;
+} pyrowave_band_stats;
+
+typedef struct pyrowave_frame_stats
+{
+	// Indexed as [component][level][band], where level 0 is the highest frequency level.
+	// Bands which are not coded, e.g. level 0 chroma for 4:2:0, are zero.
+	pyrowave_band_stats bands[PYROWAVE_NUM_COMPONENTS][PYROWAVE_NUM_DECOMPOSITION_LEVELS][PYROWAVE_NUM_BANDS_PER_LEVEL];
+	// Includes the sequence header.
+	size_t total_bytes;
+	uint32_t num_blocks;
+	uint32_t num_non_zero_blocks;
+	// Unused bytes if every packet was padded to packet_boundary.
+	size_t packet_padding_bytes;
+	// Payload the quantizer could not fit in its scratch buffer, which only happens with a memory_budget.
+	// Blocks which did not fit are dropped regardless of rate control, including low frequency bands,
+	// and their distortion is counted in full.
+	size_t payload_overflow_bytes;
+	// Quantizer, distortion and overflow fields are only valid if stats were enabled when the frame was encoded.
+	bool has_rate_control_stats;
+} pyrowave_frame_stats;
+
+// Enables readback of rate control state for subsequent encodes. Disabled by default.
+// When enabled, the readback is recorded as part of the encode and adds some memory traffic.
+// When disabled, no extra work is done.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_set_stats_enabled(pyrowave_encoder encoder, bool enable);
+
+// Can only be called after a successful encoding operation and result is only valid for that particular frame.
+// Like pyrowave_encoder_packetize, blocks until the encode has completed.
+// packet_boundary is used to compute packet padding and can be 0 if that is not needed.
+// Sizes and block counts are always reported. Quantizer and distortion require stats to be enabled.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_encoder_get_frame_stats(pyrowave_encoder encoder, size_t packet_boundary, pyrowave_frame_stats *stats);
+
 // Implementation ensures GPU is idle before destroying objects.
 PYROWAVE_PUBLIC_API void
 pyrowave_encoder_destroy(pyrowave_encoder encoder);
@@ -485,11 +762,25 @@ pyrowave_encoder_destroy(pyrowave_encoder encoder);
 typedef struct pyrowave_decoder_create_info
 {
 	pyrowave_device device;
-	// For 420 subsampling, must be even.
+	// For 420 subsampling, must be even. For 422 subsampling, width must be even.
 	int width;
 	int height;
 	pyrowave_chroma_subsampling chroma;
 	bool fragment_path;
+	// Must match the encoder, 0 selects PYROWAVE_DEFAULT_DECOMPOSITION_LEVELS.
+	int decomposition_levels;
+	// Must match the encoder.
+	pyrowave_wavelet_transform transform;
+	// Upper bound for device_local_size as reported by pyrowave_decoder_query_memory_requirements(),
+	// 0 is unlimited. The payload buffer grows without slack to stay within the budget.
+	// A frame which is larger than the budget allows is still decoded.
+	// Fails with PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY if the fixed resources alone do not fit.
+	uint64_t memory_budget;
+	// If non-NULL, images and buffers are allocated through the pool and returned to it on destruction.
+	// Must have been created for the same device.
+	pyrowave_resource_pool pool;
+	// Must match the encoder. Slice mode is not supported in the fragment path.
+	int slice_height;
 } pyrowave_decoder_create_info;
 
 // Fragment path is optimized for typical mobile GPUs which have weak compute support.
@@ -501,6 +792,14 @@ pyrowave_decoder_device_prefers_fragment_path(pyrowave_device device);
 PYROWAVE_PUBLIC_API pyrowave_result
 pyrowave_decoder_create(const pyrowave_decoder_create_info *info, pyrowave_decoder *decoder);
 
+// Computes the most memory a decoder created with info uses, without creating it, e.g. for admission control.
+// info->device and info->memory_budget are ignored, and device can be NULL.
+// Includes a payload buffer for the largest possible frame and the chroma images for RGB output.
+// Readback buffers for the CPU decode path are sized by the pyrowave_cpu_buffer and not included.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_decoder_query_memory_requirements(const pyrowave_decoder_create_info *info,
+                                           pyrowave_memory_requirements *requirements);
+
 // Throws away all queued packets.
 PYROWAVE_PUBLIC_API void pyrowave_decoder_clear(pyrowave_decoder decoder);
 
@@ -508,13 +807,38 @@ PYROWAVE_PUBLIC_API void pyrowave_decoder_clear(pyrowave_decoder decoder);
 // If a packet is pushed for a frame that is deemed to arrive earlier, it is dropped.
 // A packet that is pushed for a frame with a higher frame sequence will clear out the old queued frame and start a new frame.
 // Packets are pushed into the decoder until decode_is_ready says it's ready.
+// Unlike other decoder entry points, push_packet is thread-safe and packets for the same frame
+// can be pushed concurrently from multiple threads, e.g. one per receive queue.
+// It may also be called concurrently with pyrowave_decoder_decode_is_ready().
+// pyrowave_decoder_clear() and the decode functions must be externally synchronized against push_packet.
+// push_packet never blocks on other threads. Payload alternates between two buffers, one per frame sequence,
+// so if one thread runs two frames ahead while another thread is still copying a packet for the older frame,
+// the packet cannot be stored and an error is returned. Pushing the packet again later succeeds.
 PYROWAVE_PUBLIC_API pyrowave_result
 pyrowave_decoder_push_packet(pyrowave_decoder decoder, const void *data, size_t size);
 
+// Same as calling pyrowave_decoder_push_packet for every packet, but overhead is amortized over many packets,
+// e.g. when receiving many datagrams at once with recvmmsg().
+// Thread-safety rules are the same as pyrowave_decoder_push_packet.
+// If a packet fails to parse, the remaining packets are skipped, but earlier packets are still queued.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_decoder_push_packets(pyrowave_decoder decoder, const pyrowave_packet_data *packets, size_t count);
+
 // For error correction purposes, it may be okay to decode a frame which dropped some packets.
 PYROWAVE_PUBLIC_API bool
 pyrowave_decoder_decode_is_ready(pyrowave_decoder decoder, bool allow_partial_frame);
 
+// With SNR layers, blocks in layers at or above this count are ignored, and pyrowave_decoder_decode_is_ready()
+// does not wait for them, e.g. 1 to only decode the base layer. Defaults to all layers.
+// Must be externally synchronized like pyrowave_decoder_clear().
+PYROWAVE_PUBLIC_API void
+pyrowave_decoder_set_num_layers(pyrowave_decoder decoder, int layers);
+
+// SNR layer of a packet from pyrowave_encoder_packetize(), 0 for the base layer, so relays can forward layers selectively.
+// Returns -1 if the packet is too small to tell.
+PYROWAVE_PUBLIC_API int
+pyrowave_get_packet_layer(const void *data, size_t size);
+
 // Decoding can be done at any time, leading to potentially corrupt/incomplete results if packets are missing.
 // Missing wavelet weights are assumed to be 0 which can lead to extra blurring.
 // See pyrowave_decoder_decode_is_ready() to determine if the final result is known to be complete.
@@ -531,10 +855,51 @@ pyrowave_decoder_decode_gpu_buffer(pyrowave_decoder decoder,
                                    const pyrowave_gpu_sync_operation *release,
                                    const pyrowave_gpu_buffers *buffers);
 
+// In slice mode, the full frame decode functions decode every slice of the frame.
+// A slice can also be decoded on its own as soon as its packets are in, regardless of the order slices arrive in.
+// buffers cover the full frame, but only the rows of slice_index are written.
+// A slice is only reported as ready once per frame, and not at all once the full frame was decoded.
+PYROWAVE_PUBLIC_API bool
+pyrowave_decoder_decode_slice_is_ready(pyrowave_decoder decoder, int slice_index, bool allow_partial_slice);
+
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_decoder_decode_slice_gpu_buffer(pyrowave_decoder decoder,
+                                         const pyrowave_gpu_sync_operation *acquire,
+                                         const pyrowave_gpu_sync_operation *release,
+                                         const pyrowave_gpu_buffers *buffers,
+                                         int slice_index);
+
+// Same as pyrowave_decoder_decode_gpu_buffer, except that YCbCr to RGB conversion is fused into the final iDWT pass,
+// which avoids a separate color conversion pass.
+// The view must be a color format, e.g. RGBA8 or RGB10A2 UNORM. Alpha is written as 1. Swizzle is ignored.
+// For compute path, the image must support VK_IMAGE_USAGE_STORAGE_BIT.
+// For fragment path, the image must support VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+// which allows decoding directly into e.g. a swapchain image.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_decoder_decode_gpu_rgb(pyrowave_decoder decoder,
+                                const pyrowave_gpu_sync_operation *acquire,
+                                const pyrowave_gpu_sync_operation *release,
+                                const pyrowave_image_view *rgb,
+                                const pyrowave_color_conversion *conversion);
+
 // A command buffer must not be set on pyrowave_device.
 PYROWAVE_PUBLIC_API pyrowave_result
 pyrowave_decoder_decode_cpu_buffer_synchronous(pyrowave_decoder decoder, const pyrowave_cpu_buffer *buffers);
 
+// Same as pyrowave_decoder_decode_cpu_buffer_synchronous, but returns as soon as the GPU work is submitted,
+// so the application can overlap decoding with its own processing.
+// Only the pointers in buffers are retained. The memory must remain valid until the decode is completed.
+// Only one CPU decode can be in flight. Any pending decode is completed before a new one is started.
+// A command buffer must not be set on pyrowave_device.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_decoder_decode_cpu_buffer_async(pyrowave_decoder decoder, const pyrowave_cpu_buffer *buffers);
+
+// Waits for a pending pyrowave_decoder_decode_cpu_buffer_async to complete and writes the result to the CPU buffers.
+// Timeout is in nanoseconds. A timeout of 0 polls. Returns PYROWAVE_TIMEOUT if the GPU is not done yet.
+// Returns PYROWAVE_ERROR_GENERIC if there is no pending decode.
+PYROWAVE_PUBLIC_API pyrowave_result
+pyrowave_decoder_wait_cpu_buffer(pyrowave_decoder decoder, uint64_t timeout);
+
 // Implementation ensures GPU is idle before destroying objects.
 PYROWAVE_PUBLIC_API void pyrowave_decoder_destroy(pyrowave_decoder decoder);
 //////
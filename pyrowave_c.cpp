@@ -1,6 +1,10 @@
 // Copyright (c) 2026 Hans-Kristian Arntzen
 // SPDX-License-Identifier: MIT
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
 #include "context.hpp"
 #include "device.hpp"
 #include "image.hpp"
@@ -8,6 +12,7 @@
 #include "pyrowave.h"
 #include "pyrowave_decoder.hpp"
 #include "pyrowave_encoder.hpp"
+#include "pyrowave_instrumentation.hpp"
 #include "logging.hpp"
 
 using namespace Granite;
@@ -253,6 +258,66 @@ void pyrowave_device_report_performance_stats(pyrowave_device device, pyrowave_m
 		device->device.timestamp_log_reset();
 }
 
+bool pyrowave_set_timing_enabled(bool enable)
+{
+	return Instrumentation::set_enabled(enable);
+}
+
+pyrowave_result
+pyrowave_get_timing_histogram(pyrowave_timing_event event, pyrowave_timing_histogram *histogram, bool reset)
+{
+	return Instrumentation::get_histogram(event, histogram, reset);
+}
+
+uint64_t pyrowave_timing_histogram_bucket_upper_bound_ns(uint32_t bucket)
+{
+	return Instrumentation::bucket_upper_bound_ns(bucket);
+}
+
+uint64_t pyrowave_timing_histogram_percentile_ns(const pyrowave_timing_histogram *histogram, double percentile)
+{
+	if (!histogram->count)
+		return 0;
+
+	percentile = std::min(std::max(percentile, 0.0), 1.0);
+	auto rank = std::max<uint64_t>(uint64_t(std::ceil(percentile * double(histogram->count))), 1);
+
+	uint64_t accumulated = 0;
+	for (uint32_t i = 0; i < PYROWAVE_TIMING_HISTOGRAM_BUCKETS; i++)
+	{
+		accumulated += histogram->buckets[i];
+		if (accumulated >= rank)
+			return Instrumentation::bucket_upper_bound_ns(i);
+	}
+
+	return UINT64_MAX;
+}
+
+void pyrowave_report_timing_stats(pyrowave_message_cb cb, void *userdata, bool reset)
+{
+	static const char *names[PYROWAVE_TIMING_EVENT_COUNT] = {
+		"Encode record", "Encode fence wait", "Packetize", "Push packet", "Decode submit", "Decode fence wait",
+	};
+
+	for (int i = 0; i < PYROWAVE_TIMING_EVENT_COUNT; i++)
+	{
+		pyrowave_timing_histogram hist;
+		if (Instrumentation::get_histogram(pyrowave_timing_event(i), &hist, reset) != PYROWAVE_SUCCESS)
+			return;
+		if (!hist.count)
+			continue;
+
+		char msg[256];
+		snprintf(msg, sizeof(msg), "%s: %llu samples, %.3f us avg, p50 < %.3f us, p99 < %.3f us, p99.9 < %.3f us\n",
+		         names[i], static_cast<unsigned long long>(hist.count),
+		         1e-3 * double(hist.total_ns) / double(hist.count),
+		         1e-3 * double(pyrowave_timing_histogram_percentile_ns(&hist, 0.5)),
+		         1e-3 * double(pyrowave_timing_histogram_percentile_ns(&hist, 0.99)),
+		         1e-3 * double(pyrowave_timing_histogram_percentile_ns(&hist, 0.999)));
+		cb(userdata, msg);
+	}
+}
+
 void pyrowave_device_get_vk_device_handles(
 	pyrowave_device device,
 	VkInstance *vk_instance, VkPhysicalDevice *vk_physical_device,
@@ -401,6 +466,40 @@ void pyrowave_device_destroy(pyrowave_device device)
 	delete device;
 }
 
+struct pyrowave_resource_pool_opaque
+{
+	pyrowave_device device = nullptr;
+	ResourcePool pool;
+};
+
+pyrowave_result pyrowave_resource_pool_create(pyrowave_device device, pyrowave_resource_pool *pool)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	if (!device)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	auto *p = new pyrowave_resource_pool_opaque();
+	p->device = device;
+	*pool = p;
+	return PYROWAVE_SUCCESS;
+}
+
+uint64_t pyrowave_resource_pool_get_idle_memory_size(pyrowave_resource_pool pool)
+{
+	return pool->pool.get_idle_memory_size();
+}
+
+void pyrowave_resource_pool_clear(pyrowave_resource_pool pool)
+{
+	pool->pool.clear();
+}
+
+void pyrowave_resource_pool_destroy(pyrowave_resource_pool pool)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	delete pool;
+}
+
 struct pyrowave_sync_object_opaque
 {
 	Device *device = nullptr;
@@ -667,18 +766,21 @@ pyrowave_image_get_image_view(pyrowave_image image, VkImageAspectFlagBits aspect
 	// 3-plane YCbCr
 	case VK_FORMAT_G8_B8_R8_3PLANE_420_UNORM:
 	case VK_FORMAT_G8_B8_R8_3PLANE_444_UNORM:
+	case VK_FORMAT_G8_B8_R8_3PLANE_422_UNORM:
 		view->view_format = VK_FORMAT_R8_UNORM;
 		view->aspect = aspect;
 		break;
 
 	case VK_FORMAT_G10X6_B10X6_R10X6_3PLANE_420_UNORM_3PACK16:
 	case VK_FORMAT_G10X6_B10X6_R10X6_3PLANE_444_UNORM_3PACK16:
+	case VK_FORMAT_G10X6_B10X6_R10X6_3PLANE_422_UNORM_3PACK16:
 		view->view_format = VK_FORMAT_R10X6_UNORM_PACK16;
 		view->aspect = aspect;
 		break;
 
 	case VK_FORMAT_G16_B16_R16_3PLANE_420_UNORM:
 	case VK_FORMAT_G16_B16_R16_3PLANE_444_UNORM:
+	case VK_FORMAT_G16_B16_R16_3PLANE_422_UNORM:
 		view->view_format = VK_FORMAT_R16_UNORM;
 		view->aspect = aspect;
 		break;
@@ -686,6 +788,7 @@ pyrowave_image_get_image_view(pyrowave_image image, VkImageAspectFlagBits aspect
 	// 2-plane YCbCr
 	case VK_FORMAT_G8_B8R8_2PLANE_420_UNORM:
 	case VK_FORMAT_G8_B8R8_2PLANE_444_UNORM:
+	case VK_FORMAT_G8_B8R8_2PLANE_422_UNORM:
 		switch (aspect)
 		{
 		case VK_IMAGE_ASPECT_PLANE_0_BIT:
@@ -716,6 +819,7 @@ pyrowave_image_get_image_view(pyrowave_image image, VkImageAspectFlagBits aspect
 
 	case VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16:
 	case VK_FORMAT_G10X6_B10X6R10X6_2PLANE_444_UNORM_3PACK16:
+	case VK_FORMAT_G10X6_B10X6R10X6_2PLANE_422_UNORM_3PACK16:
 		switch (aspect)
 		{
 		case VK_IMAGE_ASPECT_PLANE_0_BIT:
@@ -746,6 +850,7 @@ pyrowave_image_get_image_view(pyrowave_image image, VkImageAspectFlagBits aspect
 
 	case VK_FORMAT_G16_B16R16_2PLANE_420_UNORM:
 	case VK_FORMAT_G16_B16R16_2PLANE_444_UNORM:
+	case VK_FORMAT_G16_B16R16_2PLANE_422_UNORM:
 		switch (aspect)
 		{
 		case VK_IMAGE_ASPECT_PLANE_0_BIT:
@@ -791,6 +896,35 @@ void pyrowave_image_destroy(pyrowave_image image)
 	device->next_frame_context();
 }
 
+static bool validate_stream_parameters(int width, int height, pyrowave_chroma_subsampling chroma,
+                                       int decomposition_levels, pyrowave_wavelet_transform transform)
+{
+	if (width <= 0 || height <= 0)
+		return false;
+
+	if (chroma != PYROWAVE_CHROMA_SUBSAMPLING_420 &&
+	    chroma != PYROWAVE_CHROMA_SUBSAMPLING_444 &&
+	    chroma != PYROWAVE_CHROMA_SUBSAMPLING_422)
+		return false;
+
+	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_420 && (width % 2 || height % 2))
+		return false;
+
+	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_422 && width % 2)
+		return false;
+
+	if (decomposition_levels != 0 &&
+	    (decomposition_levels < PYROWAVE_MIN_DECOMPOSITION_LEVELS ||
+	     decomposition_levels > PYROWAVE_MAX_DECOMPOSITION_LEVELS))
+		return false;
+
+	if (transform != PYROWAVE_WAVELET_TRANSFORM_CDF97 &&
+	    transform != PYROWAVE_WAVELET_TRANSFORM_LEGALL53)
+		return false;
+
+	return true;
+}
+
 struct pyrowave_encoder_opaque
 {
 	Device *device = nullptr;
@@ -800,6 +934,7 @@ struct pyrowave_encoder_opaque
 	BufferHandle queued_meta;
 	BufferHandle queued_bitstream;
 	ChromaSubsampling chroma = {};
+	WaveletTransform transform = {};
 	int width = 0;
 	int height = 0;
 };
@@ -809,36 +944,125 @@ pyrowave_encoder_create(const pyrowave_encoder_create_info *info, pyrowave_encod
 {
 	Util::set_thread_logging_interface(&null_logger);
 
-	if (!info->device)
+	if (!info->device || (info->pool && info->pool->device != info->device))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
-	if (info->width <= 0 || info->height <= 0)
+	if (!validate_stream_parameters(info->width, info->height, info->chroma,
+	                                info->decomposition_levels, info->transform))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
-	if (info->chroma == PYROWAVE_CHROMA_SUBSAMPLING_420 && (info->width % 2 || info->height % 2))
-		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	int decomposition_levels = info->decomposition_levels ? info->decomposition_levels : DefaultDecompositionLevels;
 
 	auto *enc = new pyrowave_encoder_opaque();
+	if (info->pool)
+		enc->encoder.set_resource_pool(&info->pool->pool);
 	enc->pyro_device = info->device;
 	enc->device = &info->device->device;
 	enc->chroma = ChromaSubsampling(info->chroma);
+	enc->transform = WaveletTransform(info->transform);
 	enc->width = info->width;
 	enc->height = info->height;
 
-	if (!enc->encoder.init(&info->device->device, info->width, info->height, enc->chroma))
+	if (!enc->encoder.init(&info->device->device, info->width, info->height, enc->chroma, decomposition_levels,
+	                       WaveletTransform(info->transform), info->slice_height))
 	{
 		delete enc;
 		return PYROWAVE_ERROR_GENERIC;
 	}
 
+	// Before the budget, since layers grow the meta buffer.
+	if (!enc->encoder.set_enhancement_planes(info->enhancement_planes))
+	{
+		delete enc;
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	}
+
+	if (!enc->encoder.set_memory_budget(info->memory_budget))
+	{
+		delete enc;
+		return PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
 	*encoder = enc;
 	return PYROWAVE_SUCCESS;
 }
 
+pyrowave_result
+pyrowave_encoder_query_memory_requirements(const pyrowave_encoder_create_info *info,
+                                           const pyrowave_rate_control *rate_control,
+                                           pyrowave_memory_requirements *requirements)
+{
+	Util::set_thread_logging_interface(&null_logger);
+
+	if (!validate_stream_parameters(info->width, info->height, info->chroma,
+	                                info->decomposition_levels, info->transform))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	// Same rounding as encode.
+	size_t target_size = rate_control ? rate_control->maximum_bitstream_size & ~size_t(3) : 0;
+	if (rate_control && (target_size > UINT32_MAX || target_size == 0))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	int decomposition_levels = info->decomposition_levels ? info->decomposition_levels : DefaultDecompositionLevels;
+
+	MemoryRequirements reqs;
+	if (!Encoder::query_memory_requirements(info->width, info->height, ChromaSubsampling(info->chroma),
+	                                        decomposition_levels, WaveletTransform(info->transform),
+	                                        info->slice_height, info->enhancement_planes, target_size, reqs))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	requirements->device_local_size = reqs.device_local;
+	requirements->host_visible_size = reqs.host_visible;
+	return PYROWAVE_SUCCESS;
+}
+
+struct WrappedView
+{
+	ImageHandle wrapped_image;
+	ImageViewHandle image_view;
+	bool wrap(Device *device, const pyrowave_image_view &plane, VkImageUsageFlags usage, VkComponentSwizzle swizzle);
+};
+
+bool WrappedView::wrap(Device *device, const pyrowave_image_view &plane, VkImageUsageFlags usage, VkComponentSwizzle swizzle)
+{
+	ImageCreateInfo image_info = {};
+	image_info.usage = usage;
+	image_info.type = VK_IMAGE_TYPE_2D;
+	image_info.domain = ImageDomain::Physical;
+	image_info.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+	image_info.width = plane.width;
+	image_info.height = plane.height;
+	image_info.format = plane.image_format;
+
+	// The exact numbers aren't important.
+	image_info.layers = plane.layer + 1;
+	image_info.levels = plane.mip_level + 1;
+
+	image_info.layout = plane.layout == VK_IMAGE_LAYOUT_GENERAL ? ImageLayout::General : ImageLayout::Optimal;
+	wrapped_image = device->wrap_image(image_info, plane.image);
+	if (!wrapped_image)
+		return false;
+
+	ImageViewCreateInfo view_info = {};
+	view_info.image = wrapped_image.get();
+	view_info.format = plane.view_format;
+	view_info.view_type = VK_IMAGE_VIEW_TYPE_2D;
+	view_info.layers = 1;
+	view_info.levels = 1;
+	view_info.base_level = plane.mip_level;
+	view_info.base_layer = plane.layer;
+	view_info.swizzle.r = swizzle;
+	view_info.swizzle.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+	view_info.swizzle.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+	view_info.swizzle.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+	view_info.aspect = plane.aspect;
+	image_view = device->create_image_view(view_info);
+	return bool(image_view);
+}
+
 struct WrappedViewBuffers : ViewBuffers
 {
-	ImageHandle wrapped_images[3];
-	ImageViewHandle image_views[3];
+	WrappedView views[3];
 	bool wrap(Device *device, const pyrowave_gpu_buffers *buffers, VkImageUsageFlags usage);
 };
 
@@ -846,43 +1070,9 @@ bool WrappedViewBuffers::wrap(Device *device, const pyrowave_gpu_buffers *buffer
 {
 	for (int i = 0; i < 3; i++)
 	{
-		ImageCreateInfo image_info = {};
-		image_info.usage = usage;
-		image_info.type = VK_IMAGE_TYPE_2D;
-		image_info.domain = ImageDomain::Physical;
-		image_info.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
-		image_info.width = buffers->planes[i].width;
-		image_info.height = buffers->planes[i].height;
-		image_info.format = buffers->planes[i].image_format;
-
-		// The exact numbers aren't important.
-		image_info.layers = buffers->planes[i].layer + 1;
-		image_info.levels = buffers->planes[i].mip_level + 1;
-
-		image_info.layout =
-			buffers->planes[i].layout == VK_IMAGE_LAYOUT_GENERAL ? ImageLayout::General : ImageLayout::Optimal;
-		wrapped_images[i] = device->wrap_image(image_info, buffers->planes[i].image);
-		if (!wrapped_images[i])
-			return false;
-
-		ImageViewCreateInfo view_info = {};
-		view_info.image = wrapped_images[i].get();
-		view_info.format = buffers->planes[i].view_format;
-		view_info.view_type = VK_IMAGE_VIEW_TYPE_2D;
-		view_info.layers = 1;
-		view_info.levels = 1;
-		view_info.base_level = buffers->planes[i].mip_level;
-		view_info.base_layer = buffers->planes[i].layer;
-		view_info.swizzle.r = buffers->planes[i].swizzle;
-		view_info.swizzle.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-		view_info.swizzle.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-		view_info.swizzle.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-		view_info.aspect = buffers->planes[i].aspect;
-		image_views[i] = device->create_image_view(view_info);
-		if (!image_views[i])
+		if (!views[i].wrap(device, buffers->planes[i], usage, buffers->planes[i].swizzle))
 			return false;
-
-		planes[i] = image_views[i].get();
+		planes[i] = views[i].image_view.get();
 	}
 
 	return true;
@@ -921,20 +1111,52 @@ static void pyrowave_device_signal_semaphore(Device *device, CommandBuffer::Type
 	}
 }
 
-pyrowave_result
-pyrowave_encoder_encode_gpu_synchronous(pyrowave_encoder encoder,
-                                        const pyrowave_gpu_sync_operation *acquire,
-                                        const pyrowave_gpu_sync_operation *release,
-                                        const pyrowave_gpu_buffers *buffers,
-                                        const pyrowave_rate_control *rate_control)
+// The reversible transform DC shifts by rounding samples to 8-bit integers,
+// so anything deeper than 8 bits would silently lose its LSBs.
+static bool gpu_buffers_are_8bit(const pyrowave_gpu_buffers *buffers)
 {
-	if (encoder->pyro_device->cmd && (acquire || release))
-		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	for (auto &plane : buffers->planes)
+		if (plane.view_format != VK_FORMAT_R8_UNORM && plane.view_format != VK_FORMAT_R8G8_UNORM)
+			return false;
+	return true;
+}
 
-	Util::set_thread_logging_interface(&null_logger);
-	auto *device = encoder->device;
+static bool translate_color_conversion(const pyrowave_color_conversion &conversion, ColorConversion &conv)
+{
+	switch (conversion.transform)
+	{
+	case PYROWAVE_YCBCR_TRANSFORM_BT709: conv.transform = YCbCrTransform::BT709; break;
+	case PYROWAVE_YCBCR_TRANSFORM_BT2020: conv.transform = YCbCrTransform::BT2020; break;
+	default: return false;
+	}
 
-	device->next_frame_context();
+	switch (conversion.range)
+	{
+	case PYROWAVE_YCBCR_RANGE_FULL: conv.range = YCbCrRange::Full; break;
+	case PYROWAVE_YCBCR_RANGE_LIMITED: conv.range = YCbCrRange::Limited; break;
+	default: return false;
+	}
+
+	switch (conversion.siting)
+	{
+	case PYROWAVE_CHROMA_SITING_CENTER: conv.siting = ChromaSiting::Center; break;
+	case PYROWAVE_CHROMA_SITING_LEFT: conv.siting = ChromaSiting::Left; break;
+	default: return false;
+	}
+
+	return true;
+}
+
+// The caller has moved the device to the next frame context and wrapped the input views.
+static pyrowave_result
+pyrowave_encoder_encode_gpu(pyrowave_encoder encoder,
+                            const pyrowave_gpu_sync_operation *acquire,
+                            const pyrowave_gpu_sync_operation *release,
+                            const pyrowave_rate_control *rate_control,
+                            const std::function<bool (CommandBuffer &, const Encoder::BitstreamBuffers &)> &op)
+{
+	PYROWAVE_TIMING_BEGIN(record_start);
+	auto *device = encoder->device;
 
 	BufferCreateInfo bufinfo = {};
 	bufinfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
@@ -960,6 +1182,10 @@ pyrowave_encoder_encode_gpu_synchronous(pyrowave_encoder encoder,
 	if (target_bitstream_size > UINT32_MAX || target_bitstream_size == 0)
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
+	auto base_layer_size = rate_control->maximum_base_layer_size & ~VkDeviceSize(3u);
+	if (base_layer_size > target_bitstream_size)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
 	bufinfo.size = target_bitstream_size + encoder->encoder.get_meta_required_size();
 	bufinfo.domain = BufferDomain::CachedHost;
 	encoder->queued_bitstream = device->create_buffer(bufinfo);
@@ -974,16 +1200,12 @@ pyrowave_encoder_encode_gpu_synchronous(pyrowave_encoder encoder,
 		return PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY;
 
 	Encoder::BitstreamBuffers bitstream_buffers = {};
-
-	WrappedViewBuffers views = {};
-	if (!views.wrap(device, buffers, VK_IMAGE_USAGE_SAMPLED_BIT))
-		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
-
 	bitstream_buffers.meta.buffer = queued_meta_gpu.get();
 	bitstream_buffers.meta.size = queued_meta_gpu->get_create_info().size;
 	bitstream_buffers.bitstream.buffer = queued_bitstream_gpu.get();
 	bitstream_buffers.bitstream.size = queued_bitstream_gpu->get_create_info().size;
 	bitstream_buffers.target_size = target_bitstream_size;
+	bitstream_buffers.base_layer_target_size = base_layer_size;
 
 	auto cmd =
 			encoder->pyro_device->cmd
@@ -1002,8 +1224,7 @@ pyrowave_encoder_encode_gpu_synchronous(pyrowave_encoder encoder,
 		}
 	}
 
-	auto ret = encoder->encoder.encode(*cmd, views, bitstream_buffers);
-	if (!ret)
+	if (!op(*cmd, bitstream_buffers))
 	{
 		device->submit_discard(cmd);
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
@@ -1046,65 +1267,245 @@ pyrowave_encoder_encode_gpu_synchronous(pyrowave_encoder encoder,
 		device->submit(cmd, &encoder->queued_fence);
 
 	pyrowave_device_signal_semaphore(device, encoder->pyro_device->queue_type, release);
+	PYROWAVE_TIMING_END(record_start, PYROWAVE_TIMING_EVENT_ENCODE_RECORD);
 
 	return PYROWAVE_SUCCESS;
 }
 
-pyrowave_result
-pyrowave_encoder_encode_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
-										const pyrowave_rate_control *rate_control)
+// slice_index is -1 for a full frame.
+static pyrowave_result
+pyrowave_encoder_encode_gpu_buffers(pyrowave_encoder encoder,
+                                    const pyrowave_gpu_sync_operation *acquire,
+                                    const pyrowave_gpu_sync_operation *release,
+                                    const pyrowave_gpu_buffers *buffers,
+                                    int slice_index,
+                                    const pyrowave_rate_control *rate_control)
 {
+	if (encoder->pyro_device->cmd && (acquire || release))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	if (encoder->transform == WaveletTransform::LeGall53 && !gpu_buffers_are_8bit(buffers))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
 	Util::set_thread_logging_interface(&null_logger);
-	int num_planes = buffers->format == PYROWAVE_CPU_BUFFER_FORMAT_NV12 ? 2 : 3;
-	auto *device = encoder->device;
-	ImageHandle images[3];
+	encoder->device->next_frame_context();
 
-	// Validate some assumptions.
-	if (buffers->width != encoder->width || buffers->height != encoder->height)
+	WrappedViewBuffers views = {};
+	if (!views.wrap(encoder->device, buffers, VK_IMAGE_USAGE_SAMPLED_BIT))
+		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
+
+	return pyrowave_encoder_encode_gpu(encoder, acquire, release, rate_control,
+	                                   [&](CommandBuffer &cmd, const Encoder::BitstreamBuffers &bitstream_buffers) {
+		return slice_index < 0 ?
+		       encoder->encoder.encode(cmd, views, bitstream_buffers) :
+		       encoder->encoder.encode_slice(cmd, views, slice_index, bitstream_buffers);
+	});
+}
+
+pyrowave_result
+pyrowave_encoder_encode_gpu_synchronous(pyrowave_encoder encoder,
+                                        const pyrowave_gpu_sync_operation *acquire,
+                                        const pyrowave_gpu_sync_operation *release,
+                                        const pyrowave_gpu_buffers *buffers,
+                                        const pyrowave_rate_control *rate_control)
+{
+	return pyrowave_encoder_encode_gpu_buffers(encoder, acquire, release, buffers, -1, rate_control);
+}
+
+pyrowave_result
+pyrowave_encoder_encode_slice_gpu_synchronous(pyrowave_encoder encoder,
+                                              const pyrowave_gpu_sync_operation *acquire,
+                                              const pyrowave_gpu_sync_operation *release,
+                                              const pyrowave_gpu_buffers *buffers,
+                                              int slice_index,
+                                              const pyrowave_rate_control *rate_control)
+{
+	if (slice_index < 0)
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	return pyrowave_encoder_encode_gpu_buffers(encoder, acquire, release, buffers, slice_index, rate_control);
+}
 
-	if (encoder->chroma == ChromaSubsampling::Chroma420 && buffers->format == PYROWAVE_CPU_BUFFER_FORMAT_YUV444P)
+pyrowave_result
+pyrowave_encoder_encode_gpu_rgb_synchronous(pyrowave_encoder encoder,
+                                            const pyrowave_gpu_sync_operation *acquire,
+                                            const pyrowave_gpu_sync_operation *release,
+                                            const pyrowave_image_view *rgb,
+                                            const pyrowave_color_conversion *conversion,
+                                            const pyrowave_rate_control *rate_control)
+{
+	if (encoder->pyro_device->cmd && (acquire || release))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
-	if (encoder->chroma == ChromaSubsampling::Chroma444 && buffers->format != PYROWAVE_CPU_BUFFER_FORMAT_YUV444P)
+	if (!rgb || !conversion)
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
-	for (int plane = 0; plane < num_planes; plane++)
+	ColorConversion conv = {};
+	if (!translate_color_conversion(*conversion, conv))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	Util::set_thread_logging_interface(&null_logger);
+	encoder->device->next_frame_context();
+
+	WrappedView view = {};
+	if (!view.wrap(encoder->device, *rgb, VK_IMAGE_USAGE_SAMPLED_BIT, VK_COMPONENT_SWIZZLE_IDENTITY))
+		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
+
+	return pyrowave_encoder_encode_gpu(encoder, acquire, release, rate_control,
+	                                   [&](CommandBuffer &cmd, const Encoder::BitstreamBuffers &bitstream_buffers) {
+		return encoder->encoder.encode_rgb(cmd, *view.image_view, conv, bitstream_buffers);
+	});
+}
+
+static bool cpu_buffer_format_is_valid(pyrowave_cpu_buffer_format format)
+{
+	switch (format)
 	{
-		int plane_width = encoder->width;
-		int plane_height = encoder->height;
+	case PYROWAVE_CPU_BUFFER_FORMAT_NV12:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV420P:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV444P:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P010:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P016:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV420P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV422P:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_NV16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P210:
+		return true;
+	default:
+		return false;
+	}
+}
 
-		if (plane != 0 && encoder->chroma == ChromaSubsampling::Chroma420)
-		{
+static int cpu_buffer_format_num_planes(pyrowave_cpu_buffer_format format)
+{
+	switch (format)
+	{
+	case PYROWAVE_CPU_BUFFER_FORMAT_NV12:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P010:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P016:
+	case PYROWAVE_CPU_BUFFER_FORMAT_NV16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P210:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+static ChromaSubsampling cpu_buffer_format_chroma(pyrowave_cpu_buffer_format format)
+{
+	switch (format)
+	{
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV444P:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16:
+		return ChromaSubsampling::Chroma444;
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV422P:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_NV16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P210:
+		return ChromaSubsampling::Chroma422;
+	default:
+		return ChromaSubsampling::Chroma420;
+	}
+}
+
+static bool cpu_buffer_format_is_16bit(pyrowave_cpu_buffer_format format)
+{
+	switch (format)
+	{
+	case PYROWAVE_CPU_BUFFER_FORMAT_P010:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P016:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV420P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16:
+	case PYROWAVE_CPU_BUFFER_FORMAT_P210:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// P010 and P210 keep the 6 LSBs zero, so reading them as UNORM16 is the same as P016.
+// The DWT samples the planes directly, so no conversion pass is needed for any format.
+static VkFormat cpu_buffer_format_plane_format(pyrowave_cpu_buffer_format format, int plane)
+{
+	bool interleaved = cpu_buffer_format_num_planes(format) == 2 && plane == 1;
+	if (cpu_buffer_format_is_16bit(format))
+		return interleaved ? VK_FORMAT_R16G16_UNORM : VK_FORMAT_R16_UNORM;
+	else
+		return interleaved ? VK_FORMAT_R8G8_UNORM : VK_FORMAT_R8_UNORM;
+}
+
+static size_t cpu_buffer_format_texel_size(pyrowave_cpu_buffer_format format, int plane)
+{
+	size_t size = cpu_buffer_format_is_16bit(format) ? 2 : 1;
+	if (cpu_buffer_format_num_planes(format) == 2 && plane == 1)
+		size *= 2;
+	return size;
+}
+
+static bool validate_cpu_buffer_planes(const pyrowave_cpu_buffer *buffers, ChromaSubsampling chroma)
+{
+	if (!cpu_buffer_format_is_valid(buffers->format))
+		return false;
+
+	if (cpu_buffer_format_chroma(buffers->format) != chroma)
+		return false;
+
+	for (int plane = 0; plane < cpu_buffer_format_num_planes(buffers->format); plane++)
+	{
+		size_t plane_width = buffers->width;
+		size_t plane_height = buffers->height;
+
+		if (plane != 0 && chroma != ChromaSubsampling::Chroma444)
 			plane_width /= 2;
+		if (plane != 0 && chroma == ChromaSubsampling::Chroma420)
 			plane_height /= 2;
-		}
 
-		const size_t plane_bpp = num_planes == 2 && plane == 1 ? 2 : 1;
+		const size_t texel_size = cpu_buffer_format_texel_size(buffers->format, plane);
 
-		if (buffers->row_stride_in_bytes[plane] < plane_width * plane_bpp)
-			return PYROWAVE_ERROR_INVALID_ARGUMENT;
+		if (buffers->row_stride_in_bytes[plane] < plane_width * texel_size)
+			return false;
+		if (buffers->row_stride_in_bytes[plane] % texel_size != 0)
+			return false;
 		if (buffers->row_stride_in_bytes[plane] * plane_height > buffers->plane_size_in_bytes[plane])
-			return PYROWAVE_ERROR_INVALID_ARGUMENT;
+			return false;
 	}
 
+	return true;
+}
+
+static pyrowave_result
+pyrowave_encoder_encode_cpu(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
+                            int slice_index, const pyrowave_rate_control *rate_control)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	auto *device = encoder->device;
+	ImageHandle images[3];
+
+	// Validate some assumptions.
+	if (buffers->width != encoder->width || buffers->height != encoder->height)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	if (!validate_cpu_buffer_planes(buffers, encoder->chroma))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	int num_planes = cpu_buffer_format_num_planes(buffers->format);
+
 	for (int plane = 0; plane < num_planes; plane++)
 	{
-		unsigned plane_bpp = num_planes == 2 && plane == 1 ? 2 : 1;
-
 		const ImageInitialData initial = {
 			buffers->data[plane],
-			uint32_t(buffers->row_stride_in_bytes[plane] / plane_bpp)
+			uint32_t(buffers->row_stride_in_bytes[plane] / cpu_buffer_format_texel_size(buffers->format, plane))
 		};
 
 		auto info = ImageCreateInfo::immutable_2d_image(
 			buffers->width, buffers->height,
-			plane_bpp == 2 ? VK_FORMAT_R8G8_UNORM : VK_FORMAT_R8_UNORM);
+			cpu_buffer_format_plane_format(buffers->format, plane));
 
-		if (plane != 0 && encoder->chroma == ChromaSubsampling::Chroma420)
-		{
+		if (plane != 0 && encoder->chroma != ChromaSubsampling::Chroma444)
 			info.width /= 2;
+		if (plane != 0 && encoder->chroma == ChromaSubsampling::Chroma420)
 			info.height /= 2;
-		}
 
 		images[plane] = device->create_image(info, &initial);
 		if (!images[plane])
@@ -1121,7 +1522,7 @@ pyrowave_encoder_encode_cpu_synchronous(pyrowave_encoder encoder, const pyrowave
 
 		p.aspect = VK_IMAGE_ASPECT_COLOR_BIT;
 		p.swizzle = num_planes == 2 && plane == 2 ? VK_COMPONENT_SWIZZLE_G : VK_COMPONENT_SWIZZLE_R;
-		p.image_format = images[plane] ? images[plane]->get_format() : VK_FORMAT_R8G8_UNORM;
+		p.image_format = images[plane] ? images[plane]->get_format() : images[1]->get_format();
 		p.view_format = p.image_format;
 		p.layout = images[plane]
 			           ? images[plane]->get_layout(VK_IMAGE_LAYOUT_READ_ONLY_OPTIMAL)
@@ -1129,16 +1530,86 @@ pyrowave_encoder_encode_cpu_synchronous(pyrowave_encoder encoder, const pyrowave
 		p.image = images[plane] ? images[plane]->get_image() : images[1]->get_image();
 	}
 
-	auto ret = pyrowave_encoder_encode_gpu_synchronous(encoder, nullptr, nullptr, &gpu_buffers, rate_control);
+	auto ret = pyrowave_encoder_encode_gpu_buffers(encoder, nullptr, nullptr, &gpu_buffers, slice_index, rate_control);
 	return ret;
 }
 
+pyrowave_result
+pyrowave_encoder_encode_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
+										const pyrowave_rate_control *rate_control)
+{
+	return pyrowave_encoder_encode_cpu(encoder, buffers, -1, rate_control);
+}
+
+pyrowave_result
+pyrowave_encoder_encode_slice_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
+                                              int slice_index, const pyrowave_rate_control *rate_control)
+{
+	if (slice_index < 0)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	return pyrowave_encoder_encode_cpu(encoder, buffers, slice_index, rate_control);
+}
+
+pyrowave_result
+pyrowave_encoder_encode_rgb_cpu_synchronous(pyrowave_encoder encoder, const pyrowave_cpu_buffer *buffers,
+                                            const pyrowave_color_conversion *conversion,
+                                            const pyrowave_rate_control *rate_control)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	auto *device = encoder->device;
+
+	if (buffers->width != encoder->width || buffers->height != encoder->height)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	if (buffers->format != PYROWAVE_CPU_BUFFER_FORMAT_RGBA8)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	const size_t texel_size = 4;
+	if (buffers->row_stride_in_bytes[0] < size_t(buffers->width) * texel_size ||
+	    buffers->row_stride_in_bytes[0] % texel_size != 0 ||
+	    buffers->row_stride_in_bytes[0] * size_t(buffers->height) > buffers->plane_size_in_bytes[0])
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	const ImageInitialData initial = {
+		buffers->data[0], uint32_t(buffers->row_stride_in_bytes[0] / texel_size)
+	};
+
+	auto info = ImageCreateInfo::immutable_2d_image(buffers->width, buffers->height, VK_FORMAT_R8G8B8A8_UNORM);
+	auto image = device->create_image(info, &initial);
+	if (!image)
+		return PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY;
+
+	pyrowave_image_view view = {};
+	view.image = image->get_image();
+	view.width = image->get_width();
+	view.height = image->get_height();
+	view.image_format = image->get_format();
+	view.view_format = view.image_format;
+	view.aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+	view.swizzle = VK_COMPONENT_SWIZZLE_IDENTITY;
+	view.layout = image->get_layout(VK_IMAGE_LAYOUT_READ_ONLY_OPTIMAL);
+
+	return pyrowave_encoder_encode_gpu_rgb_synchronous(encoder, nullptr, nullptr, &view, conversion, rate_control);
+}
+
+static void pyrowave_encoder_wait_queued(pyrowave_encoder encoder)
+{
+	if (!encoder->queued_fence)
+		return;
+
+	PYROWAVE_TIMING_BEGIN(wait_start);
+	encoder->queued_fence->wait();
+	PYROWAVE_TIMING_END(wait_start, PYROWAVE_TIMING_EVENT_ENCODE_FENCE_WAIT);
+
+	// Only the first wait is interesting.
+	encoder->queued_fence.reset();
+}
+
 pyrowave_result
 pyrowave_encoder_compute_num_packets(pyrowave_encoder encoder, size_t packet_boundary, size_t *num_packets)
 {
 	Util::set_thread_logging_interface(&null_logger);
-	if (encoder->queued_fence)
-		encoder->queued_fence->wait();
+	pyrowave_encoder_wait_queued(encoder);
 
 	if (!encoder->queued_meta)
 		return PYROWAVE_ERROR_GENERIC;
@@ -1153,8 +1624,7 @@ pyrowave_encoder_packetize(pyrowave_encoder encoder, pyrowave_packet *packets, s
                            size_t *out_packets, void *bitstream, size_t size)
 {
 	Util::set_thread_logging_interface(&null_logger);
-	if (encoder->queued_fence)
-		encoder->queued_fence->wait();
+	pyrowave_encoder_wait_queued(encoder);
 
 	if (!encoder->queued_meta || !encoder->queued_bitstream)
 		return PYROWAVE_ERROR_GENERIC;
@@ -1162,9 +1632,68 @@ pyrowave_encoder_packetize(pyrowave_encoder encoder, pyrowave_packet *packets, s
 	auto *mapped_meta = encoder->device->map_host_buffer(*encoder->queued_meta, MEMORY_ACCESS_READ_BIT);
 	auto *mapped_bitstream = encoder->device->map_host_buffer(*encoder->queued_bitstream, MEMORY_ACCESS_READ_BIT);
 
+	PYROWAVE_TIMING_BEGIN(packetize_start);
 	*out_packets = encoder->encoder.packetize(
 		reinterpret_cast<Encoder::Packet *>(packets), packet_boundary, bitstream,
 		size, mapped_meta, mapped_bitstream);
+	PYROWAVE_TIMING_END(packetize_start, PYROWAVE_TIMING_EVENT_PACKETIZE);
+
+	return PYROWAVE_SUCCESS;
+}
+
+pyrowave_result
+pyrowave_encoder_set_stats_enabled(pyrowave_encoder encoder, bool enable)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	if (!encoder->encoder.set_stats_readback(enable))
+		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
+	return PYROWAVE_SUCCESS;
+}
+
+pyrowave_result
+pyrowave_encoder_get_frame_stats(pyrowave_encoder encoder, size_t packet_boundary, pyrowave_frame_stats *stats)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	if (!stats)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	pyrowave_encoder_wait_queued(encoder);
+
+	if (!encoder->queued_meta)
+		return PYROWAVE_ERROR_GENERIC;
+
+	auto *mapped_meta = encoder->device->map_host_buffer(*encoder->queued_meta, MEMORY_ACCESS_READ_BIT);
+
+	Encoder::FrameStats frame_stats;
+	encoder->encoder.get_frame_stats(frame_stats, mapped_meta, packet_boundary);
+
+	*stats = {};
+
+	for (int component = 0; component < PYROWAVE_NUM_COMPONENTS; component++)
+	{
+		for (int level = 0; level < PYROWAVE_NUM_DECOMPOSITION_LEVELS; level++)
+		{
+			for (int band = 0; band < PYROWAVE_NUM_BANDS_PER_LEVEL; band++)
+			{
+				auto &in = frame_stats.bands[component][level][band];
+				auto &out = stats->bands[component][level][band];
+				out.bytes = in.bytes;
+				out.num_blocks = in.num_blocks;
+				out.num_non_zero_blocks = in.num_non_zero_blocks;
+				out.min_quant = in.min_quant;
+				out.max_quant = in.max_quant;
+				out.mean_quant = in.mean_quant;
+				out.distortion = in.distortion;
+			}
+		}
+	}
+
+	stats->total_bytes = frame_stats.total_bytes;
+	stats->num_blocks = frame_stats.num_blocks;
+	stats->num_non_zero_blocks = frame_stats.num_non_zero_blocks;
+	stats->packet_padding_bytes = frame_stats.packet_padding_bytes;
+	stats->payload_overflow_bytes = frame_stats.payload_overflow_bytes;
+	stats->has_rate_control_stats = frame_stats.has_rate_control_stats;
 
 	return PYROWAVE_SUCCESS;
 }
@@ -1183,6 +1712,10 @@ struct pyrowave_decoder_opaque
 	pyrowave_device pyro_device = nullptr;
 	Decoder decoder;
 	ImageHandle planes[3];
+	BufferHandle readback_buffers[3];
+	Fence readback_fence;
+	pyrowave_cpu_buffer readback_target = {};
+	bool readback_pending = false;
 	bool fragment_path = false;
 	ChromaSubsampling chroma = {};
 	int width = 0;
@@ -1199,16 +1732,18 @@ pyrowave_result
 pyrowave_decoder_create(const pyrowave_decoder_create_info *info, pyrowave_decoder *decoder)
 {
 	Util::set_thread_logging_interface(&null_logger);
-	if (!info->device)
+	if (!info->device || (info->pool && info->pool->device != info->device))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
-	if (info->width <= 0 || info->height <= 0)
+	if (!validate_stream_parameters(info->width, info->height, info->chroma,
+	                                info->decomposition_levels, info->transform))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
-	if (info->chroma == PYROWAVE_CHROMA_SUBSAMPLING_420 && (info->width % 2 || info->height % 2))
-		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	int decomposition_levels = info->decomposition_levels ? info->decomposition_levels : DefaultDecompositionLevels;
 
 	auto *dec = new pyrowave_decoder_opaque();
+	if (info->pool)
+		dec->decoder.set_resource_pool(&info->pool->pool);
 	dec->pyro_device = info->device;
 	dec->device = &info->device->device;
 	dec->chroma = ChromaSubsampling(info->chroma);
@@ -1216,16 +1751,46 @@ pyrowave_decoder_create(const pyrowave_decoder_create_info *info, pyrowave_decod
 	dec->width = info->width;
 	dec->height = info->height;
 
-	if (!dec->decoder.init(dec->device, info->width, info->height, dec->chroma, info->fragment_path))
+	if (!dec->decoder.init(dec->device, info->width, info->height, dec->chroma, info->fragment_path,
+	                       decomposition_levels, WaveletTransform(info->transform), info->slice_height))
 	{
 		delete dec;
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 	}
 
+	if (!dec->decoder.set_memory_budget(info->memory_budget))
+	{
+		delete dec;
+		return PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
 	*decoder = dec;
 	return PYROWAVE_SUCCESS;
 }
 
+pyrowave_result
+pyrowave_decoder_query_memory_requirements(const pyrowave_decoder_create_info *info,
+                                           pyrowave_memory_requirements *requirements)
+{
+	Util::set_thread_logging_interface(&null_logger);
+
+	if (!validate_stream_parameters(info->width, info->height, info->chroma,
+	                                info->decomposition_levels, info->transform))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	int decomposition_levels = info->decomposition_levels ? info->decomposition_levels : DefaultDecompositionLevels;
+
+	MemoryRequirements reqs;
+	if (!Decoder::query_memory_requirements(info->width, info->height, ChromaSubsampling(info->chroma),
+	                                        info->fragment_path, decomposition_levels,
+	                                        WaveletTransform(info->transform), info->slice_height, reqs))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	requirements->device_local_size = reqs.device_local;
+	requirements->host_visible_size = reqs.host_visible;
+	return PYROWAVE_SUCCESS;
+}
+
 void pyrowave_decoder_clear(pyrowave_decoder decoder)
 {
 	Util::set_thread_logging_interface(&null_logger);
@@ -1237,7 +1802,24 @@ pyrowave_result
 pyrowave_decoder_push_packet(pyrowave_decoder decoder, const void *data, size_t size)
 {
 	Util::set_thread_logging_interface(&null_logger);
+	PYROWAVE_TIMING_BEGIN(push_start);
 	bool ret = decoder->decoder.push_packet(data, size);
+	PYROWAVE_TIMING_END(push_start, PYROWAVE_TIMING_EVENT_PUSH_PACKET);
+	return ret ? PYROWAVE_SUCCESS : PYROWAVE_ERROR_INVALID_ARGUMENT;
+}
+
+// push_packets() passes the array straight through.
+static_assert(sizeof(pyrowave_packet_data) == sizeof(Decoder::PacketData), "Packet data layout mismatch.");
+static_assert(offsetof(pyrowave_packet_data, data) == offsetof(Decoder::PacketData, data), "Packet data layout mismatch.");
+static_assert(offsetof(pyrowave_packet_data, size) == offsetof(Decoder::PacketData, size), "Packet data layout mismatch.");
+
+pyrowave_result
+pyrowave_decoder_push_packets(pyrowave_decoder decoder, const pyrowave_packet_data *packets, size_t count)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	PYROWAVE_TIMING_BEGIN(push_start);
+	bool ret = decoder->decoder.push_packets(reinterpret_cast<const Decoder::PacketData *>(packets), count);
+	PYROWAVE_TIMING_END(push_start, PYROWAVE_TIMING_EVENT_PUSH_PACKET);
 	return ret ? PYROWAVE_SUCCESS : PYROWAVE_ERROR_INVALID_ARGUMENT;
 }
 
@@ -1248,22 +1830,30 @@ bool pyrowave_decoder_decode_is_ready(pyrowave_decoder decoder, bool allow_parti
 	return decoder->decoder.decode_is_ready(allow_partial_frame);
 }
 
-pyrowave_result
-pyrowave_decoder_decode_gpu_buffer(pyrowave_decoder decoder,
-                                   const pyrowave_gpu_sync_operation *acquire,
-                                   const pyrowave_gpu_sync_operation *release,
-                                   const pyrowave_gpu_buffers *buffers)
+bool pyrowave_decoder_decode_slice_is_ready(pyrowave_decoder decoder, int slice_index, bool allow_partial_slice)
 {
-	if (decoder->pyro_device->cmd && (acquire || release))
-		return PYROWAVE_ERROR_INVALID_ARGUMENT;
-
 	Util::set_thread_logging_interface(&null_logger);
-	auto *device = decoder->device;
-	device->next_frame_context();
+	return decoder->decoder.decode_slice_is_ready(slice_index, allow_partial_slice);
+}
 
-	WrappedViewBuffers views = {};
-	if (!views.wrap(device, buffers, decoder->fragment_path ? VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT : VK_IMAGE_USAGE_STORAGE_BIT))
-		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
+void pyrowave_decoder_set_num_layers(pyrowave_decoder decoder, int layers)
+{
+	decoder->decoder.set_num_layers(layers);
+}
+
+int pyrowave_get_packet_layer(const void *data, size_t size)
+{
+	return Decoder::get_packet_layer(data, size);
+}
+
+static pyrowave_result
+pyrowave_decoder_decode_gpu(pyrowave_decoder decoder,
+                            const pyrowave_gpu_sync_operation *acquire,
+                            const pyrowave_gpu_sync_operation *release,
+                            const std::function<bool (CommandBuffer &)> &op)
+{
+	PYROWAVE_TIMING_BEGIN(submit_start);
+	auto *device = decoder->device;
 
 	// Just use normal graphics queue here since the result will likely be consumed there.
 	auto cmd = decoder->pyro_device->cmd
@@ -1297,7 +1887,7 @@ pyrowave_decoder_decode_gpu_buffer(pyrowave_decoder decoder,
 		}
 	}
 
-	auto ret = decoder->decoder.decode(*cmd, views);
+	auto ret = op(*cmd);
 	if (!ret)
 	{
 		device->submit_discard(cmd);
@@ -1329,56 +1919,145 @@ pyrowave_decoder_decode_gpu_buffer(pyrowave_decoder decoder,
 		device->submit(cmd);
 
 	pyrowave_device_signal_semaphore(device, decoder->pyro_device->queue_type, release);
+	PYROWAVE_TIMING_END(submit_start, PYROWAVE_TIMING_EVENT_DECODE_SUBMIT);
 
 	return PYROWAVE_SUCCESS;
 }
 
-pyrowave_result
-pyrowave_decoder_decode_cpu_buffer_synchronous(pyrowave_decoder decoder, const pyrowave_cpu_buffer *buffers)
+static VkImageUsageFlags pyrowave_decoder_output_usage(pyrowave_decoder decoder)
 {
-	if (decoder->pyro_device->cmd)
+	return decoder->fragment_path ? VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT : VK_IMAGE_USAGE_STORAGE_BIT;
+}
+
+// slice_index is -1 for a full frame.
+static pyrowave_result
+pyrowave_decoder_decode_gpu_buffers(pyrowave_decoder decoder,
+                                    const pyrowave_gpu_sync_operation *acquire,
+                                    const pyrowave_gpu_sync_operation *release,
+                                    const pyrowave_gpu_buffers *buffers,
+                                    int slice_index)
+{
+	if (decoder->pyro_device->cmd && (acquire || release))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
 	Util::set_thread_logging_interface(&null_logger);
-	auto *device = decoder->device;
+	decoder->device->next_frame_context();
 
-	if (buffers->width != decoder->width || buffers->height != decoder->height)
-		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	WrappedViewBuffers views = {};
+	if (!views.wrap(decoder->device, buffers, pyrowave_decoder_output_usage(decoder)))
+		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
+
+	return pyrowave_decoder_decode_gpu(decoder, acquire, release, [&](CommandBuffer &cmd) {
+		return slice_index < 0 ?
+		       decoder->decoder.decode(cmd, views) :
+		       decoder->decoder.decode_slice(cmd, views, slice_index);
+	});
+}
+
+pyrowave_result
+pyrowave_decoder_decode_gpu_buffer(pyrowave_decoder decoder,
+                                   const pyrowave_gpu_sync_operation *acquire,
+                                   const pyrowave_gpu_sync_operation *release,
+                                   const pyrowave_gpu_buffers *buffers)
+{
+	return pyrowave_decoder_decode_gpu_buffers(decoder, acquire, release, buffers, -1);
+}
 
-	if (buffers->format == PYROWAVE_CPU_BUFFER_FORMAT_NV12)
+pyrowave_result
+pyrowave_decoder_decode_slice_gpu_buffer(pyrowave_decoder decoder,
+                                         const pyrowave_gpu_sync_operation *acquire,
+                                         const pyrowave_gpu_sync_operation *release,
+                                         const pyrowave_gpu_buffers *buffers,
+                                         int slice_index)
+{
+	if (slice_index < 0)
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+	return pyrowave_decoder_decode_gpu_buffers(decoder, acquire, release, buffers, slice_index);
+}
 
-	if (decoder->chroma == ChromaSubsampling::Chroma420 && buffers->format == PYROWAVE_CPU_BUFFER_FORMAT_YUV444P)
+pyrowave_result
+pyrowave_decoder_decode_gpu_rgb(pyrowave_decoder decoder,
+                                const pyrowave_gpu_sync_operation *acquire,
+                                const pyrowave_gpu_sync_operation *release,
+                                const pyrowave_image_view *rgb,
+                                const pyrowave_color_conversion *conversion)
+{
+	if (decoder->pyro_device->cmd && (acquire || release))
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
-	if (decoder->chroma == ChromaSubsampling::Chroma444 && buffers->format != PYROWAVE_CPU_BUFFER_FORMAT_YUV444P)
+	if (!rgb || !conversion)
 		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
+	ColorConversion conv = {};
+	if (!translate_color_conversion(*conversion, conv))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	Util::set_thread_logging_interface(&null_logger);
+	decoder->device->next_frame_context();
+
+	WrappedView view = {};
+	if (!view.wrap(decoder->device, *rgb, pyrowave_decoder_output_usage(decoder), VK_COMPONENT_SWIZZLE_IDENTITY))
+		return PYROWAVE_ERROR_OUT_OF_HOST_MEMORY;
+
+	return pyrowave_decoder_decode_gpu(decoder, acquire, release, [&](CommandBuffer &cmd) {
+		return decoder->decoder.decode_rgb(cmd, *view.image_view, conv);
+	});
+}
+
+static pyrowave_result pyrowave_decoder_complete_readback(pyrowave_decoder decoder, uint64_t timeout)
+{
+	if (!decoder->readback_pending)
+		return PYROWAVE_ERROR_GENERIC;
+
+	PYROWAVE_TIMING_BEGIN(wait_start);
+	if (timeout == UINT64_MAX)
+		decoder->readback_fence->wait();
+	else if (!decoder->readback_fence->wait_timeout(timeout))
+		return PYROWAVE_TIMEOUT;
+	PYROWAVE_TIMING_END(wait_start, PYROWAVE_TIMING_EVENT_DECODE_FENCE_WAIT);
+
+	auto &target = decoder->readback_target;
 	for (int plane = 0; plane < 3; plane++)
 	{
-		int plane_width = decoder->width;
-		int plane_height = decoder->height;
+		void *mapped = decoder->device->map_host_buffer(*decoder->readback_buffers[plane], MEMORY_ACCESS_READ_BIT);
+		memcpy(target.data[plane], mapped, target.plane_size_in_bytes[plane]);
+	}
 
-		if (plane != 0 && decoder->chroma == ChromaSubsampling::Chroma420)
-		{
-			plane_width /= 2;
-			plane_height /= 2;
-		}
+	decoder->readback_fence.reset();
+	decoder->readback_pending = false;
+	return PYROWAVE_SUCCESS;
+}
 
-		const size_t plane_bpp = 1;
+pyrowave_result
+pyrowave_decoder_decode_cpu_buffer_async(pyrowave_decoder decoder, const pyrowave_cpu_buffer *buffers)
+{
+	if (decoder->pyro_device->cmd)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
 
-		if (buffers->row_stride_in_bytes[plane] < plane_width * plane_bpp)
-			return PYROWAVE_ERROR_INVALID_ARGUMENT;
-		if (buffers->row_stride_in_bytes[plane] * plane_height > buffers->plane_size_in_bytes[plane])
-			return PYROWAVE_ERROR_INVALID_ARGUMENT;
-	}
+	Util::set_thread_logging_interface(&null_logger);
+	auto *device = decoder->device;
+
+	if (buffers->width != decoder->width || buffers->height != decoder->height)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	// Interleaved chroma cannot be written by the decoder.
+	if (cpu_buffer_format_num_planes(buffers->format) != 3)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	if (!validate_cpu_buffer_planes(buffers, decoder->chroma))
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	// Readback buffers and decode images are shared between frames, so retire the previous frame first.
+	if (decoder->readback_pending)
+		pyrowave_decoder_complete_readback(decoder, UINT64_MAX);
 
 	for (int plane = 0; plane < 3; plane++)
 	{
 		auto &img = decoder->planes[plane];
+		VkFormat format = cpu_buffer_format_plane_format(buffers->format, plane);
 
-		if (!img)
+		if (!img || img->get_format() != format)
 		{
-			auto info = ImageCreateInfo::immutable_2d_image(buffers->width, buffers->height, VK_FORMAT_R8_UNORM);
+			auto info = ImageCreateInfo::immutable_2d_image(buffers->width, buffers->height, format);
 			info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
 			if (decoder->fragment_path)
 			{
@@ -1391,11 +2070,10 @@ pyrowave_decoder_decode_cpu_buffer_synchronous(pyrowave_decoder decoder, const p
 				info.layout = ImageLayout::General;
 			}
 
-			if (plane != 0 && decoder->chroma == ChromaSubsampling::Chroma420)
-			{
+			if (plane != 0 && decoder->chroma != ChromaSubsampling::Chroma444)
 				info.width /= 2;
+			if (plane != 0 && decoder->chroma == ChromaSubsampling::Chroma420)
 				info.height /= 2;
-			}
 
 			img = device->create_image(info);
 			if (!img)
@@ -1433,8 +2111,20 @@ pyrowave_decoder_decode_cpu_buffer_synchronous(pyrowave_decoder decoder, const p
 		p.layout = decoder->fragment_path ? VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
 	}
 
-	BufferCreateInfo bufinfo = {};
-	BufferHandle readback_buffers[3];
+	for (int plane = 0; plane < 3; plane++)
+	{
+		auto &buf = decoder->readback_buffers[plane];
+		if (!buf || buf->get_create_info().size < buffers->plane_size_in_bytes[plane])
+		{
+			BufferCreateInfo bufinfo = {};
+			bufinfo.size = buffers->plane_size_in_bytes[plane];
+			bufinfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+			bufinfo.domain = BufferDomain::CachedHost;
+			buf = device->create_buffer(bufinfo);
+			if (!buf)
+				return PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY;
+		}
+	}
 
 	auto res = pyrowave_decoder_decode_gpu_buffer(decoder, nullptr, nullptr, &gpu_buffers);
 	if (res != PYROWAVE_SUCCESS)
@@ -1461,33 +2151,39 @@ pyrowave_decoder_decode_cpu_buffer_synchronous(pyrowave_decoder decoder, const p
 
 	for (int plane = 0; plane < 3; plane++)
 	{
-		bufinfo.size = buffers->plane_size_in_bytes[plane];
-		bufinfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-		bufinfo.domain = BufferDomain::CachedHost;
-		readback_buffers[plane] = device->create_buffer(bufinfo);
-
-		cmd->copy_image_to_buffer(*readback_buffers[plane], *decoder->planes[plane], 0, {},
+		cmd->copy_image_to_buffer(*decoder->readback_buffers[plane], *decoder->planes[plane], 0, {},
 		                          {decoder->planes[plane]->get_width(), decoder->planes[plane]->get_height(), 1},
-		                          buffers->row_stride_in_bytes[plane], 0,
+		                          uint32_t(buffers->row_stride_in_bytes[plane] /
+		                                   cpu_buffer_format_texel_size(buffers->format, plane)), 0,
 		                          {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1});
 	}
 
 	cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
 	             VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
 
-	Fence fence;
-	device->submit(cmd, &fence);
-	fence->wait();
-
-	for (int plane = 0; plane < 3; plane++)
-	{
-		void *mapped = device->map_host_buffer(*readback_buffers[plane], MEMORY_ACCESS_READ_BIT);
-		memcpy(buffers->data[plane], mapped, buffers->plane_size_in_bytes[plane]);
-	}
+	device->submit(cmd, &decoder->readback_fence);
+	decoder->readback_target = *buffers;
+	decoder->readback_pending = true;
 
 	return PYROWAVE_SUCCESS;
 }
 
+pyrowave_result
+pyrowave_decoder_wait_cpu_buffer(pyrowave_decoder decoder, uint64_t timeout)
+{
+	Util::set_thread_logging_interface(&null_logger);
+	return pyrowave_decoder_complete_readback(decoder, timeout);
+}
+
+pyrowave_result
+pyrowave_decoder_decode_cpu_buffer_synchronous(pyrowave_decoder decoder, const pyrowave_cpu_buffer *buffers)
+{
+	auto res = pyrowave_decoder_decode_cpu_buffer_async(decoder, buffers);
+	if (res != PYROWAVE_SUCCESS)
+		return res;
+	return pyrowave_decoder_wait_cpu_buffer(decoder, UINT64_MAX);
+}
+
 void pyrowave_decoder_destroy(pyrowave_decoder decoder)
 {
 	auto *device = decoder->device;
@@ -9,6 +9,8 @@
 
 #include "pyrowave.h"
 #include <stdio.h>
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <exception>
 #include <vector>
@@ -481,25 +483,26 @@ static void validate_granite_image(Device &device, Image &img, SemaphoreHolder &
 	validate_mirror_buffer(device, *cr, 640, 360, 5, 7);
 }
 
-static void test_direct_interop()
+static void init_direct_context(Context &ctx)
 {
 	ASSERT_THAT(Context::init_loader(nullptr));
 
-	Context ctx;
 	ctx.set_num_thread_indices(1);
 	ctx.set_system_handles({});
 
-	VkApplicationInfo app_info = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
+	// The context keeps a pointer to it.
+	static VkApplicationInfo app_info = { VK_STRUCTURE_TYPE_APPLICATION_INFO };
 	app_info.apiVersion = VK_API_VERSION_1_3;
 	app_info.pApplicationName = "pyrowave-c-test";
 	app_info.pEngineName = "Granite";
 	ctx.set_application_info(&app_info);
 
 	ASSERT_THAT(ctx.init_instance_and_device(nullptr, 0, nullptr, 0));
+}
 
-	Device device;
-	device.set_context(ctx);
-
+// Shares the VkDevice and VkQueue of a Granite device, so images can be used directly.
+static pyrowave_device create_direct_device(Context &ctx, Device &device)
+{
 	// Fill in a proxy instance create info.
 	VkInstanceCreateInfo instance_create_info = { VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO };
 	instance_create_info.enabledExtensionCount = device.get_device_features().num_instance_extensions;
@@ -536,10 +539,22 @@ static void test_direct_interop()
 	info.queue_lock_callback = [](void *userdata) { static_cast<Device *>(userdata)->external_queue_lock(); };
 	info.queue_unlock_callback = [](void *userdata) { static_cast<Device *>(userdata)->external_queue_unlock(); };
 
-	pyrowave_encoder encoder;
-	pyrowave_decoder decoder;
 	pyrowave_device pyro_device;
 	CHECKED(pyrowave_create_device(&info, &pyro_device));
+	return pyro_device;
+}
+
+static void test_direct_interop()
+{
+	Context ctx;
+	init_direct_context(ctx);
+
+	Device device;
+	device.set_context(ctx);
+
+	pyrowave_encoder encoder;
+	pyrowave_decoder decoder;
+	pyrowave_device pyro_device = create_direct_device(ctx, device);
 
 	pyrowave_encoder_create_info encoder_info = {};
 	encoder_info.device = pyro_device;
@@ -670,6 +685,206 @@ static void test_direct_interop()
 	pyrowave_device_destroy(pyro_device);
 }
 
+static void ycbcr_to_rgb(const uint8_t *ycbcr, const pyrowave_color_conversion &conversion, int *rgb)
+{
+	float y = float(ycbcr[0]) / 255.0f;
+	float cb = float(ycbcr[1]) / 255.0f - 128.0f / 255.0f;
+	float cr = float(ycbcr[2]) / 255.0f - 128.0f / 255.0f;
+
+	if (conversion.range == PYROWAVE_YCBCR_RANGE_LIMITED)
+	{
+		y = std::min(std::max((y - 16.0f / 255.0f) * (255.0f / 219.0f), 0.0f), 1.0f);
+		cb = std::min(std::max(cb * (255.0f / 224.0f), -0.5f), 0.5f);
+		cr = std::min(std::max(cr * (255.0f / 224.0f), -0.5f), 0.5f);
+	}
+
+	float kr, kb;
+	if (conversion.transform == PYROWAVE_YCBCR_TRANSFORM_BT2020)
+	{
+		kr = 0.299f;
+		kb = 0.114f;
+	}
+	else
+	{
+		kr = 0.2126f;
+		kb = 0.0722f;
+	}
+
+	float kg = 1.0f - kr - kb;
+	float r = y + 2.0f * (1.0f - kr) * cr;
+	float b = y + 2.0f * (1.0f - kb) * cb;
+	float g = (y - kr * r - kb * b) / kg;
+
+	const float values[3] = { r, g, b };
+	for (int i = 0; i < 3; i++)
+		rgb[i] = int(std::lround(std::min(std::max(values[i], 0.0f), 1.0f) * 255.0f));
+}
+
+// Decodes the same frame with YCbCr to RGB conversion fused into the last iDWT pass,
+// and as YCbCr planes which are converted on the CPU. Both must agree.
+static void test_rgb_decode(bool fragment_path)
+{
+	Context ctx;
+	init_direct_context(ctx);
+
+	Device device;
+	device.set_context(ctx);
+
+	pyrowave_device pyro_device = create_direct_device(ctx, device);
+
+	constexpr int Width = 128;
+	constexpr int Height = 64;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = pyro_device;
+	encoder_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+	pyrowave_encoder encoder;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = pyro_device;
+	decoder_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+	pyrowave_decoder ycbcr_decoder;
+	CHECKED(pyrowave_decoder_create(&decoder_info, &ycbcr_decoder));
+	decoder_info.fragment_path = fragment_path;
+	pyrowave_decoder rgb_decoder;
+	CHECKED(pyrowave_decoder_create(&decoder_info, &rgb_decoder));
+
+	// Covers the limited range extremes, so that clamping is exercised as well.
+	std::vector<uint8_t> planes[3];
+	for (int i = 0; i < 3; i++)
+		planes[i].resize(Width * Height);
+
+	for (int y = 0; y < Height; y++)
+	{
+		for (int x = 0; x < Width; x++)
+		{
+			planes[0][y * Width + x] = uint8_t(x * 2);
+			planes[1][y * Width + x] = uint8_t(y * 4);
+			planes[2][y * Width + x] = uint8_t(255 - y * 4);
+		}
+	}
+
+	pyrowave_cpu_buffer buffer = {};
+	buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV444P;
+	buffer.width = Width;
+	buffer.height = Height;
+	for (int i = 0; i < 3; i++)
+	{
+		buffer.data[i] = planes[i].data();
+		buffer.row_stride_in_bytes[i] = Width;
+		buffer.plane_size_in_bytes[i] = planes[i].size();
+	}
+
+	pyrowave_rate_control rate_control = { BitstreamSize };
+	CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control));
+
+	size_t num_packets;
+	CHECKED(pyrowave_encoder_compute_num_packets(encoder, BitstreamSize, &num_packets));
+	ASSERT_THAT(num_packets == 1);
+
+	pyrowave_packet packet;
+	std::unique_ptr<uint8_t[]> bitstream(new uint8_t[BitstreamSize]);
+	CHECKED(pyrowave_encoder_packetize(encoder, &packet, BitstreamSize, &num_packets, bitstream.get(), BitstreamSize));
+	CHECKED(pyrowave_decoder_push_packet(ycbcr_decoder, bitstream.get() + packet.offset, packet.size));
+	CHECKED(pyrowave_decoder_push_packet(rgb_decoder, bitstream.get() + packet.offset, packet.size));
+	ASSERT_THAT(pyrowave_decoder_decode_is_ready(ycbcr_decoder, false));
+	ASSERT_THAT(pyrowave_decoder_decode_is_ready(rgb_decoder, false));
+
+	std::vector<uint8_t> decoded[3];
+	for (int i = 0; i < 3; i++)
+	{
+		decoded[i].resize(Width * Height);
+		buffer.data[i] = decoded[i].data();
+	}
+	CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(ycbcr_decoder, &buffer));
+
+	auto image_info = ImageCreateInfo::immutable_2d_image(Width, Height, VK_FORMAT_R8G8B8A8_UNORM);
+	image_info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+	                   (fragment_path ? VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT : VK_IMAGE_USAGE_STORAGE_BIT);
+	image_info.initial_layout = VK_IMAGE_LAYOUT_GENERAL;
+	auto rgb_image = device.create_image(image_info);
+	ASSERT_THAT(rgb_image);
+
+	pyrowave_image_view view = {};
+	view.image = rgb_image->get_image();
+	view.width = Width;
+	view.height = Height;
+	view.image_format = VK_FORMAT_R8G8B8A8_UNORM;
+	view.view_format = VK_FORMAT_R8G8B8A8_UNORM;
+	view.aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+	view.layout = VK_IMAGE_LAYOUT_GENERAL;
+
+	BufferCreateInfo bufinfo = {};
+	bufinfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	bufinfo.size = Width * Height * 4;
+	bufinfo.domain = BufferDomain::CachedHost;
+	auto readback_buffer = device.create_buffer(bufinfo);
+
+	const pyrowave_color_conversion conversions[] = {
+		{ PYROWAVE_YCBCR_TRANSFORM_BT709, PYROWAVE_YCBCR_RANGE_LIMITED, PYROWAVE_CHROMA_SITING_CENTER },
+		{ PYROWAVE_YCBCR_TRANSFORM_BT2020, PYROWAVE_YCBCR_RANGE_FULL, PYROWAVE_CHROMA_SITING_CENTER },
+	};
+
+	for (auto &conversion : conversions)
+	{
+		auto cmd = device.request_command_buffer();
+		pyrowave_device_set_command_buffer(pyro_device, cmd->get_command_buffer());
+		CHECKED(pyrowave_decoder_decode_gpu_rgb(rgb_decoder, nullptr, nullptr, &view, &conversion));
+		pyrowave_device_set_command_buffer(pyro_device, VK_NULL_HANDLE);
+
+		if (fragment_path)
+		{
+			cmd->image_barrier(*rgb_image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			                   VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+			                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+		}
+		else
+		{
+			cmd->image_barrier(*rgb_image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+			                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+		}
+
+		cmd->copy_image_to_buffer(*readback_buffer, *rgb_image, 0, {}, { Width, Height, 1 }, 0, 0,
+			{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+		cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+
+		// The next decode writes the image in GENERAL layout again.
+		cmd->image_barrier(*rgb_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+		                   VK_PIPELINE_STAGE_2_COPY_BIT, 0,
+		                   VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, 0);
+
+		Fence fence;
+		device.submit(cmd, &fence);
+		fence->wait();
+
+		auto *rgba = static_cast<const uint8_t *>(device.map_host_buffer(*readback_buffer, MEMORY_ACCESS_READ_BIT));
+
+		for (int i = 0; i < Width * Height; i++)
+		{
+			const uint8_t ycbcr[3] = { decoded[0][i], decoded[1][i], decoded[2][i] };
+			int reference[3];
+			ycbcr_to_rgb(ycbcr, conversion, reference);
+
+			// The fused path converts before rounding YCbCr to 8 bits, which chroma scaling amplifies.
+			for (int c = 0; c < 3; c++)
+				ASSERT_THAT(std::abs(int(rgba[4 * i + c]) - reference[c]) <= 3);
+			ASSERT_THAT(rgba[4 * i + 3] == 255);
+		}
+	}
+
+	pyrowave_decoder_destroy(rgb_decoder);
+	pyrowave_decoder_destroy(ycbcr_decoder);
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_device_destroy(pyro_device);
+}
+
 // Most basic interop scenario, OPAQUE_FD for everything.
 static void test_opaque_interop(bool win32_kmt)
 {
@@ -1896,6 +2111,12 @@ int main(int argc, char **argv)
 	printf("Running Vulkan <-> Vulkan interop test with direct device share ...\n");
 	test_direct_interop();
 
+	printf("Running fused RGB decode test (compute) ...\n");
+	test_rgb_decode(false);
+
+	printf("Running fused RGB decode test (fragment) ...\n");
+	test_rgb_decode(true);
+
 	printf("Running opaque Vulkan <-> Vulkan interop test ...\n");
 	test_opaque_interop(false);
 
@@ -4,9 +4,12 @@
 #include "vulkan/vulkan.h"
 #include "pyrowave.h"
 #include <stdio.h>
+#include <string.h>
+#include <chrono>
 #include <cstdlib>
 #include <exception>
 #include <vector>
+#include <thread>
 
 // Smoke test the C API.
 
@@ -54,6 +57,36 @@ static void test_encoder_create_validation()
 	CHECKED(pyrowave_encoder_create(&info, &dummy));
 	pyrowave_encoder_destroy(dummy);
 
+	// Odd height allowed for 422, but not odd width.
+	info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_422;
+	CHECKED(pyrowave_encoder_create(&info, &dummy));
+	pyrowave_encoder_destroy(dummy);
+	info.width = 65;
+	ASSERT_THAT(pyrowave_encoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.width = 64;
+	info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+
+	// Level count out of range.
+	info.decomposition_levels = PYROWAVE_MIN_DECOMPOSITION_LEVELS - 1;
+	ASSERT_THAT(pyrowave_encoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.decomposition_levels = PYROWAVE_MAX_DECOMPOSITION_LEVELS + 1;
+	ASSERT_THAT(pyrowave_encoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	for (int levels = PYROWAVE_MIN_DECOMPOSITION_LEVELS; levels <= PYROWAVE_MAX_DECOMPOSITION_LEVELS; levels++)
+	{
+		info.decomposition_levels = levels;
+		CHECKED(pyrowave_encoder_create(&info, &dummy));
+		pyrowave_encoder_destroy(dummy);
+	}
+	info.decomposition_levels = 0;
+
+	info.transform = PYROWAVE_WAVELET_TRANSFORM_LEGALL53;
+	CHECKED(pyrowave_encoder_create(&info, &dummy));
+	pyrowave_encoder_destroy(dummy);
+	info.transform = pyrowave_wavelet_transform(2);
+	ASSERT_THAT(pyrowave_encoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.transform = PYROWAVE_WAVELET_TRANSFORM_CDF97;
+
 	pyrowave_encoder_destroy(encoder);
 	pyrowave_device_destroy(device);
 }
@@ -93,11 +126,50 @@ static void test_decoder_create_validation()
 	CHECKED(pyrowave_decoder_create(&info, &dummy));
 	pyrowave_decoder_destroy(dummy);
 
+	// Odd height allowed for 422, but not odd width.
+	info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_422;
+	CHECKED(pyrowave_decoder_create(&info, &dummy));
+	pyrowave_decoder_destroy(dummy);
+	info.width = 65;
+	ASSERT_THAT(pyrowave_decoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.width = 64;
+	info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+
+	// Level count out of range.
+	info.decomposition_levels = PYROWAVE_MIN_DECOMPOSITION_LEVELS - 1;
+	ASSERT_THAT(pyrowave_decoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.decomposition_levels = PYROWAVE_MAX_DECOMPOSITION_LEVELS + 1;
+	ASSERT_THAT(pyrowave_decoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	for (int levels = PYROWAVE_MIN_DECOMPOSITION_LEVELS; levels <= PYROWAVE_MAX_DECOMPOSITION_LEVELS; levels++)
+	{
+		info.decomposition_levels = levels;
+		CHECKED(pyrowave_decoder_create(&info, &dummy));
+		pyrowave_decoder_destroy(dummy);
+	}
+	info.decomposition_levels = 0;
+
 	// Smoke test that creating device on fragment path doesn't explode.
 	info.fragment_path = true;
 	CHECKED(pyrowave_decoder_create(&info, &dummy));
 	pyrowave_decoder_destroy(dummy);
 
+	// 422 is only implemented in the compute path.
+	info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_422;
+	ASSERT_THAT(pyrowave_decoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+
+	// So is the reversible transform.
+	info.transform = PYROWAVE_WAVELET_TRANSFORM_LEGALL53;
+	ASSERT_THAT(pyrowave_decoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.fragment_path = false;
+	CHECKED(pyrowave_decoder_create(&info, &dummy));
+	pyrowave_decoder_destroy(dummy);
+
+	info.transform = pyrowave_wavelet_transform(2);
+	ASSERT_THAT(pyrowave_decoder_create(&info, &dummy) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	info.transform = PYROWAVE_WAVELET_TRANSFORM_CDF97;
+
 	pyrowave_decoder_destroy(decoder);
 	pyrowave_device_destroy(device);
 }
@@ -157,6 +229,17 @@ static void test_decode_cpu_buffer_validation(bool fragment_path)
 		for (uint32_t x = 0; x < 8; x++)
 			ASSERT_THAT(cr[y][x] == 0x7f || cr[y][x] == 0x80);
 
+	// Async path should give the same result once waited for.
+	ASSERT_THAT(pyrowave_decoder_wait_cpu_buffer(decoder, 0) == PYROWAVE_ERROR_GENERIC);
+	memset(luma, 0, sizeof(luma));
+	CHECKED(pyrowave_decoder_decode_cpu_buffer_async(decoder, &cpu_buffer));
+	CHECKED(pyrowave_decoder_wait_cpu_buffer(decoder, UINT64_MAX));
+	ASSERT_THAT(pyrowave_decoder_wait_cpu_buffer(decoder, 0) == PYROWAVE_ERROR_GENERIC);
+
+	for (uint32_t y = 0; y < 16; y++)
+		for (uint32_t x = 0; x < 16; x++)
+			ASSERT_THAT(luma[y][x] == 0x7f || luma[y][x] == 0x80);
+
 	pyrowave_decoder_destroy(decoder);
 	pyrowave_device_destroy(info.device);
 }
@@ -217,7 +300,9 @@ static void test_encode_cpu_buffer_validation(bool nv12)
 	pyrowave_device_destroy(info.device);
 }
 
-static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode, pyrowave_chroma_subsampling chroma)
+static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode, pyrowave_chroma_subsampling chroma,
+                                         int decomposition_levels = 0,
+                                         pyrowave_wavelet_transform transform = PYROWAVE_WAVELET_TRANSFORM_CDF97)
 {
 	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_444 && nv12_encode)
 		return;
@@ -237,12 +322,16 @@ static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode,
 	decoder_info.height = Height;
 	decoder_info.fragment_path = fragment_decode;
 	decoder_info.chroma = chroma;
+	decoder_info.decomposition_levels = decomposition_levels;
+	decoder_info.transform = transform;
 
 	pyrowave_encoder_create_info encoder_info = {};
 	encoder_info.device = device;
 	encoder_info.width = Width;
 	encoder_info.height = Height;
 	encoder_info.chroma = chroma;
+	encoder_info.decomposition_levels = decomposition_levels;
+	encoder_info.transform = transform;
 
 	pyrowave_decoder decoder;
 	pyrowave_encoder encoder;
@@ -260,12 +349,22 @@ static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode,
 
 	pyrowave_cpu_buffer cpu_buffer = {};
 
-	cpu_buffer.format =
-			nv12_encode
-				? PYROWAVE_CPU_BUFFER_FORMAT_NV12
-				: (chroma == PYROWAVE_CHROMA_SUBSAMPLING_444
-					   ? PYROWAVE_CPU_BUFFER_FORMAT_YUV444P
-					   : PYROWAVE_CPU_BUFFER_FORMAT_YUV420P);
+	const int chroma_width = chroma == PYROWAVE_CHROMA_SUBSAMPLING_444 ? Width : Width / 2;
+	const int chroma_height = chroma == PYROWAVE_CHROMA_SUBSAMPLING_420 ? Height / 2 : Height;
+
+	pyrowave_cpu_buffer_format planar_format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_444)
+		planar_format = PYROWAVE_CPU_BUFFER_FORMAT_YUV444P;
+	else if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_422)
+		planar_format = PYROWAVE_CPU_BUFFER_FORMAT_YUV422P;
+
+	if (nv12_encode)
+	{
+		cpu_buffer.format = chroma == PYROWAVE_CHROMA_SUBSAMPLING_422 ?
+				PYROWAVE_CPU_BUFFER_FORMAT_NV16 : PYROWAVE_CPU_BUFFER_FORMAT_NV12;
+	}
+	else
+		cpu_buffer.format = planar_format;
 
 	cpu_buffer.row_stride_in_bytes[0] = Width;
 	cpu_buffer.row_stride_in_bytes[1] = nv12_encode ? sizeof(cbcr[0]) : sizeof(cb[0]);
@@ -310,6 +409,7 @@ static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode,
 	cpu_buffer.width = Width;
 	cpu_buffer.height = Height;
 	const pyrowave_rate_control rate_control = { 64 * 1024 }; // Just give it something massive.
+	CHECKED(pyrowave_encoder_set_stats_enabled(encoder, true));
 	CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &cpu_buffer, &rate_control));
 
 	size_t num_packets;
@@ -325,6 +425,61 @@ static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode,
 	ASSERT_THAT(packet.size <= bitstream.size());
 	bitstream.resize(packet.size);
 
+	pyrowave_frame_stats stats = {};
+	CHECKED(pyrowave_encoder_get_frame_stats(encoder, 64 * 1024, &stats));
+	ASSERT_THAT(stats.has_rate_control_stats);
+	ASSERT_THAT(stats.total_bytes == packet.size);
+	ASSERT_THAT(stats.packet_padding_bytes == 64 * 1024 - packet.size);
+	ASSERT_THAT(stats.num_non_zero_blocks != 0 && stats.num_non_zero_blocks <= stats.num_blocks);
+	// Plenty of bits, so rate control should not have to drop anything.
+	for (auto &level : stats.bands[0])
+		for (auto &band : level)
+			ASSERT_THAT(band.max_quant == 0);
+	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_420)
+		ASSERT_THAT(stats.bands[1][0][3].num_blocks == 0);
+	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_422)
+	{
+		// Only the vertical split is coded at level 0.
+		ASSERT_THAT(stats.bands[1][0][1].num_blocks == 0);
+		ASSERT_THAT(stats.bands[1][0][2].num_blocks != 0);
+		ASSERT_THAT(stats.bands[1][0][3].num_blocks == 0);
+	}
+	if (decomposition_levels && decomposition_levels < PYROWAVE_NUM_DECOMPOSITION_LEVELS)
+		ASSERT_THAT(stats.bands[0][decomposition_levels][0].num_blocks == 0);
+
+	if (decomposition_levels && decomposition_levels != PYROWAVE_DEFAULT_DECOMPOSITION_LEVELS)
+	{
+		// A decoder with a different level count must reject the stream.
+		pyrowave_decoder_create_info mismatch_info = decoder_info;
+		mismatch_info.decomposition_levels = 0;
+		pyrowave_decoder mismatch;
+		CHECKED(pyrowave_decoder_create(&mismatch_info, &mismatch));
+		ASSERT_THAT(pyrowave_decoder_push_packet(mismatch, bitstream.data() + packet.offset, packet.size) != PYROWAVE_SUCCESS);
+		pyrowave_decoder_destroy(mismatch);
+	}
+
+	if (transform != PYROWAVE_WAVELET_TRANSFORM_CDF97)
+	{
+		// A decoder with a different transform must reject the stream.
+		pyrowave_decoder_create_info mismatch_info = decoder_info;
+		mismatch_info.transform = PYROWAVE_WAVELET_TRANSFORM_CDF97;
+		pyrowave_decoder mismatch;
+		CHECKED(pyrowave_decoder_create(&mismatch_info, &mismatch));
+		ASSERT_THAT(pyrowave_decoder_push_packet(mismatch, bitstream.data() + packet.offset, packet.size) != PYROWAVE_SUCCESS);
+		pyrowave_decoder_destroy(mismatch);
+	}
+
+	if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_422)
+	{
+		// 4:2:2 streams share the 4:2:0 start of frame header, so this relies on the sequence parameters.
+		pyrowave_decoder_create_info mismatch_info = decoder_info;
+		mismatch_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_420;
+		pyrowave_decoder mismatch;
+		CHECKED(pyrowave_decoder_create(&mismatch_info, &mismatch));
+		ASSERT_THAT(pyrowave_decoder_push_packet(mismatch, bitstream.data() + packet.offset, packet.size) != PYROWAVE_SUCCESS);
+		pyrowave_decoder_destroy(mismatch);
+	}
+
 	CHECKED(pyrowave_decoder_push_packet(decoder, bitstream.data() + packet.offset, packet.size));
 	ASSERT_THAT(pyrowave_decoder_decode_is_ready(decoder, false));
 	pyrowave_decoder_clear(decoder);
@@ -339,41 +494,42 @@ static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode,
 	cpu_buffer.row_stride_in_bytes[2] = sizeof(decode_cr[0]);
 	cpu_buffer.plane_size_in_bytes[1] = sizeof(decode_cb);
 	cpu_buffer.plane_size_in_bytes[2] = sizeof(decode_cr);
-	cpu_buffer.format = chroma == PYROWAVE_CHROMA_SUBSAMPLING_444 ?
-			PYROWAVE_CPU_BUFFER_FORMAT_YUV444P : PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	cpu_buffer.format = planar_format;
 
 	CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoder, &cpu_buffer));
 
+	// With the "infinite" bitrate we get here, accept a maximum 1 ULP error.
+	// The reversible transform must be lossless.
+	const int max_error = transform == PYROWAVE_WAVELET_TRANSFORM_LEGALL53 ? 0 : 1;
+
 	for (int y = 0; y < Height; y++)
 	{
 		for (int x = 0; x < Width; x++)
 		{
 			int d = std::abs(int(decode_luma[y][x]) - int(luma[y][x]));
-			// With the "infinite" bitrate we get here,
-			// accept a maximum 1 ULP error.
-			ASSERT_THAT(d <= 1);
+			ASSERT_THAT(d <= max_error);
 
-			if (chroma == PYROWAVE_CHROMA_SUBSAMPLING_444 || (!nv12_encode && y < Height / 2 && x < Width / 2))
+			if (!nv12_encode && y < chroma_height && x < chroma_width)
 			{
 				// Allow more error for chroma.
 				d = std::abs(int(decode_cb[y][x]) - int(cb[y][x]));
-				ASSERT_THAT(d <= 1);
+				ASSERT_THAT(d <= max_error);
 				d = std::abs(int(decode_cr[y][x]) - int(cr[y][x]));
-				ASSERT_THAT(d <= 1);
+				ASSERT_THAT(d <= max_error);
 			}
 		}
 	}
 
 	if (nv12_encode)
 	{
-		for (int y = 0; y < Height / 2; y++)
+		for (int y = 0; y < chroma_height; y++)
 		{
-			for (int x = 0; x < Width / 2; x++)
+			for (int x = 0; x < chroma_width; x++)
 			{
 				int d = std::abs(int(decode_cb[y][x]) - int(cbcr[y][x][0]));
-				ASSERT_THAT(d <= 1);
+				ASSERT_THAT(d <= max_error);
 				d = std::abs(int(decode_cr[y][x]) - int(cbcr[y][x][1]));
-				ASSERT_THAT(d <= 1);
+				ASSERT_THAT(d <= max_error);
 			}
 		}
 	}
@@ -382,6 +538,174 @@ static void test_basic_encoder_roundtrip(bool fragment_decode, bool nv12_encode,
 	pyrowave_encoder_destroy(encoder);
 }
 
+static void test_16bit_roundtrip(pyrowave_cpu_buffer_format format)
+{
+	bool interleaved = format == PYROWAVE_CPU_BUFFER_FORMAT_P010 || format == PYROWAVE_CPU_BUFFER_FORMAT_P016 ||
+	                   format == PYROWAVE_CPU_BUFFER_FORMAT_P210;
+
+	pyrowave_chroma_subsampling chroma = PYROWAVE_CHROMA_SUBSAMPLING_420;
+	pyrowave_cpu_buffer_format planar_format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P16;
+	if (format == PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16)
+	{
+		chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+		planar_format = PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16;
+	}
+	else if (format == PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16 || format == PYROWAVE_CPU_BUFFER_FORMAT_P210)
+	{
+		chroma = PYROWAVE_CHROMA_SUBSAMPLING_422;
+		planar_format = PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16;
+	}
+
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+
+	constexpr int Width = 34;
+	constexpr int Height = 30;
+	const int chroma_width = chroma == PYROWAVE_CHROMA_SUBSAMPLING_444 ? Width : Width / 2;
+	const int chroma_height = chroma == PYROWAVE_CHROMA_SUBSAMPLING_420 ? Height / 2 : Height;
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = device;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+	decoder_info.chroma = chroma;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+	encoder_info.chroma = chroma;
+
+	pyrowave_decoder decoder;
+	pyrowave_encoder encoder;
+	CHECKED(pyrowave_decoder_create(&decoder_info, &decoder));
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+
+	std::vector<uint16_t> luma(Width * Height);
+	std::vector<uint16_t> cb(chroma_width * chroma_height);
+	std::vector<uint16_t> cr(chroma_width * chroma_height);
+	std::vector<uint16_t> cbcr(2 * chroma_width * chroma_height);
+
+	// Only keep the 10 MSBs for P010 and P210.
+	uint16_t mask = format == PYROWAVE_CPU_BUFFER_FORMAT_P010 || format == PYROWAVE_CPU_BUFFER_FORMAT_P210 ? 0xffc0 : 0xffff;
+
+	for (int y = 0; y < Height; y++)
+		for (int x = 0; x < Width; x++)
+			luma[y * Width + x] = uint16_t((700 * x + 1100 * y) & mask);
+
+	for (int y = 0; y < chroma_height; y++)
+	{
+		for (int x = 0; x < chroma_width; x++)
+		{
+			int i = y * chroma_width + x;
+			cb[i] = uint16_t((1500 * x + 700 * y) & mask);
+			cr[i] = uint16_t((700 * x + 1300 * y) & mask);
+			cbcr[2 * i + 0] = cb[i];
+			cbcr[2 * i + 1] = cr[i];
+		}
+	}
+
+	pyrowave_cpu_buffer cpu_buffer = {};
+	cpu_buffer.format = format;
+	cpu_buffer.width = Width;
+	cpu_buffer.height = Height;
+	cpu_buffer.data[0] = luma.data();
+	cpu_buffer.row_stride_in_bytes[0] = Width * sizeof(uint16_t);
+	cpu_buffer.plane_size_in_bytes[0] = luma.size() * sizeof(uint16_t);
+
+	if (interleaved)
+	{
+		cpu_buffer.data[1] = cbcr.data();
+		cpu_buffer.row_stride_in_bytes[1] = 2 * chroma_width * sizeof(uint16_t);
+		cpu_buffer.plane_size_in_bytes[1] = cbcr.size() * sizeof(uint16_t);
+	}
+	else
+	{
+		cpu_buffer.data[1] = cb.data();
+		cpu_buffer.data[2] = cr.data();
+		cpu_buffer.row_stride_in_bytes[1] = chroma_width * sizeof(uint16_t);
+		cpu_buffer.row_stride_in_bytes[2] = chroma_width * sizeof(uint16_t);
+		cpu_buffer.plane_size_in_bytes[1] = cb.size() * sizeof(uint16_t);
+		cpu_buffer.plane_size_in_bytes[2] = cr.size() * sizeof(uint16_t);
+	}
+
+	const pyrowave_rate_control rate_control = { 64 * 1024 }; // Just give it something massive.
+
+	// Row stride which is not a multiple of the texel size.
+	cpu_buffer.row_stride_in_bytes[0] += 1;
+	ASSERT_THAT(pyrowave_encoder_encode_cpu_synchronous(encoder, &cpu_buffer, &rate_control) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	cpu_buffer.row_stride_in_bytes[0] -= 1;
+	CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &cpu_buffer, &rate_control));
+
+	std::vector<uint8_t> bitstream(64 * 1024);
+	pyrowave_packet packet = {};
+	size_t num_packets;
+	CHECKED(pyrowave_encoder_packetize(encoder, &packet, 64 * 1024, &num_packets, bitstream.data(), bitstream.size()));
+	ASSERT_THAT(num_packets == 1);
+	CHECKED(pyrowave_decoder_push_packet(decoder, bitstream.data() + packet.offset, packet.size));
+	ASSERT_THAT(pyrowave_decoder_decode_is_ready(decoder, false));
+
+	// 2-plane formats are encode only.
+	if (interleaved)
+		ASSERT_THAT(pyrowave_decoder_decode_cpu_buffer_synchronous(decoder, &cpu_buffer) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	std::vector<uint16_t> decode_luma(luma.size());
+	std::vector<uint16_t> decode_cb(cb.size());
+	std::vector<uint16_t> decode_cr(cr.size());
+
+	cpu_buffer.format = planar_format;
+	cpu_buffer.data[0] = decode_luma.data();
+	cpu_buffer.data[1] = decode_cb.data();
+	cpu_buffer.data[2] = decode_cr.data();
+	cpu_buffer.row_stride_in_bytes[1] = chroma_width * sizeof(uint16_t);
+	cpu_buffer.row_stride_in_bytes[2] = chroma_width * sizeof(uint16_t);
+	cpu_buffer.plane_size_in_bytes[1] = decode_cb.size() * sizeof(uint16_t);
+	cpu_buffer.plane_size_in_bytes[2] = decode_cr.size() * sizeof(uint16_t);
+	CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoder, &cpu_buffer));
+
+	// Same 1 ULP tolerance as the 8-bit roundtrip, but this must not be an 8-bit result in disguise.
+	constexpr int Tolerance = 257;
+	bool any_fine_detail = false;
+
+	for (size_t i = 0; i < luma.size(); i++)
+	{
+		ASSERT_THAT(std::abs(int(decode_luma[i]) - int(luma[i])) <= Tolerance);
+		if ((decode_luma[i] & 0xff) != (decode_luma[i] >> 8))
+			any_fine_detail = true;
+	}
+
+	for (size_t i = 0; i < cb.size(); i++)
+	{
+		ASSERT_THAT(std::abs(int(decode_cb[i]) - int(cb[i])) <= Tolerance);
+		ASSERT_THAT(std::abs(int(decode_cr[i]) - int(cr[i])) <= Tolerance);
+	}
+
+	ASSERT_THAT(any_fine_detail);
+
+	// The reversible transform is 8-bit only, so it must not silently truncate deep input.
+	pyrowave_encoder_destroy(encoder);
+	encoder_info.transform = PYROWAVE_WAVELET_TRANSFORM_LEGALL53;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+	cpu_buffer.format = format;
+	cpu_buffer.data[0] = luma.data();
+	if (interleaved)
+	{
+		cpu_buffer.data[1] = cbcr.data();
+		cpu_buffer.row_stride_in_bytes[1] = 2 * chroma_width * sizeof(uint16_t);
+		cpu_buffer.plane_size_in_bytes[1] = cbcr.size() * sizeof(uint16_t);
+	}
+	else
+	{
+		cpu_buffer.data[1] = cb.data();
+		cpu_buffer.data[2] = cr.data();
+	}
+	ASSERT_THAT(pyrowave_encoder_encode_cpu_synchronous(encoder, &cpu_buffer, &rate_control) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	pyrowave_decoder_destroy(decoder);
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_device_destroy(device);
+}
+
 static void test_basic_system_stability()
 {
 	pyrowave_device device;
@@ -547,28 +871,995 @@ static void test_basic_system_stability()
 	pyrowave_device_destroy(device);
 }
 
-int main()
+static void test_concurrent_push_packet()
 {
-	printf("Running system stability test ...\n");
-	test_basic_system_stability();
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
 
-	// Correctness tests for small-ish outputs.
-	for (int variant = 0; variant < 8; variant++)
+	constexpr int Width = 640;
+	constexpr int Height = 480;
+	constexpr int NumThreads = 4;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = device;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+
+	pyrowave_encoder encoder;
+	pyrowave_decoder decoder, reference;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+	CHECKED(pyrowave_decoder_create(&decoder_info, &decoder));
+	CHECKED(pyrowave_decoder_create(&decoder_info, &reference));
+
+	std::vector<uint8_t> luma(Width * Height);
+	std::vector<uint8_t> cb(Width * Height / 4);
+	std::vector<uint8_t> cr(Width * Height / 4);
+
+	// Add some noise so that the frame actually uses most of its rate budget.
+	uint32_t seed = 1;
+	for (int y = 0; y < Height; y++)
 	{
-		printf("Running roundtrip variant %d test ...\n", variant);
-		test_basic_encoder_roundtrip(
-			(variant & 1) != 0, (variant & 2) != 0,
-			(variant & 4) != 0 ? PYROWAVE_CHROMA_SUBSAMPLING_444 : PYROWAVE_CHROMA_SUBSAMPLING_420);
+		for (int x = 0; x < Width; x++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			luma[y * Width + x] = uint8_t(3 * x + 5 * y + (seed >> 26));
+		}
 	}
 
-	// Validate that we handle error inputs gracefully.
-	printf("Running error handling tests ...\n");
-	test_decode_cpu_buffer_validation(false);
-	test_decode_cpu_buffer_validation(true);
-	test_encode_cpu_buffer_validation(false);
-	test_encode_cpu_buffer_validation(true);
-	test_encoder_create_validation();
-	test_decoder_create_validation();
+	for (int y = 0; y < Height / 2; y++)
+	{
+		for (int x = 0; x < Width / 2; x++)
+		{
+			cb[y * Width / 2 + x] = uint8_t(7 * x + 3 * y);
+			cr[y * Width / 2 + x] = uint8_t(3 * x + 5 * y);
+		}
+	}
+
+	pyrowave_cpu_buffer buffer = {};
+	buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	buffer.row_stride_in_bytes[0] = Width;
+	buffer.row_stride_in_bytes[1] = Width / 2;
+	buffer.row_stride_in_bytes[2] = Width / 2;
+	buffer.plane_size_in_bytes[0] = luma.size();
+	buffer.plane_size_in_bytes[1] = cb.size();
+	buffer.plane_size_in_bytes[2] = cr.size();
+	buffer.data[0] = luma.data();
+	buffer.data[1] = cb.data();
+	buffer.data[2] = cr.data();
+	buffer.width = Width;
+	buffer.height = Height;
+
+	std::vector<uint8_t> bitstream;
+	std::vector<pyrowave_packet> packets;
+
+	std::vector<uint8_t> decoded[2][3];
+	pyrowave_cpu_buffer decode_buffers[2];
+	for (int i = 0; i < 2; i++)
+	{
+		decoded[i][0].resize(luma.size());
+		decoded[i][1].resize(cb.size());
+		decoded[i][2].resize(cr.size());
+		decode_buffers[i] = buffer;
+		for (int plane = 0; plane < 3; plane++)
+			decode_buffers[i].data[plane] = decoded[i][plane].data();
+	}
+
+	for (int iter = 0; iter < 16; iter++)
+	{
+		// High enough that pushing every packet from every thread would overflow the payload arena
+		// if duplicates were not filtered before allocating payload space.
+		const pyrowave_rate_control rate_control = { 300000 };
+		CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control));
+
+		size_t num_packets;
+		CHECKED(pyrowave_encoder_compute_num_packets(encoder, 1024, &num_packets));
+		ASSERT_THAT(num_packets > NumThreads);
+
+		packets.resize(num_packets);
+		bitstream.resize(rate_control.maximum_bitstream_size);
+		CHECKED(pyrowave_encoder_packetize(encoder, packets.data(), 1024, &num_packets,
+		                                   bitstream.data(), bitstream.size()));
+
+		for (auto &packet : packets)
+			CHECKED(pyrowave_decoder_push_packet(reference, bitstream.data() + packet.offset, packet.size));
+
+		// Spread packets over threads the same way a receiver with multiple queues would.
+		// Every other pair of frames, each thread receives every packet to stress duplicate handling.
+		const size_t stride = (iter & 2) ? 1 : NumThreads;
+		std::vector<std::thread> threads;
+		for (int i = 0; i < NumThreads; i++)
+		{
+			threads.emplace_back([&, i]() {
+				// Alternate between single packets and batched ingestion.
+				std::vector<pyrowave_packet_data> batch;
+				for (size_t j = (iter & 2) ? 0 : i; j < packets.size(); j += stride)
+				{
+					if (iter & 1)
+					{
+						batch.push_back({ bitstream.data() + packets[j].offset, packets[j].size });
+					}
+					else
+					{
+						CHECKED(pyrowave_decoder_push_packet(
+								decoder, bitstream.data() + packets[j].offset, packets[j].size));
+					}
+				}
+
+				if (!batch.empty())
+					CHECKED(pyrowave_decoder_push_packets(decoder, batch.data(), batch.size()));
+			});
+		}
+
+		for (auto &t : threads)
+			t.join();
+
+		ASSERT_THAT(pyrowave_decoder_decode_is_ready(decoder, false));
+		ASSERT_THAT(pyrowave_decoder_decode_is_ready(reference, false));
+
+		// Payload lands in the arena in a different order, but the decoded frame must be identical.
+		CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoder, &decode_buffers[0]));
+		CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(reference, &decode_buffers[1]));
+		for (int plane = 0; plane < 3; plane++)
+			ASSERT_THAT(decoded[0][plane] == decoded[1][plane]);
+	}
+
+	pyrowave_decoder_destroy(reference);
+	pyrowave_decoder_destroy(decoder);
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_device_destroy(device);
+}
+
+static float sum_distortion(const pyrowave_frame_stats &stats)
+{
+	float distortion = 0.0f;
+	for (auto &component : stats.bands)
+		for (auto &level : component)
+			for (auto &band : level)
+				distortion += band.distortion;
+	return distortion;
+}
+
+static void test_payload_overflow()
+{
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+
+	constexpr int Width = 1920;
+	constexpr int Height = 1080;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+
+	// Without a budget the payload scratch fits the worst case, so nothing is dropped.
+	pyrowave_encoder reference;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &reference));
+	CHECKED(pyrowave_encoder_set_stats_enabled(reference, true));
+
+	// Leave the payload scratch well short of the worst case, which is 2 bytes per pixel.
+	pyrowave_rate_control rate_control = { 16 * 1024 };
+	pyrowave_memory_requirements reqs = {};
+	CHECKED(pyrowave_encoder_query_memory_requirements(&encoder_info, &rate_control, &reqs));
+	encoder_info.memory_budget = reqs.device_local_size - 3 * Width * Height / 2;
+
+	pyrowave_encoder encoder;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+	CHECKED(pyrowave_encoder_set_stats_enabled(encoder, true));
+
+	std::vector<uint8_t> luma(Width * Height);
+	std::vector<uint8_t> cb(Width * Height / 4);
+	std::vector<uint8_t> cr(Width * Height / 4);
+
+	// Full range noise has no energy compaction, so nearly every coefficient costs bits.
+	uint32_t seed = 1;
+	for (auto *plane : { &luma, &cb, &cr })
+	{
+		for (auto &v : *plane)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			v = uint8_t(seed >> 24);
+		}
+	}
+
+	pyrowave_cpu_buffer buffer = {};
+	buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	buffer.row_stride_in_bytes[0] = Width;
+	buffer.row_stride_in_bytes[1] = Width / 2;
+	buffer.row_stride_in_bytes[2] = Width / 2;
+	buffer.plane_size_in_bytes[0] = luma.size();
+	buffer.plane_size_in_bytes[1] = cb.size();
+	buffer.plane_size_in_bytes[2] = cr.size();
+	buffer.data[0] = luma.data();
+	buffer.data[1] = cb.data();
+	buffer.data[2] = cr.data();
+	buffer.width = Width;
+	buffer.height = Height;
+
+	CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control));
+	pyrowave_frame_stats overflow_stats = {};
+	CHECKED(pyrowave_encoder_get_frame_stats(encoder, 0, &overflow_stats));
+	ASSERT_THAT(overflow_stats.has_rate_control_stats);
+	ASSERT_THAT(overflow_stats.payload_overflow_bytes != 0);
+	ASSERT_THAT(overflow_stats.total_bytes <= rate_control.maximum_bitstream_size);
+
+	// Even noise at a tiny rate target must fit without a budget.
+	CHECKED(pyrowave_encoder_encode_cpu_synchronous(reference, &buffer, &rate_control));
+	pyrowave_frame_stats stats = {};
+	CHECKED(pyrowave_encoder_get_frame_stats(reference, 0, &stats));
+	ASSERT_THAT(stats.has_rate_control_stats);
+	ASSERT_THAT(stats.payload_overflow_bytes == 0);
+
+	// Dropped blocks must not look free to rate control.
+	ASSERT_THAT(sum_distortion(overflow_stats) > sum_distortion(stats));
+
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_encoder_destroy(reference);
+	pyrowave_device_destroy(device);
+}
+
+static uint64_t wait_for_idle_memory(pyrowave_resource_pool pool, uint64_t previous)
+{
+	// Returned resources only become idle once the GPU has retired the work submitted before them.
+	uint64_t size = pyrowave_resource_pool_get_idle_memory_size(pool);
+	for (int i = 0; i < 1000 && size <= previous; i++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		size = pyrowave_resource_pool_get_idle_memory_size(pool);
+	}
+	return size;
+}
+
+static void test_resource_pool()
+{
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+
+	constexpr int Width = 640;
+	constexpr int Height = 480;
+
+	pyrowave_resource_pool pool;
+	CHECKED(pyrowave_resource_pool_create(device, &pool));
+	ASSERT_THAT(pyrowave_resource_pool_get_idle_memory_size(pool) == 0);
+
+	std::vector<uint8_t> planes[3];
+	planes[0].resize(Width * Height);
+	planes[1].resize(Width * Height / 4);
+	planes[2].resize(Width * Height / 4);
+	for (int y = 0; y < Height; y++)
+		for (int x = 0; x < Width; x++)
+			planes[0][y * Width + x] = uint8_t(3 * x + 5 * y);
+	for (int y = 0; y < Height / 2; y++)
+	{
+		for (int x = 0; x < Width / 2; x++)
+		{
+			planes[1][y * Width / 2 + x] = uint8_t(7 * x + 3 * y);
+			planes[2][y * Width / 2 + x] = uint8_t(3 * x + 5 * y);
+		}
+	}
+
+	pyrowave_cpu_buffer buffer = {};
+	buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	buffer.width = Width;
+	buffer.height = Height;
+	for (int i = 0; i < 3; i++)
+	{
+		buffer.row_stride_in_bytes[i] = i ? Width / 2 : Width;
+		buffer.plane_size_in_bytes[i] = planes[i].size();
+		buffer.data[i] = planes[i].data();
+	}
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+	encoder_info.pool = pool;
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = device;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+	decoder_info.pool = pool;
+
+	const auto roundtrip = [&](std::vector<uint8_t> (&decoded)[3]) {
+		pyrowave_encoder encoder;
+		pyrowave_decoder decoder;
+		CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+		CHECKED(pyrowave_decoder_create(&decoder_info, &decoder));
+
+		const pyrowave_rate_control rate_control = { 64 * 1024 };
+		CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control));
+
+		std::vector<uint8_t> bitstream(rate_control.maximum_bitstream_size);
+		pyrowave_packet packet = {};
+		size_t num_packets;
+		CHECKED(pyrowave_encoder_packetize(encoder, &packet, bitstream.size(), &num_packets,
+		                                   bitstream.data(), bitstream.size()));
+		ASSERT_THAT(num_packets == 1);
+		CHECKED(pyrowave_decoder_push_packet(decoder, bitstream.data() + packet.offset, packet.size));
+
+		pyrowave_cpu_buffer decode_buffer = buffer;
+		for (int i = 0; i < 3; i++)
+		{
+			decoded[i].resize(planes[i].size());
+			decode_buffer.data[i] = decoded[i].data();
+		}
+		CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoder, &decode_buffer));
+
+		pyrowave_encoder_destroy(encoder);
+		uint64_t encoder_size = wait_for_idle_memory(pool, 0);
+		ASSERT_THAT(encoder_size != 0);
+		pyrowave_decoder_destroy(decoder);
+		ASSERT_THAT(wait_for_idle_memory(pool, encoder_size) > encoder_size);
+	};
+
+	std::vector<uint8_t> reference[3], decoded[3];
+	roundtrip(reference);
+	uint64_t idle = pyrowave_resource_pool_get_idle_memory_size(pool);
+
+	// An identical session takes over what the previous one returned.
+	pyrowave_encoder encoder;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+	ASSERT_THAT(pyrowave_resource_pool_get_idle_memory_size(pool) < idle);
+	pyrowave_encoder_destroy(encoder);
+	ASSERT_THAT(wait_for_idle_memory(pool, idle - 1) == idle);
+
+	// Reused resources must produce identical results.
+	roundtrip(decoded);
+	for (int i = 0; i < 3; i++)
+		ASSERT_THAT(decoded[i] == reference[i]);
+
+	pyrowave_resource_pool_clear(pool);
+	ASSERT_THAT(pyrowave_resource_pool_get_idle_memory_size(pool) == 0);
+
+	pyrowave_resource_pool_destroy(pool);
+	pyrowave_device_destroy(device);
+}
+
+struct LayeredFrame
+{
+	std::vector<uint8_t> bitstream;
+	std::vector<pyrowave_packet> packets[2];
+	size_t layer_bytes[2];
+};
+
+static void encode_layered_frame(pyrowave_encoder encoder, const pyrowave_cpu_buffer &buffer,
+                                 const pyrowave_rate_control &rate_control, LayeredFrame &frame)
+{
+	CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control));
+
+	size_t num_packets;
+	CHECKED(pyrowave_encoder_compute_num_packets(encoder, 1024, &num_packets));
+	std::vector<pyrowave_packet> packets(num_packets);
+	frame.bitstream.resize(rate_control.maximum_bitstream_size);
+	CHECKED(pyrowave_encoder_packetize(encoder, packets.data(), 1024, &num_packets,
+	                                   frame.bitstream.data(), frame.bitstream.size()));
+
+	for (int layer = 0; layer < 2; layer++)
+	{
+		frame.packets[layer].clear();
+		frame.layer_bytes[layer] = 0;
+	}
+
+	for (auto &packet : packets)
+	{
+		int layer = pyrowave_get_packet_layer(frame.bitstream.data() + packet.offset, packet.size);
+		ASSERT_THAT(layer == 0 || layer == 1);
+		frame.packets[layer].push_back(packet);
+		frame.layer_bytes[layer] += packet.size;
+	}
+}
+
+static void test_snr_layers()
+{
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+
+	constexpr int Width = 640;
+	constexpr int Height = 480;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+	encoder_info.enhancement_planes = PYROWAVE_MAX_ENHANCEMENT_PLANES + 1;
+
+	pyrowave_encoder encoder;
+	ASSERT_THAT(pyrowave_encoder_create(&encoder_info, &encoder) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	encoder_info.enhancement_planes = 2;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = device;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+
+	pyrowave_decoder base_decoder, full_decoder;
+	CHECKED(pyrowave_decoder_create(&decoder_info, &base_decoder));
+	CHECKED(pyrowave_decoder_create(&decoder_info, &full_decoder));
+	pyrowave_decoder_set_num_layers(base_decoder, 1);
+
+	std::vector<uint8_t> planes[3];
+	planes[0].resize(Width * Height);
+	planes[1].resize(Width * Height / 4);
+	planes[2].resize(Width * Height / 4);
+
+	// Noise makes the lowest planes expensive, so the enhancement layer has something to carry.
+	uint32_t seed = 1;
+	for (int y = 0; y < Height; y++)
+	{
+		for (int x = 0; x < Width; x++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			planes[0][y * Width + x] = uint8_t(3 * x + 5 * y + (seed >> 27));
+		}
+	}
+
+	for (int y = 0; y < Height / 2; y++)
+	{
+		for (int x = 0; x < Width / 2; x++)
+		{
+			planes[1][y * Width / 2 + x] = uint8_t(7 * x + 3 * y);
+			planes[2][y * Width / 2 + x] = uint8_t(3 * x + 5 * y);
+		}
+	}
+
+	pyrowave_cpu_buffer buffer = {};
+	buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	buffer.width = Width;
+	buffer.height = Height;
+	for (int i = 0; i < 3; i++)
+	{
+		buffer.row_stride_in_bytes[i] = i ? Width / 2 : Width;
+		buffer.plane_size_in_bytes[i] = planes[i].size();
+		buffer.data[i] = planes[i].data();
+	}
+
+	pyrowave_rate_control rate_control = { 200000, 200004 };
+	ASSERT_THAT(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control) ==
+	            PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	// Without a base layer bound, the base layer is whatever the plane split leaves it.
+	LayeredFrame frame;
+	rate_control.maximum_base_layer_size = 0;
+	encode_layered_frame(encoder, buffer, rate_control, frame);
+	ASSERT_THAT(!frame.packets[0].empty() && !frame.packets[1].empty());
+	ASSERT_THAT(frame.layer_bytes[0] + frame.layer_bytes[1] <= rate_control.maximum_bitstream_size);
+
+	rate_control.maximum_base_layer_size = frame.layer_bytes[0] / 2;
+	encode_layered_frame(encoder, buffer, rate_control, frame);
+	ASSERT_THAT(frame.layer_bytes[0] <= rate_control.maximum_base_layer_size);
+	ASSERT_THAT(frame.layer_bytes[0] + frame.layer_bytes[1] <= rate_control.maximum_bitstream_size);
+
+	// A relay which only forwards the base layer.
+	for (auto &packet : frame.packets[0])
+	{
+		CHECKED(pyrowave_decoder_push_packet(base_decoder, frame.bitstream.data() + packet.offset, packet.size));
+		CHECKED(pyrowave_decoder_push_packet(full_decoder, frame.bitstream.data() + packet.offset, packet.size));
+	}
+
+	ASSERT_THAT(pyrowave_decoder_decode_is_ready(base_decoder, false));
+	ASSERT_THAT(!pyrowave_decoder_decode_is_ready(full_decoder, false));
+
+	for (auto &packet : frame.packets[1])
+		CHECKED(pyrowave_decoder_push_packet(full_decoder, frame.bitstream.data() + packet.offset, packet.size));
+	ASSERT_THAT(pyrowave_decoder_decode_is_ready(full_decoder, false));
+
+	std::vector<uint8_t> decoded[2][3];
+	double error[2] = {};
+	pyrowave_decoder decoders[2] = { base_decoder, full_decoder };
+	for (int layers = 0; layers < 2; layers++)
+	{
+		pyrowave_cpu_buffer decode_buffer = buffer;
+		for (int i = 0; i < 3; i++)
+		{
+			decoded[layers][i].resize(planes[i].size());
+			decode_buffer.data[i] = decoded[layers][i].data();
+		}
+		CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoders[layers], &decode_buffer));
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (size_t j = 0; j < planes[i].size(); j++)
+			{
+				double d = double(planes[i][j]) - double(decoded[layers][i][j]);
+				error[layers] += d * d;
+			}
+		}
+	}
+
+	// The enhancement layer must improve PSNR, and the base layer alone must still be a usable frame.
+	double signal = 255.0 * 255.0 * (Width * Height * 3 / 2);
+	ASSERT_THAT(error[1] < error[0]);
+	ASSERT_THAT(signal / error[0] > 100.0);
+
+	pyrowave_decoder_destroy(full_decoder);
+	pyrowave_decoder_destroy(base_decoder);
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_device_destroy(device);
+}
+
+struct SliceBitstream
+{
+	std::vector<uint8_t> bitstream;
+	std::vector<pyrowave_packet> packets;
+};
+
+static void push_slice(pyrowave_decoder decoder, const SliceBitstream &slice, bool reverse)
+{
+	for (size_t i = 0; i < slice.packets.size(); i++)
+	{
+		auto &packet = slice.packets[reverse ? slice.packets.size() - 1 - i : i];
+		CHECKED(pyrowave_decoder_push_packet(decoder, slice.bitstream.data() + packet.offset, packet.size));
+	}
+}
+
+static void test_slices()
+{
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+
+	constexpr int Width = 640;
+	constexpr int Height = 480;
+	constexpr int SliceHeight = 160;
+	constexpr int NumSlices = Height / SliceHeight;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+	encoder_info.slice_height = SliceHeight;
+
+	pyrowave_encoder encoder;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = device;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+	decoder_info.slice_height = SliceHeight;
+
+	pyrowave_decoder in_order_decoder, shuffled_decoder;
+	CHECKED(pyrowave_decoder_create(&decoder_info, &in_order_decoder));
+	CHECKED(pyrowave_decoder_create(&decoder_info, &shuffled_decoder));
+
+	std::vector<uint8_t> planes[3];
+	planes[0].resize(Width * Height);
+	planes[1].resize(Width * Height / 4);
+	planes[2].resize(Width * Height / 4);
+
+	for (int y = 0; y < Height; y++)
+		for (int x = 0; x < Width; x++)
+			planes[0][y * Width + x] = uint8_t(3 * x + 5 * y);
+
+	for (int y = 0; y < Height / 2; y++)
+	{
+		for (int x = 0; x < Width / 2; x++)
+		{
+			planes[1][y * Width / 2 + x] = uint8_t(7 * x + 3 * y);
+			planes[2][y * Width / 2 + x] = uint8_t(3 * x + 5 * y);
+		}
+	}
+
+	pyrowave_cpu_buffer buffer = {};
+	buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	buffer.width = Width;
+	buffer.height = Height;
+	for (int i = 0; i < 3; i++)
+	{
+		buffer.row_stride_in_bytes[i] = i ? Width / 2 : Width;
+		buffer.plane_size_in_bytes[i] = planes[i].size();
+		buffer.data[i] = planes[i].data();
+	}
+
+	const pyrowave_rate_control rate_control = { 100000, 0 };
+	ASSERT_THAT(pyrowave_encoder_encode_cpu_synchronous(encoder, &buffer, &rate_control) ==
+	            PYROWAVE_ERROR_INVALID_ARGUMENT);
+	ASSERT_THAT(pyrowave_encoder_encode_slice_cpu_synchronous(encoder, &buffer, NumSlices, &rate_control) ==
+	            PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	SliceBitstream slices[NumSlices];
+	for (int i = 0; i < NumSlices; i++)
+	{
+		CHECKED(pyrowave_encoder_encode_slice_cpu_synchronous(encoder, &buffer, i, &rate_control));
+
+		size_t num_packets;
+		CHECKED(pyrowave_encoder_compute_num_packets(encoder, 1024, &num_packets));
+		slices[i].packets.resize(num_packets);
+		slices[i].bitstream.resize(rate_control.maximum_bitstream_size);
+		CHECKED(pyrowave_encoder_packetize(encoder, slices[i].packets.data(), 1024, &num_packets,
+		                                   slices[i].bitstream.data(), slices[i].bitstream.size()));
+		slices[i].packets.resize(num_packets);
+	}
+
+	for (auto &slice : slices)
+		push_slice(in_order_decoder, slice, false);
+	ASSERT_THAT(pyrowave_decoder_decode_is_ready(in_order_decoder, false));
+
+	// Slices arrive bottom up, and the start of frame of every slice arrives last.
+	// Earlier slices of the frame must not be thrown away by later ones.
+	for (int i = NumSlices - 1; i >= 0; i--)
+	{
+		push_slice(shuffled_decoder, slices[i], true);
+		for (int j = 0; j < NumSlices; j++)
+			ASSERT_THAT(pyrowave_decoder_decode_slice_is_ready(shuffled_decoder, j, false) == (j >= i));
+		ASSERT_THAT(pyrowave_decoder_decode_is_ready(shuffled_decoder, false) == (i == 0));
+	}
+
+	std::vector<uint8_t> decoded[2][3];
+	pyrowave_decoder decoders[2] = { in_order_decoder, shuffled_decoder };
+	for (int d = 0; d < 2; d++)
+	{
+		pyrowave_cpu_buffer decode_buffer = buffer;
+		for (int i = 0; i < 3; i++)
+		{
+			decoded[d][i].resize(planes[i].size());
+			decode_buffer.data[i] = decoded[d][i].data();
+		}
+		CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoders[d], &decode_buffer));
+	}
+
+	// A slice is not ready again once the full frame has been decoded.
+	ASSERT_THAT(!pyrowave_decoder_decode_slice_is_ready(shuffled_decoder, 0, false));
+
+	double error = 0.0;
+	for (int i = 0; i < 3; i++)
+	{
+		ASSERT_THAT(decoded[0][i] == decoded[1][i]);
+		for (size_t j = 0; j < planes[i].size(); j++)
+		{
+			double d = double(planes[i][j]) - double(decoded[0][i][j]);
+			error += d * d;
+		}
+	}
+
+	// Every slice must land on its own rows.
+	double signal = 255.0 * 255.0 * (Width * Height * 3 / 2);
+	ASSERT_THAT(signal / error > 1000.0);
+
+	pyrowave_decoder_destroy(shuffled_decoder);
+	pyrowave_decoder_destroy(in_order_decoder);
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_device_destroy(device);
+}
+
+static void test_rgb_encode()
+{
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+
+	constexpr int Width = 640;
+	constexpr int Height = 480;
+
+	pyrowave_encoder_create_info encoder_info = {};
+	encoder_info.device = device;
+	encoder_info.width = Width;
+	encoder_info.height = Height;
+
+	pyrowave_encoder encoder;
+	CHECKED(pyrowave_encoder_create(&encoder_info, &encoder));
+
+	pyrowave_decoder_create_info decoder_info = {};
+	decoder_info.device = device;
+	decoder_info.width = Width;
+	decoder_info.height = Height;
+
+	pyrowave_decoder decoder;
+	CHECKED(pyrowave_decoder_create(&decoder_info, &decoder));
+
+	std::vector<uint8_t> rgba(Width * Height * 4);
+	for (int y = 0; y < Height; y++)
+	{
+		for (int x = 0; x < Width; x++)
+		{
+			uint8_t *texel = &rgba[(y * Width + x) * 4];
+			texel[0] = uint8_t(x * 255 / Width);
+			texel[1] = uint8_t(y * 255 / Height);
+			texel[2] = uint8_t(255 - (x + y) * 255 / (Width + Height));
+			texel[3] = 0;
+		}
+	}
+
+	// Reference conversion, BT.709 full range with centered chroma,
+	// which is what a separate conversion pass in front of the encoder would produce.
+	const auto to_ycbcr = [](const float *rgb, float *ycbcr) {
+		float y = 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+		ycbcr[0] = y;
+		ycbcr[1] = (rgb[2] - y) / 1.8556f + 128.0f;
+		ycbcr[2] = (rgb[0] - y) / 1.5748f + 128.0f;
+	};
+
+	std::vector<uint8_t> planes[3];
+	planes[0].resize(Width * Height);
+	planes[1].resize(Width * Height / 4);
+	planes[2].resize(Width * Height / 4);
+
+	for (int y = 0; y < Height; y++)
+	{
+		for (int x = 0; x < Width; x++)
+		{
+			const uint8_t *texel = &rgba[(y * Width + x) * 4];
+			float rgb[3] = { float(texel[0]), float(texel[1]), float(texel[2]) };
+			float ycbcr[3];
+			to_ycbcr(rgb, ycbcr);
+			planes[0][y * Width + x] = uint8_t(ycbcr[0] + 0.5f);
+		}
+	}
+
+	for (int y = 0; y < Height / 2; y++)
+	{
+		for (int x = 0; x < Width / 2; x++)
+		{
+			float rgb[3] = {};
+			for (int c = 0; c < 3; c++)
+				for (int i = 0; i < 4; i++)
+					rgb[c] += 0.25f * float(rgba[((2 * y + (i >> 1)) * Width + 2 * x + (i & 1)) * 4 + c]);
+
+			float ycbcr[3];
+			to_ycbcr(rgb, ycbcr);
+			planes[1][y * Width / 2 + x] = uint8_t(ycbcr[1] + 0.5f);
+			planes[2][y * Width / 2 + x] = uint8_t(ycbcr[2] + 0.5f);
+		}
+	}
+
+	pyrowave_cpu_buffer yuv_buffer = {};
+	yuv_buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_YUV420P;
+	yuv_buffer.width = Width;
+	yuv_buffer.height = Height;
+	for (int i = 0; i < 3; i++)
+	{
+		yuv_buffer.row_stride_in_bytes[i] = i ? Width / 2 : Width;
+		yuv_buffer.plane_size_in_bytes[i] = planes[i].size();
+		yuv_buffer.data[i] = planes[i].data();
+	}
+
+	pyrowave_cpu_buffer rgb_buffer = {};
+	rgb_buffer.format = PYROWAVE_CPU_BUFFER_FORMAT_RGBA8;
+	rgb_buffer.width = Width;
+	rgb_buffer.height = Height;
+	rgb_buffer.row_stride_in_bytes[0] = Width * 4;
+	rgb_buffer.plane_size_in_bytes[0] = rgba.size();
+	rgb_buffer.data[0] = rgba.data();
+
+	pyrowave_color_conversion conversion = {};
+	conversion.transform = PYROWAVE_YCBCR_TRANSFORM_BT709;
+	conversion.range = PYROWAVE_YCBCR_RANGE_FULL;
+	conversion.siting = PYROWAVE_CHROMA_SITING_CENTER;
+
+	const pyrowave_rate_control rate_control = { 400000, 0 };
+	ASSERT_THAT(pyrowave_encoder_encode_rgb_cpu_synchronous(encoder, &yuv_buffer, &conversion, &rate_control) ==
+	            PYROWAVE_ERROR_INVALID_ARGUMENT);
+	ASSERT_THAT(pyrowave_encoder_encode_cpu_synchronous(encoder, &rgb_buffer, &rate_control) ==
+	            PYROWAVE_ERROR_INVALID_ARGUMENT);
+
+	std::vector<uint8_t> decoded[2][3];
+	std::vector<uint8_t> bitstream(rate_control.maximum_bitstream_size);
+
+	for (int rgb = 0; rgb < 2; rgb++)
+	{
+		if (rgb)
+			CHECKED(pyrowave_encoder_encode_rgb_cpu_synchronous(encoder, &rgb_buffer, &conversion, &rate_control));
+		else
+			CHECKED(pyrowave_encoder_encode_cpu_synchronous(encoder, &yuv_buffer, &rate_control));
+
+		size_t num_packets;
+		CHECKED(pyrowave_encoder_compute_num_packets(encoder, 1024, &num_packets));
+		std::vector<pyrowave_packet> packets(num_packets);
+		CHECKED(pyrowave_encoder_packetize(encoder, packets.data(), 1024, &num_packets,
+		                                   bitstream.data(), bitstream.size()));
+
+		for (size_t i = 0; i < num_packets; i++)
+			CHECKED(pyrowave_decoder_push_packet(decoder, bitstream.data() + packets[i].offset, packets[i].size));
+		ASSERT_THAT(pyrowave_decoder_decode_is_ready(decoder, false));
+
+		pyrowave_cpu_buffer decode_buffer = yuv_buffer;
+		for (int i = 0; i < 3; i++)
+		{
+			decoded[rgb][i].resize(planes[i].size());
+			decode_buffer.data[i] = decoded[rgb][i].data();
+		}
+		CHECKED(pyrowave_decoder_decode_cpu_buffer_synchronous(decoder, &decode_buffer));
+	}
+
+	// The fused path converts in float and skips the 8-bit rounding of the planes,
+	// so it only has to match the separate conversion closely, not exactly.
+	for (int i = 0; i < 3; i++)
+	{
+		double error = 0.0;
+		for (size_t j = 0; j < planes[i].size(); j++)
+		{
+			double d = double(decoded[0][i][j]) - double(decoded[1][i][j]);
+			error += d * d;
+		}
+
+		double signal = 255.0 * 255.0 * double(planes[i].size());
+		ASSERT_THAT(error == 0.0 || signal / error > 10000.0);
+	}
+
+	pyrowave_decoder_destroy(decoder);
+	pyrowave_encoder_destroy(encoder);
+	pyrowave_device_destroy(device);
+}
+
+static void test_memory_requirements()
+{
+	pyrowave_encoder_create_info enc_info = {};
+	enc_info.width = 1280;
+	enc_info.height = 720;
+
+	// Does not need a device.
+	pyrowave_memory_requirements small = {}, large = {};
+	pyrowave_rate_control rate = {};
+	rate.maximum_bitstream_size = 100000;
+	CHECKED(pyrowave_encoder_query_memory_requirements(&enc_info, &rate, &small));
+	ASSERT_THAT(small.device_local_size != 0);
+	ASSERT_THAT(small.host_visible_size >= rate.maximum_bitstream_size);
+
+	rate.maximum_bitstream_size = 1000000;
+	CHECKED(pyrowave_encoder_query_memory_requirements(&enc_info, &rate, &large));
+	ASSERT_THAT(large.device_local_size > small.device_local_size);
+	ASSERT_THAT(large.host_visible_size > small.host_visible_size);
+
+	CHECKED(pyrowave_encoder_query_memory_requirements(&enc_info, nullptr, &large));
+	ASSERT_THAT(large.device_local_size > small.device_local_size);
+
+	enc_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_444;
+	CHECKED(pyrowave_encoder_query_memory_requirements(&enc_info, nullptr, &small));
+	ASSERT_THAT(small.device_local_size > large.device_local_size);
+	enc_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_420;
+
+	enc_info.width = 0;
+	ASSERT_THAT(pyrowave_encoder_query_memory_requirements(&enc_info, nullptr, &small) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	enc_info.width = 1280;
+
+	pyrowave_decoder_create_info dec_info = {};
+	dec_info.width = 1280;
+	dec_info.height = 720;
+	CHECKED(pyrowave_decoder_query_memory_requirements(&dec_info, &small));
+	ASSERT_THAT(small.device_local_size != 0);
+	ASSERT_THAT(small.host_visible_size == 0);
+
+	dec_info.fragment_path = true;
+	dec_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_422;
+	ASSERT_THAT(pyrowave_decoder_query_memory_requirements(&dec_info, &small) == PYROWAVE_ERROR_INVALID_ARGUMENT);
+	dec_info.fragment_path = false;
+	dec_info.chroma = PYROWAVE_CHROMA_SUBSAMPLING_420;
+
+	pyrowave_device device;
+	CHECKED(pyrowave_create_default_device(&device));
+	enc_info.device = device;
+	dec_info.device = device;
+
+	// A budget which cannot hold the fixed resources fails, one which matches the query does not.
+	pyrowave_encoder encoder;
+	enc_info.memory_budget = 1024;
+	ASSERT_THAT(pyrowave_encoder_create(&enc_info, &encoder) == PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY);
+	rate.maximum_bitstream_size = 100000;
+	CHECKED(pyrowave_encoder_query_memory_requirements(&enc_info, &rate, &small));
+	enc_info.memory_budget = small.device_local_size;
+	CHECKED(pyrowave_encoder_create(&enc_info, &encoder));
+	pyrowave_encoder_destroy(encoder);
+
+	pyrowave_decoder decoder;
+	dec_info.memory_budget = 1024;
+	ASSERT_THAT(pyrowave_decoder_create(&dec_info, &decoder) == PYROWAVE_ERROR_OUT_OF_DEVICE_MEMORY);
+	CHECKED(pyrowave_decoder_query_memory_requirements(&dec_info, &small));
+	dec_info.memory_budget = small.device_local_size;
+	CHECKED(pyrowave_decoder_create(&dec_info, &decoder));
+	pyrowave_decoder_destroy(decoder);
+
+	pyrowave_device_destroy(device);
+}
+
+static void test_timing_histogram()
+{
+	pyrowave_timing_histogram hist = {};
+	ASSERT_THAT(pyrowave_timing_histogram_percentile_ns(&hist, 0.5) == 0);
+
+	// Bucket bounds must be strictly increasing.
+	for (uint32_t i = 1; i < PYROWAVE_TIMING_HISTOGRAM_BUCKETS; i++)
+		ASSERT_THAT(pyrowave_timing_histogram_bucket_upper_bound_ns(i) > pyrowave_timing_histogram_bucket_upper_bound_ns(i - 1));
+
+	hist.buckets[10] = 99;
+	hist.buckets[20] = 1;
+	hist.count = 100;
+	ASSERT_THAT(pyrowave_timing_histogram_percentile_ns(&hist, 0.5) == pyrowave_timing_histogram_bucket_upper_bound_ns(10));
+	ASSERT_THAT(pyrowave_timing_histogram_percentile_ns(&hist, 0.99) == pyrowave_timing_histogram_bucket_upper_bound_ns(10));
+	ASSERT_THAT(pyrowave_timing_histogram_percentile_ns(&hist, 1.0) == pyrowave_timing_histogram_bucket_upper_bound_ns(20));
+}
+
+static void test_timing_samples_recorded()
+{
+	// Samples are only recorded if built with instrumentation.
+	pyrowave_timing_histogram hist = {};
+	for (int i = 0; i < PYROWAVE_TIMING_EVENT_COUNT; i++)
+	{
+		CHECKED(pyrowave_get_timing_histogram(pyrowave_timing_event(i), &hist, true));
+		ASSERT_THAT(hist.count != 0);
+	}
+
+	CHECKED(pyrowave_get_timing_histogram(PYROWAVE_TIMING_EVENT_PACKETIZE, &hist, false));
+	ASSERT_THAT(hist.count == 0);
+	pyrowave_set_timing_enabled(false);
+}
+
+int main()
+{
+	bool timing = pyrowave_set_timing_enabled(true);
+
+	printf("Running system stability test ...\n");
+	test_basic_system_stability();
+
+	// Correctness tests for small-ish outputs.
+	for (int variant = 0; variant < 12; variant++)
+	{
+		printf("Running roundtrip variant %d test ...\n", variant);
+		test_basic_encoder_roundtrip(
+			(variant & 1) != 0, (variant & 2) != 0, pyrowave_chroma_subsampling(variant >> 2));
+	}
+
+	for (int levels = PYROWAVE_MIN_DECOMPOSITION_LEVELS; levels <= PYROWAVE_MAX_DECOMPOSITION_LEVELS; levels++)
+	{
+		printf("Running roundtrip test with %d decomposition levels ...\n", levels);
+		test_basic_encoder_roundtrip(false, false, PYROWAVE_CHROMA_SUBSAMPLING_420, levels);
+		test_basic_encoder_roundtrip(false, false, PYROWAVE_CHROMA_SUBSAMPLING_444, levels);
+		test_basic_encoder_roundtrip(false, false, PYROWAVE_CHROMA_SUBSAMPLING_422, levels);
+	}
+
+	printf("Running reversible roundtrip tests ...\n");
+	for (int variant = 0; variant < 6; variant++)
+	{
+		test_basic_encoder_roundtrip(false, (variant & 1) != 0, pyrowave_chroma_subsampling(variant >> 1),
+		                             0, PYROWAVE_WAVELET_TRANSFORM_LEGALL53);
+	}
+
+	printf("Running 16-bit roundtrip tests ...\n");
+	test_16bit_roundtrip(PYROWAVE_CPU_BUFFER_FORMAT_P010);
+	test_16bit_roundtrip(PYROWAVE_CPU_BUFFER_FORMAT_P016);
+	test_16bit_roundtrip(PYROWAVE_CPU_BUFFER_FORMAT_YUV420P16);
+	test_16bit_roundtrip(PYROWAVE_CPU_BUFFER_FORMAT_YUV444P16);
+	test_16bit_roundtrip(PYROWAVE_CPU_BUFFER_FORMAT_YUV422P16);
+	test_16bit_roundtrip(PYROWAVE_CPU_BUFFER_FORMAT_P210);
+
+	printf("Running concurrent push_packet test ...\n");
+	test_concurrent_push_packet();
+
+	printf("Running payload overflow test ...\n");
+	test_payload_overflow();
+
+	printf("Running SNR layer test ...\n");
+	test_snr_layers();
+
+	printf("Running slice test ...\n");
+	test_slices();
+
+	printf("Running RGB encode test ...\n");
+	test_rgb_encode();
+
+	printf("Running timing instrumentation tests ...\n");
+	test_timing_histogram();
+	if (timing)
+		test_timing_samples_recorded();
+
+	// Validate that we handle error inputs gracefully.
+	printf("Running error handling tests ...\n");
+	test_decode_cpu_buffer_validation(false);
+	test_decode_cpu_buffer_validation(true);
+	test_encode_cpu_buffer_validation(false);
+	test_encode_cpu_buffer_validation(true);
+	test_encoder_create_validation();
+	test_decoder_create_validation();
+
+	printf("Running memory requirements test ...\n");
+	test_memory_requirements();
+
+	printf("Running resource pool test ...\n");
+	test_resource_pool();
 
 	printf("Passed all tests :)\n");
 }
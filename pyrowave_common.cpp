@@ -1,6 +1,8 @@
 // Copyright (c) 2025 Hans-Kristian Arntzen
 // SPDX-License-Identifier: MIT
 #include "pyrowave_common.hpp"
+#include <algorithm>
+#include <string.h>
 
 #if PYROWAVE_PRECISION < 0 || PYROWAVE_PRECISION > 2
 #error "PYROWAVE_PRECISION must be in range [0, 2]."
@@ -24,6 +26,18 @@ Configuration::Configuration()
 		precision = PYROWAVE_PRECISION;
 	}
 
+	if (const char *env = getenv("PYROWAVE_PAYLOAD_PATH"))
+	{
+		if (strcmp(env, "ssbo") == 0)
+			payload_path = PayloadPath::StorageBuffer;
+		else if (strcmp(env, "texel") == 0)
+			payload_path = PayloadPath::TexelBuffer;
+		else if (strcmp(env, "linear") == 0)
+			payload_path = PayloadPath::LinearImage;
+		else if (strcmp(env, "auto") != 0)
+			fprintf(stderr, "pyrowave: unknown payload path \"%s\", expected auto, ssbo, texel or linear.\n", env);
+	}
+
 	LOGI("Selection precision level: %d\n", precision);
 }
 
@@ -38,6 +52,27 @@ int Configuration::get_precision() const
 	return precision;
 }
 
+void Configuration::set_precision(int precision_)
+{
+	if (precision_ < 0 || precision_ > 2)
+	{
+		LOGE("Precision must be in range [0, 2].\n");
+		return;
+	}
+
+	precision = precision_;
+}
+
+PayloadPath Configuration::get_payload_path() const
+{
+	return payload_path;
+}
+
+void Configuration::set_payload_path(PayloadPath path)
+{
+	payload_path = path;
+}
+
 void WaveletBuffers::init_samplers()
 {
 	SamplerCreateInfo samp = {};
@@ -49,6 +84,13 @@ void WaveletBuffers::init_samplers()
 	samp.mipmap_mode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
 	mirror_repeat_sampler = device->create_sampler(samp);
 
+	// For filtering RGB input down to chroma resolution in the encoder.
+	samp.min_filter = VK_FILTER_LINEAR;
+	samp.mag_filter = VK_FILTER_LINEAR;
+	linear_mirror_repeat_sampler = device->create_sampler(samp);
+	samp.min_filter = VK_FILTER_NEAREST;
+	samp.mag_filter = VK_FILTER_NEAREST;
+
 	samp.address_mode_u = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
 	samp.address_mode_v = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
 	samp.address_mode_w = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
@@ -58,44 +100,22 @@ void WaveletBuffers::init_samplers()
 
 void WaveletBuffers::allocate_images_fragment()
 {
-	auto format = Configuration::get().get_precision() == 2 ?
-	              VK_FORMAT_R32_SFLOAT : VK_FORMAT_R16_SFLOAT;
-	auto vert_chroma_format = Configuration::get().get_precision() == 2 ?
-	                          VK_FORMAT_R32G32_SFLOAT : VK_FORMAT_R16G16_SFLOAT;
-
-	for (int level = 0; level < DecompositionLevels; level++)
+	for (int level = 0; level < decomposition_levels; level++)
 	{
-		uint32_t horiz_output_width = aligned_width >> (level + 1);
-		uint32_t horiz_output_height = aligned_height >> (level + 1);
-		uint32_t vert_input_width = horiz_output_width;
-		uint32_t vert_input_height = horiz_output_height * 2;
-
-		auto info = ImageCreateInfo::render_target(horiz_output_width, horiz_output_height, format);
-		info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
-		info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-
 		char label[64];
 		for (int comp = 0; comp < 3; comp++)
 		{
-			info.width = horiz_output_width;
-			info.height = horiz_output_height;
-			info.format = format;
-			fragment.levels[level].horiz[comp] = device->create_image(info);
+			auto info = get_fragment_image_info(level, comp, false);
 			snprintf(label, sizeof(label), "Horiz Output (level %u, comp %u)", level, comp);
-			device->set_name(*fragment.levels[level].horiz[comp], label);
+			fragment.levels[level].horiz[comp] = create_image(info, label);
 
 			if (comp < 2)
 			{
-				info.width = vert_input_width;
-				info.height = vert_input_height;
-				info.format = comp == 0 ? format : vert_chroma_format;
-				fragment.levels[level].vert[0][comp] = device->create_image(info);
-				fragment.levels[level].vert[1][comp] = device->create_image(info);
-
+				info = get_fragment_image_info(level, comp, true);
 				snprintf(label, sizeof(label), "Vert Even Input (level %u, comp %u)", level, comp);
-				device->set_name(*fragment.levels[level].vert[0][comp], label);
+				fragment.levels[level].vert[0][comp] = create_image(info, label);
 				snprintf(label, sizeof(label), "Vert Odd Input (level %u, comp %u)", level, comp);
-				device->set_name(*fragment.levels[level].vert[1][comp], label);
+				fragment.levels[level].vert[1][comp] = create_image(info, label);
 			}
 		}
 
@@ -110,7 +130,7 @@ void WaveletBuffers::allocate_images_fragment()
 				view_info.levels = 1;
 				view_info.layers = 1;
 
-				if (band == 0 && level < DecompositionLevels - 1)
+				if (band == 0 && level < decomposition_levels - 1)
 				{
 					view_info.image = fragment.levels[level].horiz[comp].get();
 					view_info.base_level = 0;
@@ -130,7 +150,30 @@ void WaveletBuffers::allocate_images_fragment()
 	}
 }
 
-void WaveletBuffers::allocate_images()
+ImageCreateInfo WaveletBuffers::get_fragment_image_info(int level, int component, bool vert) const
+{
+	auto format = Configuration::get().get_precision() == 2 ?
+	              VK_FORMAT_R32_SFLOAT : VK_FORMAT_R16_SFLOAT;
+	auto vert_chroma_format = Configuration::get().get_precision() == 2 ?
+	                          VK_FORMAT_R32G32_SFLOAT : VK_FORMAT_R16G16_SFLOAT;
+
+	uint32_t horiz_output_width = aligned_width >> (level + 1);
+	uint32_t horiz_output_height = aligned_height >> (level + 1);
+
+	auto info = ImageCreateInfo::render_target(horiz_output_width, horiz_output_height, format);
+	info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	if (vert)
+	{
+		info.height = horiz_output_height * 2;
+		info.format = component == 0 ? format : vert_chroma_format;
+	}
+
+	return info;
+}
+
+ImageCreateInfo WaveletBuffers::get_wavelet_image_info(bool low_res) const
 {
 	auto info = ImageCreateInfo::immutable_2d_image(
 			aligned_width / 2, aligned_height / 2,
@@ -140,23 +183,27 @@ void WaveletBuffers::allocate_images()
 	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
 	info.layers = NumFrequencyBandsPerLevel * NumComponents;
 	info.layout = ImageLayout::General;
-	info.levels = Configuration::get().get_precision() != 1 ? DecompositionLevels : WaveletFP16Levels;
-
-	wavelet_img_high_res = device->create_image(info);
-	device->set_name(*wavelet_img_high_res, "wavelet-buffer-high-res");
+	info.levels = Configuration::get().get_precision() != 1 ? decomposition_levels : WaveletFP16Levels;
 
-	if (Configuration::get().get_precision() == 1)
+	if (low_res)
 	{
 		// For the lowest level bands, we want to maintain precision as much as possible and bandwidth here is trivial.
-		info.levels = DecompositionLevels - info.levels;
+		info.levels = decomposition_levels - info.levels;
 		info.format = VK_FORMAT_R32_SFLOAT;
 		info.width >>= WaveletFP16Levels;
 		info.height >>= WaveletFP16Levels;
-		wavelet_img_low_res = device->create_image(info);
-		device->set_name(*wavelet_img_low_res, "wavelet-buffer-low-res");
 	}
 
-	for (int level = 0; level < DecompositionLevels; level++)
+	return info;
+}
+
+void WaveletBuffers::allocate_images()
+{
+	wavelet_img_high_res = create_image(get_wavelet_image_info(false), "wavelet-buffer-high-res");
+	if (Configuration::get().get_precision() == 1)
+		wavelet_img_low_res = create_image(get_wavelet_image_info(true), "wavelet-buffer-low-res");
+
+	for (int level = 0; level < decomposition_levels; level++)
 	{
 		ImageViewCreateInfo view_info = {};
 		view_info.levels = 1;
@@ -210,9 +257,30 @@ void WaveletBuffers::accumulate_block_mapping(int blocks_x_8x8, int blocks_y_8x8
 	block_count_8x8 += blocks_x_8x8 * blocks_y_8x8;
 }
 
-void WaveletBuffers::init_block_meta()
+bool WaveletBuffers::band_is_coded(int level, int component, int band) const
 {
-	for (int level = DecompositionLevels - 1; level >= 0; level--)
+	if (band == 0 && level != decomposition_levels - 1)
+		return false;
+
+	if (level == 0 && component != 0)
+	{
+		if (chroma == ChromaSubsampling::Chroma420)
+			return false;
+		else if (chroma == ChromaSubsampling::Chroma422)
+			return band == 2;
+	}
+
+	return true;
+}
+
+void WaveletBuffers::init_block_mapping()
+{
+	block_32x32_to_8x8_mapping.clear();
+	block_count_8x8 = 0;
+	block_count_32x32 = 0;
+	memset(block_meta, 0, sizeof(block_meta));
+
+	for (int level = decomposition_levels - 1; level >= 0; level--)
 	{
 		for (int component = 0; component < NumComponents; component++)
 		{
@@ -220,10 +288,14 @@ void WaveletBuffers::init_block_meta()
 			if (level == 0 && component != 0 && chroma == ChromaSubsampling::Chroma420)
 				continue;
 
-			for (int band = (level == DecompositionLevels - 1 ? 0 : 1); band < 4; band++)
+			for (int band = (level == decomposition_levels - 1 ? 0 : 1); band < 4; band++)
 			{
-				uint32_t level_width = wavelet_img_high_res->get_width(level);
-				uint32_t level_height = wavelet_img_high_res->get_height(level);
+				if (!band_is_coded(level, component, band))
+					continue;
+
+				// Same as the mip dimensions of the wavelet image.
+				uint32_t level_width = (aligned_width / 2) >> level;
+				uint32_t level_height = (aligned_height / 2) >> level;
 
 				int blocks_x_8x8 = (level_width + 7) / 8;
 				int blocks_y_8x8 = (level_height + 7) / 8;
@@ -240,18 +312,217 @@ void WaveletBuffers::init_block_meta()
 	}
 }
 
-bool WaveletBuffers::init(Device *device_, int width_, int height_, ChromaSubsampling chroma_, bool fragment_path_)
+WaveletBuffers::~WaveletBuffers()
 {
-	device = device_;
+	release_resources();
+}
+
+ImageHandle WaveletBuffers::create_image(const ImageCreateInfo &info, const char *name)
+{
+	ImageHandle image;
+	if (pool)
+		image = pool->impl->take_image(*device, info);
+	if (!image)
+		image = device->create_image(info);
+	if (!image)
+		return {};
+
+	device->set_name(*image, name);
+	pooled_images.push_back(image);
+	return image;
+}
+
+BufferHandle WaveletBuffers::create_buffer(const BufferCreateInfo &info, const char *name)
+{
+	BufferHandle buffer;
+	if (pool)
+		buffer = pool->impl->take_buffer(*device, info);
+	if (!buffer)
+		buffer = device->create_buffer(info);
+	if (!buffer)
+		return {};
+
+	device->set_name(*buffer, name);
+	pooled_buffers.push_back(buffer);
+	return buffer;
+}
+
+void WaveletBuffers::release_buffer(const Buffer *buffer)
+{
+	auto itr = std::find_if(pooled_buffers.begin(), pooled_buffers.end(),
+	                        [buffer](const BufferHandle &handle) { return handle.get() == buffer; });
+	if (itr == pooled_buffers.end())
+		return;
+
+	std::vector<ImageHandle> no_images;
+	std::vector<BufferHandle> released = { std::move(*itr) };
+	pooled_buffers.erase(itr);
+	if (pool)
+		pool->impl->give(*device, no_images, released);
+}
+
+void WaveletBuffers::release_resources()
+{
+	if (pool)
+		pool->impl->give(*device, pooled_images, pooled_buffers);
+	pooled_images.clear();
+	pooled_buffers.clear();
+}
+
+static uint32_t get_texel_size(VkFormat format)
+{
+	switch (format)
+	{
+	case VK_FORMAT_R16_SFLOAT:
+	case VK_FORMAT_R16_UNORM:
+		return 2;
+	case VK_FORMAT_R32_SFLOAT:
+	case VK_FORMAT_R16G16_SFLOAT:
+		return 4;
+	case VK_FORMAT_R32G32_SFLOAT:
+	case VK_FORMAT_R16G16B16A16_SFLOAT:
+	case VK_FORMAT_R16G16B16A16_UNORM:
+		return 8;
+	default:
+		return 4;
+	}
+}
+
+uint64_t WaveletBuffers::get_image_size(const ImageCreateInfo &info)
+{
+	uint64_t texels = 0;
+	for (unsigned level = 0; level < info.levels; level++)
+		texels += uint64_t(std::max(info.width >> level, 1u)) * std::max(info.height >> level, 1u);
+	return texels * info.layers * get_texel_size(info.format);
+}
+
+uint64_t WaveletBuffers::get_image_size(const Image *image)
+{
+	return image ? get_image_size(image->get_create_info()) : 0;
+}
+
+uint64_t WaveletBuffers::get_image_memory_size() const
+{
+	uint64_t size = get_image_size(get_wavelet_image_info(false));
+	if (Configuration::get().get_precision() == 1)
+		size += get_image_size(get_wavelet_image_info(true));
+
+	if (fragment_path)
+	{
+		for (int level = 0; level < decomposition_levels; level++)
+		{
+			for (int comp = 0; comp < NumComponents; comp++)
+			{
+				size += get_image_size(get_fragment_image_info(level, comp, false));
+				if (comp < 2)
+					size += 2 * get_image_size(get_fragment_image_info(level, comp, true));
+			}
+		}
+	}
+
+	return size;
+}
+
+int WaveletBuffers::get_slice_rows(int slice_index) const
+{
+	if (!slice_height)
+		return height;
+	return std::min<int>(slice_height, frame_height - slice_index * slice_height);
+}
+
+int WaveletBuffers::get_frame_block_count() const
+{
+	return block_count_32x32 * num_slices;
+}
+
+bool WaveletBuffers::init_layout(int width_, int height_, ChromaSubsampling chroma_, bool fragment_path_,
+                                 int decomposition_levels_, WaveletTransform transform_, int slice_height_)
+{
+	if (decomposition_levels_ < MinDecompositionLevels || decomposition_levels_ > MaxDecompositionLevels)
+	{
+		LOGE("Decomposition levels must be in range [%d, %d].\n", MinDecompositionLevels, MaxDecompositionLevels);
+		return false;
+	}
+
+	if (fragment_path_ && chroma_ == ChromaSubsampling::Chroma422)
+	{
+		LOGE("4:2:2 chroma subsampling is not supported with the fragment path.\n");
+		return false;
+	}
+
+	if (fragment_path_ && transform_ == WaveletTransform::LeGall53)
+	{
+		LOGE("The reversible transform is not supported with the fragment path.\n");
+		return false;
+	}
+
+	int alignment = 1 << decomposition_levels_;
+	// If the final decomposition band is too small, the mirroring will break since it starts double mirroring.
+	int minimum_image_size = 4 << decomposition_levels_;
+
+	// A single slice is the same as no slicing.
+	if (slice_height_ >= height_)
+		slice_height_ = 0;
+
+	if (slice_height_ != 0)
+	{
+		// Slices other than the last must not need any padding, or they would overlap.
+		if (slice_height_ < minimum_image_size || slice_height_ % alignment != 0)
+		{
+			LOGE("Slice height must be a multiple of %d, and at least %d.\n", alignment, minimum_image_size);
+			return false;
+		}
+
+		if ((height_ + slice_height_ - 1) / slice_height_ > MaxSlices)
+		{
+			LOGE("Too many slices, at most %d are supported.\n", MaxSlices);
+			return false;
+		}
+
+		if (fragment_path_)
+		{
+			LOGE("Slices are not supported with the fragment path.\n");
+			return false;
+		}
+	}
+
 	width = width_;
-	height = height_;
+	frame_height = height_;
+	slice_height = slice_height_;
+	num_slices = slice_height ? (frame_height + slice_height - 1) / slice_height : 1;
+	height = slice_height ? slice_height : frame_height;
 	chroma = chroma_;
+	transform = transform_;
 	fragment_path = fragment_path_;
+	decomposition_levels = decomposition_levels_;
 
-	aligned_width = align(width, Alignment);
-	aligned_height = align(height, Alignment);
-	aligned_width = std::max<int>(aligned_width, MinimumImageSize);
-	aligned_height = std::max<int>(aligned_height, MinimumImageSize);
+	aligned_width = align(width, alignment);
+	aligned_height = align(height, alignment);
+	aligned_width = std::max<int>(aligned_width, minimum_image_size);
+	aligned_height = std::max<int>(aligned_height, minimum_image_size);
+
+	init_block_mapping();
+
+	// All slices share the block index space.
+	if (int64_t(block_count_32x32) * num_slices > MaxBlockCount32x32)
+	{
+		LOGE("Image needs %lld blocks, but at most %d can be addressed.\n",
+		     static_cast<long long>(block_count_32x32) * num_slices, MaxBlockCount32x32);
+		return false;
+	}
+
+	return true;
+}
+
+bool WaveletBuffers::init(Device *device_, int width_, int height_, ChromaSubsampling chroma_, bool fragment_path_,
+                          int decomposition_levels_, WaveletTransform transform_, int slice_height_)
+{
+	if (!init_layout(width_, height_, chroma_, fragment_path_, decomposition_levels_, transform_, slice_height_))
+		return false;
+
+	// Resources from a previous init() may be handed to someone else.
+	release_resources();
+	device = device_;
 
 	init_samplers();
 	allocate_images();
@@ -262,11 +533,15 @@ bool WaveletBuffers::init(Device *device_, int width_, int height_, ChromaSubsam
 
 	Vulkan::ResourceLayout layout;
 
+	auto payload_path = Configuration::get().get_payload_path();
+
 	// If the GPU is sufficiently competent with texel buffers, we can use that as a fallback to 8-bit storage.
-	if (device->get_gpu_properties().limits.maxTexelBufferElements >= 16 * 1024 * 1024)
+	if (payload_path != PayloadPath::StorageBuffer &&
+	    device->get_gpu_properties().limits.maxTexelBufferElements >= 16 * 1024 * 1024)
 	{
 		auto vendor_id = device->get_gpu_properties().vendorID;
-		if (!device->get_device_features().vk12_features.storageBuffer8BitAccess ||
+		if (payload_path != PayloadPath::Auto ||
+		    !device->get_device_features().vk12_features.storageBuffer8BitAccess ||
 		    (vendor_id != VENDOR_ID_AMD && vendor_id != VENDOR_ID_INTEL && vendor_id != VENDOR_ID_NVIDIA &&
 		     device->get_device_features().driver_id != VK_DRIVER_ID_SAMSUNG_PROPRIETARY))
 		{
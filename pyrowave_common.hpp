@@ -3,10 +3,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <mutex>
+#include <vector>
 #include "device.hpp"
 #include "buffer.hpp"
 #include "image.hpp"
 #include "pyrowave_config.hpp"
+#include "pyrowave_pool.hpp"
 #include "shaders/slangmosh.hpp"
 
 namespace PyroWave
@@ -24,7 +27,9 @@ struct BitstreamHeader
 	uint16_t sequence : 3;
 	uint16_t extended : 1;
 	uint32_t quant_code : 8;
-	uint32_t block_index : 24;
+	uint32_t block_index : 23;
+	// 0 for the base layer, 1 for the enhancement layer with SNR layers.
+	uint32_t layer : 1;
 };
 
 static_assert(sizeof(BitstreamHeader) == 8, "BitstreamHeader is not 8 bytes.");
@@ -32,6 +37,7 @@ static_assert(sizeof(BitstreamHeader) == 8, "BitstreamHeader is not 8 bytes.");
 enum
 {
 	BITSTREAM_EXTENDED_CODE_START_OF_FRAME = 0,
+	BITSTREAM_EXTENDED_CODE_SEQUENCE_PARAMETERS = 1,
 };
 
 enum
@@ -90,6 +96,30 @@ struct BitstreamSequenceHeader
 
 static_assert(sizeof(BitstreamSequenceHeader) == 8, "BitstreamSequenceHeader is not 8 bytes.");
 
+// Follows BitstreamSequenceHeader in the same packet when parameters differ from the defaults.
+struct BitstreamSequenceParameters
+{
+	uint32_t decomposition_levels : 4;
+	// Only meaningful with CHROMA_RESOLUTION_420, where chroma is then only subsampled horizontally.
+	uint32_t chroma_422 : 1;
+	// Reversible LeGall 5/3 transform with integer coefficients instead of CDF 9/7.
+	uint32_t reversible : 1;
+	// Number of bit-planes in the enhancement layer. 0 if there is only one layer.
+	uint32_t enhancement_planes : 4;
+	uint32_t reserved0 : 18;
+	uint32_t sequence : 3;
+	uint32_t extended : 1;
+	// In slice mode, the frame is split into slices of this many rows. 0 if the frame is not sliced.
+	uint32_t slice_height : 14;
+	// Slice which the start of frame header describes. Every slice has its own.
+	uint32_t slice_index : 8;
+	uint32_t reserved1 : 2;
+	uint32_t code : 2;
+	uint32_t reserved2 : 6;
+};
+
+static_assert(sizeof(BitstreamSequenceParameters) == 8, "BitstreamSequenceParameters is not 8 bytes.");
+
 struct QuantStats
 {
 	uint16_t square_error_fp16;
@@ -109,10 +139,6 @@ struct BlockMeta
 	uint32_t offset;
 };
 
-static constexpr int DecompositionLevels = 5;
-static constexpr int Alignment = 1 << DecompositionLevels;
-// If the final decomposition band is too small, the mirroring will break since it starts double mirroring.
-static constexpr int MinimumImageSize = 4 << DecompositionLevels;
 static constexpr int NumComponents = 3;
 static constexpr int NumFrequencyBandsPerLevel = 4;
 
@@ -144,27 +170,90 @@ static inline uint8_t encode_quant(float decoder_q_scale)
 	return (e << 3) | m;
 }
 
+// How the decoder reads packed payload data in dequant.
+enum class PayloadPath
+{
+	// Pick the path based on device features and vendor.
+	Auto,
+	StorageBuffer,
+	TexelBuffer,
+	// Texel buffer promoted to linear images where supported.
+	LinearImage
+};
+
 class Configuration
 {
 public:
 	static Configuration &get();
 	int get_precision() const;
+	PayloadPath get_payload_path() const;
+
+	// Overrides are mostly useful for benchmarking and testing.
+	// They only affect encoders and decoders which are initialized afterwards.
+	void set_precision(int precision);
+	void set_payload_path(PayloadPath path);
 private:
 	Configuration();
 	int precision;
+	PayloadPath payload_path = PayloadPath::Auto;
+};
+
+struct ResourcePool::Impl
+{
+	std::mutex lock;
+	Vulkan::Device *device = nullptr;
+	std::vector<Vulkan::ImageHandle> images;
+	std::vector<Vulkan::BufferHandle> buffers;
+
+	// Returned resources which the GPU may still be using.
+	// The fences signal once all work submitted before the return has completed, on either queue type.
+	struct PendingReturn
+	{
+		Vulkan::Fence fences[2];
+		std::vector<Vulkan::ImageHandle> images;
+		std::vector<Vulkan::BufferHandle> buffers;
+	};
+	std::vector<PendingReturn> pending;
+
+	// Returns null handles if nothing matches.
+	Vulkan::ImageHandle take_image(Vulkan::Device &device, const Vulkan::ImageCreateInfo &info);
+	Vulkan::BufferHandle take_buffer(Vulkan::Device &device, const Vulkan::BufferCreateInfo &info);
+	void give(Vulkan::Device &device, std::vector<Vulkan::ImageHandle> &images, std::vector<Vulkan::BufferHandle> &buffers);
+	bool bind_device(Vulkan::Device &device);
+	// Moves pending returns to the idle lists once their fences have signalled. Lock must be held.
+	void retire_pending();
 };
 
 struct WaveletBuffers
 {
-	bool init(Vulkan::Device *device, int width, int height, ChromaSubsampling chroma, bool fragment_path);
+	~WaveletBuffers();
+
+	bool init(Vulkan::Device *device, int width, int height, ChromaSubsampling chroma, bool fragment_path,
+	          int decomposition_levels, WaveletTransform transform, int slice_height);
+
+	// Validates parameters and sets up dimensions and block layout without touching a device.
+	// init() calls this, but it can also be used on its own to compute memory requirements.
+	bool init_layout(int width, int height, ChromaSubsampling chroma, bool fragment_path,
+	                 int decomposition_levels, WaveletTransform transform, int slice_height);
+
+	// CbCr in 4:2:0 has no bands at level 0.
+	// In 4:2:2 level 0 only splits CbCr vertically, so the L half is LL and the H half is coded as LH.
+	bool band_is_coded(int level, int component, int band) const;
+
+	// Device memory of the wavelet images and fragment path images in bytes, not counting tiling padding.
+	// Computed from the layout, so it is valid before the images are allocated.
+	uint64_t get_image_memory_size() const;
+	static uint64_t get_image_size(const Vulkan::ImageCreateInfo &info);
+	static uint64_t get_image_size(const Vulkan::Image *image);
 
 	Vulkan::Device *device = nullptr;
 	Vulkan::ImageHandle wavelet_img_low_res;
 	Vulkan::ImageHandle wavelet_img_high_res;
 	Vulkan::SamplerHandle mirror_repeat_sampler;
+	Vulkan::SamplerHandle linear_mirror_repeat_sampler;
 	Vulkan::SamplerHandle border_sampler;
-	Vulkan::ImageViewHandle component_layer_views[NumComponents][DecompositionLevels];
-	Vulkan::ImageViewHandle component_ll_views[NumComponents][DecompositionLevels];
+	Vulkan::ImageViewHandle component_layer_views[NumComponents][MaxDecompositionLevels];
+	Vulkan::ImageViewHandle component_ll_views[NumComponents][MaxDecompositionLevels];
 
 	// For fragment based iDWT.
 	struct
@@ -174,7 +263,7 @@ struct WaveletBuffers
 			Vulkan::ImageHandle vert[2][2];
 			Vulkan::ImageHandle horiz[NumComponents];
 			Vulkan::ImageViewHandle decoded[NumComponents][NumFrequencyBandsPerLevel];
-		} levels[DecompositionLevels];
+		} levels[MaxDecompositionLevels];
 	} fragment;
 
 	struct BlockInfo
@@ -184,7 +273,7 @@ struct WaveletBuffers
 		int block_offset_32x32;
 		int block_stride_32x32;
 	};
-	BlockInfo block_meta[NumComponents][DecompositionLevels][4] = {};
+	BlockInfo block_meta[NumComponents][MaxDecompositionLevels][4] = {};
 
 	struct BlockMapping
 	{
@@ -202,20 +291,49 @@ struct WaveletBuffers
 	int height = 0;
 	int aligned_width = 0;
 	int aligned_height = 0;
+	int decomposition_levels = DefaultDecompositionLevels;
+
+	// In slice mode, height is the slice height, and every slice is transformed as an independent image.
+	// The final slice may have fewer rows, and is padded like any other image.
+	// Every slice has block_count_32x32 blocks, and blocks of a slice follow the blocks of the slices above it.
+	int frame_height = 0;
+	int slice_height = 0;
+	int num_slices = 1;
+	int get_slice_rows(int slice_index) const;
+	int get_frame_block_count() const;
 
 	bool use_readonly_texel_buffer = false;
 	bool fragment_path = false;
 
+	// Must be set before init().
+	ResourcePool *pool = nullptr;
+
 protected:
+	// Resources created through these go back to the pool when this is destroyed or re-initialized.
+	Vulkan::ImageHandle create_image(const Vulkan::ImageCreateInfo &info, const char *name);
+	Vulkan::BufferHandle create_buffer(const Vulkan::BufferCreateInfo &info, const char *name);
+	// For resources which are replaced while in use, e.g. when growing.
+	// The old one only becomes available to other sessions once the GPU is done with it.
+	void release_buffer(const Vulkan::Buffer *buffer);
+	void release_resources();
+
 	void init_samplers();
+	Vulkan::ImageCreateInfo get_wavelet_image_info(bool low_res) const;
+	// vert selects the input of the vertical pass, which is twice as tall as the horizontal output.
+	Vulkan::ImageCreateInfo get_fragment_image_info(int level, int component, bool vert) const;
 	void allocate_images();
 	void allocate_images_fragment();
-	virtual void init_block_meta();
+	// Allocates the buffers which depend on the block layout.
+	virtual void init_block_meta() = 0;
 	ChromaSubsampling chroma = {};
+	WaveletTransform transform = {};
 
 	Shaders<> shaders;
 
 private:
+	void init_block_mapping();
 	void accumulate_block_mapping(int blocks_x_8x8, int blocks_y_8x8);
+	std::vector<Vulkan::ImageHandle> pooled_images;
+	std::vector<Vulkan::BufferHandle> pooled_buffers;
 };
 }
@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: MIT
 #pragma once
 
+#include <stdint.h>
+
 namespace Vulkan
 {
 class ImageView;
@@ -9,6 +11,24 @@ class ImageView;
 
 namespace PyroWave
 {
+// Number of DWT decompositions. Fewer levels reduce padding for small images,
+// more levels compress the lowest frequency band better for very large images.
+// Streams must be decoded with the same level count they were encoded with.
+static constexpr int DefaultDecompositionLevels = 5;
+static constexpr int MinDecompositionLevels = 3;
+static constexpr int MaxDecompositionLevels = 7;
+
+// Upper bound for the number of horizontal slices in slice mode.
+static constexpr int MaxSlices = 256;
+
+// With SNR layers, the base layer drops this many of the lowest bit-planes, which the enhancement layer carries.
+static constexpr int MaxEnhancementPlanes = 8;
+// Base layer and one enhancement layer.
+static constexpr int MaxLayers = 2;
+
+// Limited by block_index in the block header, which gave up its top bit for the layer.
+static constexpr int MaxBlockCount32x32 = 1 << 23;
+
 struct ViewBuffers
 {
 	const Vulkan::ImageView *planes[3];
@@ -17,6 +37,53 @@ struct ViewBuffers
 enum class ChromaSubsampling
 {
 	Chroma420,
-	Chroma444
+	Chroma444,
+	// Chroma is only subsampled horizontally.
+	Chroma422
+};
+
+enum class WaveletTransform
+{
+	// Irreversible, the default.
+	CDF97,
+	// Reversible integer transform. Mathematically lossless for 8-bit samples when the rate allows,
+	// and degrades to near-lossless when rate control has to drop bit-planes.
+	// Sample precision beyond 8 bits is rounded away.
+	// Streams must be decoded with the same transform they were encoded with.
+	LeGall53
+};
+
+enum class YCbCrTransform
+{
+	BT709,
+	BT2020
+};
+
+enum class YCbCrRange
+{
+	Full,
+	Limited
+};
+
+enum class ChromaSiting
+{
+	Center,
+	Left
+};
+
+// In bytes, not counting alignment or tiling padding.
+struct MemoryRequirements
+{
+	uint64_t device_local;
+	uint64_t host_visible;
+};
+
+// Used when encoding from or decoding directly to RGB.
+struct ColorConversion
+{
+	YCbCrTransform transform;
+	YCbCrRange range;
+	// Only relevant for subsampled chroma.
+	ChromaSiting siting;
 };
 }
@@ -7,18 +7,114 @@
 #include "math.hpp"
 #include "pyrowave_common.hpp"
 #include <algorithm>
+#include <atomic>
+
+#if defined(__GNUC__)
+#define PYROWAVE_PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#define PYROWAVE_PREFETCH(ptr) ((void)(ptr))
+#endif
 
 namespace PyroWave
 {
 using namespace Granite;
 using namespace Vulkan;
 
+static constexpr VkDeviceSize PayloadPadding = 16;
+// Payload buffer which the linear images alias.
+static constexpr VkDeviceSize LinearPayloadSize = 4 * 1024 * 1024;
+// Smallest payload buffer, the first frames are usually tiny.
+static constexpr VkDeviceSize MinPayloadSize = 64 * 1024;
+
 struct DequantizerPushData
 {
 	ivec2 resolution;
 	int32_t output_layer;
 	int32_t block_offset_32x32;
 	int32_t block_stride_32x32;
+	int32_t num_blocks_32x32;
+	int32_t enhancement_planes;
+};
+
+// Per-frame state in the decoder is tagged with an epoch in the upper 32 bits.
+// Starting a new frame bumps the epoch, which implicitly invalidates everything tagged with an older epoch.
+// This lets push_packet() run from multiple threads without locks or O(n) clears on the hot path.
+static inline uint64_t epoch_tag(uint32_t epoch, uint32_t value)
+{
+	return (uint64_t(epoch) << 32) | value;
+}
+
+static inline uint32_t tag_epoch(uint64_t v)
+{
+	return uint32_t(v >> 32);
+}
+
+static inline uint32_t tag_value(uint64_t v)
+{
+	return uint32_t(v);
+}
+
+// Epochs wrap around, so compare them the same way as sequence counters.
+static inline bool epoch_is_older(uint32_t a, uint32_t b)
+{
+	return int32_t(a - b) < 0;
+}
+
+static inline uint32_t epoch_value(const std::atomic<uint64_t> &state, uint32_t epoch, uint32_t fallback)
+{
+	uint64_t v = state.load(std::memory_order_acquire);
+	return tag_epoch(v) == epoch ? tag_value(v) : fallback;
+}
+
+// Read-modify-write of an epoch tagged value. Values tagged with an older epoch are treated as reset_value.
+// Fails if a newer epoch has already claimed the value, or if op rejects the update.
+template <typename Op>
+static inline bool epoch_update(std::atomic<uint64_t> &state, uint32_t epoch, uint32_t reset_value,
+                                uint32_t &old_value, const Op &op)
+{
+	uint64_t v = state.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		uint32_t current_epoch = tag_epoch(v);
+		if (epoch_is_older(epoch, current_epoch))
+			return false;
+
+		old_value = current_epoch == epoch ? tag_value(v) : reset_value;
+		uint32_t new_value;
+		if (!op(old_value, new_value))
+			return false;
+
+		if (state.compare_exchange_weak(v, epoch_tag(epoch, new_value),
+		                                std::memory_order_acq_rel, std::memory_order_relaxed))
+			return true;
+	}
+}
+
+// A block which has been claimed by a thread, but whose payload is not copied into the arena yet.
+// Decoding treats it the same as a missing block.
+static constexpr uint32_t UnpublishedBlockOffset = UINT32_MAX;
+
+// Block packets which have been parsed, but not yet copied into the payload arena.
+// Payload space for all of them is allocated with a single atomic operation.
+struct PendingBlocks
+{
+	enum { MaxBlocks = 64 };
+	const BitstreamHeader *headers[MaxBlocks];
+	uint32_t count = 0;
+	uint32_t epoch = 0;
+
+	// Consecutive packets almost always belong to the same frame, so avoid redundant sequence checks.
+	uint32_t cached_sequence = UINT32_MAX;
+	uint32_t cached_epoch = 0;
+};
+
+enum class ArenaAccess
+{
+	Granted,
+	// A newer frame owns the arena half.
+	Stale,
+	// A packet for the frame two epochs back is still being copied into the arena half.
+	Busy
 };
 
 struct Decoder::Impl final : public WaveletBuffers
@@ -31,28 +127,95 @@ struct Decoder::Impl final : public WaveletBuffers
 	ImageHandle payload_r8_image, payload_r16_image, payload_r32_image;
 	bool need_image_transition = true;
 
-	std::vector<uint32_t> dequant_offset_buffer_cpu;
-	std::vector<uint32_t> payload_data_cpu;
-	int decoded_blocks = 0;
-	int total_blocks_in_sequence = 0;
-	uint32_t last_seq = UINT32_MAX;
-	bool decoded_frame_for_current_sequence = false;
-
-	bool push_packet(const void *data, size_t size);
+	// Offset into the payload arena for every 32x32 block of the frame, epoch tagged.
+	// The enhancement layer blocks follow the base layer blocks.
+	std::unique_ptr<std::atomic<uint64_t>[]> block_offsets;
+
+	// The arena is split in two halves which alternate between epochs.
+	// A thread which is still writing a packet for the previous frame cannot clobber the current frame.
+	std::unique_ptr<uint32_t[]> payload_arena;
+	uint32_t payload_arena_words = 0;
+	// Number of threads accessing each half, tagged with the epoch they access it for.
+	// A half is only handed over to a newer epoch once every user of the older epoch is done,
+	// so a slow writer for one frame cannot clobber the frame two epochs later.
+	std::atomic<uint64_t> payload_arena_users[2] = { {epoch_tag(0, 0)}, {epoch_tag(0, 0)} };
+
+	// Epoch in upper bits, sequence in lower bits. UINT32_MAX sequence means no frame is active.
+	std::atomic<uint64_t> sequence_state{epoch_tag(0, UINT32_MAX)};
+	std::atomic<uint64_t> payload_allocator{epoch_tag(0, 0)};
+	std::atomic<uint64_t> enhancement_planes_in_sequence{epoch_tag(0, 0)};
+	std::atomic<uint32_t> decoded_epoch{UINT32_MAX};
+
+	// Progress of every slice, or of the whole frame when not in slice mode. Epoch tagged.
+	// Every slice has its own start of frame header, which carries the number of blocks in that slice.
+	struct SliceState
+	{
+		std::atomic<uint64_t> decoded_blocks{epoch_tag(0, 0)};
+		std::atomic<uint64_t> decoded_enhancement_blocks{epoch_tag(0, 0)};
+		std::atomic<uint64_t> total_blocks{epoch_tag(0, 0)};
+		std::atomic<uint32_t> decoded_epoch{UINT32_MAX};
+	};
+	std::unique_ptr<SliceState[]> slices;
+	// Slice which is being recorded, i.e. where dequant reads blocks from and the iDWT writes.
+	int current_slice = 0;
+	// Enhancement planes of the frame which was last uploaded.
+	int current_enhancement_planes = 0;
+	// Blocks in layers above this are dropped.
+	int num_layers = MaxLayers;
+
+	// For fused RGB output, chroma is fully reconstructed here before the final luma pass.
+	ImageHandle rgb_chroma[2];
+	const ColorConversion *rgb_conversion = nullptr;
+
+	bool push_packets(const PacketData *packets, size_t count);
 	bool decode(CommandBuffer &cmd, const ViewBuffers &views);
+	bool decode_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion);
+	bool decode_slice(CommandBuffer &cmd, const ViewBuffers &views, int slice_index);
+	bool decode_slice_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion, int slice_index);
 	bool decode_is_ready(bool allow_partial_frame) const;
-
-	bool decode_packet(const BitstreamHeader *header);
-
-	bool dequant(CommandBuffer &cmd);
-	bool idwt(CommandBuffer &cmd, const ViewBuffers &views);
+	bool decode_slice_is_ready(int slice_index, bool allow_partial_slice) const;
+	bool slice_is_ready(int slice_index, uint32_t epoch, bool allow_partial_slice) const;
+
+	bool begin_sequence(uint32_t sequence, uint32_t &epoch);
+	bool begin_sequence(PendingBlocks &pending, uint32_t sequence, uint32_t &epoch);
+	bool parse_packet(PendingBlocks &pending, const void *data, size_t size);
+	bool queue_block(PendingBlocks &pending, const BitstreamHeader *header, uint32_t epoch);
+	bool flush_blocks(PendingBlocks &pending);
+	ArenaAccess begin_arena_access(uint32_t epoch);
+	void end_arena_access(uint32_t epoch);
+
+	// Decodes a range of slices. In slice mode, the slices go through the wavelet images one after the other.
+	bool record_decode(CommandBuffer &cmd, const ViewBuffers &views, int first_slice, int count);
+	bool record_dequant(CommandBuffer &cmd);
+	void record_idwt(CommandBuffer &cmd, const ViewBuffers &views);
+
+	uint32_t upload(CommandBuffer &cmd, int first_slice, int count);
+	bool setup_dequant(CommandBuffer &cmd);
+	void dequant_barriers(CommandBuffer &cmd);
+	void dispatch_dequant(CommandBuffer &cmd);
+	void idwt_barriers(CommandBuffer &cmd);
+	void dispatch_idwt(CommandBuffer &cmd, const ViewBuffers &views, int input_level, bool rgb_pass);
 	bool idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views);
 	void init_block_meta() override;
 	void clear();
 
-	void upload_payload(CommandBuffer &cmd);
+	// Uploads the payload from begin_word up to the end of the block at last_block_word.
+	void upload_payload(CommandBuffer &cmd, uint32_t epoch, uint32_t begin_word, uint32_t last_block_word);
+	bool prepare_rgb_views(const ImageView &view, ViewBuffers &views);
+
+	// 0 is unlimited. Only the payload buffer shrinks to fit, everything else is fixed by the layout.
+	uint64_t memory_budget = 0;
+	uint32_t get_payload_arena_words() const;
+	VkDeviceSize get_max_payload_size() const;
+	VkDeviceSize get_payload_buffer_size(VkDeviceSize required_size) const;
+	// Everything but the payload buffer.
+	uint64_t get_fixed_memory_size() const;
+	MemoryRequirements get_memory_requirements() const;
 
 	void check_linear_texture_support();
+	ImageCreateInfo get_rgb_chroma_info() const;
+	bool init_rgb_chroma();
+	void set_rgb_specialization_constants(CommandBuffer &cmd, unsigned first_constant);
 };
 
 Decoder::Decoder()
@@ -64,24 +227,36 @@ Decoder::~Decoder()
 {
 }
 
-void Decoder::Impl::upload_payload(CommandBuffer &cmd)
+void Decoder::Impl::upload_payload(CommandBuffer &cmd, uint32_t epoch, uint32_t begin_word, uint32_t last_block_word)
 {
-	VkDeviceSize required_size = payload_data_cpu.size() * sizeof(uint32_t);
+	const uint32_t *arena = payload_arena.get() + (epoch & 1) * payload_arena_words;
+	bool has_payload = last_block_word != UnpublishedBlockOffset && begin_arena_access(epoch) == ArenaAccess::Granted;
+
+	// Blocks are copied into the arena before they are published, so the header of the last block is in place.
+	uint32_t end_word = 0;
+	if (has_payload)
+		end_word = last_block_word + reinterpret_cast<const BitstreamHeader *>(arena + last_block_word)->payload_words;
+
+	// Blocks keep their arena offsets, so the buffer covers everything up to the last block.
+	VkDeviceSize required_size = end_word * sizeof(uint32_t);
 
 	// Avoid edge case OOB access without robustness on the payload buffer during dequant.
-	VkDeviceSize required_size_padded = required_size + 16;
+	VkDeviceSize required_size_padded = required_size + PayloadPadding;
 
 	if (!payload_data || required_size_padded > payload_data->get_create_info().size)
 	{
 		BufferCreateInfo bufinfo;
-		bufinfo.size = std::max<VkDeviceSize>(64 * 1024, required_size_padded * 2);
+		bufinfo.size = get_payload_buffer_size(required_size_padded);
 		bufinfo.usage =
 			VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
 			VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT;
 		bufinfo.domain = BufferDomain::Device;
-		payload_data = device->create_buffer(bufinfo);
-		device->set_name(*payload_data, "payload-data");
+
+		// The old buffer may still be in flight, the pool holds it back until it retires.
+		if (payload_data)
+			release_buffer(payload_data.get());
+		payload_data = create_buffer(bufinfo, "payload-data");
 
 		if (use_readonly_texel_buffer)
 		{
@@ -119,24 +294,73 @@ void Decoder::Impl::upload_payload(CommandBuffer &cmd)
 		need_image_transition = false;
 	}
 
-	if (!payload_data_cpu.empty())
-		memcpy(cmd.update_buffer(*payload_data, 0, required_size), payload_data_cpu.data(), required_size);
+	if (has_payload)
+	{
+		VkDeviceSize begin_offset = begin_word * sizeof(uint32_t);
+		memcpy(cmd.update_buffer(*payload_data, begin_offset, required_size - begin_offset),
+		       arena + begin_word, required_size - begin_offset);
+		end_arena_access(epoch);
+	}
 }
 
-bool Decoder::Impl::decode_packet(const BitstreamHeader *header)
+bool Decoder::Impl::begin_sequence(uint32_t sequence, uint32_t &epoch)
 {
-	auto &offset = dequant_offset_buffer_cpu[header->block_index];
-	if (offset == UINT32_MAX)
+	uint64_t state = sequence_state.load(std::memory_order_acquire);
+
+	for (;;)
 	{
-		decoded_blocks++;
-		offset = payload_data_cpu.size();
+		uint32_t current_epoch = tag_epoch(state);
+		uint32_t current_seq = tag_value(state);
+
+		if (current_seq != UINT32_MAX)
+		{
+			uint8_t diff = (sequence - current_seq) & SequenceCountMask;
+
+			// Packet belongs to an older frame, drop it.
+			if (diff > (SequenceCountMask / 2))
+				return false;
+
+			if (diff == 0)
+			{
+				epoch = current_epoch;
+				return true;
+			}
+		}
+
+		// The first thread to observe a new sequence starts the new frame.
+		if (sequence_state.compare_exchange_weak(state, epoch_tag(current_epoch + 1, sequence),
+		                                         std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			epoch = current_epoch + 1;
+			return true;
+		}
 	}
-	else
+}
+
+bool Decoder::Impl::begin_sequence(PendingBlocks &pending, uint32_t sequence, uint32_t &epoch)
+{
+	// If a newer frame started behind our back, the cached epoch is stale,
+	// and the payload allocation in flush_blocks() will drop the blocks as expected.
+	if (sequence == pending.cached_sequence)
 	{
+		epoch = pending.cached_epoch;
 		return true;
 	}
 
-	auto *payload_words = reinterpret_cast<const uint32_t *>(header);
+	if (!begin_sequence(sequence, epoch))
+		return false;
+
+	pending.cached_sequence = sequence;
+	pending.cached_epoch = epoch;
+	return true;
+}
+
+bool Decoder::Impl::queue_block(PendingBlocks &pending, const BitstreamHeader *header, uint32_t epoch)
+{
+	// Early out for duplicate packets.
+	uint64_t current = block_offsets[header->block_index + header->layer * get_frame_block_count()].load(std::memory_order_relaxed);
+	if (!epoch_is_older(tag_epoch(current), epoch))
+		return true;
 
 	if (sizeof(*header) / sizeof(uint32_t) > header->payload_words)
 	{
@@ -144,14 +368,167 @@ bool Decoder::Impl::decode_packet(const BitstreamHeader *header)
 		return false;
 	}
 
-	payload_data_cpu.insert(
-			payload_data_cpu.end(),
-			payload_words,
-			payload_words + header->payload_words);
+	if (pending.count && (pending.epoch != epoch || pending.count == PendingBlocks::MaxBlocks))
+		if (!flush_blocks(pending))
+			return false;
+
+	pending.headers[pending.count++] = header;
+	pending.epoch = epoch;
+	return true;
+}
+
+ArenaAccess Decoder::Impl::begin_arena_access(uint32_t epoch)
+{
+	auto &users = payload_arena_users[epoch & 1];
+	uint64_t v = users.load(std::memory_order_acquire);
+
+	for (;;)
+	{
+		uint32_t current_epoch = tag_epoch(v);
+		uint32_t count = current_epoch == epoch ? tag_value(v) : 0;
+
+		// A newer frame owns this half already.
+		if (epoch_is_older(epoch, current_epoch))
+			return ArenaAccess::Stale;
+
+		// The frame two epochs back is still being written. Never wait on another thread, let the caller retry.
+		if (current_epoch != epoch && tag_value(v) != 0)
+			return ArenaAccess::Busy;
+
+		if (users.compare_exchange_weak(v, epoch_tag(epoch, count + 1),
+		                                std::memory_order_acq_rel, std::memory_order_acquire))
+			return ArenaAccess::Granted;
+	}
+}
+
+void Decoder::Impl::end_arena_access(uint32_t epoch)
+{
+	// The epoch in the upper bits cannot change while the count is non-zero.
+	payload_arena_users[epoch & 1].fetch_sub(1, std::memory_order_release);
+}
+
+bool Decoder::Impl::flush_blocks(PendingBlocks &pending)
+{
+	if (!pending.count)
+		return true;
+
+	uint32_t epoch = pending.epoch;
+	uint32_t num_blocks = pending.count;
+	pending.count = 0;
+
+	ArenaAccess access = begin_arena_access(epoch);
+
+	// A newer frame has reused this half of the arena while we were parsing, drop the packets.
+	if (access == ArenaAccess::Stale)
+		return true;
+
+	if (access == ArenaAccess::Busy)
+	{
+		LOGE("Payload arena is still in use by an older frame.\n");
+		return false;
+	}
+
+	// Claim the blocks before allocating payload space, so that duplicates which lose a race
+	// with another thread do not eat into the arena.
+	const BitstreamHeader *claimed[PendingBlocks::MaxBlocks];
+	uint32_t num_claimed = 0;
+	uint32_t payload_words = 0;
+
+	for (uint32_t i = 0; i < num_blocks; i++)
+	{
+		auto *header = pending.headers[i];
+		auto &slot = block_offsets[header->block_index + header->layer * get_frame_block_count()];
+		uint64_t current = slot.load(std::memory_order_relaxed);
+		bool claim = true;
+		do
+		{
+			if (!epoch_is_older(tag_epoch(current), epoch))
+			{
+				claim = false;
+				break;
+			}
+		} while (!slot.compare_exchange_weak(current, epoch_tag(epoch, UnpublishedBlockOffset),
+		                                     std::memory_order_relaxed, std::memory_order_relaxed));
+
+		if (claim)
+		{
+			claimed[num_claimed++] = header;
+			payload_words += header->payload_words;
+		}
+	}
+
+	if (!num_claimed)
+	{
+		end_arena_access(epoch);
+		return true;
+	}
+
+	bool exhausted = false;
+	uint32_t offset;
+	if (!epoch_update(payload_allocator, epoch, 0, offset, [&](uint32_t old_value, uint32_t &new_value) {
+		exhausted = payload_words > payload_arena_words - old_value;
+		new_value = old_value + payload_words;
+		return !exhausted;
+	}))
+	{
+		end_arena_access(epoch);
+
+		if (exhausted)
+		{
+			LOGE("Payload arena is exhausted.\n");
+			return false;
+		}
+
+		// A newer frame has started while we were parsing, drop the packets.
+		return true;
+	}
+
+	uint32_t *arena = payload_arena.get() + (epoch & 1) * payload_arena_words;
+	// Slice and layer of every published block, as slice * MaxLayers + layer.
+	uint32_t published[PendingBlocks::MaxBlocks];
+	uint32_t num_published = 0;
+
+	for (uint32_t i = 0; i < num_claimed; i++)
+	{
+		auto *header = claimed[i];
+		memcpy(arena + offset, header, header->payload_words * sizeof(uint32_t));
+
+		// Publish the block, unless a newer frame took over the slot in the meantime.
+		auto &slot = block_offsets[header->block_index + header->layer * get_frame_block_count()];
+		uint64_t expected = epoch_tag(epoch, UnpublishedBlockOffset);
+		if (slot.compare_exchange_strong(expected, epoch_tag(epoch, offset),
+		                                 std::memory_order_release, std::memory_order_relaxed))
+		{
+			published[num_published++] = (header->block_index / block_count_32x32) * MaxLayers + header->layer;
+		}
+		offset += header->payload_words;
+	}
+
+	end_arena_access(epoch);
+
+	// Packets arrive in block order, so runs of the same slice and layer are counted with one update.
+	for (uint32_t i = 0; i < num_published; )
+	{
+		uint32_t key = published[i];
+		uint32_t run = 1;
+		while (i + run < num_published && published[i + run] == key)
+			run++;
+
+		auto &slice = slices[key / MaxLayers];
+		auto &counter = key % MaxLayers ? slice.decoded_enhancement_blocks : slice.decoded_blocks;
+		uint32_t count;
+		epoch_update(counter, epoch, 0, count, [run](uint32_t old_value, uint32_t &new_value) {
+			new_value = old_value + run;
+			return true;
+		});
+
+		i += run;
+	}
+
 	return true;
 }
 
-bool Decoder::Impl::push_packet(const void *data_, size_t size)
+bool Decoder::Impl::parse_packet(PendingBlocks &pending, const void *data_, size_t size)
 {
 	auto *data = static_cast<const uint8_t *>(data_);
 	while (size >= sizeof(BitstreamHeader))
@@ -168,34 +545,94 @@ bool Decoder::Impl::push_packet(const void *data_, size_t size)
 				return false;
 			}
 
-			if (seq->chroma_resolution != int(chroma))
+			if (seq->code == BITSTREAM_EXTENDED_CODE_START_OF_FRAME &&
+			    seq->chroma_resolution != (chroma == ChromaSubsampling::Chroma444 ? CHROMA_RESOLUTION_444 : CHROMA_RESOLUTION_420))
 			{
 				LOGE("Chroma resolution mismatch!\n");
 				return false;
 			}
 
-			uint8_t diff = (header->sequence - last_seq) & SequenceCountMask;
-			if (last_seq != UINT32_MAX && diff > (SequenceCountMask / 2))
-			{
+			uint32_t epoch;
+			if (!begin_sequence(pending, header->sequence, epoch))
 				return true;
-			}
-
-			if (last_seq == UINT32_MAX || diff != 0)
-			{
-				clear();
-				last_seq = header->sequence;
-			}
 
 			if (seq->code == BITSTREAM_EXTENDED_CODE_START_OF_FRAME)
 			{
-				if (seq->width_minus_1 + 1 != width || seq->height_minus_1 + 1 != height)
+				if (seq->width_minus_1 + 1 != width || seq->height_minus_1 + 1 != frame_height)
 				{
 					LOGE("Dimension mismatch in seq packet, (%d, %d) != (%d, %d)\n",
-					     seq->width_minus_1 + 1, seq->height_minus_1 + 1, width, height);
+					     seq->width_minus_1 + 1, seq->height_minus_1 + 1, width, frame_height);
 					return false;
 				}
 
-				total_blocks_in_sequence = int(seq->total_blocks);
+				// Non-default parameters immediately follow the start of frame. If they're absent, defaults apply.
+				int levels = DefaultDecompositionLevels;
+				bool chroma_422 = false;
+				bool reversible = false;
+				int seq_slice_height = 0;
+				int seq_slice_index = 0;
+				int seq_enhancement_planes = 0;
+				if (size >= sizeof(*seq) + sizeof(BitstreamSequenceParameters))
+				{
+					auto *params = reinterpret_cast<const BitstreamSequenceParameters *>(seq + 1);
+					if (params->extended != 0 && params->code == BITSTREAM_EXTENDED_CODE_SEQUENCE_PARAMETERS)
+					{
+						levels = int(params->decomposition_levels);
+						chroma_422 = params->chroma_422 != 0;
+						reversible = params->reversible != 0;
+						seq_slice_height = int(params->slice_height);
+						seq_slice_index = int(params->slice_index);
+						seq_enhancement_planes = int(params->enhancement_planes);
+					}
+				}
+
+				if (levels != decomposition_levels)
+				{
+					LOGE("Decomposition level mismatch in seq packet, %d != %d\n", levels, decomposition_levels);
+					return false;
+				}
+
+				if (chroma_422 != (chroma == ChromaSubsampling::Chroma422))
+				{
+					LOGE("Chroma resolution mismatch!\n");
+					return false;
+				}
+
+				if (reversible != (transform == WaveletTransform::LeGall53))
+				{
+					LOGE("Wavelet transform mismatch!\n");
+					return false;
+				}
+
+				if (seq_slice_height != slice_height || seq_slice_index >= num_slices)
+				{
+					LOGE("Slice mismatch in seq packet.\n");
+					return false;
+				}
+
+				if (seq_enhancement_planes > MaxEnhancementPlanes)
+				{
+					LOGE("Enhancement planes %d is out of range.\n", seq_enhancement_planes);
+					return false;
+				}
+
+				uint32_t old_planes;
+				epoch_update(enhancement_planes_in_sequence, epoch, 0, old_planes,
+				             [seq_enhancement_planes](uint32_t, uint32_t &new_value) {
+					             new_value = uint32_t(seq_enhancement_planes);
+					             return true;
+				             });
+
+				uint32_t old_total;
+				epoch_update(slices[seq_slice_index].total_blocks, epoch, 0, old_total,
+				             [seq](uint32_t, uint32_t &new_value) {
+					             new_value = seq->total_blocks;
+					             return true;
+				             });
+			}
+			else if (seq->code == BITSTREAM_EXTENDED_CODE_SEQUENCE_PARAMETERS)
+			{
+				// Validated together with the start of frame header.
 			}
 			else
 			{
@@ -217,35 +654,17 @@ bool Decoder::Impl::push_packet(const void *data_, size_t size)
 			return false;
 		}
 
-		bool restart;
-
-		if (last_seq == UINT32_MAX)
-		{
-			restart = true;
-		}
-		else
-		{
-			uint8_t diff = (header->sequence - last_seq) & SequenceCountMask;
-			if (diff > (SequenceCountMask / 2))
-			{
-				return true;
-			}
-			restart = diff != 0;
-		}
-
-		if (restart)
-		{
-			clear();
-			last_seq = header->sequence;
-		}
+		uint32_t epoch;
+		if (!begin_sequence(pending, header->sequence, epoch))
+			return true;
 
-		if (header->block_index >= uint32_t(block_count_32x32))
+		if (header->block_index >= uint32_t(get_frame_block_count()))
 		{
-			LOGE("block_index %u is out of bounds (>= %d).\n", header->block_index, block_count_32x32);
+			LOGE("block_index %u is out of bounds (>= %d).\n", header->block_index, get_frame_block_count());
 			return false;
 		}
 
-		if (!decode_packet(header))
+		if (header->layer < uint32_t(num_layers) && !queue_block(pending, header, epoch))
 			return false;
 
 		data += packet_size;
@@ -261,27 +680,99 @@ bool Decoder::Impl::push_packet(const void *data_, size_t size)
 	return true;
 }
 
-void Decoder::Impl::init_block_meta()
+bool Decoder::Impl::push_packets(const PacketData *packets, size_t count)
 {
-	WaveletBuffers::init_block_meta();
+	PendingBlocks pending;
+	bool ret = true;
 
+	for (size_t i = 0; i < count && ret; i++)
+	{
+		if (i + 1 < count)
+			PYROWAVE_PREFETCH(packets[i + 1].data);
+		ret = parse_packet(pending, packets[i].data, packets[i].size);
+	}
+
+	// Blocks which were parsed before an error are still valid.
+	if (!flush_blocks(pending))
+		ret = false;
+
+	return ret;
+}
+
+void Decoder::Impl::init_block_meta()
+{
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
 	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 
-	info.size = block_count_32x32 * sizeof(uint32_t);
-	dequant_offset_buffer = device->create_buffer(info);
-	device->set_name(*dequant_offset_buffer, "meta-buffer");
-	dequant_offset_buffer_cpu.resize(block_count_32x32);
+	info.size = MaxLayers * get_frame_block_count() * sizeof(uint32_t);
+	dequant_offset_buffer = create_buffer(info, "meta-buffer");
 
-	payload_data_cpu.reserve(1024 * 1024);
+	block_offsets.reset(new std::atomic<uint64_t>[MaxLayers * get_frame_block_count()]);
+	for (int i = 0; i < MaxLayers * get_frame_block_count(); i++)
+		block_offsets[i].store(epoch_tag(UINT32_MAX, UINT32_MAX), std::memory_order_relaxed);
+	slices.reset(new SliceState[num_slices]);
+
+	// Double it so two frames can be in flight.
+	payload_arena_words = get_payload_arena_words();
+	payload_arena.reset(new uint32_t[2 * size_t(payload_arena_words)]);
 }
 
-bool Decoder::Impl::dequant(CommandBuffer &cmd)
+uint32_t Decoder::Impl::get_payload_arena_words() const
 {
-	DequantizerPushData push = {};
+	// Same worst case as the encoder's payload scratch at its largest, for every slice.
+	// With SNR layers, every block can carry a second header and a second copy of the control codes.
+	return (aligned_width * aligned_height / 2 + block_count_32x32 * (2 + 12)) * num_slices;
+}
 
-	cmd.set_specialization_constant_mask(0);
+VkDeviceSize Decoder::Impl::get_max_payload_size() const
+{
+	// A full arena is the most a frame can upload.
+	return get_payload_arena_words() * sizeof(uint32_t) + PayloadPadding;
+}
+
+VkDeviceSize Decoder::Impl::get_payload_buffer_size(VkDeviceSize required_size) const
+{
+	// Leave room to grow, but not beyond the worst case or the budget.
+	VkDeviceSize max_size = get_max_payload_size();
+	if (memory_budget)
+	{
+		uint64_t fixed_size = get_fixed_memory_size();
+		max_size = std::min<VkDeviceSize>(max_size, memory_budget > fixed_size ? memory_budget - fixed_size : 0);
+	}
+
+	VkDeviceSize size = std::max<VkDeviceSize>(MinPayloadSize, required_size * 2);
+	size = std::min(size, max_size);
+	// A frame which is already queued has to be uploaded, budget or not.
+	return std::max(size, required_size);
+}
+
+uint64_t Decoder::Impl::get_fixed_memory_size() const
+{
+	uint64_t size = get_image_memory_size();
+	size += MaxLayers * get_frame_block_count() * sizeof(uint32_t);
+
+	// Only allocated by decode_rgb().
+	if (!fragment_path || chroma != ChromaSubsampling::Chroma444)
+		size += 2 * get_image_size(get_rgb_chroma_info());
+
+	return size;
+}
+
+MemoryRequirements Decoder::Impl::get_memory_requirements() const
+{
+	MemoryRequirements reqs = {};
+
+	// The linear image path starts out with a fixed size buffer, which is replaced if a frame does not fit.
+	reqs.device_local = get_fixed_memory_size() + std::max(LinearPayloadSize, get_max_payload_size());
+
+	// The payload arena lives in plain host memory.
+	return reqs;
+}
+
+bool Decoder::Impl::setup_dequant(CommandBuffer &cmd)
+{
+	cmd.set_specialization_constant_mask(1);
 	cmd.enable_subgroup_size_control(true);
 
 	if (device->supports_subgroup_size_log2(true, 4, 7))
@@ -298,16 +789,11 @@ bool Decoder::Impl::dequant(CommandBuffer &cmd)
 		return false;
 	}
 
-	if (payload_r8_image && payload_r16_image && payload_r32_image)
-		cmd.set_program(shaders.wavelet_dequant[2]);
-	else if (use_readonly_texel_buffer)
-		cmd.set_program(shaders.wavelet_dequant[1]);
-	else
-		cmd.set_program(shaders.wavelet_dequant[0]);
-
-	cmd.begin_region("DWT dequant");
-	auto start_dequant = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	return true;
+}
 
+void Decoder::Impl::dequant_barriers(CommandBuffer &cmd)
+{
 	cmd.image_barrier(*wavelet_img_high_res, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
 	                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
 	                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
@@ -320,9 +806,22 @@ bool Decoder::Impl::dequant(CommandBuffer &cmd)
 		                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 		                  VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
 	}
+}
+
+void Decoder::Impl::dispatch_dequant(CommandBuffer &cmd)
+{
+	DequantizerPushData push = {};
+
+	if (payload_r8_image && payload_r16_image && payload_r32_image)
+		cmd.set_program(shaders.wavelet_dequant[2]);
+	else if (use_readonly_texel_buffer)
+		cmd.set_program(shaders.wavelet_dequant[1]);
+	else
+		cmd.set_program(shaders.wavelet_dequant[0]);
+	cmd.set_specialization_constant(0, transform == WaveletTransform::LeGall53);
 
 	// De-quantize
-	for (int level = 0; level < DecompositionLevels; level++)
+	for (int level = 0; level < decomposition_levels; level++)
 	{
 		for (int component = 0; component < NumComponents; component++)
 		{
@@ -334,13 +833,19 @@ bool Decoder::Impl::dequant(CommandBuffer &cmd)
 			snprintf(label, sizeof(label), "level %d - component %d", level, component);
 			cmd.begin_region(label);
 
-			for (int band = (level == DecompositionLevels - 1 ? 0 : 1); band < 4; band++)
+			for (int band = (level == decomposition_levels - 1 ? 0 : 1); band < 4; band++)
 			{
+				if (!band_is_coded(level, component, band))
+					continue;
+
 				push.resolution.x = wavelet_img_high_res->get_width(level);
 				push.resolution.y = wavelet_img_high_res->get_height(level);
 				push.output_layer = band;
-				push.block_offset_32x32 = block_meta[component][level][band].block_offset_32x32;
+				push.block_offset_32x32 = block_meta[component][level][band].block_offset_32x32 +
+				                          current_slice * block_count_32x32;
 				push.block_stride_32x32 = block_meta[component][level][band].block_stride_32x32;
+				push.num_blocks_32x32 = get_frame_block_count();
+				push.enhancement_planes = current_enhancement_planes;
 				cmd.push_constants(&push, 0, sizeof(push));
 
 				cmd.set_storage_texture(0, 0, *component_layer_views[component][level]);
@@ -367,6 +872,18 @@ bool Decoder::Impl::dequant(CommandBuffer &cmd)
 			cmd.end_region();
 		}
 	}
+}
+
+bool Decoder::Impl::record_dequant(CommandBuffer &cmd)
+{
+	if (!setup_dequant(cmd))
+		return false;
+
+	cmd.begin_region("DWT dequant");
+	auto start_dequant = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+	dequant_barriers(cmd);
+	dispatch_dequant(cmd);
 
 	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
 	            fragment_path ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
@@ -375,6 +892,7 @@ bool Decoder::Impl::dequant(CommandBuffer &cmd)
 	auto end_dequant = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 	cmd.end_region();
 	cmd.enable_subgroup_size_control(false);
+	cmd.set_specialization_constant_mask(0);
 	device->register_time_interval("GPU", std::move(start_dequant), std::move(end_dequant), "Dequant");
 
 	return true;
@@ -409,6 +927,10 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 		for (auto &comp : level.horiz)
 			add_discard(comp.get());
 	}
+
+	if (rgb_conversion)
+		for (auto &comp : rgb_chroma)
+			add_discard(comp.get());
 	cmd.end_barrier_batch();
 
 	auto start_idwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
@@ -423,7 +945,7 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 		uint32_t pivot_size;
 	} push = {};
 
-	for (int input_level = DecompositionLevels - 1; input_level >= 0; input_level--)
+	for (int input_level = decomposition_levels - 1; input_level >= 0; input_level--)
 	{
 		int output_level = input_level - 1;
 
@@ -437,6 +959,7 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 		Vulkan::RenderPassInfo rp_info = {};
 
 		bool has_chroma_output = output_level >= 0 || chroma == ChromaSubsampling::Chroma444;
+		bool rgb_output = rgb_conversion && output_level < 0;
 
 		Vulkan::Program *vert_prog;
 		Vulkan::Program *horiz_prog;
@@ -445,15 +968,15 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 		{
 			rp_info.store_attachments = 0x3;
 			rp_info.num_color_attachments = 2;
-			vert_prog = device->request_program(shaders.idwt_vs, shaders.idwt_fs[1]);
-			horiz_prog = device->request_program(shaders.idwt_vs, shaders.idwt_fs[2]);
+			vert_prog = device->request_program(shaders.idwt_vs, shaders.idwt_fs[1][0]);
+			horiz_prog = device->request_program(shaders.idwt_vs, shaders.idwt_fs[2][rgb_output]);
 		}
 		else
 		{
 			rp_info.store_attachments = 0x1;
 			rp_info.num_color_attachments = 1;
-			vert_prog = device->request_program(shaders.idwt_vs, shaders.idwt_fs[0]);
-			horiz_prog = vert_prog;
+			vert_prog = device->request_program(shaders.idwt_vs, shaders.idwt_fs[0][0]);
+			horiz_prog = rgb_output ? device->request_program(shaders.idwt_vs, shaders.idwt_fs[0][1]) : vert_prog;
 		}
 
 		// Vertical passes.
@@ -520,7 +1043,7 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 				add_read_only(comp.get());
 		cmd.end_barrier_batch();
 
-		if (has_chroma_output)
+		if (has_chroma_output && !rgb_output)
 		{
 			rp_info.num_color_attachments = 3;
 			rp_info.store_attachments = 0x7;
@@ -556,6 +1079,18 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 			cmd.set_texture(0, 3, fragment.levels[input_level].vert[0][1]->get_view());
 			cmd.set_texture(0, 4, fragment.levels[input_level].vert[1][1]->get_view());
 		}
+		else if (rgb_output)
+		{
+			cmd.set_texture(0, 3, *views.planes[1]);
+			cmd.set_texture(0, 4, *views.planes[2]);
+			cmd.set_sampler(0, 5, StockSampler::LinearClamp);
+		}
+
+		if (rgb_output)
+		{
+			cmd.set_specialization_constant_mask(0x7f);
+			set_rgb_specialization_constants(cmd, 4);
+		}
 
 		uint32_t aligned_render_width = aligned_width >> (output_level + 1);
 		uint32_t aligned_render_height = aligned_height >> (output_level + 1);
@@ -634,7 +1169,7 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 				rp_info.render_area.offset.y = rp_info.color_attachments[1]->get_view_height();
 
 				cmd.begin_render_pass(rp_info);
-				cmd.set_program(device->request_program(shaders.idwt_vs, shaders.idwt_fs[0]));
+				cmd.set_program(device->request_program(shaders.idwt_vs, shaders.idwt_fs[0][0]));
 				cmd.set_opaque_sprite_state();
 				cmd.set_texture(0, 0, fragment.levels[input_level].vert[0][0]->get_view());
 				cmd.set_texture(0, 1, fragment.levels[input_level].vert[1][0]->get_view());
@@ -660,7 +1195,7 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 				rp_info.render_area.offset.y = 0;
 
 				cmd.begin_render_pass(rp_info);
-				cmd.set_program(device->request_program(shaders.idwt_vs, shaders.idwt_fs[0]));
+				cmd.set_program(device->request_program(shaders.idwt_vs, shaders.idwt_fs[0][0]));
 				cmd.set_opaque_sprite_state();
 				cmd.set_texture(0, 0, fragment.levels[input_level].vert[0][0]->get_view());
 				cmd.set_texture(0, 1, fragment.levels[input_level].vert[1][0]->get_view());
@@ -679,6 +1214,9 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 			cmd.begin_barrier_batch();
 			for (auto &comp: fragment.levels[output_level].horiz)
 				add_read_only(comp.get());
+			if (output_level == 0 && rgb_conversion)
+				for (auto &comp : rgb_chroma)
+					add_read_only(comp.get());
 			cmd.end_barrier_batch();
 		}
 
@@ -696,147 +1234,449 @@ bool Decoder::Impl::idwt_fragment(CommandBuffer &cmd, const ViewBuffers &views)
 	return true;
 }
 
-bool Decoder::Impl::idwt(CommandBuffer &cmd, const ViewBuffers &views)
+void Decoder::Impl::idwt_barriers(CommandBuffer &cmd)
 {
-	cmd.set_program(shaders.idwt[Configuration::get().get_precision()]);
-	cmd.enable_subgroup_size_control(false);
+	if (!rgb_conversion)
+		return;
 
-	auto start_idwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	cmd.begin_barrier_batch();
+	for (auto &comp : rgb_chroma)
+	{
+		cmd.image_barrier(*comp, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+		                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+	}
+	cmd.end_barrier_batch();
+}
 
+void Decoder::Impl::dispatch_idwt(CommandBuffer &cmd, const ViewBuffers &views, int input_level, bool rgb_pass)
+{
 	struct
 	{
 		ivec2 resolution;
 		vec2 inv_resolution;
+		ivec2 output_offset;
+		ivec2 output_resolution;
+		vec2 inv_output_resolution;
 	} push = {};
 
-	for (int input_level = DecompositionLevels - 1; input_level >= 0; input_level--)
-	{
-		// Transposed.
-		push.resolution.x = component_layer_views[0][input_level]->get_view_height();
-		push.resolution.y = component_layer_views[0][input_level]->get_view_width();
-		push.inv_resolution.x = 1.0f / float(push.resolution.x);
-		push.inv_resolution.y = 1.0f / float(push.resolution.y);
+	push.inv_output_resolution = vec2(1.0f / float(width), 1.0f / float(height));
+
+	// In slice mode, the planes owned by the caller are full frames, so the slice is written at its offset.
+	const auto set_output = [&](const ImageView &view, bool frame_output, bool half_height) {
+		if (frame_output)
+		{
+			int rows = get_slice_rows(current_slice);
+			int offset = current_slice * slice_height;
+			push.output_offset = ivec2(0, half_height ? offset / 2 : offset);
+			push.output_resolution = ivec2(int(view.get_view_width()), half_height ? rows / 2 : rows);
+		}
+		else
+		{
+			push.output_offset = ivec2(0);
+			push.output_resolution = ivec2(int(view.get_view_width()), int(view.get_view_height()));
+		}
+
 		cmd.push_constants(&push, 0, sizeof(push));
-		cmd.set_specialization_constant_mask(1);
-		cmd.set_specialization_constant(0, false);
+		cmd.set_storage_texture(0, 1, view);
+	};
+
+	// Transposed.
+	push.resolution.x = component_layer_views[0][input_level]->get_view_height();
+	push.resolution.y = component_layer_views[0][input_level]->get_view_width();
+	push.inv_resolution.x = 1.0f / float(push.resolution.x);
+	push.inv_resolution.y = 1.0f / float(push.resolution.y);
 
-		if (input_level == 0)
+	cmd.set_program(shaders.idwt[Configuration::get().get_precision()][rgb_pass ? 1 : 0]);
+	cmd.set_specialization_constant_mask(0x21);
+	cmd.set_specialization_constant(0, input_level == 0);
+	cmd.set_specialization_constant(5, transform == WaveletTransform::LeGall53);
+
+	if (rgb_pass)
+	{
+		cmd.set_specialization_constant_mask(0x2f);
+		set_rgb_specialization_constants(cmd, 1);
+		set_output(*views.planes[0], true, false);
+		cmd.set_texture(0, 2, *views.planes[1], StockSampler::LinearClamp);
+		cmd.set_texture(0, 3, *views.planes[2], StockSampler::LinearClamp);
+		cmd.begin_region("iDWT final, RGB");
+		cmd.set_texture(0, 0, *component_layer_views[0][input_level], *mirror_repeat_sampler);
+		cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
+		cmd.end_region();
+	}
+	else if (input_level == 0)
+	{
+		if (chroma == ChromaSubsampling::Chroma444)
 		{
-			cmd.set_specialization_constant(0, true);
-			if (chroma == ChromaSubsampling::Chroma444)
+			// With RGB output, luma is written in the fused RGB pass instead.
+			for (int c = rgb_conversion ? 1 : 0; c < NumComponents; c++)
+			{
+				char label[64];
+				snprintf(label, sizeof(label), "iDWT final, component %u", c);
+				cmd.begin_region(label);
+				set_output(*views.planes[c], c == 0 || !rgb_conversion, false);
+				cmd.set_texture(0, 0, *component_layer_views[c][input_level], *mirror_repeat_sampler);
+				cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
+				cmd.end_region();
+			}
+		}
+		else
+		{
+			if (!rgb_conversion)
+			{
+				set_output(*views.planes[0], true, false);
+				cmd.begin_region("iDWT final");
+				cmd.set_texture(0, 0, *component_layer_views[0][input_level], *mirror_repeat_sampler);
+				cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
+				cmd.end_region();
+			}
+
+			if (chroma == ChromaSubsampling::Chroma422)
 			{
-				for (int c = 0; c < NumComponents; c++)
+				// CbCr was only split vertically. Even and odd columns are synthesized as if they were
+				// horizontal low and high bands, so the transposed band is half as tall.
+				push.resolution.y /= 2;
+				push.inv_resolution.y = 1.0f / float(push.resolution.y);
+				cmd.set_specialization_constant_mask(0x31);
+				cmd.set_specialization_constant(4, true);
+
+				for (int c = 1; c < NumComponents; c++)
 				{
 					char label[64];
-					snprintf(label, sizeof(label), "iDWT final, component %u", c);
+					snprintf(label, sizeof(label), "iDWT final vertical, component %u", c);
 					cmd.begin_region(label);
-					cmd.set_storage_texture(0, 1, *views.planes[c]);
+					set_output(*views.planes[c], !rgb_conversion, false);
 					cmd.set_texture(0, 0, *component_layer_views[c][input_level], *mirror_repeat_sampler);
 					cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
 					cmd.end_region();
 				}
 			}
-			else
-			{
-				cmd.set_storage_texture(0, 1, *views.planes[0]);
-				cmd.begin_region("iDWT final");
-				cmd.set_texture(0, 0, *component_layer_views[0][input_level], *mirror_repeat_sampler);
-				cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
-				cmd.end_region();
-			}
 		}
-		else
+	}
+	else
+	{
+		for (int c = 0; c < NumComponents; c++)
 		{
-			for (int c = 0; c < NumComponents; c++)
+			cmd.set_texture(0, 0, *component_layer_views[c][input_level], *mirror_repeat_sampler);
+
+			if (chroma == ChromaSubsampling::Chroma420 && c != 0 && input_level == 1)
 			{
-				cmd.set_texture(0, 0, *component_layer_views[c][input_level], *mirror_repeat_sampler);
+				set_output(*views.planes[c], !rgb_conversion, true);
+				cmd.set_specialization_constant(0, true);
+			}
+			else
+				set_output(*component_ll_views[c][input_level - 1], false, false);
 
-				if (chroma == ChromaSubsampling::Chroma420 && c != 0 && input_level == 1)
-				{
-					cmd.set_storage_texture(0, 1, *views.planes[c]);
-					cmd.set_specialization_constant(0, true);
-				}
-				else
-					cmd.set_storage_texture(0, 1, *component_ll_views[c][input_level - 1]);
+			char label[64];
+			snprintf(label, sizeof(label), "iDWT level %u, component %u", input_level - 1, c);
+			cmd.begin_region(label);
+			cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
+			cmd.end_region();
+		}
+	}
 
-				char label[64];
-				snprintf(label, sizeof(label), "iDWT level %u, component %u", input_level - 1, c);
-				cmd.begin_region(label);
-				cmd.dispatch((push.resolution.x + 15) / 16, (push.resolution.y + 15) / 16, 1);
-				cmd.end_region();
+	cmd.set_specialization_constant_mask(0);
+}
+
+void Decoder::Impl::record_idwt(CommandBuffer &cmd, const ViewBuffers &views)
+{
+	cmd.enable_subgroup_size_control(false);
+
+	if (rgb_conversion)
+		idwt_barriers(cmd);
+
+	auto start_idwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+	// Components of a level are independent, so we only need one barrier per level.
+	for (int input_level = decomposition_levels - 1; input_level >= 0; input_level--)
+	{
+		dispatch_idwt(cmd, views, input_level, false);
+
+		if (input_level == 0 && rgb_conversion)
+		{
+			// With 444 or 422 RGB output, chroma is completed at level 0 as well,
+			// and must be complete before the fused luma pass.
+			if (chroma != ChromaSubsampling::Chroma420)
+			{
+				cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+				            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
 			}
+
+			dispatch_idwt(cmd, views, input_level, true);
 		}
 
-		cmd.set_specialization_constant_mask(0);
 		cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
 		            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
 	}
 
 	auto end_idwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 	device->register_time_interval("GPU", std::move(start_idwt), std::move(end_idwt), "iDWT");
+}
+
+bool Decoder::Impl::slice_is_ready(int slice_index, uint32_t epoch, bool allow_partial_slice) const
+{
+	auto &slice = slices[slice_index];
+	int decoded = int(epoch_value(slice.decoded_blocks, epoch, 0));
+	int total_blocks = int(epoch_value(slice.total_blocks, epoch, block_count_32x32));
+
+	// Need at least half of the slice decoded to accept, otherwise we assume the slice is complete garbage.
+	if (decoded < total_blocks)
+		if (!allow_partial_slice || decoded <= total_blocks / 2)
+			return false;
+
+	// Every coded block has an enhancement layer block as well.
+	// A partial enhancement layer is fine, since missing blocks just decode at base layer quality.
+	if (num_layers > 1 && !allow_partial_slice && epoch_value(enhancement_planes_in_sequence, epoch, 0) != 0)
+		if (int(epoch_value(slice.decoded_enhancement_blocks, epoch, 0)) < total_blocks)
+			return false;
+
 	return true;
 }
 
 bool Decoder::Impl::decode_is_ready(bool allow_partial_frame) const
 {
-	if (decoded_frame_for_current_sequence)
+	uint64_t state = sequence_state.load(std::memory_order_acquire);
+	if (tag_value(state) == UINT32_MAX)
 		return false;
 
-	if (last_seq == UINT32_MAX)
+	uint32_t epoch = tag_epoch(state);
+	if (decoded_epoch.load(std::memory_order_relaxed) == epoch)
 		return false;
 
-	// Need at least half of the frame decoded to accept, otherwise we assume the frame is complete garbage.
-	if (decoded_blocks < total_blocks_in_sequence)
-		if (!allow_partial_frame || decoded_blocks <= total_blocks_in_sequence / 2)
+	for (int i = 0; i < num_slices; i++)
+		if (!slice_is_ready(i, epoch, allow_partial_frame))
 			return false;
 
 	return true;
 }
 
-bool Decoder::Impl::decode(CommandBuffer &cmd, const ViewBuffers &views)
+bool Decoder::Impl::decode_slice_is_ready(int slice_index, bool allow_partial_slice) const
+{
+	if (slice_index < 0 || slice_index >= num_slices)
+		return false;
+
+	uint64_t state = sequence_state.load(std::memory_order_acquire);
+	if (tag_value(state) == UINT32_MAX)
+		return false;
+
+	uint32_t epoch = tag_epoch(state);
+	if (decoded_epoch.load(std::memory_order_relaxed) == epoch ||
+	    slices[slice_index].decoded_epoch.load(std::memory_order_relaxed) == epoch)
+		return false;
+
+	return slice_is_ready(slice_index, epoch, allow_partial_slice);
+}
+
+uint32_t Decoder::Impl::upload(CommandBuffer &cmd, int first_slice, int count)
+{
+	uint32_t epoch = tag_epoch(sequence_state.load(std::memory_order_acquire));
+	current_enhancement_planes = int(epoch_value(enhancement_planes_in_sequence, epoch, 0));
+
+	int frame_blocks = get_frame_block_count();
+	int first_block = first_slice * block_count_32x32;
+	int num_blocks = count * block_count_32x32;
+
+	// Only the payload which the blocks of the slices refer to is uploaded.
+	uint32_t payload_begin = UnpublishedBlockOffset;
+	uint32_t last_block_offset = UnpublishedBlockOffset;
+
+	for (int layer = 0; layer < MaxLayers; layer++)
+	{
+		int slot_offset = layer * frame_blocks + first_block;
+		auto *offsets = static_cast<uint32_t *>(
+				cmd.update_buffer(*dequant_offset_buffer, slot_offset * sizeof(uint32_t), num_blocks * sizeof(uint32_t)));
+
+		for (int i = 0; i < num_blocks; i++)
+		{
+			auto &slot = block_offsets[slot_offset + i];
+			uint64_t v = slot.load(std::memory_order_acquire);
+			if (tag_epoch(v) == epoch)
+			{
+				uint32_t offset = tag_value(v);
+				offsets[i] = offset;
+				if (offset != UnpublishedBlockOffset)
+				{
+					payload_begin = std::min(payload_begin, offset);
+					if (last_block_offset == UnpublishedBlockOffset || offset > last_block_offset)
+						last_block_offset = offset;
+				}
+			}
+			else
+			{
+				offsets[i] = UINT32_MAX;
+				// Re-tag stale blocks so that epoch wrap-around can never make them look newer than the current frame.
+				// Frames which started after we sampled the epoch may have claimed blocks already, leave those alone.
+				if (uint32_t(tag_epoch(v) - epoch) > SequenceCountMask)
+				{
+					slot.compare_exchange_strong(v, epoch_tag(epoch - 1, UINT32_MAX),
+					                             std::memory_order_relaxed, std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+
+	// Blocks are copied into the arena before they are published, so every offset read above
+	// refers to payload which is in the arena by now.
+	upload_payload(cmd, epoch, payload_begin, last_block_offset);
+
+	return epoch;
+}
+
+bool Decoder::Impl::record_decode(CommandBuffer &cmd, const ViewBuffers &views, int first_slice, int count)
 {
 	cmd.begin_region("Decode uploads");
+	uint32_t epoch = upload(cmd, first_slice, count);
+	cmd.barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+	            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+	            use_readonly_texel_buffer ? VK_ACCESS_2_SHADER_SAMPLED_READ_BIT : VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+	cmd.end_region();
+
+	// Slices share the wavelet images, so they are decoded one after the other.
+	// The barriers at the end of the iDWT order the next dequant after the reads of the previous slice.
+	for (int slice = 0; slice < count; slice++)
 	{
-		upload_payload(cmd);
+		current_slice = first_slice + slice;
+
+		if (!record_dequant(cmd))
+			return false;
 
-		memcpy(cmd.update_buffer(*dequant_offset_buffer, 0,
-		                         dequant_offset_buffer_cpu.size() * sizeof(dequant_offset_buffer_cpu.front())),
-		       dequant_offset_buffer_cpu.data(), dequant_offset_buffer_cpu.size() * sizeof(dequant_offset_buffer_cpu.front()));
+		cmd.barrier(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, 0, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
 
-		cmd.barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
-		            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
-		            use_readonly_texel_buffer ? VK_ACCESS_2_SHADER_SAMPLED_READ_BIT : VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+		if (fragment_path)
+		{
+			if (!idwt_fragment(cmd, views))
+				return false;
+		}
+		else
+		{
+			record_idwt(cmd, views);
+		}
 	}
-	cmd.end_region();
 
-	if (!dequant(cmd))
+	for (int slice = 0; slice < count; slice++)
+		slices[first_slice + slice].decoded_epoch.store(epoch, std::memory_order_relaxed);
+	if (count == num_slices)
+		decoded_epoch.store(epoch, std::memory_order_relaxed);
+
+	return true;
+}
+
+bool Decoder::Impl::decode(CommandBuffer &cmd, const ViewBuffers &views)
+{
+	return record_decode(cmd, views, 0, num_slices);
+}
+
+bool Decoder::Impl::decode_slice(CommandBuffer &cmd, const ViewBuffers &views, int slice_index)
+{
+	if (!slice_height || slice_index < 0 || slice_index >= num_slices)
+	{
+		LOGE("Slice %d is out of range.\n", slice_index);
 		return false;
+	}
 
-	cmd.barrier(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, 0, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	return record_decode(cmd, views, slice_index, 1);
+}
+
+ImageCreateInfo Decoder::Impl::get_rgb_chroma_info() const
+{
+	int chroma_width = chroma != ChromaSubsampling::Chroma444 ? width / 2 : width;
+	int chroma_height = chroma == ChromaSubsampling::Chroma420 ? height / 2 : height;
+
+	auto info = ImageCreateInfo::immutable_2d_image(chroma_width, chroma_height, VK_FORMAT_R16_SFLOAT);
+	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
 
 	if (fragment_path)
 	{
-		if (!idwt_fragment(cmd, views))
-			return false;
+		info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
 	}
 	else
 	{
-		if (!idwt(cmd, views))
+		info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		info.layout = ImageLayout::General;
+	}
+
+	return info;
+}
+
+bool Decoder::Impl::init_rgb_chroma()
+{
+	// The 444 fragment path has all components available in the final pass already.
+	if (rgb_chroma[0] || (fragment_path && chroma == ChromaSubsampling::Chroma444))
+		return true;
+
+	auto info = get_rgb_chroma_info();
+	for (int i = 0; i < 2; i++)
+	{
+		rgb_chroma[i] = create_image(info, i == 0 ? "rgb-chroma-cb" : "rgb-chroma-cr");
+		if (!rgb_chroma[i])
+		{
+			LOGE("Failed to allocate chroma images for RGB output.\n");
 			return false;
+		}
 	}
 
-	decoded_frame_for_current_sequence = true;
 	return true;
 }
 
+void Decoder::Impl::set_rgb_specialization_constants(CommandBuffer &cmd, unsigned first_constant)
+{
+	cmd.set_specialization_constant(first_constant + 0, rgb_conversion->transform == YCbCrTransform::BT2020);
+	cmd.set_specialization_constant(first_constant + 1, rgb_conversion->range == YCbCrRange::Full);
+	cmd.set_specialization_constant(first_constant + 2,
+	                                chroma != ChromaSubsampling::Chroma444 &&
+	                                rgb_conversion->siting == ChromaSiting::Left);
+}
+
+bool Decoder::Impl::prepare_rgb_views(const ImageView &view, ViewBuffers &views)
+{
+	if (!init_rgb_chroma())
+		return false;
+
+	// Chroma outputs are redirected to internal images, and the final luma pass writes RGB.
+	views = {};
+	views.planes[0] = &view;
+	if (rgb_chroma[0])
+	{
+		views.planes[1] = &rgb_chroma[0]->get_view();
+		views.planes[2] = &rgb_chroma[1]->get_view();
+	}
+
+	return true;
+}
+
+bool Decoder::Impl::decode_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion)
+{
+	ViewBuffers views;
+	if (!prepare_rgb_views(view, views))
+		return false;
+
+	rgb_conversion = &conversion;
+	bool ret = decode(cmd, views);
+	rgb_conversion = nullptr;
+	return ret;
+}
+
+bool Decoder::Impl::decode_slice_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+                                     int slice_index)
+{
+	ViewBuffers views;
+	if (!prepare_rgb_views(view, views))
+		return false;
+
+	rgb_conversion = &conversion;
+	bool ret = decode_slice(cmd, views, slice_index);
+	rgb_conversion = nullptr;
+	return ret;
+}
+
 void Decoder::Impl::clear()
 {
-	std::fill(dequant_offset_buffer_cpu.begin(), dequant_offset_buffer_cpu.end(), UINT32_MAX);
-	decoded_blocks = 0;
-	last_seq = UINT32_MAX;
-	decoded_frame_for_current_sequence = false;
-	total_blocks_in_sequence = block_count_32x32;
-	payload_data_cpu.clear();
+	// Bumping the epoch throws away everything queued for the current frame.
+	uint64_t state = sequence_state.load(std::memory_order_relaxed);
+	while (!sequence_state.compare_exchange_weak(state, epoch_tag(tag_epoch(state) + 1, UINT32_MAX),
+	                                             std::memory_order_acq_rel, std::memory_order_relaxed))
+	{
+	}
 }
 
 bool Decoder::device_prefers_fragment_path(Vulkan::Device &device)
@@ -880,14 +1720,14 @@ void Decoder::Impl::check_linear_texture_support()
 	// Just assume this works. Can't imagine any GPU where this wouldn't work tightly packed.
 
 	BufferCreateInfo bufinfo;
-	bufinfo.size = 4 * 1024 * 1024;
+	bufinfo.size = LinearPayloadSize;
 	bufinfo.usage =
 			VK_BUFFER_USAGE_TRANSFER_DST_BIT |
 			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
 			VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT;
 	bufinfo.domain = BufferDomain::Device;
 	bufinfo.allocation_requirements.alignment = 64 * 1024;
-	bufinfo.allocation_requirements.size = 4 * 1024 * 1024;
+	bufinfo.allocation_requirements.size = LinearPayloadSize;
 	bufinfo.allocation_requirements.memoryTypeBits = UINT32_MAX;
 	payload_data = device->create_buffer(bufinfo);
 	device->set_name(*payload_data, "payload-data");
@@ -920,7 +1760,8 @@ void Decoder::Impl::check_linear_texture_support()
 		LOGI("Using linear textures instead of texel buffers.\n");
 }
 
-bool Decoder::init(Vulkan::Device *device, int width, int height, ChromaSubsampling chroma_, bool fragment_path_)
+bool Decoder::init(Vulkan::Device *device, int width, int height, ChromaSubsampling chroma_, bool fragment_path_,
+                   int decomposition_levels, WaveletTransform transform_, int slice_height)
 {
 	auto ops = device->get_device_features().vk11_props.subgroupSupportedOperations;
 	constexpr VkSubgroupFeatureFlags required_features =
@@ -945,7 +1786,18 @@ bool Decoder::init(Vulkan::Device *device, int width, int height, ChromaSubsampl
 		return false;
 	}
 
-	if (!impl->init(device, width, height, chroma_, fragment_path_))
+	// Lazily allocated resources are returned to the pool by init().
+	for (auto &comp : impl->rgb_chroma)
+		comp.reset();
+	impl->payload_data.reset();
+	impl->payload_u8_view.reset();
+	impl->payload_u16_view.reset();
+	impl->payload_u32_view.reset();
+	impl->payload_r8_image.reset();
+	impl->payload_r16_image.reset();
+	impl->payload_r32_image.reset();
+
+	if (!impl->init(device, width, height, chroma_, fragment_path_, decomposition_levels, transform_, slice_height))
 	{
 		LOGE("Failed to initialize.\n");
 		return false;
@@ -958,7 +1810,23 @@ bool Decoder::init(Vulkan::Device *device, int width, int height, ChromaSubsampl
 		return false;
 	}
 
-	impl->check_linear_texture_support();
+	auto payload_path = Configuration::get().get_payload_path();
+	if (payload_path != PayloadPath::Auto && payload_path != PayloadPath::StorageBuffer &&
+	    !impl->use_readonly_texel_buffer)
+	{
+		LOGE("Device doesn't support large texel buffers.\n");
+		return false;
+	}
+
+	if (payload_path != PayloadPath::TexelBuffer)
+		impl->check_linear_texture_support();
+
+	if (payload_path == PayloadPath::LinearImage &&
+	    !(impl->payload_r8_image && impl->payload_r16_image && impl->payload_r32_image))
+	{
+		LOGE("Device doesn't support linear payload images.\n");
+		return false;
+	}
 
 	clear();
 	return true;
@@ -971,7 +1839,13 @@ void Decoder::clear()
 
 bool Decoder::push_packet(const void *data, size_t size)
 {
-	return impl->push_packet(data, size);
+	PacketData packet = { data, size };
+	return impl->push_packets(&packet, 1);
+}
+
+bool Decoder::push_packets(const PacketData *packets, size_t count)
+{
+	return impl->push_packets(packets, count);
 }
 
 bool Decoder::decode(Vulkan::CommandBuffer &cmd, const ViewBuffers &views)
@@ -979,6 +1853,77 @@ bool Decoder::decode(Vulkan::CommandBuffer &cmd, const ViewBuffers &views)
 	return impl->decode(cmd, views);
 }
 
+bool Decoder::decode_rgb(Vulkan::CommandBuffer &cmd, const Vulkan::ImageView &view, const ColorConversion &conversion)
+{
+	return impl->decode_rgb(cmd, view, conversion);
+}
+
+bool Decoder::decode_slice(Vulkan::CommandBuffer &cmd, const ViewBuffers &views, int slice_index)
+{
+	return impl->decode_slice(cmd, views, slice_index);
+}
+
+bool Decoder::decode_slice_rgb(Vulkan::CommandBuffer &cmd, const Vulkan::ImageView &view,
+                               const ColorConversion &conversion, int slice_index)
+{
+	return impl->decode_slice_rgb(cmd, view, conversion, slice_index);
+}
+
+bool Decoder::decode_slice_is_ready(int slice_index, bool allow_partial_slice) const
+{
+	return impl->decode_slice_is_ready(slice_index, allow_partial_slice);
+}
+
+int Decoder::get_num_slices() const
+{
+	return impl->num_slices;
+}
+
+bool Decoder::query_memory_requirements(int width, int height, ChromaSubsampling chroma, bool fragment_path,
+                                        int decomposition_levels, WaveletTransform transform, int slice_height,
+                                        MemoryRequirements &reqs)
+{
+	Impl layout;
+	if (!layout.init_layout(width, height, chroma, fragment_path, decomposition_levels, transform, slice_height))
+		return false;
+
+	reqs = layout.get_memory_requirements();
+	return true;
+}
+
+bool Decoder::set_memory_budget(uint64_t bytes)
+{
+	if (bytes && impl->get_fixed_memory_size() + MinPayloadSize > bytes)
+	{
+		LOGE("Memory budget of %llu bytes cannot hold the decoder's fixed resources.\n",
+		     static_cast<unsigned long long>(bytes));
+		return false;
+	}
+
+	impl->memory_budget = bytes;
+	return true;
+}
+
+void Decoder::set_resource_pool(ResourcePool *pool)
+{
+	impl->pool = pool;
+}
+
+void Decoder::set_num_layers(int layers)
+{
+	impl->num_layers = std::max(1, std::min(layers, MaxLayers));
+}
+
+int Decoder::get_packet_layer(const void *data, size_t size)
+{
+	if (size < sizeof(BitstreamHeader))
+		return -1;
+
+	// Sequence headers are always in the first packet of the base layer.
+	auto *header = static_cast<const BitstreamHeader *>(data);
+	return header->extended ? 0 : int(header->layer);
+}
+
 bool Decoder::decode_is_ready(bool allow_partial_frame) const
 {
 	return impl->decode_is_ready(allow_partial_frame);
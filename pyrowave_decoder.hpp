@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "pyrowave_config.hpp"
+#include "pyrowave_pool.hpp"
 
 namespace Vulkan
 {
@@ -25,21 +26,88 @@ public:
 	// Fragment path is optimized for typical mobile GPUs which have weak compute support.
 	// iDWT is instead computed entirely in traditional render passes and fragment shaders.
 	// This path is *not* recommended for desktop-class chips.
+	// decomposition_levels and transform must match the encoder. A mismatch is reported by push_packet().
+	// The reversible transform is only supported in the compute path.
+	// slice_height must match the encoder as well, and slice mode is only supported in the compute path.
 	bool init(Vulkan::Device *device, int width, int height,
-	          ChromaSubsampling chroma, bool fragment_path = false);
+	          ChromaSubsampling chroma, bool fragment_path = false,
+	          int decomposition_levels = DefaultDecompositionLevels,
+	          WaveletTransform transform = WaveletTransform::CDF97,
+	          int slice_height = 0);
+
+	// Allocates images and buffers through a pool shared with other sessions, see ResourcePool.
+	// Must be called before init(). nullptr allocates directly from the device.
+	void set_resource_pool(ResourcePool *pool);
 
 	static bool device_prefers_fragment_path(Vulkan::Device &device);
 
+	// Device memory a decoder with these parameters needs at most, without creating it.
+	// Includes the chroma images for decode_rgb() and a payload buffer for the largest possible frame.
+	// host_visible is always 0, packets are queued in plain host memory.
+	static bool query_memory_requirements(int width, int height, ChromaSubsampling chroma, bool fragment_path,
+	                                      int decomposition_levels, WaveletTransform transform, int slice_height,
+	                                      MemoryRequirements &reqs);
+
+	// Caps device_local as reported by query_memory_requirements() by growing the payload buffer
+	// without slack once it gets close to the budget. A frame larger than the budget allows is still uploaded.
+	// Must be called after init(). Fails if the fixed resources alone exceed the budget.
+	// 0 removes the budget, which is the default.
+	bool set_memory_budget(uint64_t bytes);
+
 	void clear();
+
+	// push_packet() is thread-safe and may be called concurrently from multiple threads,
+	// also concurrently with decode_is_ready().
+	// clear() and decode() must be externally synchronized against push_packet().
+	// Never blocks. If another thread is still copying a packet for the frame two sequences back,
+	// the packet cannot be stored yet and false is returned. Pushing it again once that thread is done succeeds.
 	bool push_packet(const void *data, size_t size);
 
+	struct PacketData
+	{
+		const void *data;
+		size_t size;
+	};
+
+	// Same as calling push_packet() for every packet, but payload space is reserved for many blocks at once.
+	// Useful when receiving many datagrams at once, e.g. with recvmmsg().
+	// If a packet fails to parse, the remaining packets are skipped and false is returned.
+	bool push_packets(const PacketData *packets, size_t count);
+
 	// If fragment path is enabled, the command buffer must support graphics operations.
 	// To synchronize, synchronize with COLOR_OUTPUT / COLOR_ATTACHMENT_WRITE / COLOR_ATTACHMENT_OPTIMAL.
 	// Views must be created with VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT.
 	bool decode(Vulkan::CommandBuffer &cmd, const ViewBuffers &views);
 
+	// Final iDWT pass is fused with YCbCr to RGB conversion and writes directly to an RGB(A) image,
+	// e.g. RGBA8 or RGB10A2 UNORM. Alpha is written as 1.
+	// For the compute path, the view must be created with VK_IMAGE_USAGE_STORAGE_BIT.
+	// For the fragment path, synchronization rules are the same as decode(), and swapchain images can be used directly.
+	bool decode_rgb(Vulkan::CommandBuffer &cmd, const Vulkan::ImageView &view, const ColorConversion &conversion);
+
 	bool decode_is_ready(bool allow_partial_frame) const;
 
+	// In slice mode, decode() writes every slice of the frame, while decode_slice() only writes the rows
+	// of slice_index into the full frame views, so slices can be presented as they complete.
+	// Slice packets may arrive in any order. A slice is only decoded once per frame,
+	// and decode_slice_is_ready() returns false for it afterwards, or once the whole frame was decoded.
+	bool decode_slice(Vulkan::CommandBuffer &cmd, const ViewBuffers &views, int slice_index);
+	bool decode_slice_rgb(Vulkan::CommandBuffer &cmd, const Vulkan::ImageView &view,
+	                      const ColorConversion &conversion, int slice_index);
+	bool decode_slice_is_ready(int slice_index, bool allow_partial_slice) const;
+	// 1 when not in slice mode.
+	int get_num_slices() const;
+
+	// With SNR layers, blocks in layers at or above this count are ignored, and decode_is_ready()
+	// does not wait for them. Defaults to all layers. Must be externally synchronized like clear().
+	// Without allow_partial_frame, decode_is_ready() waits for the complete enhancement layer,
+	// otherwise whatever arrived of it is used on top of the base layer.
+	void set_num_layers(int layers);
+
+	// Layer of a packet from Encoder::packetize(), so relays can forward layers selectively.
+	// Returns -1 if the packet is too small to tell.
+	static int get_packet_layer(const void *data, size_t size);
+
 private:
 	struct Impl;
 	std::unique_ptr<Impl> impl;
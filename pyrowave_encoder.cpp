@@ -8,6 +8,7 @@
 #include "pyrowave_common.hpp"
 #include <algorithm>
 #include <cmath>
+#include <limits>
 
 namespace PyroWave
 {
@@ -18,6 +19,10 @@ static constexpr int BlockSpaceSubdivision = 16;
 static constexpr int NumRDOBuckets = 128;
 static constexpr int RDOBucketOffset = 64;
 
+// Payload scratch holds every block before rate control drops bit-planes, so it is sized for the worst case.
+// Only a memory budget shrinks it, and never below this.
+static constexpr size_t MinPayloadScratchSize = 1024 * 1024;
+
 static int compute_block_count_per_subdivision(int num_blocks)
 {
 	int per_subdivision = align(num_blocks, BlockSpaceSubdivision) / BlockSpaceSubdivision;
@@ -35,6 +40,7 @@ struct QuantizerPushData
 	int32_t block_offset;
 	int32_t block_stride;
 	float rdo_distortion_scale;
+	uint32_t payload_capacity;
 };
 
 struct BlockPackingPushData
@@ -48,6 +54,21 @@ struct BlockPackingPushData
 	uint32_t block_stride_32x32;
 	uint32_t block_offset_8x8;
 	uint32_t block_stride_8x8;
+	int32_t enhancement_planes;
+	uint32_t layer;
+	int32_t meta_offset;
+	uint32_t meta_trailer_index;
+	uint32_t slice_index;
+	uint32_t block_index_offset;
+};
+
+struct DWTPushData
+{
+	uvec2 resolution;
+	vec2 inv_resolution;
+	uvec2 aligned_resolution;
+	int32_t input_row_offset;
+	float inv_input_height;
 };
 
 struct AnalyzeRateControlPushData
@@ -61,6 +82,8 @@ struct AnalyzeRateControlPushData
 	uint32_t total_wg_count;
 	uint32_t num_blocks_aligned;
 	uint32_t block_index_shamt;
+	uint32_t enhancement_planes;
+	uint32_t base_layer_pass;
 };
 
 struct RDOperation
@@ -73,24 +96,81 @@ struct RDOperation
 struct Encoder::Impl final : public WaveletBuffers
 {
 	BufferHandle bucket_buffer, meta_buffer, block_stat_buffer, payload_data, quant_buffer;
+	BufferHandle quant_readback, block_stat_readback, payload_counter_readback;
+	bool stats_readback_recorded = false;
+	uint32_t readback_payload_capacity = 0;
+
+	// Non-null while recording an encode from an RGB image. All planes in the ViewBuffers point to that image.
+	const ColorConversion *rgb_conversion = nullptr;
+
+	// In slice mode, the slice which is being encoded. Its blocks follow the blocks of the slices above it.
+	int current_slice = 0;
+
+	// With SNR layers, every block is split into a base layer without this many of the lowest planes,
+	// and an enhancement layer with those planes. Meta for the enhancement layer follows the base layer.
+	int enhancement_planes = 0;
+	int get_num_layers() const { return enhancement_planes ? MaxLayers : 1; }
+	bool needs_base_layer_pass(const BitstreamBuffers &buffers) const
+	{
+		return enhancement_planes && buffers.base_layer_target_size;
+	}
 
 	bool encode(CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers);
+	bool encode_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+	                const BitstreamBuffers &buffers);
 	bool encode_pre_transformed(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
-	bool encode_quant_and_coding(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
-
-	bool dwt(CommandBuffer &cmd, const ViewBuffers &views);
-	bool quant(CommandBuffer &cmd, float quant_scale);
-	bool analyze_rdo(CommandBuffer &cmd);
-	bool resolve_rdo(CommandBuffer &cmd, size_t target_payload_size);
-	bool block_packing(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
+	bool encode_slice(CommandBuffer &cmd, const ViewBuffers &views, int slice_index, const BitstreamBuffers &buffers);
+	bool encode_slice_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+	                      int slice_index, const BitstreamBuffers &buffers);
+
+	bool record_encode(CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers);
+	bool record_quant_and_coding(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
+	void record_dwt(CommandBuffer &cmd, const ViewBuffers &views);
+	bool record_quant(CommandBuffer &cmd, float quant_scale);
+	bool record_rate_control(CommandBuffer &cmd, const BitstreamBuffers &buffers);
+	bool record_analyze_rdo(CommandBuffer &cmd, bool base_layer_pass);
+	bool record_resolve_rdo(CommandBuffer &cmd, size_t target_size);
+	bool record_block_packing(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
+
+	void begin_frame(CommandBuffer &cmd);
+	bool init_payload_data(size_t target_size);
+	void clear_buffers(CommandBuffer &cmd);
+	bool validate_slice_index(int slice_index) const;
+	void dispatch_dwt(CommandBuffer &cmd, const ViewBuffers &views, int output_level);
+	void set_dwt_input(CommandBuffer &cmd, DWTPushData &push, uvec2 resolution, bool half_rows) const;
+	void set_rgb_input(CommandBuffer &cmd, int component, bool downsample);
+	uvec2 get_chroma_input_resolution(const ViewBuffers &views, int component) const;
+	void dispatch_quant(CommandBuffer &cmd, float quant_scale);
+	void dispatch_analyze_rdo(CommandBuffer &cmd, bool base_layer_pass);
+	void dispatch_analyze_rdo_finalize(CommandBuffer &cmd);
+	void dispatch_resolve_rdo(CommandBuffer &cmd, size_t target_payload_size);
+	void dispatch_block_packing(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
+	void copy_stats_readback(CommandBuffer &cmd);
+
+	bool set_stats_readback(bool enable);
+	void get_frame_stats(FrameStats &stats, const void *mapped_meta, size_t packet_boundary) const;
 
 	float get_noise_power_normalized_quant_resolution(int level, int component, int band) const;
+	float get_reversible_synthesis_gain(int level, int component, int band) const;
 	float get_quant_resolution(int level, int component, int band) const;
 	float get_quant_rdo_distortion_scale(int level, int component, int band) const;
 
 	void init_block_meta() override;
+	uint64_t get_device_memory_size() const;
+
+	// 0 is unlimited. Only the payload scratch shrinks to fit, everything else is fixed by the layout.
+	uint64_t memory_budget = 0;
+	VkDeviceSize get_max_payload_size() const;
+	VkDeviceSize get_min_payload_scratch_size() const;
+	uint32_t get_payload_capacity() const;
+	VkDeviceSize get_bucket_buffer_size() const;
+	uint64_t get_meta_trailer_offset() const;
+	uint64_t get_meta_required_size() const;
+	MemoryRequirements get_memory_requirements(size_t target_size) const;
 
 	size_t compute_num_packets(const void *meta, size_t packet_boundary) const;
+	size_t get_sequence_header_size() const;
+	bool has_sequence_parameters() const;
 
 	size_t packetize(Packet *packets, size_t packet_boundary,
 	                 void *bitstream, size_t size,
@@ -125,16 +205,18 @@ float Encoder::Impl::get_quant_rdo_distortion_scale(int level, int component, in
 	float csf = 2.6f * (0.0192f + 0.114f * cpd) * std::exp(-std::pow(0.114f * cpd, 1.1f));
 
 	// Heavily discount chroma quality.
-	if (component != 0 && level != DecompositionLevels - 1)
+	if (component != 0 && level != decomposition_levels - 1)
 	{
 		// Consider chroma a little more important if we're not subsampling.
-		if (chroma == ChromaSubsampling::Chroma420)
+		if (chroma != ChromaSubsampling::Chroma444)
 			csf *= 0.6f;
 	}
 
 	// Due to filtering, distortion in lower bands will result in more noise power.
 	// By scaling the distortion by this factor, we ensure uniform results.
-	float resolution = get_noise_power_normalized_quant_resolution(level, component, band);
+	float resolution = transform == WaveletTransform::LeGall53 ?
+	                   get_reversible_synthesis_gain(level, component, band) :
+	                   get_noise_power_normalized_quant_resolution(level, component, band);
 	float weighted_resolution = csf * resolution;
 
 	// The distortion is scaled in terms of power, not amplitude.
@@ -143,6 +225,10 @@ float Encoder::Impl::get_quant_rdo_distortion_scale(int level, int component, in
 
 float Encoder::Impl::get_quant_resolution(int level, int component, int band) const
 {
+	// Coefficients are already integers. Any extra quantization has to come from dropping bit-planes.
+	if (transform == WaveletTransform::LeGall53)
+		return 1.0f;
+
 	// FP16 range is limited, and this is more than a good enough initial estimate.
 	return std::min<float>(
 			Configuration::get().get_precision() >= 1 ? 4096.0f : 512.0f,
@@ -171,43 +257,163 @@ float Encoder::Impl::get_noise_power_normalized_quant_resolution(int level, int
 	return float(1 << bits);
 }
 
-void Encoder::Impl::init_block_meta()
+float Encoder::Impl::get_reversible_synthesis_gain(int level, int component, int band) const
 {
-	WaveletBuffers::init_block_meta();
+	// The 5/3 low-pass has unity DC gain, so the integer coefficients are not normalized like the 9/7 ones.
+	// Approximate the synthesis gain of a coefficient instead, which doubles every decomposition level.
+	// Sample values are 8-bit integers rather than normalized, which puts this in the same range
+	// as the noise power normalized resolution.
+	static const float band_gain[] = { 2.0f, 1.0f, 1.0f, 0.75f };
+	float gain = band_gain[band] * float(1 << level);
+
+	// Chroma starts at level 1.
+	if (component != 0)
+		gain *= 0.5f;
+
+	return gain;
+}
 
+void Encoder::Impl::init_block_meta()
+{
 	BufferCreateInfo info;
 	info.domain = BufferDomain::Device;
 	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
+	// Can be read back for frame stats.
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
 	info.size = block_count_8x8 * sizeof(BlockStats);
-	block_stat_buffer = device->create_buffer(info);
-	device->set_name(*block_stat_buffer, "block-stat-buffer");
+	block_stat_buffer = create_buffer(info, "block-stat-buffer");
+
+	info.size = block_count_32x32 * sizeof(uint32_t);
+	quant_buffer = create_buffer(info, "quant-buffer");
+
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 
 	info.size = block_count_8x8 * sizeof(BlockMeta);
-	meta_buffer = device->create_buffer(info);
-	device->set_name(*meta_buffer, "meta-buffer");
+	meta_buffer = create_buffer(info, "meta-buffer");
+
+	// Payload scratch is allocated on first encode, since the memory budget may shrink it.
+	payload_data.reset();
+
+	info.size = get_bucket_buffer_size();
+	bucket_buffer = create_buffer(info, "bucket-buffer");
+}
+
+VkDeviceSize Encoder::Impl::get_bucket_buffer_size() const
+{
+	VkDeviceSize size = RDOBucketOffset;
+	size += NumRDOBuckets * BlockSpaceSubdivision * sizeof(uint32_t);
+	size += NumRDOBuckets * compute_block_count_per_subdivision(block_count_32x32) *
+	        BlockSpaceSubdivision * sizeof(RDOperation);
+	return size;
+}
 
+VkDeviceSize Encoder::Impl::get_max_payload_size() const
+{
 	// Worst case estimate.
-	info.size = aligned_width * aligned_height * 2;
-	payload_data = device->create_buffer(info);
-	device->set_name(*payload_data, "payload-data");
+	return VkDeviceSize(aligned_width) * aligned_height * 2;
+}
 
-	info.size = block_count_32x32 * sizeof(uint32_t);
-	quant_buffer = device->create_buffer(info);
-	device->set_name(*quant_buffer, "quant-buffer");
+VkDeviceSize Encoder::Impl::get_min_payload_scratch_size() const
+{
+	return std::min<VkDeviceSize>(MinPayloadScratchSize, get_max_payload_size());
+}
 
-	info.size = RDOBucketOffset;
-	info.size += NumRDOBuckets * BlockSpaceSubdivision * sizeof(uint32_t);
-	info.size += NumRDOBuckets * compute_block_count_per_subdivision(block_count_32x32) *
-	             BlockSpaceSubdivision * sizeof(RDOperation);
-	bucket_buffer = device->create_buffer(info);
-	device->set_name(*bucket_buffer, "bucket-buffer");
+uint32_t Encoder::Impl::get_payload_capacity() const
+{
+	// The payload scratch starts with the quantizer and block packing counters.
+	return uint32_t(payload_data->get_create_info().size - 2 * sizeof(uint32_t));
 }
 
-bool Encoder::Impl::block_packing(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale)
+// packetize() may run on another thread after later frames were recorded, so anything it needs
+// which changes per frame is written into the meta buffer of that frame, after the block meta.
+uint64_t Encoder::Impl::get_meta_trailer_offset() const
+{
+	return get_num_layers() * block_count_32x32 * sizeof(BitstreamPacket);
+}
+
+uint64_t Encoder::Impl::get_meta_required_size() const
+{
+	return get_meta_trailer_offset() + sizeof(BitstreamPacket);
+}
+
+MemoryRequirements Encoder::Impl::get_memory_requirements(size_t target_size) const
+{
+	MemoryRequirements reqs = {};
+
+	reqs.device_local = get_image_memory_size();
+	reqs.device_local += block_count_8x8 * (sizeof(BlockStats) + sizeof(BlockMeta));
+	reqs.device_local += block_count_32x32 * sizeof(uint32_t);
+	reqs.device_local += get_bucket_buffer_size();
+	reqs.device_local += get_max_payload_size();
+
+	// The application provides the meta and bitstream buffers, but they are needed all the same,
+	// along with a host copy to read them back.
+	uint64_t bitstream_size = 2 * get_meta_required_size() + target_size;
+	reqs.device_local += bitstream_size;
+	reqs.host_visible += bitstream_size;
+
+	if (quant_readback)
+		reqs.host_visible += block_count_8x8 * sizeof(BlockStats) + block_count_32x32 * sizeof(uint32_t);
+
+	return reqs;
+}
+
+bool Encoder::Impl::init_payload_data(size_t target_size)
+{
+	VkDeviceSize size = get_max_payload_size();
+
+	if (memory_budget)
+	{
+		uint64_t fixed_size = get_memory_requirements(target_size).device_local - size;
+		if (fixed_size + get_min_payload_scratch_size() > memory_budget)
+		{
+			LOGE("Memory budget of %llu bytes is too small for a target size of %zu bytes.\n",
+			     static_cast<unsigned long long>(memory_budget), target_size);
+			return false;
+		}
+
+		// Blocks which do not fit in a smaller scratch are dropped by the quantizer before rate control sees them.
+		size = std::min<VkDeviceSize>(size, memory_budget - fixed_size);
+	}
+
+	// Only grow, so that alternating targets do not reallocate every frame.
+	if (payload_data && payload_data->get_create_info().size >= size)
+		return true;
+
+	BufferCreateInfo info;
+	info.domain = BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	info.size = size;
+
+	// The old scratch may still be in flight, the pool holds it back until it retires.
+	if (payload_data)
+		release_buffer(payload_data.get());
+	payload_data = create_buffer(info, "payload-data");
+	if (!payload_data)
+	{
+		LOGE("Failed to allocate payload scratch.\n");
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t Encoder::Impl::get_device_memory_size() const
+{
+	uint64_t size = get_image_memory_size();
+
+	const Buffer *buffers[] = { bucket_buffer.get(), meta_buffer.get(), block_stat_buffer.get(),
+	                            payload_data.get(), quant_buffer.get() };
+	for (auto *buffer : buffers)
+		if (buffer)
+			size += buffer->get_create_info().size;
+
+	return size;
+}
+
+void Encoder::Impl::dispatch_block_packing(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale)
 {
-	cmd.begin_region("DWT block packing");
-	auto start_packing = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 	cmd.set_program(shaders.block_packing);
 	cmd.set_storage_buffer(0, 0, *buffers.bitstream.buffer, buffers.bitstream.offset, buffers.bitstream.size);
 	cmd.set_storage_buffer(0, 1, *buffers.meta.buffer, buffers.meta.offset, buffers.meta.size);
@@ -216,17 +422,7 @@ bool Encoder::Impl::block_packing(CommandBuffer &cmd, const BitstreamBuffers &bu
 	cmd.set_storage_buffer(0, 4, *block_stat_buffer);
 	cmd.set_storage_buffer(0, 5, *quant_buffer);
 
-	if (device->supports_subgroup_size_log2(true, 4, 6))
-	{
-		cmd.set_subgroup_size_log2(true, 4, 6);
-	}
-	else
-	{
-		LOGI("No compatible subgroup size config.\n");
-		return false;
-	}
-
-	for (int level = 0; level < DecompositionLevels; level++)
+	for (int level = 0; level < decomposition_levels; level++)
 	{
 		auto level_width = wavelet_img_high_res->get_width(level);
 		auto level_height = wavelet_img_high_res->get_height(level);
@@ -241,8 +437,11 @@ bool Encoder::Impl::block_packing(CommandBuffer &cmd, const BitstreamBuffers &bu
 			snprintf(label, sizeof(label), "level %d, component %d", level, component);
 			cmd.begin_region(label);
 
-			for (int band = (level == DecompositionLevels - 1 ? 0 : 1); band < 4; band++)
+			for (int band = (level == decomposition_levels - 1 ? 0 : 1); band < 4; band++)
 			{
+				if (!band_is_coded(level, component, band))
+					continue;
+
 				BlockPackingPushData packing_push = {};
 				packing_push.resolution = ivec2(level_width, level_height);
 				packing_push.resolution_32x32_blocks = ivec2((level_width + 31) / 32, (level_height + 31) / 32);
@@ -258,16 +457,44 @@ bool Encoder::Impl::block_packing(CommandBuffer &cmd, const BitstreamBuffers &bu
 				packing_push.block_stride_32x32 = meta.block_stride_32x32;
 				packing_push.block_offset_8x8 = meta.block_offset_8x8;
 				packing_push.block_stride_8x8 = meta.block_stride_8x8;
-				cmd.push_constants(&packing_push, 0, sizeof(packing_push));
+				packing_push.enhancement_planes = enhancement_planes;
+				packing_push.meta_trailer_index = uint32_t(get_meta_trailer_offset() / sizeof(BitstreamPacket));
+				packing_push.slice_index = uint32_t(current_slice);
+				packing_push.block_index_offset = uint32_t(current_slice * block_count_32x32);
 
-				cmd.dispatch((packing_push.resolution_32x32_blocks.x + 1) / 2,
-				             (packing_push.resolution_32x32_blocks.y + 1) / 2,
-				             1);
+				for (int layer = 0; layer < get_num_layers(); layer++)
+				{
+					packing_push.layer = layer;
+					packing_push.meta_offset = layer * block_count_32x32;
+					cmd.push_constants(&packing_push, 0, sizeof(packing_push));
+
+					cmd.dispatch((packing_push.resolution_32x32_blocks.x + 1) / 2,
+					             (packing_push.resolution_32x32_blocks.y + 1) / 2,
+					             1);
+				}
 			}
 
 			cmd.end_region();
 		}
 	}
+}
+
+bool Encoder::Impl::record_block_packing(CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale)
+{
+	cmd.begin_region("DWT block packing");
+	auto start_packing = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+	if (device->supports_subgroup_size_log2(true, 4, 6))
+	{
+		cmd.set_subgroup_size_log2(true, 4, 6);
+	}
+	else
+	{
+		LOGI("No compatible subgroup size config.\n");
+		return false;
+	}
+
+	dispatch_block_packing(cmd, buffers, quant_scale);
 
 	auto end_packing = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
@@ -280,15 +507,34 @@ bool Encoder::Impl::block_packing(CommandBuffer &cmd, const BitstreamBuffers &bu
 	return true;
 }
 
-bool Encoder::Impl::resolve_rdo(CommandBuffer &cmd, size_t target_payload_size)
+void Encoder::Impl::dispatch_resolve_rdo(CommandBuffer &cmd, size_t target_payload_size)
+{
+	size_t header_size = get_sequence_header_size();
+	if (target_payload_size >= header_size)
+		target_payload_size -= header_size;
+
+	cmd.set_program(shaders.resolve_rate_control);
+
+	struct
+	{
+		uint32_t target_payload_size;
+		uint32_t num_blocks_per_subdivision;
+	} push = {};
+
+	push.target_payload_size = target_payload_size / sizeof(uint32_t);
+	push.num_blocks_per_subdivision = compute_block_count_per_subdivision(block_count_32x32);
+	cmd.push_constants(&push, 0, sizeof(push));
+	cmd.set_storage_buffer(0, 0, *bucket_buffer);
+	cmd.set_storage_buffer(0, 1, *quant_buffer);
+	cmd.dispatch(NumRDOBuckets * BlockSpaceSubdivision, 1, 1);
+}
+
+bool Encoder::Impl::record_resolve_rdo(CommandBuffer &cmd, size_t target_size)
 {
 	cmd.begin_region("DWT resolve");
 
 	auto start_resolve = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 
-	if (target_payload_size >= sizeof(BitstreamSequenceHeader))
-		target_payload_size -= sizeof(BitstreamSequenceHeader);
-
 	cmd.set_specialization_constant_mask(1);
 
 	if (device->supports_subgroup_size_log2(true, 6, 6))
@@ -312,20 +558,7 @@ bool Encoder::Impl::resolve_rdo(CommandBuffer &cmd, size_t target_payload_size)
 		return false;
 	}
 
-	cmd.set_program(shaders.resolve_rate_control);
-
-	struct
-	{
-		uint32_t target_payload_size;
-		uint32_t num_blocks_per_subdivision;
-	} push = {};
-
-	push.target_payload_size = target_payload_size / sizeof(uint32_t);
-	push.num_blocks_per_subdivision = compute_block_count_per_subdivision(block_count_32x32);
-	cmd.push_constants(&push, 0, sizeof(push));
-	cmd.set_storage_buffer(0, 0, *bucket_buffer);
-	cmd.set_storage_buffer(0, 1, *quant_buffer);
-	cmd.dispatch(NumRDOBuckets * BlockSpaceSubdivision, 1, 1);
+	dispatch_resolve_rdo(cmd, target_size);
 
 	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
 	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
@@ -337,24 +570,12 @@ bool Encoder::Impl::resolve_rdo(CommandBuffer &cmd, size_t target_payload_size)
 	return true;
 }
 
-bool Encoder::Impl::analyze_rdo(CommandBuffer &cmd)
+void Encoder::Impl::dispatch_analyze_rdo(CommandBuffer &cmd, bool base_layer_pass)
 {
-	auto start_analyze = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-	cmd.begin_region("DWT analyze");
 	cmd.set_program(shaders.analyze_rate_control);
 
-	if (device->supports_subgroup_size_log2(true, 4, 6))
-	{
-		cmd.set_subgroup_size_log2(true, 4, 6);
-	}
-	else
-	{
-		LOGI("No compatible subgroup size config.\n");
-		return false;
-	}
-
 	// Quantize
-	for (int level = 0; level < DecompositionLevels; level++)
+	for (int level = 0; level < decomposition_levels; level++)
 	{
 		for (int component = 0; component < NumComponents; component++)
 		{
@@ -368,8 +589,11 @@ bool Encoder::Impl::analyze_rdo(CommandBuffer &cmd)
 			snprintf(label, sizeof(label), "level %d, component %d", level, component);
 			cmd.begin_region(label);
 
-			for (int band = (level == DecompositionLevels - 1 ? 0 : 1); band < 4; band++)
+			for (int band = (level == decomposition_levels - 1 ? 0 : 1); band < 4; band++)
 			{
+				if (!band_is_coded(level, component, band))
+					continue;
+
 				auto level_width = wavelet_img_high_res->get_width(level);
 				auto level_height  = wavelet_img_high_res->get_height(level);
 
@@ -384,11 +608,14 @@ bool Encoder::Impl::analyze_rdo(CommandBuffer &cmd)
 				push.total_wg_count = block_count_32x32;
 				push.num_blocks_aligned = compute_block_count_per_subdivision(block_count_32x32) * BlockSpaceSubdivision;
 				push.block_index_shamt = Util::floor_log2(compute_block_count_per_subdivision(block_count_32x32));
+				push.enhancement_planes = enhancement_planes;
+				push.base_layer_pass = base_layer_pass;
 
 				cmd.push_constants(&push, 0, sizeof(push));
 
 				cmd.set_storage_buffer(0, 0, *bucket_buffer);
 				cmd.set_storage_buffer(0, 1, *block_stat_buffer);
+				cmd.set_storage_buffer(0, 2, *quant_buffer);
 
 				cmd.dispatch((level_width + 31) / 32, (level_height + 31) / 32, 1);
 			}
@@ -396,32 +623,44 @@ bool Encoder::Impl::analyze_rdo(CommandBuffer &cmd)
 			cmd.end_region();
 		}
 	}
+}
 
-	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
-
+void Encoder::Impl::dispatch_analyze_rdo_finalize(CommandBuffer &cmd)
+{
 	cmd.set_program(shaders.analyze_rate_control_finalize);
+	cmd.set_storage_buffer(0, 0, *bucket_buffer);
 	cmd.dispatch(1, 1, 1);
+}
 
-	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+bool Encoder::Impl::record_rate_control(CommandBuffer &cmd, const BitstreamBuffers &buffers)
+{
+	// With a base layer target, the base layer is rate controlled on its own first.
+	// The full pass then starts from those quantizers, so the enhancement layer gets what is left of the budget.
+	if (needs_base_layer_pass(buffers))
+	{
+		if (!record_analyze_rdo(cmd, true) || !record_resolve_rdo(cmd, buffers.base_layer_target_size))
+			return false;
 
-	cmd.end_region();
-	auto end_analyze = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-	device->register_time_interval("GPU", std::move(start_analyze), std::move(end_analyze), "Analyze");
-	return true;
+		// The full pass accumulates into the same buckets.
+		cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		            VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		cmd.fill_buffer(*bucket_buffer, 0);
+		cmd.barrier(VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+	}
+
+	return record_analyze_rdo(cmd, false) && record_resolve_rdo(cmd, buffers.target_size);
 }
 
-bool Encoder::Impl::quant(CommandBuffer &cmd, float quant_scale)
+bool Encoder::Impl::record_analyze_rdo(CommandBuffer &cmd, bool base_layer_pass)
 {
-	auto start_quant = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
-	cmd.begin_region("DWT quantize");
-	cmd.set_program(shaders.wavelet_quant);
+	auto start_analyze = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	cmd.begin_region("DWT analyze");
 
-	cmd.set_specialization_constant_mask(0);
-	if (device->supports_subgroup_size_log2(true, 3, 7))
+	if (device->supports_subgroup_size_log2(true, 4, 6))
 	{
-		cmd.set_subgroup_size_log2(true, 3, 7);
+		cmd.set_subgroup_size_log2(true, 4, 6);
 	}
 	else
 	{
@@ -429,8 +668,31 @@ bool Encoder::Impl::quant(CommandBuffer &cmd, float quant_scale)
 		return false;
 	}
 
-	// Quantize
-	for (int level = 0; level < DecompositionLevels; level++)
+	dispatch_analyze_rdo(cmd, base_layer_pass);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+	dispatch_analyze_rdo_finalize(cmd);
+
+	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+	cmd.end_region();
+	auto end_analyze = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	device->register_time_interval("GPU", std::move(start_analyze), std::move(end_analyze), "Analyze");
+	return true;
+}
+
+void Encoder::Impl::dispatch_quant(CommandBuffer &cmd, float quant_scale)
+{
+	cmd.set_program(shaders.wavelet_quant);
+	// Per-block scaling would make the integer coefficients fractional.
+	cmd.set_specialization_constant(1, transform == WaveletTransform::LeGall53);
+
+	// Quantize. The dispatches overlap, so if payload scratch runs out, which blocks get dropped is arbitrary.
+	// The overflow is reported in FrameStats::payload_overflow_bytes.
+	for (int level = decomposition_levels - 1; level >= 0; level--)
 	{
 		for (int component = 0; component < NumComponents; component++)
 		{
@@ -444,8 +706,11 @@ bool Encoder::Impl::quant(CommandBuffer &cmd, float quant_scale)
 			snprintf(label, sizeof(label), "DWT quant, level %d, component %d", level, component);
 			cmd.begin_region(label);
 
-			for (int band = (level == DecompositionLevels - 1 ? 0 : 1); band < 4; band++)
+			for (int band = (level == decomposition_levels - 1 ? 0 : 1); band < 4; band++)
 			{
+				if (!band_is_coded(level, component, band))
+					continue;
+
 				float quant_res = quant_scale < 0.0f ? get_quant_resolution(level, component, band) : quant_scale;
 
 				push.resolution.x = wavelet_img_high_res->get_width(level);
@@ -457,6 +722,7 @@ bool Encoder::Impl::quant(CommandBuffer &cmd, float quant_scale)
 				push.input_layer = float(band);
 				push.quant_resolution = 1.0f / decode_quant(encode_quant(1.0f / quant_res));
 				push.rdo_distortion_scale = get_quant_rdo_distortion_scale(level, component, band) * (1.0f / 256.0f);
+				push.payload_capacity = get_payload_capacity();
 
 				int blocks_x = (push.resolution.x + 31) / 32;
 				int blocks_y = (push.resolution.y + 31) / 32;
@@ -477,7 +743,27 @@ bool Encoder::Impl::quant(CommandBuffer &cmd, float quant_scale)
 			cmd.end_region();
 		}
 	}
+}
+
+bool Encoder::Impl::record_quant(CommandBuffer &cmd, float quant_scale)
+{
+	auto start_quant = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	cmd.begin_region("DWT quantize");
+
+	cmd.set_specialization_constant_mask(2);
+	if (device->supports_subgroup_size_log2(true, 3, 7))
+	{
+		cmd.set_subgroup_size_log2(true, 3, 7);
+	}
+	else
+	{
+		LOGI("No compatible subgroup size config.\n");
+		return false;
+	}
+
+	dispatch_quant(cmd, quant_scale);
 
+	cmd.set_specialization_constant_mask(0);
 	cmd.end_region();
 	cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
 	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
@@ -487,110 +773,192 @@ bool Encoder::Impl::quant(CommandBuffer &cmd, float quant_scale)
 	return true;
 }
 
-bool Encoder::Impl::dwt(CommandBuffer &cmd, const ViewBuffers &views)
+void Encoder::Impl::set_dwt_input(CommandBuffer &cmd, DWTPushData &push, uvec2 resolution, bool half_rows) const
 {
-	struct Push
+	push.resolution = resolution;
+	push.input_row_offset = 0;
+	push.inv_input_height = 1.0f / float(resolution.y);
+
+	// In slice mode, the input is the full frame, and only the rows of the current slice are read.
+	// Slice edges are mirrored in the shader, since the sampler only mirrors at the edges of the frame.
+	if (slice_height)
 	{
-		uvec2 resolution;
-		vec2 inv_resolution;
-		uvec2 aligned_resolution;
-	} push = {};
+		int shift = half_rows ? 1 : 0;
+		push.resolution.y = uint32_t(get_slice_rows(current_slice) >> shift);
+		push.input_row_offset = (current_slice * slice_height) >> shift;
+	}
 
-	// Forward transforms.
-	cmd.set_program(shaders.dwt[PYROWAVE_PRECISION]);
+	push.inv_resolution.x = 1.0f / float(push.resolution.x);
+	push.inv_resolution.y = 1.0f / float(push.resolution.y);
+	cmd.push_constants(&push, 0, sizeof(push));
+	cmd.set_specialization_constant(8, slice_height != 0);
+}
 
-	// Only need simple 2-lane swaps.
-	cmd.set_subgroup_size_log2(true, 2, 7);
-	cmd.set_specialization_constant_mask(1);
-	cmd.set_specialization_constant(0, false);
+void Encoder::Impl::dispatch_dwt(CommandBuffer &cmd, const ViewBuffers &views, int output_level)
+{
+	DWTPushData push = {};
 
-	auto start_dwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	// Forward transforms.
+	cmd.set_program(shaders.dwt[Configuration::get().get_precision()][0]);
 
-	for (int output_level = 0; output_level < DecompositionLevels; output_level++)
+	if (output_level > 0)
 	{
-		if (output_level > 0)
-		{
-			push.resolution = uvec2(component_ll_views[0][output_level - 1]->get_view_width(),
-			                        component_ll_views[0][output_level - 1]->get_view_height());
-			push.aligned_resolution = push.resolution;
-		}
-		else
-		{
-			push.resolution = uvec2(views.planes[0]->get_view_width(), views.planes[0]->get_view_height());
-			push.aligned_resolution.x = aligned_width;
-			push.aligned_resolution.y = aligned_height;
-		}
-
+		push.resolution = uvec2(component_ll_views[0][output_level - 1]->get_view_width(),
+		                        component_ll_views[0][output_level - 1]->get_view_height());
+		push.aligned_resolution = push.resolution;
 		push.inv_resolution.x = 1.0f / float(push.resolution.x);
 		push.inv_resolution.y = 1.0f / float(push.resolution.y);
+		push.inv_input_height = push.inv_resolution.y;
 		cmd.push_constants(&push, 0, sizeof(push));
+		cmd.set_specialization_constant(8, false);
+	}
+	else
+	{
+		push.aligned_resolution.x = aligned_width;
+		push.aligned_resolution.y = aligned_height;
+		set_dwt_input(cmd, push, uvec2(views.planes[0]->get_view_width(), views.planes[0]->get_view_height()), false);
+	}
+
+	cmd.set_specialization_constant(0, output_level == 0);
+	cmd.set_specialization_constant(7, transform == WaveletTransform::LeGall53);
 
-		if (output_level == 0)
+	if (output_level == 0)
+	{
+		if (chroma == ChromaSubsampling::Chroma444)
+		{
+			for (int c = 0; c < NumComponents; c++)
+			{
+				char label[64];
+				snprintf(label, sizeof(label), "DWT level 0, component %u", c);
+				cmd.begin_region(label);
+				if (rgb_conversion)
+					set_rgb_input(cmd, c, false);
+				cmd.set_texture(0, 0, *views.planes[c], *mirror_repeat_sampler);
+				cmd.set_storage_texture(0, 1, *component_layer_views[c][output_level]);
+				cmd.dispatch((push.aligned_resolution.x + 31) / 32, (push.aligned_resolution.y + 31) / 32, 1);
+				cmd.end_region();
+			}
+		}
+		else
 		{
-			cmd.set_specialization_constant(0, true);
+			if (rgb_conversion)
+				set_rgb_input(cmd, 0, false);
+			cmd.set_texture(0, 0, *views.planes[0], *mirror_repeat_sampler);
+			cmd.set_storage_texture(0, 1, *component_layer_views[0][output_level]);
+			cmd.begin_region("DWT level 0 Y");
+			cmd.dispatch((push.aligned_resolution.x + 31) / 32, (push.aligned_resolution.y + 31) / 32, 1);
+			cmd.end_region();
 
-			if (chroma == ChromaSubsampling::Chroma444)
+			if (chroma == ChromaSubsampling::Chroma422)
 			{
-				for (int c = 0; c < NumComponents; c++)
+				// Split CbCr vertically only. L feeds level 1 through the LL layer.
+				push.aligned_resolution.x = aligned_width >> 1;
+				push.aligned_resolution.y = aligned_height;
+				set_dwt_input(cmd, push, get_chroma_input_resolution(views, 1), false);
+				cmd.set_specialization_constant(1, true);
+
+				for (int c = 1; c < NumComponents; c++)
 				{
 					char label[64];
-					snprintf(label, sizeof(label), "DWT level 0, component %u", c);
+					snprintf(label, sizeof(label), "DWT level 0 vertical, component %u", c);
 					cmd.begin_region(label);
-					cmd.set_texture(0, 0, *views.planes[c], *mirror_repeat_sampler);
+					if (rgb_conversion)
+					{
+						set_rgb_input(cmd, c, true);
+						cmd.set_texture(0, 0, *views.planes[c], *linear_mirror_repeat_sampler);
+					}
+					else
+						cmd.set_texture(0, 0, *views.planes[c], *mirror_repeat_sampler);
 					cmd.set_storage_texture(0, 1, *component_layer_views[c][output_level]);
 					cmd.dispatch((push.aligned_resolution.x + 31) / 32, (push.aligned_resolution.y + 31) / 32, 1);
 					cmd.end_region();
 				}
-			}
-			else
-			{
-				cmd.set_texture(0, 0, *views.planes[0], *mirror_repeat_sampler);
-				cmd.set_storage_texture(0, 1, *component_layer_views[0][output_level]);
-				cmd.begin_region("DWT level 0 Y");
-				cmd.dispatch((push.aligned_resolution.x + 31) / 32, (push.aligned_resolution.y + 31) / 32, 1);
-				cmd.end_region();
+
+				cmd.set_specialization_constant(1, false);
 			}
 		}
-		else
+	}
+	else
+	{
+		for (int c = 0; c < NumComponents; c++)
 		{
-			for (int c = 0; c < NumComponents; c++)
+			if (chroma == ChromaSubsampling::Chroma420 && c != 0 && output_level == 1)
 			{
-				if (chroma == ChromaSubsampling::Chroma420 && c != 0 && output_level == 1)
+				push.aligned_resolution.x = aligned_width >> output_level;
+				push.aligned_resolution.y = aligned_height >> output_level;
+				set_dwt_input(cmd, push, get_chroma_input_resolution(views, c), true);
+				if (rgb_conversion)
 				{
-					push.resolution = uvec2(views.planes[c]->get_view_width(), views.planes[c]->get_view_height());
-					push.aligned_resolution.x = aligned_width >> output_level;
-					push.aligned_resolution.y = aligned_height >> output_level;
-					push.inv_resolution.x = 1.0f / float(push.resolution.x);
-					push.inv_resolution.y = 1.0f / float(push.resolution.y);
-					cmd.push_constants(&push, 0, sizeof(push));
-					cmd.set_texture(0, 0, *views.planes[c], *mirror_repeat_sampler);
-					cmd.set_specialization_constant(0, true);
+					set_rgb_input(cmd, c, true);
+					cmd.set_texture(0, 0, *views.planes[c], *linear_mirror_repeat_sampler);
 				}
 				else
-				{
-					cmd.set_texture(0, 0, *component_ll_views[c][output_level - 1], *mirror_repeat_sampler);
-				}
+					cmd.set_texture(0, 0, *views.planes[c], *mirror_repeat_sampler);
+				cmd.set_specialization_constant(0, true);
+			}
+			else
+			{
+				cmd.set_texture(0, 0, *component_ll_views[c][output_level - 1], *mirror_repeat_sampler);
+			}
 
-				cmd.set_storage_texture(0, 1, *component_layer_views[c][output_level]);
+			cmd.set_storage_texture(0, 1, *component_layer_views[c][output_level]);
 
-				char label[64];
-				snprintf(label, sizeof(label), "DWT level %u, component %u", output_level, c);
-				cmd.begin_region(label);
-				cmd.dispatch((push.aligned_resolution.x + 31) / 32, (push.aligned_resolution.y + 31) / 32, 1);
-				cmd.end_region();
-			}
+			char label[64];
+			snprintf(label, sizeof(label), "DWT level %u, component %u", output_level, c);
+			cmd.begin_region(label);
+			cmd.dispatch((push.aligned_resolution.x + 31) / 32, (push.aligned_resolution.y + 31) / 32, 1);
+			cmd.end_region();
 		}
+	}
+
+	if (rgb_conversion)
+		cmd.set_specialization_constant_mask(0x183);
+}
+
+void Encoder::Impl::set_rgb_input(CommandBuffer &cmd, int component, bool downsample)
+{
+	cmd.set_program(shaders.dwt[Configuration::get().get_precision()][1]);
+	cmd.set_specialization_constant_mask(0x1ff);
+	cmd.set_specialization_constant(2, rgb_conversion->transform == YCbCrTransform::BT2020);
+	cmd.set_specialization_constant(3, rgb_conversion->range == YCbCrRange::Full);
+	cmd.set_specialization_constant(4, downsample && rgb_conversion->siting == ChromaSiting::Left);
+	cmd.set_specialization_constant(5, component);
+	cmd.set_specialization_constant(6, downsample);
+}
+
+uvec2 Encoder::Impl::get_chroma_input_resolution(const ViewBuffers &views, int component) const
+{
+	// RGB input is downsampled to the chroma resolution while loading.
+	if (rgb_conversion)
+	{
+		return uvec2(chroma != ChromaSubsampling::Chroma444 ? width / 2 : width,
+		             chroma == ChromaSubsampling::Chroma420 ? frame_height / 2 : frame_height);
+	}
+	else
+		return uvec2(views.planes[component]->get_view_width(), views.planes[component]->get_view_height());
+}
+
+void Encoder::Impl::record_dwt(CommandBuffer &cmd, const ViewBuffers &views)
+{
+	// Only need simple 2-lane swaps.
+	cmd.set_subgroup_size_log2(true, 2, 7);
+	cmd.set_specialization_constant_mask(0x183);
+	cmd.set_specialization_constant(1, false);
+
+	auto start_dwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+	// Components of a level are independent, so we only need one barrier per level.
+	for (int output_level = 0; output_level < decomposition_levels; output_level++)
+	{
+		dispatch_dwt(cmd, views, output_level);
 
 		cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
 		            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
-
-		cmd.set_specialization_constant(0, false);
 	}
 
 	auto end_dwt = cmd.write_timestamp(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 	device->register_time_interval("GPU", std::move(start_dwt), std::move(end_dwt), "DWT");
 	cmd.set_specialization_constant_mask(0);
-	return true;
 }
 
 size_t Encoder::Impl::compute_num_packets(const void *meta_, size_t packet_boundary) const
@@ -599,21 +967,31 @@ size_t Encoder::Impl::compute_num_packets(const void *meta_, size_t packet_bound
 	size_t num_packets = 0;
 	size_t size_in_packet = 0;
 
-	size_in_packet += sizeof(BitstreamSequenceHeader);
+	size_in_packet += get_sequence_header_size();
 
-	for (int i = 0; i < block_count_32x32; i++)
+	for (int layer = 0; layer < get_num_layers(); layer++)
 	{
-		size_t packet_size = meta[i].num_words * sizeof(uint32_t);
-		if (!packet_size)
-			continue;
-
-		if (size_in_packet + packet_size > packet_boundary)
+		// Layers never share a packet.
+		if (layer && size_in_packet)
 		{
 			size_in_packet = 0;
 			num_packets++;
 		}
 
-		size_in_packet += packet_size;
+		for (int i = layer * block_count_32x32; i < (layer + 1) * block_count_32x32; i++)
+		{
+			size_t packet_size = meta[i].num_words * sizeof(uint32_t);
+			if (!packet_size)
+				continue;
+
+			if (size_in_packet + packet_size > packet_boundary)
+			{
+				size_in_packet = 0;
+				num_packets++;
+			}
+
+			size_in_packet += packet_size;
+		}
 	}
 
 	if (size_in_packet)
@@ -622,6 +1000,21 @@ size_t Encoder::Impl::compute_num_packets(const void *meta_, size_t packet_bound
 	return num_packets;
 }
 
+size_t Encoder::Impl::get_sequence_header_size() const
+{
+	size_t size = sizeof(BitstreamSequenceHeader);
+	// Omitted for default parameters, so those streams remain readable by older decoders.
+	if (has_sequence_parameters())
+		size += sizeof(BitstreamSequenceParameters);
+	return size;
+}
+
+bool Encoder::Impl::has_sequence_parameters() const
+{
+	return decomposition_levels != DefaultDecompositionLevels || chroma == ChromaSubsampling::Chroma422 ||
+	       transform == WaveletTransform::LeGall53 || slice_height != 0 || enhancement_planes != 0;
+}
+
 #if 0
 static int max_magnitude(const int (&values)[64][64], int off_x, int off_y, int w, int h)
 {
@@ -727,7 +1120,7 @@ void Encoder::Impl::analyze_alternative_packing(const void *mapped_meta, const v
 
 	for (int component = 0; component < NumComponents; component++)
 	{
-		for (int level = 0; level < DecompositionLevels; level++)
+		for (int level = 0; level < decomposition_levels; level++)
 		{
 			// Ignore top-level CbCr when doing 420 subsampling.
 			if (level == 0 && component != 0)
@@ -738,7 +1131,7 @@ void Encoder::Impl::analyze_alternative_packing(const void *mapped_meta, const v
 			int blocks_x_64x64 = (band_width + 63) / 64;
 			int blocks_y_64x64 = (band_height + 63) / 64;
 
-			for (int band = 3; band >= (level == DecompositionLevels - 1 ? 0 : 1); band--)
+			for (int band = 3; band >= (level == decomposition_levels - 1 ? 0 : 1); band--)
 			{
 				auto &block_mapping = block_meta[component][level][band];
 
@@ -845,7 +1238,7 @@ void Encoder::Impl::report_stats(const void *mapped_meta, const void *mapped_bit
 
 	for (int component = 0; component < NumComponents; component++)
 	{
-		for (int level = 0; level < DecompositionLevels; level++)
+		for (int level = 0; level < decomposition_levels; level++)
 		{
 			int total_words_in_level = 0;
 
@@ -858,7 +1251,7 @@ void Encoder::Impl::report_stats(const void *mapped_meta, const void *mapped_bit
 			int blocks_x_64x64 = (band_width + 63) / 64;
 			int blocks_y_64x64 = (band_height + 63) / 64;
 
-			for (int band = 3; band >= (level == DecompositionLevels - 1 ? 0 : 1); band--)
+			for (int band = 3; band >= (level == decomposition_levels - 1 ? 0 : 1); band--)
 			{
 				auto &block_mapping = block_meta[component][level][band];
 
@@ -965,7 +1358,8 @@ bool Encoder::Impl::validate_bitstream(
 
 	bitstream_u32 += meta[block_index].offset_u32;
 	auto *header = reinterpret_cast<const BitstreamHeader *>(bitstream_u32);
-	if (header->block_index != block_index)
+	// In slice mode, blocks are numbered after the blocks of the slices above.
+	if (header->block_index % uint32_t(block_count_32x32) != block_index)
 	{
 		LOGI("Mismatch in block index. header: %u, meta: %u\n", header->block_index, block_index);
 		return false;
@@ -996,7 +1390,7 @@ bool Encoder::Impl::validate_bitstream(
 		return false;
 	}
 
-	const auto &mapping = block_32x32_to_8x8_mapping[header->block_index];
+	const auto &mapping = block_32x32_to_8x8_mapping[block_index];
 	bool invalid_packet = false;
 	int num_significant_values = 0;
 
@@ -1059,6 +1453,9 @@ size_t Encoder::Impl::packetize(Packet *packets, size_t packet_boundary,
 	auto *output_bitstream = static_cast<uint8_t *>(output_bitstream_);
 	(void)size;
 
+	uint32_t slice_index = meta[get_meta_trailer_offset() / sizeof(BitstreamPacket)].offset_u32;
+
+	// Every block in the enhancement layer also has a block in the base layer, so only count the base layer.
 	size_t num_non_zero_blocks = 0;
 	for (int i = 0; i < block_count_32x32; i++)
 		if (meta[i].num_words != 0)
@@ -1066,46 +1463,76 @@ size_t Encoder::Impl::packetize(Packet *packets, size_t packet_boundary,
 
 	BitstreamSequenceHeader header = {};
 	header.width_minus_1 = width - 1;
-	header.height_minus_1 = height - 1;
+	header.height_minus_1 = frame_height - 1;
 	header.sequence = reinterpret_cast<const BitstreamHeader *>(input_bitstream + meta[0].offset_u32)->sequence;
 	header.extended = 1;
 	header.code = BITSTREAM_EXTENDED_CODE_START_OF_FRAME;
 	header.total_blocks = num_non_zero_blocks;
 	header.chroma_resolution = chroma == ChromaSubsampling::Chroma444 ? CHROMA_RESOLUTION_444 : CHROMA_RESOLUTION_420;
 
-	assert(sizeof(header) <= size);
+	assert(get_sequence_header_size() <= size);
 	memcpy(output_bitstream, &header, sizeof(header));
 	output_offset += sizeof(header);
 	size_in_packet += sizeof(header);
 
+	if (has_sequence_parameters())
+	{
+		BitstreamSequenceParameters params = {};
+		params.decomposition_levels = decomposition_levels;
+		params.chroma_422 = chroma == ChromaSubsampling::Chroma422;
+		params.reversible = transform == WaveletTransform::LeGall53;
+		params.enhancement_planes = enhancement_planes;
+		params.slice_height = slice_height;
+		params.slice_index = slice_index;
+		params.sequence = header.sequence;
+		params.extended = 1;
+		params.code = BITSTREAM_EXTENDED_CODE_SEQUENCE_PARAMETERS;
+		memcpy(output_bitstream + output_offset, &params, sizeof(params));
+		output_offset += sizeof(params);
+		size_in_packet += sizeof(params);
+	}
+
 	//for (int i = 0; i < block_count_32x32; i++)
 	//	if (!validate_bitstream(input_bitstream, meta, i))
 	//		return false;
 
-	for (int i = 0; i < block_count_32x32; i++)
+	for (int layer = 0; layer < get_num_layers(); layer++)
 	{
-		size_t packet_size = meta[i].num_words * sizeof(uint32_t);
-		if (!packet_size)
-			continue;
-
-		if (size_in_packet + packet_size > packet_boundary)
+		// Layers never share a packet, so receivers and relays can subscribe to layers per packet.
+		if (layer && size_in_packet)
 		{
 			packets[num_packets++] = { packet_offset, size_in_packet };
 			size_in_packet = 0;
 			packet_offset = output_offset;
 		}
 
-		assert(output_offset + packet_size <= size);
-		assert(packet_size >= sizeof(BitstreamHeader) / sizeof(uint32_t));
+		for (int i = 0; i < block_count_32x32; i++)
+		{
+			auto &block_meta = meta[layer * block_count_32x32 + i];
+			size_t packet_size = block_meta.num_words * sizeof(uint32_t);
+			if (!packet_size)
+				continue;
+
+			if (size_in_packet + packet_size > packet_boundary)
+			{
+				packets[num_packets++] = { packet_offset, size_in_packet };
+				size_in_packet = 0;
+				packet_offset = output_offset;
+			}
+
+			assert(output_offset + packet_size <= size);
+			assert(packet_size >= sizeof(BitstreamHeader) / sizeof(uint32_t));
 
-		uint16_t block = reinterpret_cast<const BitstreamHeader *>(input_bitstream + meta[i].offset_u32)->block_index;
-		(void)block;
-		assert(block == i);
+			auto *block_header = reinterpret_cast<const BitstreamHeader *>(input_bitstream + block_meta.offset_u32);
+			(void)block_header;
+			assert(block_header->block_index == slice_index * block_count_32x32 + uint32_t(i) &&
+			       block_header->layer == uint32_t(layer));
 
-		memcpy(output_bitstream + output_offset, input_bitstream + meta[i].offset_u32, packet_size);
+			memcpy(output_bitstream + output_offset, input_bitstream + block_meta.offset_u32, packet_size);
 
-		output_offset += packet_size;
-		size_in_packet += packet_size;
+			output_offset += packet_size;
+			size_in_packet += packet_size;
+		}
 	}
 
 	if (size_in_packet)
@@ -1114,45 +1541,221 @@ size_t Encoder::Impl::packetize(Packet *packets, size_t packet_boundary,
 	return num_packets;
 }
 
-bool Encoder::Impl::encode_quant_and_coding(
+bool Encoder::Impl::record_quant_and_coding(
 		Vulkan::CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale)
 {
 	cmd.enable_subgroup_size_control(true);
 
-	if (!quant(cmd, quant_scale))
+	if (!record_quant(cmd, quant_scale))
 		return false;
 
-	if (!analyze_rdo(cmd))
+	if (!record_rate_control(cmd, buffers))
 		return false;
 
-	if (!resolve_rdo(cmd, buffers.target_size))
+	if (!record_block_packing(cmd, buffers, quant_scale))
 		return false;
 
-	if (!block_packing(cmd, buffers, quant_scale))
+	cmd.enable_subgroup_size_control(false);
+
+	// Block packing already made its writes visible to copies.
+	copy_stats_readback(cmd);
+
+	return true;
+}
+
+void Encoder::Impl::copy_stats_readback(CommandBuffer &cmd)
+{
+	stats_readback_recorded = bool(quant_readback);
+	if (!stats_readback_recorded)
+		return;
+
+	cmd.copy_buffer(*quant_readback, *quant_buffer);
+	cmd.copy_buffer(*block_stat_readback, *block_stat_buffer);
+	// The quantizer counter keeps counting past the capacity, which is how overflow is detected.
+	cmd.copy_buffer(*payload_counter_readback, 0, *payload_data, 0, sizeof(uint32_t));
+	readback_payload_capacity = get_payload_capacity();
+}
+
+bool Encoder::Impl::set_stats_readback(bool enable)
+{
+	if (!enable)
+	{
+		quant_readback.reset();
+		block_stat_readback.reset();
+		payload_counter_readback.reset();
+		return true;
+	}
+
+	if (quant_readback)
+		return true;
+
+	BufferCreateInfo info;
+	info.domain = BufferDomain::CachedHost;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	info.size = quant_buffer->get_create_info().size;
+	quant_readback = device->create_buffer(info);
+	info.size = block_stat_buffer->get_create_info().size;
+	block_stat_readback = device->create_buffer(info);
+	info.size = sizeof(uint32_t);
+	payload_counter_readback = device->create_buffer(info);
+
+	if (!quant_readback || !block_stat_readback || !payload_counter_readback)
+	{
+		LOGE("Failed to allocate stats readback buffers.\n");
+		quant_readback.reset();
+		block_stat_readback.reset();
+		payload_counter_readback.reset();
 		return false;
+	}
 
-	cmd.enable_subgroup_size_control(false);
+	device->set_name(*quant_readback, "quant-readback");
+	device->set_name(*block_stat_readback, "block-stat-readback");
+	device->set_name(*payload_counter_readback, "payload-counter-readback");
 	return true;
 }
 
-bool Encoder::Impl::encode_pre_transformed(
-		Vulkan::CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale)
+static float half_to_float(uint16_t v)
+{
+	int e = (v >> 10) & 0x1f;
+	int m = v & 0x3ff;
+	float f;
+
+	if (e == 0)
+		f = std::ldexp(float(m), -24);
+	else if (e == 31)
+		f = m ? std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::infinity();
+	else
+		f = std::ldexp(float(m | 0x400), e - 25);
+
+	return (v & 0x8000) ? -f : f;
+}
+
+void Encoder::Impl::get_frame_stats(FrameStats &stats, const void *mapped_meta, size_t packet_boundary) const
+{
+	static_assert(sizeof(stats.bands) / sizeof(stats.bands[0]) == NumComponents, "Component count mismatch.");
+	static_assert(sizeof(stats.bands[0]) / sizeof(stats.bands[0][0]) == MaxDecompositionLevels, "Level count mismatch.");
+	static_assert(sizeof(stats.bands[0][0]) / sizeof(stats.bands[0][0][0]) == NumFrequencyBandsPerLevel, "Band count mismatch.");
+
+	auto *meta = static_cast<const BitstreamPacket *>(mapped_meta);
+	const int32_t *quant = nullptr;
+	const BlockStats *block_stats = nullptr;
+
+	stats = {};
+	stats.has_rate_control_stats = stats_readback_recorded && quant_readback;
+
+	if (stats.has_rate_control_stats)
+	{
+		quant = static_cast<const int32_t *>(device->map_host_buffer(*quant_readback, MEMORY_ACCESS_READ_BIT));
+		block_stats = static_cast<const BlockStats *>(device->map_host_buffer(*block_stat_readback, MEMORY_ACCESS_READ_BIT));
+
+		uint32_t requested = *static_cast<const uint32_t *>(
+				device->map_host_buffer(*payload_counter_readback, MEMORY_ACCESS_READ_BIT));
+		if (requested > readback_payload_capacity)
+			stats.payload_overflow_bytes = requested - readback_payload_capacity;
+	}
+
+	for (int level = 0; level < decomposition_levels; level++)
+	{
+		int blocks_x_32x32 = int(wavelet_img_high_res->get_width(level) + 31) / 32;
+		int blocks_y_32x32 = int(wavelet_img_high_res->get_height(level) + 31) / 32;
+
+		for (int component = 0; component < NumComponents; component++)
+		{
+			// Ignore top-level CbCr when doing 420 subsampling.
+			if (level == 0 && component != 0 && chroma == ChromaSubsampling::Chroma420)
+				continue;
+
+			for (int band = (level == decomposition_levels - 1 ? 0 : 1); band < 4; band++)
+			{
+				if (!band_is_coded(level, component, band))
+					continue;
+
+				auto &band_stats = stats.bands[component][level][band];
+				int block_offset = block_meta[component][level][band].block_offset_32x32;
+				uint64_t quant_sum = 0;
+
+				band_stats.num_blocks = blocks_x_32x32 * blocks_y_32x32;
+				band_stats.min_quant = UINT32_MAX;
+
+				for (int i = block_offset; i < block_offset + int(band_stats.num_blocks); i++)
+				{
+					band_stats.bytes += meta[i].num_words * sizeof(uint32_t);
+					if (enhancement_planes)
+						band_stats.bytes += meta[block_count_32x32 + i].num_words * sizeof(uint32_t);
+					if (meta[i].num_words)
+						band_stats.num_non_zero_blocks++;
+
+					if (!quant)
+						continue;
+
+					auto q = uint32_t(std::max<int32_t>(quant[i], 0));
+					band_stats.min_quant = std::min(band_stats.min_quant, q);
+					band_stats.max_quant = std::max(band_stats.max_quant, q);
+					quant_sum += q;
+
+					auto &mapping = block_32x32_to_8x8_mapping[i];
+					for (int y = 0; y < mapping.block_height_8x8; y++)
+					{
+						for (int x = 0; x < mapping.block_width_8x8; x++)
+						{
+							auto &block = block_stats[mapping.block_offset_8x8 + y * mapping.block_stride_8x8 + x];
+							uint32_t index = std::min<uint32_t>(std::min(q, block.num_planes), 14);
+							band_stats.distortion += half_to_float(block.stats[index].square_error_fp16);
+						}
+					}
+				}
+
+				if (quant && band_stats.num_blocks)
+					band_stats.mean_quant = float(quant_sum) / float(band_stats.num_blocks);
+				else
+					band_stats.min_quant = 0;
+
+				stats.total_bytes += band_stats.bytes;
+				stats.num_blocks += band_stats.num_blocks;
+				stats.num_non_zero_blocks += band_stats.num_non_zero_blocks;
+			}
+		}
+	}
+
+	stats.total_bytes += get_sequence_header_size();
+
+	if (packet_boundary)
+	{
+		uint64_t num_packets = compute_num_packets(mapped_meta, packet_boundary);
+		if (num_packets * packet_boundary > stats.total_bytes)
+			stats.packet_padding_bytes = num_packets * packet_boundary - stats.total_bytes;
+	}
+}
+
+void Encoder::Impl::clear_buffers(CommandBuffer &cmd)
 {
 	cmd.fill_buffer(*payload_data, 0, 0, 2 * sizeof(uint32_t));
 	cmd.fill_buffer(*bucket_buffer, 0);
 	cmd.fill_buffer(*quant_buffer, 0);
+}
+
+bool Encoder::Impl::encode_pre_transformed(
+		Vulkan::CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale)
+{
+	if (!init_payload_data(buffers.target_size))
+		return false;
+
+	clear_buffers(cmd);
 
 	// Don't need to read the payload offset counter until quantizer.
 	cmd.barrier(VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
 	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
 
-	return encode_quant_and_coding(cmd, buffers, quant_scale);
+	return record_quant_and_coding(cmd, buffers, quant_scale);
 }
 
-bool Encoder::Impl::encode(CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers)
+void Encoder::Impl::begin_frame(CommandBuffer &cmd)
 {
-	sequence_count = (sequence_count + 1) & SequenceCountMask;
+	// All slices of a frame share its sequence, so that the decoder collects them into one frame.
+	if (current_slice == 0)
+		sequence_count = (sequence_count + 1) & SequenceCountMask;
 
 	cmd.image_barrier(*wavelet_img_high_res, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
 	                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
@@ -1164,14 +1767,18 @@ bool Encoder::Impl::encode(CommandBuffer &cmd, const ViewBuffers &views, const B
 		                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
 		                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
 	}
+}
 
-	cmd.fill_buffer(*payload_data, 0, 0, 2 * sizeof(uint32_t));
-	cmd.fill_buffer(*bucket_buffer, 0);
-	cmd.fill_buffer(*quant_buffer, 0);
+bool Encoder::Impl::record_encode(CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers)
+{
+	if (!init_payload_data(buffers.target_size))
+		return false;
+
+	begin_frame(cmd);
+	clear_buffers(cmd);
 
 	cmd.enable_subgroup_size_control(true);
-	if (!dwt(cmd, views))
-		return false;
+	record_dwt(cmd, views);
 	cmd.enable_subgroup_size_control(false);
 
 	// Don't need to read the payload offset counter until quantizer.
@@ -1179,7 +1786,62 @@ bool Encoder::Impl::encode(CommandBuffer &cmd, const ViewBuffers &views, const B
 	            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
 	            VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
 
-	return encode_quant_and_coding(cmd, buffers, -1.0f);
+	return record_quant_and_coding(cmd, buffers, -1.0f);
+}
+
+bool Encoder::Impl::encode(CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers)
+{
+	return record_encode(cmd, views, buffers);
+}
+
+bool Encoder::Impl::encode_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+                               const BitstreamBuffers &buffers)
+{
+	ViewBuffers views = {};
+	for (auto &plane : views.planes)
+		plane = &view;
+
+	rgb_conversion = &conversion;
+	bool ret = encode(cmd, views, buffers);
+	rgb_conversion = nullptr;
+	return ret;
+}
+
+bool Encoder::Impl::validate_slice_index(int slice_index) const
+{
+	if (!slice_height)
+	{
+		LOGE("Encoder was not created in slice mode.\n");
+		return false;
+	}
+
+	if (slice_index < 0 || slice_index >= num_slices)
+	{
+		LOGE("Slice index %d is out of range, encoder has %d slices.\n", slice_index, num_slices);
+		return false;
+	}
+
+	return true;
+}
+
+bool Encoder::Impl::encode_slice(CommandBuffer &cmd, const ViewBuffers &views, int slice_index,
+                                 const BitstreamBuffers &buffers)
+{
+	if (!validate_slice_index(slice_index))
+		return false;
+
+	current_slice = slice_index;
+	return encode(cmd, views, buffers);
+}
+
+bool Encoder::Impl::encode_slice_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+                                     int slice_index, const BitstreamBuffers &buffers)
+{
+	if (!validate_slice_index(slice_index))
+		return false;
+
+	current_slice = slice_index;
+	return encode_rgb(cmd, view, conversion, buffers);
 }
 
 Encoder::Encoder()
@@ -1187,7 +1849,8 @@ Encoder::Encoder()
 	impl.reset(new Impl);
 }
 
-bool Encoder::init(Device *device, int width_, int height_, ChromaSubsampling chroma_)
+bool Encoder::init(Device *device, int width_, int height_, ChromaSubsampling chroma_, int decomposition_levels,
+                   WaveletTransform transform_, int slice_height)
 {
 	auto ops = device->get_device_features().vk11_props.subgroupSupportedOperations;
 	constexpr VkSubgroupFeatureFlags required_features =
@@ -1217,14 +1880,54 @@ bool Encoder::init(Device *device, int width_, int height_, ChromaSubsampling ch
 	    !device->supports_subgroup_size_log2(true, 6, 6))
 		return false;
 
-	return impl->init(device, width_, height_, chroma_, false);
+	return impl->init(device, width_, height_, chroma_, false, decomposition_levels, transform_, slice_height);
+}
+
+void Encoder::set_resource_pool(ResourcePool *pool)
+{
+	impl->pool = pool;
 }
 
 bool Encoder::encode(CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers)
 {
+	if (impl->slice_height)
+	{
+		LOGE("Encoder is in slice mode, use encode_slice().\n");
+		return false;
+	}
+
 	return impl->encode(cmd, views, buffers);
 }
 
+bool Encoder::encode_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+                         const BitstreamBuffers &buffers)
+{
+	if (impl->slice_height)
+	{
+		LOGE("Encoder is in slice mode, use encode_slice_rgb().\n");
+		return false;
+	}
+
+	return impl->encode_rgb(cmd, view, conversion, buffers);
+}
+
+bool Encoder::encode_slice(CommandBuffer &cmd, const ViewBuffers &views, int slice_index,
+                           const BitstreamBuffers &buffers)
+{
+	return impl->encode_slice(cmd, views, slice_index, buffers);
+}
+
+bool Encoder::encode_slice_rgb(CommandBuffer &cmd, const ImageView &view, const ColorConversion &conversion,
+                               int slice_index, const BitstreamBuffers &buffers)
+{
+	return impl->encode_slice_rgb(cmd, view, conversion, slice_index, buffers);
+}
+
+int Encoder::get_num_slices() const
+{
+	return impl->num_slices;
+}
+
 const Vulkan::ImageView &Encoder::get_wavelet_band(int component, int level)
 {
 	return *impl->component_layer_views[component][level];
@@ -1247,14 +1950,103 @@ size_t Encoder::packetize(Packet *packets, size_t packet_boundary,
 	return impl->packetize(packets, packet_boundary, bitstream, size, mapped_meta, mapped_bitstream);
 }
 
-void Encoder::report_stats(const void *, const void *) const
+bool Encoder::set_stats_readback(bool enable)
 {
-	//impl->report_stats(mapped_meta, mapped_bitstream);
+	return impl->set_stats_readback(enable);
+}
+
+void Encoder::get_frame_stats(FrameStats &stats, const void *mapped_meta, size_t packet_boundary) const
+{
+	impl->get_frame_stats(stats, mapped_meta, packet_boundary);
+}
+
+void Encoder::report_stats(const void *mapped_meta, const void *) const
+{
+	static const char *components[] = { "Y", "Cb", "Cr" };
+	static const char *bands[] = { "LL", "HL", "LH", "HH" };
+
+	FrameStats stats;
+	impl->get_frame_stats(stats, mapped_meta, 0);
+
+	for (int component = 0; component < NumComponents; component++)
+	{
+		for (int level = 0; level < impl->decomposition_levels; level++)
+		{
+			uint32_t band_width = impl->wavelet_img_high_res->get_width(level);
+			uint32_t band_height = impl->wavelet_img_high_res->get_height(level);
+
+			for (int band = 0; band < NumFrequencyBandsPerLevel; band++)
+			{
+				auto &band_stats = stats.bands[component][level][band];
+				if (!band_stats.num_blocks)
+					continue;
+
+				LOGI("%s: decomposition level %d, band %s: %.3f bpp, %u / %u blocks\n",
+				     components[component], level, bands[band],
+				     (band_stats.bytes * 8.0) / (band_width * band_height),
+				     band_stats.num_non_zero_blocks, band_stats.num_blocks);
+			}
+		}
+	}
+
+	LOGI("Overall: %.3f bpp\n", (stats.total_bytes * 8.0) / (impl->width * impl->height));
+}
+
+uint64_t Encoder::get_device_memory_size() const
+{
+	return impl->get_device_memory_size();
 }
 
 uint64_t Encoder::get_meta_required_size() const
 {
-	return impl->block_count_32x32 * sizeof(BitstreamPacket);
+	return impl->get_meta_required_size();
+}
+
+bool Encoder::query_memory_requirements(int width, int height, ChromaSubsampling chroma, int decomposition_levels,
+                                        WaveletTransform transform, int slice_height, int enhancement_planes,
+                                        size_t target_size, MemoryRequirements &reqs)
+{
+	Impl layout;
+	if (!layout.init_layout(width, height, chroma, false, decomposition_levels, transform, slice_height))
+		return false;
+
+	if (enhancement_planes < 0 || enhancement_planes > MaxEnhancementPlanes)
+		return false;
+	layout.enhancement_planes = enhancement_planes;
+
+	if (!target_size)
+		target_size = layout.get_max_payload_size();
+
+	reqs = layout.get_memory_requirements(target_size);
+	return true;
+}
+
+bool Encoder::set_memory_budget(uint64_t bytes)
+{
+	// Smallest footprint is with the smallest payload scratch and an empty target.
+	uint64_t min_size = impl->get_memory_requirements(0).device_local -
+	                    impl->get_max_payload_size() + impl->get_min_payload_scratch_size();
+	if (bytes && min_size > bytes)
+	{
+		LOGE("Memory budget of %llu bytes cannot hold the encoder's fixed resources.\n",
+		     static_cast<unsigned long long>(bytes));
+		return false;
+	}
+
+	impl->memory_budget = bytes;
+	return true;
+}
+
+bool Encoder::set_enhancement_planes(int planes)
+{
+	if (planes < 0 || planes > MaxEnhancementPlanes)
+	{
+		LOGE("Enhancement planes must be in [0, %d].\n", MaxEnhancementPlanes);
+		return false;
+	}
+
+	impl->enhancement_planes = planes;
+	return true;
 }
 
 Encoder::~Encoder()
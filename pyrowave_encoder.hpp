@@ -6,6 +6,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "pyrowave_config.hpp"
+#include "pyrowave_pool.hpp"
 
 namespace Vulkan
 {
@@ -32,29 +33,139 @@ public:
 			uint64_t size;
 		} meta, bitstream;
 		size_t target_size;
+		// With SNR layers, an upper bound for the base layer alone, including headers. 0 means no bound.
+		// target_size still bounds both layers together.
+		size_t base_layer_target_size;
 	};
 
-	bool init(Vulkan::Device *device, int width, int height, ChromaSubsampling chroma);
+	// decomposition_levels must be in [MinDecompositionLevels, MaxDecompositionLevels].
+	// Non-default level counts and the reversible transform are signalled in the sequence header.
+	// A non-zero slice_height smaller than height enables slice mode, where the frame is split into
+	// horizontal slices which are transformed and coded independently. slice_height must be a multiple of
+	// 1 << decomposition_levels, and at least 4 << decomposition_levels. The last slice may be shorter.
+	bool init(Vulkan::Device *device, int width, int height, ChromaSubsampling chroma,
+	          int decomposition_levels = DefaultDecompositionLevels,
+	          WaveletTransform transform = WaveletTransform::CDF97,
+	          int slice_height = 0);
+
+	// Allocates images and buffers through a pool shared with other sessions, see ResourcePool.
+	// Must be called before init(). nullptr allocates directly from the device.
+	void set_resource_pool(ResourcePool *pool);
+
 	bool encode(Vulkan::CommandBuffer &cmd, const ViewBuffers &views, const BitstreamBuffers &buffers);
 
+	// First DWT pass is fused with RGB to YCbCr conversion and reads directly from an RGB(A) image,
+	// e.g. BGRA8 or RGB10A2 UNORM. Alpha is ignored. Subsampled chroma is box filtered from the RGB image,
+	// or with a [1 2 1] filter horizontally for left siting.
+	// The view must be created with VK_IMAGE_USAGE_SAMPLED_BIT, and must not be an sRGB view,
+	// since the color matrix expects the same non-linear values as the YCbCr planes would contain.
+	bool encode_rgb(Vulkan::CommandBuffer &cmd, const Vulkan::ImageView &view, const ColorConversion &conversion,
+	                const BitstreamBuffers &buffers);
+
+	// In slice mode, encode() and encode_rgb() fail, and each slice is encoded on its own instead.
+	// The views are the full frame, and only the rows of slice_index are read, so a slice can be encoded
+	// as soon as those rows are rendered. All slices of a frame belong to the same sequence, so every slice
+	// must be encoded once per frame, starting with slice 0. Every slice has its own rate budget
+	// in buffers.target_size, and must be packetized before the same BitstreamBuffers are reused.
+	bool encode_slice(Vulkan::CommandBuffer &cmd, const ViewBuffers &views, int slice_index,
+	                  const BitstreamBuffers &buffers);
+	bool encode_slice_rgb(Vulkan::CommandBuffer &cmd, const Vulkan::ImageView &view,
+	                      const ColorConversion &conversion, int slice_index, const BitstreamBuffers &buffers);
+	// 1 when not in slice mode.
+	int get_num_slices() const;
+
 	// Debug hackery
 	const Vulkan::ImageView &get_wavelet_band(int component, int level);
 	bool encode_pre_transformed(Vulkan::CommandBuffer &cmd, const BitstreamBuffers &buffers, float quant_scale);
 	//
 
+	// SNR layers. The lowest bit-planes of every block are split off into an enhancement layer,
+	// so a receiver or relay can drop it and still decode a coarser frame from the base layer alone.
+	// Layers are packetized into separate packets, see Decoder::get_packet_layer().
+	// target_size covers both layers, and base_layer_target_size optionally bounds the base layer on its own.
+	// 0 disables layering, which is the default.
+	// The meta buffer grows when enabled, so call this before get_meta_required_size().
+	bool set_enhancement_planes(int planes);
+
 	uint64_t get_meta_required_size() const;
 
+	// Device memory currently allocated by the encoder, in bytes, e.g. to decide how many encoders fit on a GPU.
+	// The payload scratch is allocated on first encode, so query after encoding.
+	uint64_t get_device_memory_size() const;
+
+	// Memory an encoder with these parameters needs when encoding up to target_size, without creating it.
+	// 0 assumes the largest useful target_size.
+	// The meta and bitstream buffers are included as device_local, and a copy to read them back as host_visible,
+	// even though the application provides them. Stats readback is not included.
+	// enhancement_planes is as set with set_enhancement_planes(), which affects the meta buffer size.
+	static bool query_memory_requirements(int width, int height, ChromaSubsampling chroma,
+	                                      int decomposition_levels, WaveletTransform transform, int slice_height,
+	                                      int enhancement_planes, size_t target_size, MemoryRequirements &reqs);
+
+	// Caps device_local as reported by query_memory_requirements() for the target_size of each encode,
+	// by shrinking the payload scratch from its worst case size. With a tight budget, the quantizer can run out
+	// of scratch and drop arbitrary blocks, see FrameStats::payload_overflow_bytes.
+	// Must be called after init(). Fails if the fixed resources alone exceed the budget.
+	// 0 removes the budget, which is the default.
+	bool set_memory_budget(uint64_t bytes);
+
 	struct Packet
 	{
 		size_t offset;
 		size_t size;
 	};
 
+	// Only reads the mapped buffers of that frame, so a writer thread may packetize a frame
+	// while later frames are being recorded.
 	size_t compute_num_packets(const void *mapped_meta, size_t packet_boundary) const;
 	size_t packetize(Packet *packets, size_t packet_boundary,
 					 void *bitstream, size_t size,
 					 const void *mapped_meta, const void *mapped_bitstream) const;
 
+	// Arrays are indexed as [component][level][band], where level 0 is the highest frequency level.
+	// Bands which are not coded, e.g. level 0 chroma for 4:2:0, are left zero.
+	struct BandStats
+	{
+		// Includes block headers.
+		uint32_t bytes;
+		// In 32x32 blocks.
+		uint32_t num_blocks;
+		uint32_t num_non_zero_blocks;
+		// Bit-planes dropped by rate control on top of the base quantizer, per 32x32 block.
+		uint32_t min_quant;
+		uint32_t max_quant;
+		float mean_quant;
+		// Squared error after rate control, as estimated by the encoder in the wavelet domain.
+		float distortion;
+	};
+
+	struct FrameStats
+	{
+		BandStats bands[3][MaxDecompositionLevels][4];
+		// Includes the sequence header.
+		uint64_t total_bytes;
+		uint32_t num_blocks;
+		uint32_t num_non_zero_blocks;
+		// Unused bytes when packetizing with a given packet boundary.
+		uint64_t packet_padding_bytes;
+		// Payload the quantizer could not fit in its scratch buffer, which only happens under a memory budget.
+		// Blocks which did not fit are dropped regardless of rate control, including low frequency bands,
+		// and their distortion is counted in full. Raise the memory budget to avoid it.
+		uint64_t payload_overflow_bytes;
+		// Quantizer, distortion and overflow fields are only valid if stats readback was enabled for the frame.
+		bool has_rate_control_stats;
+	};
+
+	// When enabled, encode() also copies the rate control state to host memory in the same command buffer.
+	// Application must make transfer writes visible to host, just like when reading back the bitstream.
+	// The copies are only valid until next encode. Nothing is recorded when disabled, which is the default.
+	bool set_stats_readback(bool enable);
+
+	// Must be called after the encode command buffer has completed.
+	// packet_boundary can be 0 if packetization padding is not needed.
+	void get_frame_stats(FrameStats &stats, const void *mapped_meta, size_t packet_boundary) const;
+
+	// Logs bitrate per band.
 	void report_stats(const void *mapped_meta, const void *mapped_bitstream) const;
 
 private:
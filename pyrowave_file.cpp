@@ -0,0 +1,272 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#include "pyrowave_file.hpp"
+#include <string.h>
+#include <algorithm>
+
+static constexpr char FILE_MAGIC[8] = { 'P', 'Y', 'R', 'O', 'W', 'A', 'V', 'E' };
+static constexpr char INDEX_MAGIC[8] = { 'P', 'W', 'I', 'N', 'D', 'E', 'X', '\0' };
+static constexpr uint32_t INDEX_VERSION = 1;
+static constexpr uint64_t FRAMES_OFFSET = sizeof(FILE_MAGIC) + sizeof(PyroWaveFileParams);
+
+#ifdef _WIN32
+#define file_seek _fseeki64
+#else
+#define file_seek fseeko
+#endif
+
+PyroWaveFileWriter::~PyroWaveFileWriter()
+{
+	close();
+}
+
+bool PyroWaveFileWriter::open(const std::string &path, const PyroWaveFileParams &params)
+{
+	index.clear();
+	file.reset(fopen(path.c_str(), "wb"));
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open %s\n", path.c_str());
+		return false;
+	}
+
+	if (fwrite(FILE_MAGIC, sizeof(FILE_MAGIC), 1, file.get()) != 1 ||
+	    fwrite(&params, sizeof(params), 1, file.get()) != 1)
+	{
+		file.reset();
+		return false;
+	}
+
+	offset = FRAMES_OFFSET;
+	return true;
+}
+
+bool PyroWaveFileWriter::write_frame(const void *data, size_t size, uint32_t sequence, uint64_t timestamp_ns)
+{
+	// Size 0 is reserved as the terminator.
+	if (!file || size == 0 || size > UINT32_MAX)
+		return false;
+
+	uint32_t u32_size = uint32_t(size);
+	if (fwrite(&u32_size, sizeof(u32_size), 1, file.get()) != 1)
+		return false;
+	if (fwrite(data, 1, size, file.get()) != size)
+		return false;
+
+	PyroWaveFileIndexEntry entry = {};
+	entry.offset = offset + sizeof(u32_size);
+	entry.size = u32_size;
+	entry.sequence = sequence;
+	entry.timestamp_ns = timestamp_ns;
+	index.push_back(entry);
+
+	offset = entry.offset + size;
+	return true;
+}
+
+bool PyroWaveFileWriter::close()
+{
+	if (!file)
+		return true;
+
+	PyroWaveFileFooter footer = {};
+	footer.index_offset = offset + sizeof(uint32_t);
+	footer.num_entries = uint32_t(index.size());
+	footer.version = INDEX_VERSION;
+	memcpy(footer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+
+	uint32_t terminator = 0;
+	bool ret = fwrite(&terminator, sizeof(terminator), 1, file.get()) == 1 &&
+	           (index.empty() || fwrite(index.data(), sizeof(index.front()), index.size(), file.get()) == index.size()) &&
+	           fwrite(&footer, sizeof(footer), 1, file.get()) == 1;
+
+	ret = fflush(file.get()) == 0 && ret;
+	file.reset();
+	index.clear();
+	return ret;
+}
+
+bool PyroWaveFileReader::read_range(uint64_t offset, void *data, size_t size) const
+{
+	if (mapping)
+	{
+		if (offset > mapping.size() || mapping.size() - offset < size)
+			return false;
+		memcpy(data, mapping.data() + offset, size);
+		return true;
+	}
+
+	// A separate handle per call keeps concurrent reads independent.
+	struct FileDeleter { void operator()(FILE *f) { if (f) fclose(f); } };
+	std::unique_ptr<FILE, FileDeleter> file{fopen(path.c_str(), "rb")};
+	if (!file || file_seek(file.get(), int64_t(offset), SEEK_SET) != 0)
+		return false;
+	return fread(data, 1, size, file.get()) == size;
+}
+
+bool PyroWaveFileReader::open(const std::string &path_)
+{
+	path = path_;
+	index.clear();
+	indexed = false;
+
+	uint64_t file_size = 0;
+
+	if (mapping.map(path))
+	{
+		file_size = mapping.size();
+	}
+	else
+	{
+		struct FileDeleter { void operator()(FILE *f) { if (f) fclose(f); } };
+		std::unique_ptr<FILE, FileDeleter> file{fopen(path.c_str(), "rb")};
+		if (!file || file_seek(file.get(), 0, SEEK_END) != 0)
+		{
+			fprintf(stderr, "Failed to open %s\n", path.c_str());
+			return false;
+		}
+
+#ifdef _WIN32
+		file_size = uint64_t(_ftelli64(file.get()));
+#else
+		file_size = uint64_t(ftello(file.get()));
+#endif
+	}
+
+	char magic[sizeof(FILE_MAGIC)];
+	if (!read_range(0, magic, sizeof(magic)) || memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0)
+	{
+		fprintf(stderr, "Invalid magic.\n");
+		return false;
+	}
+
+	if (!read_range(sizeof(FILE_MAGIC), &params, sizeof(params)))
+	{
+		fprintf(stderr, "Failed to read parameters.\n");
+		return false;
+	}
+
+	if (load_index(file_size))
+	{
+		indexed = true;
+		return true;
+	}
+
+	return rebuild_index(file_size);
+}
+
+bool PyroWaveFileReader::load_index(uint64_t file_size)
+{
+	PyroWaveFileFooter footer;
+	if (file_size < FRAMES_OFFSET + sizeof(footer))
+		return false;
+	if (!read_range(file_size - sizeof(footer), &footer, sizeof(footer)))
+		return false;
+
+	if (memcmp(footer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || footer.version != INDEX_VERSION)
+		return false;
+
+	uint64_t index_size = uint64_t(footer.num_entries) * sizeof(PyroWaveFileIndexEntry);
+	if (footer.index_offset < FRAMES_OFFSET || footer.index_offset + index_size + sizeof(footer) != file_size)
+		return false;
+
+	index.resize(footer.num_entries);
+	if (!index.empty() && !read_range(footer.index_offset, index.data(), index_size))
+	{
+		index.clear();
+		return false;
+	}
+
+	for (auto &entry : index)
+	{
+		if (entry.offset < FRAMES_OFFSET || entry.offset + entry.size > footer.index_offset)
+		{
+			index.clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool PyroWaveFileReader::rebuild_index(uint64_t file_size)
+{
+	uint64_t offset = FRAMES_OFFSET;
+	uint32_t sequence = 0;
+
+	double frame_duration_ns = params.frame_rate_num > 0 && params.frame_rate_den > 0 ?
+	                           1e9 * double(params.frame_rate_den) / double(params.frame_rate_num) : 0.0;
+
+	while (offset + sizeof(uint32_t) <= file_size)
+	{
+		uint32_t size;
+		if (!read_range(offset, &size, sizeof(size)) || size == 0)
+			break;
+
+		offset += sizeof(size);
+
+		// Truncated frame.
+		if (file_size - offset < size)
+			break;
+
+		PyroWaveFileIndexEntry entry = {};
+		entry.offset = offset;
+		entry.size = size;
+		entry.sequence = sequence;
+		entry.timestamp_ns = uint64_t(double(sequence) * frame_duration_ns);
+		index.push_back(entry);
+
+		offset += size;
+		sequence++;
+	}
+
+	return true;
+}
+
+const PyroWaveFileParams &PyroWaveFileReader::get_params() const
+{
+	return params;
+}
+
+size_t PyroWaveFileReader::get_num_frames() const
+{
+	return index.size();
+}
+
+const PyroWaveFileIndexEntry &PyroWaveFileReader::get_entry(size_t i) const
+{
+	return index[i];
+}
+
+bool PyroWaveFileReader::has_index() const
+{
+	return indexed;
+}
+
+size_t PyroWaveFileReader::find_frame(uint64_t timestamp_ns) const
+{
+	auto itr = std::upper_bound(index.begin(), index.end(), timestamp_ns,
+	                            [](uint64_t ts, const PyroWaveFileIndexEntry &entry) {
+		                            return ts < entry.timestamp_ns;
+	                            });
+
+	if (itr == index.begin())
+		return 0;
+	return size_t(itr - index.begin()) - 1;
+}
+
+const void *PyroWaveFileReader::map_frame(size_t i) const
+{
+	if (!mapping || i >= index.size())
+		return nullptr;
+	return mapping.data() + index[i].offset;
+}
+
+bool PyroWaveFileReader::read_frame(size_t i, std::vector<uint8_t> &data) const
+{
+	if (i >= index.size())
+		return false;
+
+	data.resize(index[i].size);
+	return read_range(index[i].offset, data.data(), data.size());
+}
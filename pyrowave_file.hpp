@@ -0,0 +1,101 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pyrowave_config.hpp"
+#include "yuv4mpeg.hpp"
+#include "mapped_file.hpp"
+
+// Container for encoded streams, written by pyrowave-encode.
+//
+// "PYROWAVE" magic, PyroWaveFileParams, then one record per frame: u32 size followed by the packetized frame.
+// A record with size 0 terminates the frames and is followed by the index,
+// an array of PyroWaveFileIndexEntry, and finally PyroWaveFileFooter at the very end of the file.
+//
+// Streams written by older versions have no index, and a stream may lack one if the writer never finished.
+// In both cases, the index is rebuilt by walking the frame records,
+// which is cheap since only the size fields are read.
+struct PyroWaveFileParams
+{
+	int32_t width;
+	int32_t height;
+	YUV4MPEGFile::Format format;
+	PyroWave::ChromaSubsampling chroma;
+	uint32_t is_full_range;
+	int32_t frame_rate_num;
+	int32_t frame_rate_den;
+	uint32_t chroma_siting;
+};
+static_assert(sizeof(PyroWaveFileParams) == 32, "PyroWaveFileParams size mismatch.");
+
+struct PyroWaveFileIndexEntry
+{
+	// Offset of the frame data, i.e. after the u32 size.
+	uint64_t offset;
+	uint32_t size;
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+};
+static_assert(sizeof(PyroWaveFileIndexEntry) == 24, "PyroWaveFileIndexEntry size mismatch.");
+
+struct PyroWaveFileFooter
+{
+	uint64_t index_offset;
+	uint32_t num_entries;
+	uint32_t version;
+	char magic[8];
+};
+static_assert(sizeof(PyroWaveFileFooter) == 24, "PyroWaveFileFooter size mismatch.");
+
+class PyroWaveFileWriter
+{
+public:
+	~PyroWaveFileWriter();
+	bool open(const std::string &path, const PyroWaveFileParams &params);
+
+	// Frame records go straight to disk, the index is kept in memory until close().
+	bool write_frame(const void *data, size_t size, uint32_t sequence, uint64_t timestamp_ns);
+	bool close();
+
+private:
+	struct FileDeleter { void operator()(FILE *f) { if (f) fclose(f); } };
+	std::unique_ptr<FILE, FileDeleter> file;
+	std::vector<PyroWaveFileIndexEntry> index;
+	uint64_t offset = 0;
+};
+
+class PyroWaveFileReader
+{
+public:
+	bool open(const std::string &path);
+	const PyroWaveFileParams &get_params() const;
+
+	size_t get_num_frames() const;
+	const PyroWaveFileIndexEntry &get_entry(size_t index) const;
+	// Index of the last frame with timestamp <= timestamp_ns, or 0.
+	size_t find_frame(uint64_t timestamp_ns) const;
+	// True if the file had a complete index, false if it had to be rebuilt.
+	bool has_index() const;
+
+	// Zero-copy when memory mapped, nullptr otherwise.
+	const void *map_frame(size_t index) const;
+	// Safe to call concurrently from multiple threads.
+	bool read_frame(size_t index, std::vector<uint8_t> &data) const;
+
+private:
+	MappedFile mapping;
+	std::string path;
+	PyroWaveFileParams params = {};
+	std::vector<PyroWaveFileIndexEntry> index;
+	bool indexed = false;
+
+	bool read_range(uint64_t offset, void *data, size_t size) const;
+	bool load_index(uint64_t file_size);
+	bool rebuild_index(uint64_t file_size);
+};
@@ -0,0 +1,171 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#include "pyrowave_instrumentation.hpp"
+#include "bitops.hpp"
+
+#if PYROWAVE_INSTRUMENTATION
+#include "timer.hpp"
+#include <atomic>
+#include <mutex>
+#endif
+
+namespace PyroWave
+{
+namespace Instrumentation
+{
+// Log-linear buckets with 4 sub-buckets per power of two, similar to HDR histograms.
+// Values below 4 ns get an exact bucket.
+unsigned duration_to_bucket(uint64_t ns)
+{
+	if (ns < 4)
+		return unsigned(ns);
+
+	unsigned msb = (ns >> 32) ? 63 - Util::leading_zeroes(uint32_t(ns >> 32)) : 31 - Util::leading_zeroes(uint32_t(ns));
+	unsigned sub = unsigned(ns >> (msb - 2)) & 3;
+	unsigned bucket = 4 * (msb - 1) + sub;
+	return bucket < PYROWAVE_TIMING_HISTOGRAM_BUCKETS ? bucket : PYROWAVE_TIMING_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t bucket_upper_bound_ns(unsigned bucket)
+{
+	if (bucket >= PYROWAVE_TIMING_HISTOGRAM_BUCKETS - 1)
+		return UINT64_MAX;
+	if (bucket < 4)
+		return bucket + 1;
+
+	unsigned msb = bucket / 4 + 1;
+	unsigned sub = bucket % 4;
+	return uint64_t(5 + sub) << (msb - 2);
+}
+
+#if PYROWAVE_INSTRUMENTATION
+struct ThreadHistograms
+{
+	// Only written by the owning thread, so plain load + store is enough.
+	// Atomics are only used so that readers observe whole values.
+	std::atomic<uint64_t> buckets[PYROWAVE_TIMING_EVENT_COUNT][PYROWAVE_TIMING_HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> total_ns[PYROWAVE_TIMING_EVENT_COUNT];
+	std::atomic<bool> in_use;
+	ThreadHistograms *next;
+};
+
+// Histograms are never freed. When a thread exits, its histograms are handed over to the next new thread,
+// so samples are not lost and memory is bounded by the peak number of threads.
+static std::atomic<ThreadHistograms *> histogram_list;
+static std::atomic<bool> instrumentation_enabled;
+
+struct ThreadHistogramsOwner
+{
+	ThreadHistograms *histograms = nullptr;
+
+	~ThreadHistogramsOwner()
+	{
+		if (histograms)
+			histograms->in_use.store(false, std::memory_order_release);
+	}
+};
+
+static thread_local ThreadHistogramsOwner thread_histograms;
+
+static ThreadHistograms *acquire_thread_histograms()
+{
+	for (auto *h = histogram_list.load(std::memory_order_acquire); h; h = h->next)
+	{
+		bool expected = false;
+		if (h->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire, std::memory_order_relaxed))
+			return h;
+	}
+
+	// Value-initialization zeroes the counters.
+	auto *h = new ThreadHistograms();
+	h->in_use.store(true, std::memory_order_relaxed);
+	h->next = histogram_list.load(std::memory_order_relaxed);
+	while (!histogram_list.compare_exchange_weak(h->next, h, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+
+	return h;
+}
+
+static void increment(std::atomic<uint64_t> &counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+uint64_t begin()
+{
+	if (!instrumentation_enabled.load(std::memory_order_relaxed))
+		return 0;
+	return uint64_t(Util::get_current_time_nsecs());
+}
+
+void end(uint64_t start_ns, pyrowave_timing_event event)
+{
+	if (!start_ns)
+		return;
+
+	uint64_t end_ns = uint64_t(Util::get_current_time_nsecs());
+	uint64_t duration = end_ns > start_ns ? end_ns - start_ns : 0;
+
+	auto &owner = thread_histograms;
+	if (!owner.histograms)
+		owner.histograms = acquire_thread_histograms();
+
+	increment(owner.histograms->buckets[event][duration_to_bucket(duration)], 1);
+	increment(owner.histograms->total_ns[event], duration);
+}
+
+// Counters only ever grow, so a reset snapshots the current sums and later reads are relative to that.
+static std::mutex report_lock;
+static pyrowave_timing_histogram baseline[PYROWAVE_TIMING_EVENT_COUNT];
+
+bool set_enabled(bool enable)
+{
+	instrumentation_enabled.store(enable, std::memory_order_relaxed);
+	return true;
+}
+
+pyrowave_result get_histogram(pyrowave_timing_event event, pyrowave_timing_histogram *histogram, bool reset)
+{
+	if (int(event) < 0 || int(event) >= PYROWAVE_TIMING_EVENT_COUNT || !histogram)
+		return PYROWAVE_ERROR_INVALID_ARGUMENT;
+
+	std::lock_guard<std::mutex> holder{report_lock};
+	pyrowave_timing_histogram sum = {};
+
+	for (auto *h = histogram_list.load(std::memory_order_acquire); h; h = h->next)
+	{
+		for (unsigned i = 0; i < PYROWAVE_TIMING_HISTOGRAM_BUCKETS; i++)
+			sum.buckets[i] += h->buckets[event][i].load(std::memory_order_relaxed);
+		sum.total_ns += h->total_ns[event].load(std::memory_order_relaxed);
+	}
+
+	for (auto count : sum.buckets)
+		sum.count += count;
+
+	auto &base = baseline[event];
+
+	*histogram = {};
+	for (unsigned i = 0; i < PYROWAVE_TIMING_HISTOGRAM_BUCKETS; i++)
+		histogram->buckets[i] = sum.buckets[i] - base.buckets[i];
+	histogram->count = sum.count - base.count;
+	histogram->total_ns = sum.total_ns - base.total_ns;
+
+	if (reset)
+		base = sum;
+
+	return PYROWAVE_SUCCESS;
+}
+#else
+bool set_enabled(bool)
+{
+	return false;
+}
+
+pyrowave_result get_histogram(pyrowave_timing_event, pyrowave_timing_histogram *, bool)
+{
+	return PYROWAVE_ERROR_NOT_IMPLEMENTED;
+}
+#endif
+}
+}
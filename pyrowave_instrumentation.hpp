@@ -0,0 +1,38 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <stdint.h>
+#include "vulkan_headers.hpp"
+#include "pyrowave.h"
+
+// CPU timing of C API entry points.
+// Built only with PYROWAVE_INSTRUMENTATION, otherwise the timing macros compile to nothing.
+// Every thread records into its own histograms without locking.
+// Only readers take a lock, so they can sum over all threads.
+namespace PyroWave
+{
+namespace Instrumentation
+{
+bool set_enabled(bool enable);
+pyrowave_result get_histogram(pyrowave_timing_event event, pyrowave_timing_histogram *histogram, bool reset);
+
+unsigned duration_to_bucket(uint64_t ns);
+// Exclusive.
+uint64_t bucket_upper_bound_ns(unsigned bucket);
+
+#if PYROWAVE_INSTRUMENTATION
+// Returns 0 if instrumentation is disabled at runtime.
+uint64_t begin();
+void end(uint64_t start_ns, pyrowave_timing_event event);
+#endif
+}
+}
+
+#if PYROWAVE_INSTRUMENTATION
+#define PYROWAVE_TIMING_BEGIN(name) const uint64_t name = ::PyroWave::Instrumentation::begin()
+#define PYROWAVE_TIMING_END(name, event) ::PyroWave::Instrumentation::end(name, event)
+#else
+#define PYROWAVE_TIMING_BEGIN(name) ((void)0)
+#define PYROWAVE_TIMING_END(name, event) ((void)0)
+#endif
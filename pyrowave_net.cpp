@@ -0,0 +1,540 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "pyrowave_net.hpp"
+#include "logging.hpp"
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <netinet/udp.h>
+// Not all libc headers know about these yet.
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+namespace PyroWave
+{
+// Kernel limits for a single GSO send.
+static constexpr size_t MaxGSOSegments = 64;
+static constexpr size_t MaxGSOBytes = 65507;
+// Upper bound on messages per sendmmsg, also the default UIO_MAXIOV.
+static constexpr size_t MaxMessagesPerCall = 1024;
+
+static bool resolve_address(const char *address, uint16_t port, bool passive, sockaddr_storage &addr, socklen_t &len)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	addrinfo *result = nullptr;
+	auto port_str = std::to_string(port);
+	int ret = getaddrinfo(address, port_str.c_str(), &hints, &result);
+	if (ret != 0 || !result)
+	{
+		LOGE("Failed to resolve %s:%u: %s\n", address ? address : "*", unsigned(port), gai_strerror(ret));
+		return false;
+	}
+
+	memcpy(&addr, result->ai_addr, result->ai_addrlen);
+	len = result->ai_addrlen;
+	freeaddrinfo(result);
+	return true;
+}
+
+static bool is_transient_error(int err)
+{
+	return err == EINTR || err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+UDPSender::~UDPSender()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+bool UDPSender::init(const Options &options_)
+{
+	options = options_;
+	stats = {};
+
+	sockaddr_storage addr = {};
+	socklen_t addr_len = 0;
+	if (!resolve_address(options.address, options.port, false, addr, addr_len))
+		return false;
+
+	fd = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+	{
+		LOGE("Failed to create socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (options.send_buffer_size > 0)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer_size, sizeof(options.send_buffer_size));
+
+	// Connected, so messages need no per-message address and the route is resolved once.
+	if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), addr_len) < 0)
+	{
+		LOGE("Failed to connect socket: %s\n", strerror(errno));
+		return false;
+	}
+
+#ifdef __linux__
+	use_gso = options.gso;
+#else
+	use_gso = false;
+#endif
+
+	next_send_time = std::chrono::steady_clock::now();
+	return true;
+}
+
+size_t UDPSender::build_messages(const Encoder::Packet *packets, size_t count)
+{
+	messages.clear();
+
+	size_t i = 0;
+	while (i < count)
+	{
+		Message msg = { i, 1, 0 };
+		size_t segment_size = packets[i].size;
+
+		if (use_gso)
+		{
+			size_t total = segment_size;
+
+			// Every segment but the last must be exactly segment_size, the last may be shorter.
+			while (i + msg.num_packets < count && msg.num_packets < MaxGSOSegments)
+			{
+				size_t size = packets[i + msg.num_packets].size;
+				if (size > segment_size || total + size > MaxGSOBytes)
+					break;
+
+				total += size;
+				msg.num_packets++;
+
+				if (size < segment_size)
+					break;
+			}
+
+			if (msg.num_packets > 1)
+				msg.segment_size = uint16_t(segment_size);
+		}
+
+		messages.push_back(msg);
+		i += msg.num_packets;
+	}
+
+	return messages.size();
+}
+
+#ifdef __linux__
+bool UDPSender::send_messages(const uint8_t *bitstream, const Encoder::Packet *packets)
+{
+	union ControlBuffer
+	{
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		cmsghdr align;
+	};
+
+	std::vector<mmsghdr> hdrs;
+	std::vector<iovec> iovs;
+	std::vector<ControlBuffer> controls;
+
+	size_t msg_index = 0;
+	while (msg_index < messages.size())
+	{
+		size_t num_msgs = std::min(messages.size() - msg_index, MaxMessagesPerCall);
+
+		size_t num_iovs = 0;
+		for (size_t i = 0; i < num_msgs; i++)
+			num_iovs += messages[msg_index + i].num_packets;
+
+		// Sized up front, since the headers point into these arrays.
+		hdrs.assign(num_msgs, {});
+		iovs.resize(num_iovs);
+		controls.assign(num_msgs, {});
+
+		size_t iov_index = 0;
+		for (size_t i = 0; i < num_msgs; i++)
+		{
+			auto &msg = messages[msg_index + i];
+			auto &hdr = hdrs[i].msg_hdr;
+
+			hdr.msg_iov = &iovs[iov_index];
+			hdr.msg_iovlen = msg.num_packets;
+
+			for (size_t p = 0; p < msg.num_packets; p++)
+			{
+				auto &packet = packets[msg.first_packet + p];
+				iovs[iov_index].iov_base = const_cast<uint8_t *>(bitstream + packet.offset);
+				iovs[iov_index].iov_len = packet.size;
+				iov_index++;
+			}
+
+			if (msg.segment_size)
+			{
+				hdr.msg_control = controls[i].buf;
+				hdr.msg_controllen = sizeof(controls[i].buf);
+				auto *cmsg = CMSG_FIRSTHDR(&hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				memcpy(CMSG_DATA(cmsg), &msg.segment_size, sizeof(uint16_t));
+			}
+		}
+
+		int ret = sendmmsg(fd, hdrs.data(), unsigned(num_msgs), 0);
+		stats.syscalls++;
+
+		if (ret < 0)
+		{
+			int err = errno;
+			if (is_transient_error(err))
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			// EIO when the device cannot checksum offload, EINVAL on kernels without GSO.
+			// Regroup the remaining packets without GSO and try again.
+			if (use_gso && (err == EIO || err == EINVAL))
+			{
+				LOGW("UDP GSO is not supported, falling back to one datagram per packet.\n");
+				use_gso = false;
+
+				size_t first_packet = messages[msg_index].first_packet;
+				size_t num_packets = messages.back().first_packet + messages.back().num_packets - first_packet;
+				build_messages(packets + first_packet, num_packets);
+				for (auto &msg : messages)
+					msg.first_packet += first_packet;
+				msg_index = 0;
+				continue;
+			}
+
+			LOGE("sendmmsg failed: %s\n", strerror(err));
+			return false;
+		}
+
+		for (int i = 0; i < ret; i++)
+		{
+			auto &msg = messages[msg_index + i];
+			stats.packets += msg.num_packets;
+			stats.bytes += hdrs[i].msg_len;
+			if (msg.segment_size)
+				stats.gso_datagrams++;
+		}
+
+		msg_index += size_t(ret);
+	}
+
+	return true;
+}
+#else
+bool UDPSender::send_messages(const uint8_t *bitstream, const Encoder::Packet *packets)
+{
+	for (auto &msg : messages)
+	{
+		auto &packet = packets[msg.first_packet];
+		for (;;)
+		{
+			ssize_t ret = send(fd, bitstream + packet.offset, packet.size, 0);
+			stats.syscalls++;
+
+			if (ret >= 0)
+				break;
+
+			if (!is_transient_error(errno))
+			{
+				LOGE("send failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			std::this_thread::yield();
+		}
+
+		stats.packets++;
+		stats.bytes += packet.size;
+	}
+
+	return true;
+}
+#endif
+
+void UDPSender::pace(size_t bytes)
+{
+	auto now = std::chrono::steady_clock::now();
+
+	// Idle time does not accumulate credit, otherwise the next frame would go out as one big burst.
+	if (next_send_time < now)
+		next_send_time = now;
+	else
+		std::this_thread::sleep_until(next_send_time);
+
+	next_send_time += std::chrono::nanoseconds(uint64_t(double(bytes) * 1e9 / double(options.pacing_rate)));
+}
+
+bool UDPSender::send_frame(const void *bitstream_, const Encoder::Packet *packets, size_t count)
+{
+	if (fd < 0)
+		return false;
+
+	auto *bitstream = static_cast<const uint8_t *>(bitstream_);
+
+	if (!options.pacing_rate)
+	{
+		build_messages(packets, count);
+		return send_messages(bitstream, packets);
+	}
+
+	size_t i = 0;
+	while (i < count)
+	{
+		// Always send at least one packet per burst.
+		size_t burst_bytes = packets[i].size;
+		size_t end = i + 1;
+		while (end < count && burst_bytes + packets[end].size <= options.pacing_burst)
+			burst_bytes += packets[end++].size;
+
+		pace(burst_bytes);
+
+		build_messages(packets + i, end - i);
+		for (auto &msg : messages)
+			msg.first_packet += i;
+		if (!send_messages(bitstream, packets))
+			return false;
+
+		i = end;
+	}
+
+	return true;
+}
+
+const UDPSender::Stats &UDPSender::get_stats() const
+{
+	return stats;
+}
+
+UDPReceiver::~UDPReceiver()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+bool UDPReceiver::init(const Options &options_)
+{
+	options = options_;
+	stats = {};
+
+	if (options.batch_size == 0 || options.max_datagram_size == 0)
+		return false;
+
+	sockaddr_storage addr = {};
+	socklen_t addr_len = 0;
+	if (!resolve_address(options.address, options.port, true, addr, addr_len))
+		return false;
+
+	fd = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+	{
+		LOGE("Failed to create socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	// A frame arrives as a burst, so the default buffer is easily overrun while the receiver is busy.
+	if (options.receive_buffer_size > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer_size, sizeof(options.receive_buffer_size));
+
+	if (bind(fd, reinterpret_cast<const sockaddr *>(&addr), addr_len) < 0)
+	{
+		LOGE("Failed to bind socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	use_gro = false;
+#ifdef __linux__
+	if (options.gro)
+	{
+		int enable = 1;
+		use_gro = setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+		if (!use_gro)
+			LOGW("UDP GRO is not supported, receiving one datagram per packet.\n");
+	}
+#endif
+
+	// Coalesced datagrams can be up to 64 KiB.
+	buffer_size = use_gro ? 65536 : options.max_datagram_size;
+	buffers.resize(buffer_size * options.batch_size);
+	return true;
+}
+
+uint16_t UDPReceiver::get_port() const
+{
+	sockaddr_storage addr = {};
+	socklen_t len = sizeof(addr);
+	if (fd < 0 || getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0)
+		return 0;
+
+	if (addr.ss_family == AF_INET)
+		return ntohs(reinterpret_cast<const sockaddr_in *>(&addr)->sin_port);
+	else if (addr.ss_family == AF_INET6)
+		return ntohs(reinterpret_cast<const sockaddr_in6 *>(&addr)->sin6_port);
+	else
+		return 0;
+}
+
+bool UDPReceiver::receive(std::vector<Decoder::PacketData> &packets, int timeout_ms)
+{
+	packets.clear();
+	if (fd < 0)
+		return false;
+
+	pollfd pfd = { fd, POLLIN, 0 };
+	int ret = poll(&pfd, 1, timeout_ms);
+	if (ret == 0 || (ret < 0 && errno == EINTR))
+		return true;
+	if (ret < 0)
+	{
+		LOGE("poll failed: %s\n", strerror(errno));
+		return false;
+	}
+
+#ifdef __linux__
+	union ControlBuffer
+	{
+		char buf[CMSG_SPACE(sizeof(int))];
+		cmsghdr align;
+	};
+
+	std::vector<mmsghdr> hdrs(options.batch_size);
+	std::vector<iovec> iovs(options.batch_size);
+	std::vector<ControlBuffer> controls(options.batch_size);
+
+	for (unsigned i = 0; i < options.batch_size; i++)
+	{
+		iovs[i].iov_base = buffers.data() + i * buffer_size;
+		iovs[i].iov_len = buffer_size;
+		hdrs[i].msg_hdr.msg_iov = &iovs[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+		if (use_gro)
+		{
+			hdrs[i].msg_hdr.msg_control = controls[i].buf;
+			hdrs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+		}
+	}
+
+	int count = recvmmsg(fd, hdrs.data(), options.batch_size, MSG_DONTWAIT, nullptr);
+	stats.syscalls++;
+
+	if (count < 0)
+	{
+		if (is_transient_error(errno))
+			return true;
+		LOGE("recvmmsg failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		auto &hdr = hdrs[i].msg_hdr;
+		if (hdr.msg_flags & MSG_TRUNC)
+			continue;
+
+		auto *data = static_cast<const uint8_t *>(iovs[i].iov_base);
+		size_t size = hdrs[i].msg_len;
+		size_t segment_size = size;
+
+		for (auto *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+			{
+				int gro_size;
+				memcpy(&gro_size, CMSG_DATA(cmsg), sizeof(gro_size));
+				if (gro_size > 0)
+					segment_size = size_t(gro_size);
+			}
+		}
+
+		// The kernel coalesces equally sized datagrams, only the last one may be shorter.
+		bool coalesced = segment_size < size;
+		for (size_t offset = 0; offset < size; offset += segment_size)
+		{
+			size_t packet_size = std::min(segment_size, size - offset);
+			packets.push_back({ data + offset, packet_size });
+			stats.bytes += packet_size;
+			if (coalesced)
+				stats.gro_packets++;
+		}
+	}
+#else
+	for (unsigned i = 0; i < options.batch_size; i++)
+	{
+		auto *data = buffers.data() + i * buffer_size;
+		ssize_t size = recv(fd, data, buffer_size, MSG_DONTWAIT);
+		stats.syscalls++;
+
+		if (size < 0)
+		{
+			if (is_transient_error(errno))
+				break;
+			LOGE("recv failed: %s\n", strerror(errno));
+			return false;
+		}
+
+		packets.push_back({ data, size_t(size) });
+		stats.bytes += size_t(size);
+	}
+#endif
+
+	stats.packets += packets.size();
+	return true;
+}
+
+bool UDPReceiver::receive(Decoder &decoder, int timeout_ms, size_t *num_packets)
+{
+	if (!receive(scratch_packets, timeout_ms))
+		return false;
+
+	if (num_packets)
+		*num_packets = scratch_packets.size();
+
+	// push_packets() stops at the first bad packet, e.g. a straggler from an older frame.
+	// Push individually in that case, the decoder ignores the duplicates.
+	if (!scratch_packets.empty() && !decoder.push_packets(scratch_packets.data(), scratch_packets.size()))
+		for (auto &packet : scratch_packets)
+			decoder.push_packet(packet.data, packet.size);
+
+	return true;
+}
+
+const UDPReceiver::Stats &UDPReceiver::get_stats() const
+{
+	return stats;
+}
+}
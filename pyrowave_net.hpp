@@ -0,0 +1,132 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "pyrowave_encoder.hpp"
+#include "pyrowave_decoder.hpp"
+
+// Reference UDP transport for PyroWave packets.
+// One PyroWave packet is sent as one datagram, so the packet boundary passed to packetize()
+// should leave room for IP and UDP headers within the path MTU, e.g. 1400 for a 1500 byte Ethernet MTU.
+// POSIX only. On Linux, batching syscalls (sendmmsg / recvmmsg) and UDP GSO / GRO are used when available.
+namespace PyroWave
+{
+class UDPSender
+{
+public:
+	struct Options
+	{
+		const char *address = "127.0.0.1";
+		uint16_t port = 0;
+		// Average rate in bytes per second, 0 disables pacing.
+		// Without pacing, a whole frame hits the wire at once, which can easily overflow shallow switch buffers.
+		uint64_t pacing_rate = 0;
+		// With pacing, at most this many bytes are sent back-to-back.
+		size_t pacing_burst = 64 * 1024;
+		int send_buffer_size = 4 * 1024 * 1024;
+		// Runs of packets with identical size are sent as one GSO super-datagram.
+		// packetize() aligns packets to code blocks, so how often this hits depends on the content.
+		bool gso = true;
+	};
+
+	struct Stats
+	{
+		uint64_t syscalls;
+		uint64_t packets;
+		uint64_t bytes;
+		// Datagrams which were split into several packets by the kernel.
+		uint64_t gso_datagrams;
+	};
+
+	UDPSender() = default;
+	~UDPSender();
+	UDPSender(const UDPSender &) = delete;
+	void operator=(const UDPSender &) = delete;
+
+	bool init(const Options &options);
+
+	// Packets as returned by Encoder::packetize(), relative to bitstream.
+	// Blocks while pacing.
+	bool send_frame(const void *bitstream, const Encoder::Packet *packets, size_t count);
+
+	const Stats &get_stats() const;
+
+private:
+	int fd = -1;
+	Options options;
+	Stats stats = {};
+	bool use_gso = false;
+	std::chrono::steady_clock::time_point next_send_time;
+
+	struct Message
+	{
+		size_t first_packet;
+		size_t num_packets;
+		uint16_t segment_size;
+	};
+	std::vector<Message> messages;
+
+	size_t build_messages(const Encoder::Packet *packets, size_t count);
+	bool send_messages(const uint8_t *bitstream, const Encoder::Packet *packets);
+	void pace(size_t bytes);
+};
+
+class UDPReceiver
+{
+public:
+	struct Options
+	{
+		// nullptr binds to all interfaces.
+		const char *address = nullptr;
+		// 0 selects an ephemeral port, see get_port().
+		uint16_t port = 0;
+		// Largest datagram expected without GRO.
+		size_t max_datagram_size = 1500;
+		// Number of datagrams received per syscall.
+		unsigned batch_size = 64;
+		int receive_buffer_size = 8 * 1024 * 1024;
+		bool gro = true;
+	};
+
+	struct Stats
+	{
+		uint64_t syscalls;
+		uint64_t packets;
+		uint64_t bytes;
+		// Packets which arrived coalesced with others.
+		uint64_t gro_packets;
+	};
+
+	UDPReceiver() = default;
+	~UDPReceiver();
+	UDPReceiver(const UDPReceiver &) = delete;
+	void operator=(const UDPReceiver &) = delete;
+
+	bool init(const Options &options);
+	uint16_t get_port() const;
+
+	// Waits up to timeout_ms for data (negative waits forever), then receives one batch without blocking.
+	// packets is overwritten, and the pointers remain valid until the next call to receive().
+	// Returns false on socket errors, a timeout is not an error.
+	bool receive(std::vector<Decoder::PacketData> &packets, int timeout_ms);
+
+	// Same as above, but hands the batch straight to Decoder::push_packets().
+	// Packets which fail to parse are dropped, since they are as good as lost.
+	bool receive(Decoder &decoder, int timeout_ms, size_t *num_packets = nullptr);
+
+	const Stats &get_stats() const;
+
+private:
+	int fd = -1;
+	Options options;
+	Stats stats = {};
+	bool use_gro = false;
+	size_t buffer_size = 0;
+	std::vector<uint8_t> buffers;
+	std::vector<Decoder::PacketData> scratch_packets;
+};
+}
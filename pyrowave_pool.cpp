@@ -0,0 +1,143 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#include "pyrowave_pool.hpp"
+#include "pyrowave_common.hpp"
+#include <algorithm>
+
+namespace PyroWave
+{
+using namespace Vulkan;
+
+static bool image_info_matches(const ImageCreateInfo &a, const ImageCreateInfo &b)
+{
+	return a.domain == b.domain && a.width == b.width && a.height == b.height && a.depth == b.depth &&
+	       a.levels == b.levels && a.layers == b.layers && a.format == b.format && a.type == b.type &&
+	       a.usage == b.usage && a.samples == b.samples && a.flags == b.flags && a.misc == b.misc &&
+	       a.layout == b.layout;
+}
+
+bool ResourcePool::Impl::bind_device(Device &device_)
+{
+	if (device && device != &device_)
+	{
+		LOGE("ResourcePool is shared between devices.\n");
+		return false;
+	}
+	device = &device_;
+	return true;
+}
+
+void ResourcePool::Impl::retire_pending()
+{
+	auto itr = std::remove_if(pending.begin(), pending.end(), [this](PendingReturn &ret) {
+		for (auto &fence : ret.fences)
+			if (fence && !fence->wait_timeout(0))
+				return false;
+
+		for (auto &image : ret.images)
+			images.push_back(std::move(image));
+		for (auto &buffer : ret.buffers)
+			buffers.push_back(std::move(buffer));
+		return true;
+	});
+	pending.erase(itr, pending.end());
+}
+
+ImageHandle ResourcePool::Impl::take_image(Device &device_, const ImageCreateInfo &info)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	if (!bind_device(device_))
+		return {};
+	retire_pending();
+
+	for (auto itr = images.begin(); itr != images.end(); ++itr)
+	{
+		if (image_info_matches((*itr)->get_create_info(), info))
+		{
+			auto image = std::move(*itr);
+			images.erase(itr);
+			return image;
+		}
+	}
+
+	return {};
+}
+
+BufferHandle ResourcePool::Impl::take_buffer(Device &device_, const BufferCreateInfo &info)
+{
+	std::lock_guard<std::mutex> holder{lock};
+	if (!bind_device(device_))
+		return {};
+	retire_pending();
+
+	// Sizes must match exactly, so that memory budgets and capacities derived from the size hold.
+	for (auto itr = buffers.begin(); itr != buffers.end(); ++itr)
+	{
+		auto &candidate = (*itr)->get_create_info();
+		if (candidate.domain == info.domain && candidate.usage == info.usage &&
+		    candidate.misc == info.misc && candidate.size == info.size)
+		{
+			auto buffer = std::move(*itr);
+			buffers.erase(itr);
+			return buffer;
+		}
+	}
+
+	return {};
+}
+
+void ResourcePool::Impl::give(Device &device_, std::vector<ImageHandle> &images_, std::vector<BufferHandle> &buffers_)
+{
+	PendingReturn ret;
+	for (auto &image : images_)
+		if (image)
+			ret.images.push_back(std::move(image));
+	for (auto &buffer : buffers_)
+		if (buffer)
+			ret.buffers.push_back(std::move(buffer));
+	images_.clear();
+	buffers_.clear();
+
+	if (ret.images.empty() && ret.buffers.empty())
+		return;
+
+	std::lock_guard<std::mutex> holder{lock};
+	if (!bind_device(device_))
+		return; // Dropping the handles is fine, deferred deletion keeps them alive until the GPU is done.
+
+	// Like deferred deletion, only hand these out again once work which may use them has retired.
+	// Work recorded into external command buffers must have completed before the session is torn down.
+	device->submit_empty(CommandBuffer::Type::Generic, &ret.fences[0]);
+	device->submit_empty(CommandBuffer::Type::AsyncCompute, &ret.fences[1]);
+	pending.push_back(std::move(ret));
+}
+
+ResourcePool::ResourcePool()
+{
+	impl.reset(new Impl);
+}
+
+ResourcePool::~ResourcePool()
+{
+}
+
+void ResourcePool::clear()
+{
+	std::lock_guard<std::mutex> holder{impl->lock};
+	impl->images.clear();
+	impl->buffers.clear();
+	impl->pending.clear();
+}
+
+uint64_t ResourcePool::get_idle_memory_size() const
+{
+	std::lock_guard<std::mutex> holder{impl->lock};
+	impl->retire_pending();
+	uint64_t size = 0;
+	for (auto &image : impl->images)
+		size += WaveletBuffers::get_image_size(image.get());
+	for (auto &buffer : impl->buffers)
+		size += buffer->get_create_info().size;
+	return size;
+}
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+
+namespace PyroWave
+{
+// Device-level cache of the images and buffers owned by encoders and decoders.
+// When an encoder or decoder using the pool is destroyed or re-initialized, its resources go back to the pool,
+// and a later encoder or decoder which needs an identical resource takes it over instead of allocating.
+// This makes sessions with the same resolution and chroma cheap to create and destroy, e.g. for loopback
+// validation or transcoding. Sessions which exist at the same time never share resources.
+// Returned resources are only handed out again once GPU work submitted before the return has completed.
+// Command buffers recorded by an encoder or decoder must be submitted before it is destroyed.
+// All encoders and decoders using a pool must be created on the same device, and the pool must outlive them.
+// The pool must not outlive the Device, since it holds device resources. Destroy or clear() it first.
+// The pool is thread-safe.
+class ResourcePool
+{
+public:
+	ResourcePool();
+	~ResourcePool();
+	ResourcePool(const ResourcePool &) = delete;
+	void operator=(const ResourcePool &) = delete;
+
+	// Frees all idle resources.
+	void clear();
+
+	// Device memory held by idle resources which are ready to be reused, in bytes.
+	uint64_t get_idle_memory_size() const;
+
+private:
+	friend struct WaveletBuffers;
+	struct Impl;
+	std::unique_ptr<Impl> impl;
+};
+}
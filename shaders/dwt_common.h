@@ -41,6 +41,18 @@ const FLOAT DELTA = FLOAT(0.443506852043971);
 const FLOAT K = FLOAT(1.230174104914001);
 const FLOAT inv_K = FLOAT(1.0 / 1.230174104914001);
 
+// LeGall 5/3 integer lifting steps for the reversible transform.
+// Coefficients are integers which are exact even in FP16 for 8-bit samples, so rounding through int is lossless.
+VEC2 lift_predict(VEC2 a, VEC2 b)
+{
+	return VEC2((ivec2(a) + ivec2(b)) >> 1);
+}
+
+VEC2 lift_update(VEC2 a, VEC2 b)
+{
+	return VEC2((ivec2(a) + ivec2(b) + 2) >> 2);
+}
+
 shared SHARED_VEC2 shared_block[(BLOCK_SIZE + 2 * APRON) / 2][(BLOCK_SIZE + 2 * APRON) + 1];
 #if !FP16 && PRECISION == 1
 VEC2 load_shared(uint y, uint x) { return unpackHalf2x16(shared_block[y][x]); }
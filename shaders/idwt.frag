@@ -20,6 +20,10 @@ layout(location = 0, component = 2) in float vIntCoord;
 #error "Invalid chroma config"
 #endif
 
+#if RGB_OUTPUT
+// Final synthesis pass is fused with YCbCr -> RGB conversion.
+layout(location = 0) out mediump vec4 oRGBA;
+#else
 layout(location = 0) out mediump float oY;
 #if OUTPUT_PLANES == 2
 layout(location = 1) out mediump vec2 oCbCr;
@@ -27,6 +31,7 @@ layout(location = 1) out mediump vec2 oCbCr;
 layout(location = 1) out mediump float oCb;
 layout(location = 2) out mediump float oCr;
 #endif
+#endif
 
 layout(set = 0, binding = 0) uniform mediump texture2D uYEven;
 layout(set = 0, binding = 1) uniform mediump texture2D uYOdd;
@@ -39,6 +44,15 @@ layout(set = 0, binding = 6) uniform mediump texture2D uCrOdd;
 #elif INPUT_PLANES == 2
 layout(set = 0, binding = 3) uniform mediump texture2D uCbCrEven;
 layout(set = 0, binding = 4) uniform mediump texture2D uCbCrOdd;
+#elif RGB_OUTPUT
+// Fully reconstructed chroma planes, resampled to luma resolution.
+layout(set = 0, binding = 3) uniform mediump texture2D uCb;
+layout(set = 0, binding = 4) uniform mediump texture2D uCr;
+layout(set = 0, binding = 5) uniform mediump sampler uChromaSampler;
+#endif
+
+#if RGB_OUTPUT
+#include "ycbcr.h"
 #endif
 
 // Direct and naive implementing of the CDF 9/7 synthesis filters.
@@ -50,6 +64,9 @@ layout(constant_id = 0) const bool VERTICAL = false;
 layout(constant_id = 1) const bool FINAL_Y = false;
 layout(constant_id = 2) const bool FINAL_CBCR = false;
 layout(constant_id = 3) const int EDGE_CONDITION = 0;
+layout(constant_id = 4) const bool BT2020 = false;
+layout(constant_id = 5) const bool FULL_RANGE = false;
+layout(constant_id = 6) const bool CHROMA_LEFT = false;
 const ivec2 OFFSET_M2 = VERTICAL ? ivec2(0, 0) : ivec2(0, 0);
 const ivec2 OFFSET_M1 = VERTICAL ? ivec2(0, 1) : ivec2(1, 0);
 const ivec2 OFFSET_C  = VERTICAL ? ivec2(0, 2) : ivec2(2, 0);
@@ -226,6 +243,21 @@ void main()
 
 	AccumT result = C0 * W0 + C1 * W1 + C2 * W2 + C3 * W3 + C4 * W4;
 
+#if RGB_OUTPUT
+#if INPUT_PLANES == 1
+	vec2 chroma_size = vec2(textureSize(sampler2D(uCb, uChromaSampler), 0));
+	vec2 chroma_uv = gl_FragCoord.xy / (2.0 * chroma_size);
+	if (CHROMA_LEFT)
+		chroma_uv.x += 0.25 / chroma_size.x;
+	vec3 ycbcr = vec3(result + 0.5,
+	                  textureLod(sampler2D(uCb, uChromaSampler), chroma_uv, 0.0).x,
+	                  textureLod(sampler2D(uCr, uChromaSampler), chroma_uv, 0.0).x);
+#else
+	vec3 ycbcr = result + 0.5;
+#endif
+	vec3 rgb = ycbcr_to_rgb(ycbcr.x, ycbcr.y, ycbcr.z, BT2020, FULL_RANGE);
+	oRGBA = vec4(clamp(rgb, vec3(0.0), vec3(1.0)), 1.0);
+#else
 #if OUTPUT_PLANES == 3
 	oY = result.x;
 	oCb = result.y;
@@ -249,4 +281,5 @@ void main()
 		oCbCr += 0.5;
 #endif
 	}
+#endif
 }
@@ -0,0 +1,65 @@
+// Copyright (c) 2025 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#ifndef YCBCR_H_
+#define YCBCR_H_
+
+const mat3 yuv2rgb_bt709 = mat3(
+    vec3(1.0, 1.0, 1.0),
+    vec3(0.0, -0.13397432 / 0.7152, 1.8556),
+    vec3(1.5748, -0.33480248 / 0.7152, 0.0));
+
+const mat3 yuv2rgb_bt2020 = mat3(
+    vec3(1.0, 1.0, 1.0),
+    vec3(0.0, -0.202008 / 0.587, 1.772),
+    vec3(1.402, -0.419198 / 0.587, 0.0));
+
+// Inputs are normalized YCbCr as stored in UNORM planes, i.e. chroma is centered at 128 / 255.
+vec3 ycbcr_to_rgb(float y, float cb, float cr, bool bt2020, bool full_range)
+{
+    cb -= 128.0 / 255.0;
+    cr -= 128.0 / 255.0;
+
+    if (!full_range)
+    {
+        y -= 16.0 / 255.0;
+        y *= 255.0 / 219.0;
+        const float ChromaScale = 255.0 / 224.0;
+        cb *= ChromaScale;
+        cr *= ChromaScale;
+        y = clamp(y, 0.0, 1.0);
+        cb = clamp(cb, -0.5, 0.5);
+        cr = clamp(cr, -0.5, 0.5);
+    }
+
+    if (bt2020)
+        return yuv2rgb_bt2020 * vec3(y, cb, cr);
+    else
+        return yuv2rgb_bt709 * vec3(y, cb, cr);
+}
+
+// Luma weights matching the matrices above, so that encoding from RGB and decoding to RGB round-trips.
+const vec3 rgb2y_bt709 = vec3(0.2126, 0.7152, 0.0722);
+const vec3 rgb2y_bt2020 = vec3(0.299, 0.587, 0.114);
+
+// Inverse of ycbcr_to_rgb() for four texels at once, with components in separate vectors like textureGather().
+// Outputs are normalized YCbCr as stored in UNORM planes.
+void rgb_to_ycbcr(vec4 r, vec4 g, vec4 b, bool bt2020, bool full_range, out vec4 y, out vec4 cb, out vec4 cr)
+{
+    vec3 coeffs = bt2020 ? rgb2y_bt2020 : rgb2y_bt709;
+    y = coeffs.r * r + coeffs.g * g + coeffs.b * b;
+    cb = (b - y) * (0.5 / (1.0 - coeffs.b));
+    cr = (r - y) * (0.5 / (1.0 - coeffs.r));
+
+    if (!full_range)
+    {
+        y = y * (219.0 / 255.0) + 16.0 / 255.0;
+        const float ChromaScale = 224.0 / 255.0;
+        cb *= ChromaScale;
+        cr *= ChromaScale;
+    }
+
+    cb += 128.0 / 255.0;
+    cr += 128.0 / 255.0;
+}
+
+#endif
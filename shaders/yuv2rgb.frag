@@ -19,15 +19,7 @@ layout(constant_id = 0) const bool BT2020 = false;
 layout(constant_id = 1) const bool FullRange = false;
 layout(constant_id = 2) const bool ChromaLeft = false;
 
-const mat3 yuv2rgb_bt709 = mat3(
-    vec3(1.0, 1.0, 1.0),
-    vec3(0.0, -0.13397432 / 0.7152, 1.8556),
-    vec3(1.5748, -0.33480248 / 0.7152, 0.0));
-
-const mat3 yuv2rgb_bt2020 = mat3(
-    vec3(1.0, 1.0, 1.0),
-    vec3(0.0, -0.202008 / 0.587, 1.772),
-    vec3(1.402, -0.419198 / 0.587, 0.0));
+#include "ycbcr.h"
 
 void main()
 {
@@ -44,24 +36,6 @@ void main()
     float cb = textureLod(sampler2D(Cb, Samp), vUV + chroma_uv_offset, 0.0).x;
     float cr = textureLod(sampler2D(Cr, Samp), vUV + chroma_uv_offset, 0.0).x;
 
-    cb -= 128.0 / 255.0;
-    cr -= 128.0 / 255.0;
-
-    if (!FullRange)
-    {
-        y -= 16.0 / 255.0;
-        y *= 255.0 / 219.0;
-        const float ChromaScale = 255.0 / 224.0;
-        cb *= ChromaScale;
-        cr *= ChromaScale;
-        y = clamp(y, 0.0, 1.0);
-        cb = clamp(cb, -0.5, 0.5);
-        cr = clamp(cr, -0.5, 0.5);
-    }
-
-    if (BT2020)
-        FragColor = yuv2rgb_bt2020 * vec3(y, cb, cr);
-    else
-        FragColor = yuv2rgb_bt709 * vec3(y, cb, cr);
+    FragColor = ycbcr_to_rgb(y, cb, cr, BT2020, FullRange);
 #endif
 }
@@ -0,0 +1,955 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+
+// Loopback streaming harness.
+// Encodes a Y4M clip, packetizes it at a given MTU and sends the packets through an emulated network
+// with loss, burst loss, reordering and jitter, either in-process or over UDP on localhost.
+// The receiving side behaves like a real-time client: it decodes a frame as soon as it is complete,
+// or partially once a newer frame shows up or the display deadline expires.
+// Output quality is compared against the source and against a decode of the same stream without impairments.
+
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "global_managers_init.hpp"
+#include "device.hpp"
+#include "context.hpp"
+#include "cli_parser.hpp"
+#include "pyrowave_encoder.hpp"
+#include "pyrowave_decoder.hpp"
+#include "yuv4mpeg.hpp"
+#include "work_queue.hpp"
+
+using namespace Granite;
+using namespace Vulkan;
+using namespace Util;
+
+using Clock = std::chrono::steady_clock;
+
+struct SimOptions
+{
+	const char *input = nullptr;
+	const char *csv = nullptr;
+	uint32_t bytes_per_frame = 0;
+	unsigned mtu = 1200;
+	unsigned num_frames = 0;
+
+	// Independent loss probability per packet.
+	double loss = 0.0;
+	// Gilbert-Elliott burst loss: probability of entering the burst state per packet,
+	// and mean burst length in packets. Every packet is lost while in the burst state.
+	double burst_enter = 0.0;
+	double burst_length = 4.0;
+	// Probability that a packet is held back by reorder_delay_ms.
+	double reorder = 0.0;
+	double reorder_delay_ms = 2.0;
+	double latency_ms = 1.0;
+	// Mean of an exponentially distributed delay added to every packet.
+	double jitter_ms = 0.0;
+	// Link rate used to spread the packets of a frame, 0 sends them back-to-back.
+	double rate_mbps = 0.0;
+	// How long after the nominal arrival of a frame the receiver waits before giving up on it.
+	// Negative selects one frame interval.
+	double deadline_ms = -1.0;
+	uint32_t seed = 1;
+	bool udp = false;
+};
+
+struct YCbCrImages
+{
+	Vulkan::ImageHandle images[3];
+	PyroWave::ViewBuffers views;
+};
+
+static YCbCrImages create_ycbcr_images(Device &device, int width, int height, VkFormat fmt, PyroWave::ChromaSubsampling chroma)
+{
+	YCbCrImages images;
+	auto info = ImageCreateInfo::immutable_2d_image(width, height, fmt);
+	info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+	             VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	images.images[0] = device.create_image(info);
+	device.set_name(*images.images[0], "Y");
+
+	if (chroma == PyroWave::ChromaSubsampling::Chroma420)
+	{
+		info.width >>= 1;
+		info.height >>= 1;
+	}
+
+	images.images[1] = device.create_image(info);
+	device.set_name(*images.images[1], "Cb");
+
+	images.images[2] = device.create_image(info);
+	device.set_name(*images.images[2], "Cr");
+
+	for (int i = 0; i < 3; i++)
+		images.views.planes[i] = &images.images[i]->get_view();
+
+	return images;
+}
+
+// Host copy of a frame, planes stored back to back.
+using HostFrame = std::shared_ptr<const std::vector<uint8_t>>;
+
+struct DecodeTarget
+{
+	YCbCrImages outputs;
+	BufferHandle planes[3];
+	Fence fence;
+};
+
+static bool create_decode_target(Device &device, DecodeTarget &target, int width, int height, VkFormat fmt,
+                                 PyroWave::ChromaSubsampling chroma)
+{
+	target.outputs = create_ycbcr_images(device, width, height, fmt, chroma);
+
+	for (int i = 0; i < 3; i++)
+	{
+		auto *view = target.outputs.views.planes[i];
+		BufferCreateInfo bufinfo = {};
+		bufinfo.domain = BufferDomain::CachedHost;
+		bufinfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		bufinfo.size = format_get_layer_size(view->get_format(), VK_IMAGE_ASPECT_COLOR_BIT,
+		                                     view->get_view_width(), view->get_view_height(), 1);
+		target.planes[i] = device.create_buffer(bufinfo);
+		if (!target.planes[i])
+			return false;
+	}
+
+	return true;
+}
+
+// Decodes whatever the decoder currently holds and reads it back.
+static HostFrame decode_to_host(Device &device, PyroWave::Decoder &dec, DecodeTarget &target, double &gpu_ms)
+{
+	auto &outputs = target.outputs.views;
+	auto cmd = device.request_command_buffer();
+
+	for (auto &img : target.outputs.images)
+	{
+		cmd->image_barrier(*img, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+		                   VK_PIPELINE_STAGE_2_COPY_BIT, 0,
+		                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+	}
+
+	if (!dec.decode(*cmd, outputs))
+	{
+		device.submit_discard(cmd);
+		return {};
+	}
+
+	for (auto &plane : outputs.planes)
+	{
+		cmd->image_barrier(plane->get_image(),
+		                   VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		cmd->copy_image_to_buffer(*target.planes[i], outputs.planes[i]->get_image(), 0,
+		                          {}, { outputs.planes[i]->get_view_width(),
+		                                outputs.planes[i]->get_view_height(), 1 },
+		                          0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+	}
+
+	cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+	             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+	auto start = Clock::now();
+	target.fence.reset();
+	device.submit(cmd, &target.fence);
+	target.fence->wait();
+	gpu_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	target.fence.reset();
+
+	auto frame = std::make_shared<std::vector<uint8_t>>();
+	for (auto &plane : target.planes)
+	{
+		auto size = plane->get_create_info().size;
+		auto *mapped = static_cast<const uint8_t *>(device.map_host_buffer(*plane, MEMORY_ACCESS_READ_BIT));
+		frame->insert(frame->end(), mapped, mapped + size);
+	}
+
+	device.next_frame_context();
+	return frame;
+}
+
+static double compute_psnr(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, bool is_16bit)
+{
+	double error = 0.0;
+	size_t count;
+
+	if (is_16bit)
+	{
+		count = a.size() / 2;
+		for (size_t i = 0; i < count; i++)
+		{
+			uint16_t x, y;
+			memcpy(&x, a.data() + 2 * i, sizeof(x));
+			memcpy(&y, b.data() + 2 * i, sizeof(y));
+			double diff = double(int(x) - int(y));
+			error += diff * diff;
+		}
+	}
+	else
+	{
+		count = a.size();
+		for (size_t i = 0; i < count; i++)
+		{
+			double diff = double(int(a[i]) - int(b[i]));
+			error += diff * diff;
+		}
+	}
+
+	// Identical frames, cap rather than report infinity.
+	if (error == 0.0)
+		return 100.0;
+
+	double peak = is_16bit ? 65535.0 : 255.0;
+	return 10.0 * log10(peak * peak * double(count) / error);
+}
+
+struct EncodedFrame
+{
+	std::vector<uint8_t> payload;
+	std::vector<PyroWave::Encoder::Packet> packets;
+	double reference_psnr;
+};
+
+// Every datagram is prefixed with the frame index, like an RTP timestamp.
+// The receiver only uses it for bookkeeping, the PyroWave packets are self-describing.
+struct SimPacketHeader
+{
+	uint32_t frame_index;
+	uint32_t packet_index;
+};
+
+class Transport
+{
+public:
+	virtual ~Transport() = default;
+	virtual bool send(const void *data, size_t size) = 0;
+	// Returns 0 if nothing arrived before the deadline.
+	virtual size_t receive(void *data, size_t size, Clock::time_point deadline) = 0;
+};
+
+class ChannelTransport : public Transport
+{
+public:
+	bool send(const void *data, size_t size) override
+	{
+		auto *bytes = static_cast<const uint8_t *>(data);
+		queue.push(std::vector<uint8_t>(bytes, bytes + size));
+		return true;
+	}
+
+	size_t receive(void *data, size_t size, Clock::time_point deadline) override
+	{
+		std::vector<uint8_t> datagram;
+		if (!queue.pop_until(datagram, deadline))
+			return 0;
+		// Same truncation semantics as recv().
+		size = std::min(size, datagram.size());
+		memcpy(data, datagram.data(), size);
+		return size;
+	}
+
+private:
+	WorkQueue<std::vector<uint8_t>> queue;
+};
+
+#ifndef _WIN32
+class UDPTransport : public Transport
+{
+public:
+	~UDPTransport() override
+	{
+		if (rx_fd >= 0)
+			close(rx_fd);
+		if (tx_fd >= 0)
+			close(tx_fd);
+	}
+
+	bool init()
+	{
+		rx_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		tx_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (rx_fd < 0 || tx_fd < 0)
+			return false;
+
+		// A full frame is sent in a burst, make sure the kernel does not drop it on our behalf.
+		int buffer_size = 16 * 1024 * 1024;
+		setsockopt(rx_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+		setsockopt(tx_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+
+		if (bind(rx_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0)
+			return false;
+
+		socklen_t len = sizeof(addr);
+		if (getsockname(rx_fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0)
+			return false;
+
+		return true;
+	}
+
+	bool send(const void *data, size_t size) override
+	{
+		return sendto(tx_fd, data, size, 0, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == ssize_t(size);
+	}
+
+	size_t receive(void *data, size_t size, Clock::time_point deadline) override
+	{
+		for (;;)
+		{
+			// Round up, so we do not spin on a zero timeout right before the deadline.
+			auto remaining_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+			pollfd pfd = { rx_fd, POLLIN, 0 };
+			int ret = poll(&pfd, 1, int(std::max<int64_t>((remaining_ns + 999999) / 1000000, 0)));
+			if (ret == 0)
+				return 0;
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return 0;
+			}
+
+			ssize_t received = recv(rx_fd, data, size, 0);
+			if (received > 0)
+				return size_t(received);
+		}
+	}
+
+private:
+	int rx_fd = -1;
+	int tx_fd = -1;
+	sockaddr_in addr = {};
+};
+#endif
+
+struct ScheduledPacket
+{
+	int64_t deliver_ns;
+	uint32_t frame_index;
+	uint32_t packet_index;
+};
+
+struct NetworkStats
+{
+	size_t sent;
+	size_t dropped;
+	size_t reordered;
+};
+
+// Applies the impairments up front with a seeded RNG, so runs are reproducible
+// regardless of the transport or scheduling noise.
+static std::vector<ScheduledPacket> schedule_packets(const std::vector<EncodedFrame> &frames, const SimOptions &options,
+                                                     int64_t frame_interval_ns, NetworkStats &stats)
+{
+	std::mt19937 rng(options.seed);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::exponential_distribution<double> jitter(options.jitter_ms > 0.0 ? 1.0 / options.jitter_ms : 1.0);
+	double burst_exit = 1.0 / std::max(options.burst_length, 1.0);
+	bool in_burst = false;
+
+	std::vector<ScheduledPacket> schedule;
+	stats = {};
+
+	for (size_t f = 0; f < frames.size(); f++)
+	{
+		double send_ms = 1e-6 * double(int64_t(f) * frame_interval_ns);
+		for (size_t p = 0; p < frames[f].packets.size(); p++)
+		{
+			stats.sent++;
+			if (options.rate_mbps > 0.0)
+				send_ms += double(frames[f].packets[p].size) * 8.0 / (options.rate_mbps * 1000.0);
+
+			bool lost;
+			if (in_burst)
+			{
+				lost = true;
+				if (uniform(rng) < burst_exit)
+					in_burst = false;
+			}
+			else
+			{
+				lost = uniform(rng) < options.loss;
+				if (uniform(rng) < options.burst_enter)
+					in_burst = true;
+			}
+
+			if (lost)
+			{
+				stats.dropped++;
+				continue;
+			}
+
+			double deliver_ms = send_ms + options.latency_ms;
+			if (options.jitter_ms > 0.0)
+				deliver_ms += jitter(rng);
+			if (uniform(rng) < options.reorder)
+			{
+				deliver_ms += options.reorder_delay_ms;
+				stats.reordered++;
+			}
+
+			schedule.push_back({ int64_t(deliver_ms * 1e6), uint32_t(f), uint32_t(p) });
+		}
+	}
+
+	std::stable_sort(schedule.begin(), schedule.end(), [](const ScheduledPacket &a, const ScheduledPacket &b) {
+		return a.deliver_ns < b.deliver_ns;
+	});
+
+	return schedule;
+}
+
+enum class FrameStatus
+{
+	Complete,
+	Partial,
+	Lost
+};
+
+static const char *status_to_str(FrameStatus status)
+{
+	switch (status)
+	{
+	case FrameStatus::Complete:
+		return "complete";
+	case FrameStatus::Partial:
+		return "partial";
+	default:
+		return "lost";
+	}
+}
+
+struct FrameResult
+{
+	uint32_t packets_received;
+	uint32_t packets_late;
+	FrameStatus status;
+	// From the nominal send time until decode_is_ready() accepted the frame, or the frame was given up on.
+	double ready_ms;
+	double decode_ms;
+	double psnr;
+};
+
+static bool encode_stream(Device &device, const YUV4MPEGFile &input, const SimOptions &options,
+                          VkFormat fmt, PyroWave::ChromaSubsampling chroma, std::vector<EncodedFrame> &frames)
+{
+	int width = input.get_width();
+	int height = input.get_height();
+	bool is_16bit = YUV4MPEGFile::format_to_bytes_per_component(input.get_format()) == 2;
+
+	PyroWave::Encoder enc;
+	PyroWave::Decoder dec;
+	if (!enc.init(&device, width, height, chroma) || !dec.init(&device, width, height, chroma))
+		return false;
+
+	auto inputs = create_ycbcr_images(device, width, height, fmt, chroma);
+	DecodeTarget target;
+	if (!create_decode_target(device, target, width, height, fmt, chroma))
+		return false;
+
+	BufferCreateInfo buffer_info = {};
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.size = enc.get_meta_required_size();
+	buffer_info.domain = BufferDomain::Device;
+	auto meta = device.create_buffer(buffer_info);
+	buffer_info.domain = BufferDomain::CachedHost;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	auto meta_host = device.create_buffer(buffer_info);
+
+	buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.size = options.bytes_per_frame + 2 * enc.get_meta_required_size();
+	buffer_info.domain = BufferDomain::Device;
+	auto bitstream = device.create_buffer(buffer_info);
+	buffer_info.domain = BufferDomain::CachedHost;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	auto bitstream_host = device.create_buffer(buffer_info);
+
+	if (!meta || !meta_host || !bitstream || !bitstream_host)
+		return false;
+
+	PyroWave::Encoder::BitstreamBuffers buffers = {};
+	buffers.meta.buffer = meta.get();
+	buffers.meta.size = meta->get_create_info().size;
+	buffers.bitstream.buffer = bitstream.get();
+	buffers.bitstream.size = bitstream->get_create_info().size;
+	buffers.target_size = options.bytes_per_frame;
+
+	std::vector<uint8_t> source;
+	void *source_planes[3];
+	for (int i = 0; i < 3; i++)
+		source.resize(source.size() + input.get_plane_size(i));
+	source_planes[0] = source.data();
+	source_planes[1] = source.data() + input.get_plane_size(0);
+	source_planes[2] = source.data() + input.get_plane_size(0) + input.get_plane_size(1);
+
+	Fence fence;
+
+	for (auto &frame : frames)
+	{
+		size_t index = size_t(&frame - frames.data());
+		if (!input.read_frame(index, source_planes))
+		{
+			LOGE("Failed to read frame %zu.\n", index);
+			return false;
+		}
+
+		auto cmd = device.request_command_buffer();
+
+		for (auto &img : inputs.images)
+		{
+			cmd->image_barrier(*img, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			                   0, 0,
+			                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			auto *dst = cmd->update_image(*inputs.images[i]);
+			memcpy(dst, source_planes[i], input.get_plane_size(i));
+		}
+
+		for (auto &img : inputs.images)
+		{
+			cmd->image_barrier(*img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			                   VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+			                   VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+		}
+
+		if (!enc.encode(*cmd, inputs.views, buffers))
+		{
+			device.submit_discard(cmd);
+			LOGE("Failed to encode.\n");
+			return false;
+		}
+
+		cmd->barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		             VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+		cmd->copy_buffer(*bitstream_host, *bitstream);
+		cmd->copy_buffer(*meta_host, *meta);
+		cmd->barrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+		fence.reset();
+		device.submit(cmd, &fence);
+		fence->wait();
+		device.next_frame_context();
+
+		auto *mapped_meta = device.map_host_buffer(*meta_host, MEMORY_ACCESS_READ_BIT);
+		auto *mapped_bitstream = device.map_host_buffer(*bitstream_host, MEMORY_ACCESS_READ_BIT);
+
+		frame.payload.resize(bitstream->get_create_info().size);
+		frame.packets.resize(enc.compute_num_packets(mapped_meta, options.mtu));
+		frame.packets.resize(enc.packetize(frame.packets.data(), options.mtu,
+		                                   frame.payload.data(), frame.payload.size(),
+		                                   mapped_meta, mapped_bitstream));
+
+		// Reference decode with every packet delivered.
+		for (auto &packet : frame.packets)
+		{
+			if (!dec.push_packet(frame.payload.data() + packet.offset, packet.size))
+			{
+				LOGE("Failed to push packet.\n");
+				return false;
+			}
+		}
+
+		if (!dec.decode_is_ready(false))
+		{
+			LOGE("Reference decoder did not receive a complete frame.\n");
+			return false;
+		}
+
+		double gpu_ms;
+		auto decoded = decode_to_host(device, dec, target, gpu_ms);
+		if (!decoded)
+		{
+			LOGE("Failed to decode.\n");
+			return false;
+		}
+
+		frame.reference_psnr = compute_psnr(source, *decoded, is_16bit);
+		LOGI("Encoded frame %06zu, %zu packets, %.3f dB.\n", index, frame.packets.size(), frame.reference_psnr);
+	}
+
+	return true;
+}
+
+// Delivers packets at their scheduled time.
+static void run_sender(Transport &transport, const std::vector<EncodedFrame> &frames,
+                       const std::vector<ScheduledPacket> &schedule, Clock::time_point start, unsigned mtu)
+{
+	std::vector<uint8_t> datagram(sizeof(SimPacketHeader) + mtu);
+
+	for (auto &scheduled : schedule)
+	{
+		std::this_thread::sleep_until(start + std::chrono::nanoseconds(scheduled.deliver_ns));
+
+		auto &frame = frames[scheduled.frame_index];
+		auto &packet = frame.packets[scheduled.packet_index];
+
+		SimPacketHeader header = { scheduled.frame_index, scheduled.packet_index };
+		datagram.resize(sizeof(header) + packet.size);
+		memcpy(datagram.data(), &header, sizeof(header));
+		memcpy(datagram.data() + sizeof(header), frame.payload.data() + packet.offset, packet.size);
+
+		if (!transport.send(datagram.data(), datagram.size()))
+			LOGW("Failed to send packet %u of frame %u.\n", scheduled.packet_index, scheduled.frame_index);
+	}
+}
+
+struct MetricsJob
+{
+	uint32_t frame_index;
+	HostFrame frame;
+};
+
+// The receiver runs on the main thread, like a single-threaded client would.
+// A newer frame always ends the current one, since the decoder discards the older frame
+// as soon as the first packet of a new sequence is pushed.
+static void run_receiver(Device &device, PyroWave::Decoder &dec, DecodeTarget &target, Transport &transport,
+                         const SimOptions &options, const std::vector<EncodedFrame> &frames, Clock::time_point start,
+                         int64_t frame_interval_ns, int64_t deadline_ns,
+                         std::vector<FrameResult> &results, WorkQueue<MetricsJob> &metrics)
+{
+	std::vector<uint8_t> datagram(sizeof(SimPacketHeader) + options.mtu);
+	size_t num_frames = frames.size();
+	uint32_t next_frame = 0;
+	// Lost frames repeat whatever was last displayed.
+	HostFrame displayed = std::make_shared<std::vector<uint8_t>>(target.planes[0]->get_create_info().size +
+	                                                             target.planes[1]->get_create_info().size +
+	                                                             target.planes[2]->get_create_info().size);
+
+	const auto send_time = [&](uint32_t index) {
+		return start + std::chrono::nanoseconds(int64_t(index) * frame_interval_ns);
+	};
+
+	const auto finalize = [&](uint32_t index) {
+		auto &result = results[index];
+		result.ready_ms = std::chrono::duration<double, std::milli>(Clock::now() - send_time(index)).count();
+
+		// Only the frame the decoder is currently assembling can be decoded,
+		// frames that never received a packet are lost.
+		result.status = FrameStatus::Lost;
+		if (result.packets_received != 0 && dec.decode_is_ready(true))
+		{
+			bool complete = dec.decode_is_ready(false);
+			auto decoded = decode_to_host(device, dec, target, result.decode_ms);
+			if (decoded)
+			{
+				displayed = std::move(decoded);
+				result.status = complete ? FrameStatus::Complete : FrameStatus::Partial;
+			}
+		}
+
+		LOGI("Frame %06u: %s, %u / %zu packets, ready %.3f ms, decode %.3f ms.\n",
+		     index, status_to_str(result.status), result.packets_received, frames[index].packets.size(),
+		     result.ready_ms, result.decode_ms);
+		metrics.push({ index, displayed });
+	};
+
+	while (next_frame < num_frames)
+	{
+		auto deadline = send_time(next_frame) +
+		                std::chrono::nanoseconds(int64_t(options.latency_ms * 1e6) + deadline_ns);
+
+		size_t size = transport.receive(datagram.data(), datagram.size(), deadline);
+		if (size == 0)
+		{
+			if (Clock::now() >= deadline)
+				finalize(next_frame++);
+			continue;
+		}
+
+		if (size < sizeof(SimPacketHeader))
+			continue;
+
+		SimPacketHeader header;
+		memcpy(&header, datagram.data(), sizeof(header));
+		if (header.frame_index >= num_frames)
+			continue;
+
+		if (header.frame_index < next_frame)
+		{
+			results[header.frame_index].packets_late++;
+			continue;
+		}
+
+		while (next_frame < header.frame_index)
+			finalize(next_frame++);
+
+		results[next_frame].packets_received++;
+		if (!dec.push_packet(datagram.data() + sizeof(header), size - sizeof(header)))
+			LOGW("Failed to push packet %u of frame %u.\n", header.packet_index, header.frame_index);
+
+		if (dec.decode_is_ready(false))
+			finalize(next_frame++);
+	}
+}
+
+static void run_sim(Device &device, const SimOptions &options)
+{
+	YUV4MPEGFile input;
+	if (!input.open_read(options.input))
+	{
+		LOGE("Failed to open input file.\n");
+		return;
+	}
+
+	if (input.get_num_frames() == 0)
+	{
+		LOGE("Input must be a regular file, random access is needed to compare against the source.\n");
+		return;
+	}
+
+	int width = input.get_width();
+	int height = input.get_height();
+	bool is_16bit = YUV4MPEGFile::format_to_bytes_per_component(input.get_format()) == 2;
+	auto fmt = is_16bit ? VK_FORMAT_R16_UNORM : VK_FORMAT_R8_UNORM;
+	auto chroma = YUV4MPEGFile::format_has_subsampling(input.get_format()) ? PyroWave::ChromaSubsampling::Chroma420 : PyroWave::ChromaSubsampling::Chroma444;
+
+	size_t num_frames = input.get_num_frames();
+	if (options.num_frames)
+		num_frames = std::min<size_t>(num_frames, options.num_frames);
+
+	int64_t frame_interval_ns = 1000000000ll * input.get_frame_rate_den() / std::max(input.get_frame_rate_num(), 1);
+	int64_t deadline_ns = options.deadline_ms >= 0.0 ? int64_t(options.deadline_ms * 1e6) : frame_interval_ns;
+
+	std::vector<EncodedFrame> frames(num_frames);
+	if (!encode_stream(device, input, options, fmt, chroma, frames))
+		return;
+
+	NetworkStats net_stats;
+	auto schedule = schedule_packets(frames, options, frame_interval_ns, net_stats);
+
+	std::unique_ptr<Transport> transport;
+	if (options.udp)
+	{
+#ifndef _WIN32
+		std::unique_ptr<UDPTransport> udp(new UDPTransport);
+		if (!udp->init())
+		{
+			LOGE("Failed to set up loopback sockets.\n");
+			return;
+		}
+		transport = std::move(udp);
+#else
+		LOGE("UDP transport is not supported on this platform.\n");
+		return;
+#endif
+	}
+	else
+		transport.reset(new ChannelTransport);
+
+	PyroWave::Decoder dec;
+	if (!dec.init(&device, width, height, chroma))
+		return;
+
+	DecodeTarget target;
+	if (!create_decode_target(device, target, width, height, fmt, chroma))
+		return;
+
+	std::vector<FrameResult> results(num_frames);
+	WorkQueue<MetricsJob> metrics;
+
+	// PSNR is computed off the receive path so it does not skew the timing.
+	std::thread metrics_thread([&]() {
+		std::vector<uint8_t> source(target.planes[0]->get_create_info().size +
+		                            target.planes[1]->get_create_info().size +
+		                            target.planes[2]->get_create_info().size);
+		void *planes[3] = {
+			source.data(),
+			source.data() + input.get_plane_size(0),
+			source.data() + input.get_plane_size(0) + input.get_plane_size(1),
+		};
+
+		MetricsJob job;
+		while (metrics.pop(job))
+		{
+			if (input.read_frame(job.frame_index, planes))
+				results[job.frame_index].psnr = compute_psnr(source, *job.frame, is_16bit);
+		}
+	});
+
+	// Leave some headroom so the first frame is not late before we even start.
+	auto start = Clock::now() + std::chrono::milliseconds(100);
+	std::thread sender([&]() { run_sender(*transport, frames, schedule, start, options.mtu); });
+
+	run_receiver(device, dec, target, *transport, options, frames, start,
+	             frame_interval_ns, deadline_ns, results, metrics);
+
+	sender.join();
+	metrics.close();
+	metrics_thread.join();
+
+	std::unique_ptr<FILE, decltype(&fclose)> csv{nullptr, &fclose};
+	if (options.csv)
+	{
+		csv.reset(fopen(options.csv, "w"));
+		if (!csv)
+			LOGE("Failed to open %s.\n", options.csv);
+		else
+			fprintf(csv.get(), "frame,packets,received,late,status,ready_ms,decode_ms,psnr_reference,psnr,psnr_drop\n");
+	}
+
+	size_t status_counts[3] = {};
+	size_t late_packets = 0;
+	double psnr_reference_sum = 0.0, psnr_sum = 0.0, worst_drop = 0.0, decode_sum = 0.0;
+	std::vector<double> ready;
+
+	for (size_t i = 0; i < num_frames; i++)
+	{
+		auto &result = results[i];
+		double drop = frames[i].reference_psnr - result.psnr;
+
+		status_counts[int(result.status)]++;
+		late_packets += result.packets_late;
+		psnr_reference_sum += frames[i].reference_psnr;
+		psnr_sum += result.psnr;
+		worst_drop = std::max(worst_drop, drop);
+
+		if (result.status != FrameStatus::Lost)
+		{
+			ready.push_back(result.ready_ms);
+			decode_sum += result.decode_ms;
+		}
+
+		if (csv)
+		{
+			fprintf(csv.get(), "%zu,%zu,%u,%u,%s,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+			        i, frames[i].packets.size(), result.packets_received, result.packets_late,
+			        status_to_str(result.status), result.ready_ms, result.decode_ms,
+			        frames[i].reference_psnr, result.psnr, drop);
+		}
+	}
+
+	std::sort(ready.begin(), ready.end());
+	double ready_mean = 0.0;
+	for (double r : ready)
+		ready_mean += r;
+	if (!ready.empty())
+		ready_mean /= double(ready.size());
+	double ready_p99 = ready.empty() ? 0.0 : ready[std::min(ready.size() - 1, ready.size() * 99 / 100)];
+
+	LOGI("Packets: %zu sent, %zu dropped by network, %zu reordered, %zu late.\n",
+	     net_stats.sent, net_stats.dropped, net_stats.reordered, late_packets);
+	LOGI("Frames: %zu complete, %zu partial, %zu lost.\n",
+	     status_counts[int(FrameStatus::Complete)], status_counts[int(FrameStatus::Partial)],
+	     status_counts[int(FrameStatus::Lost)]);
+	LOGI("Ready latency: mean %.3f ms, p99 %.3f ms. Mean decode %.3f ms.\n",
+	     ready_mean, ready_p99, ready.empty() ? 0.0 : decode_sum / double(ready.size()));
+	LOGI("PSNR: reference %.3f dB, received %.3f dB, mean drop %.3f dB, worst drop %.3f dB.\n",
+	     psnr_reference_sum / double(num_frames), psnr_sum / double(num_frames),
+	     (psnr_reference_sum - psnr_sum) / double(num_frames), worst_drop);
+}
+
+static void run_sim(const SimOptions &options)
+{
+	if (!Context::init_loader(nullptr))
+		return;
+
+	// No WSI is used, so this runs headless, e.g. on lavapipe.
+	Context ctx;
+
+	if (!ctx.init_instance_and_device(nullptr, 0, nullptr, 0, CONTEXT_CREATION_ENABLE_PUSH_DESCRIPTOR_BIT))
+		return;
+
+	Device dev;
+	dev.set_context(ctx);
+
+	run_sim(dev, options);
+}
+
+static void print_help()
+{
+	LOGE("Usage: pyrowave-stream-sim <input.y4m> <bytes_per_frame>\n"
+	     "\t[--frames <count>] (default: all)\n"
+	     "\t[--mtu <bytes>] (default: 1200)\n"
+	     "\t[--loss <probability>]\n"
+	     "\t[--burst-enter <probability>] [--burst-length <packets>] (default: 4)\n"
+	     "\t[--reorder <probability>] [--reorder-delay <ms>] (default: 2)\n"
+	     "\t[--latency <ms>] (default: 1)\n"
+	     "\t[--jitter <mean ms>]\n"
+	     "\t[--rate <Mbit/s>] (default: unlimited)\n"
+	     "\t[--deadline <ms>] (default: one frame interval)\n"
+	     "\t[--seed <seed>] (default: 1)\n"
+	     "\t[--udp] (send over UDP on localhost rather than an in-process channel)\n"
+	     "\t[--csv <path>]\n");
+}
+
+int main(int argc, char **argv)
+{
+	SimOptions options;
+	const char *args[2] = {};
+	unsigned num_positional = 0;
+
+	CLICallbacks cbs;
+	cbs.add("--frames", [&](CLIParser &parser) { options.num_frames = parser.next_uint(); });
+	cbs.add("--mtu", [&](CLIParser &parser) { options.mtu = parser.next_uint(); });
+	cbs.add("--loss", [&](CLIParser &parser) { options.loss = parser.next_double(); });
+	cbs.add("--burst-enter", [&](CLIParser &parser) { options.burst_enter = parser.next_double(); });
+	cbs.add("--burst-length", [&](CLIParser &parser) { options.burst_length = parser.next_double(); });
+	cbs.add("--reorder", [&](CLIParser &parser) { options.reorder = parser.next_double(); });
+	cbs.add("--reorder-delay", [&](CLIParser &parser) { options.reorder_delay_ms = parser.next_double(); });
+	cbs.add("--latency", [&](CLIParser &parser) { options.latency_ms = parser.next_double(); });
+	cbs.add("--jitter", [&](CLIParser &parser) { options.jitter_ms = parser.next_double(); });
+	cbs.add("--rate", [&](CLIParser &parser) { options.rate_mbps = parser.next_double(); });
+	cbs.add("--deadline", [&](CLIParser &parser) { options.deadline_ms = parser.next_double(); });
+	cbs.add("--seed", [&](CLIParser &parser) { options.seed = parser.next_uint(); });
+	cbs.add("--udp", [&](CLIParser &) { options.udp = true; });
+	cbs.add("--csv", [&](CLIParser &parser) { options.csv = parser.next_string(); });
+	cbs.add("--help", [](CLIParser &parser) { parser.end(); });
+	cbs.default_handler = [&](const char *arg)
+	{
+		if (num_positional < 2)
+			args[num_positional] = arg;
+		num_positional++;
+	};
+
+	CLIParser parser(std::move(cbs), argc - 1, argv + 1);
+	if (!parser.parse() || parser.is_ended_state() || num_positional != 2)
+	{
+		print_help();
+		return parser.is_ended_state() ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	options.input = args[0];
+	options.bytes_per_frame = strtoul(args[1], nullptr, 0);
+
+	// Packets must fit in a datagram together with our header.
+	if (options.mtu < 64 || options.mtu > 65000 || options.bytes_per_frame == 0)
+	{
+		print_help();
+		return EXIT_FAILURE;
+	}
+
+	run_sim(options);
+}
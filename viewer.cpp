@@ -9,6 +9,7 @@
 #include "pyrowave_encoder.hpp"
 #include "pyrowave_decoder.hpp"
 #include "yuv4mpeg.hpp"
+#include "pyrowave_file.hpp"
 #include "pyrowave_common.hpp"
 #include "flat_renderer.hpp"
 #include "ui_manager.hpp"
@@ -70,14 +71,10 @@ struct ViewerApplication : Granite::Application, Granite::EventHandler
 	{
 		if (!file.open_read(path))
 		{
-			rawfile.reset(fopen(path, "rb"));
-			if (!rawfile)
-				throw std::runtime_error("Failed to open.");
-			char magic[9] = {};
-			if (fread(magic, 1, 8, rawfile.get()) != 8 || strcmp(magic, "PYROWAVE") != 0)
-				throw std::runtime_error("Failed to open.");
-			if (fread(&rawparam, sizeof(rawparam), 1, rawfile.get()) != 1)
+			rawfile.reset(new PyroWaveFileReader);
+			if (!rawfile->open(path))
 				throw std::runtime_error("Failed to open.");
+			rawparam = rawfile->get_params();
 		}
 
 		get_wsi().set_backbuffer_format(BackbufferFormat::UNORM);
@@ -177,22 +174,26 @@ struct ViewerApplication : Granite::Application, Granite::EventHandler
 
 	bool read_raw_payload()
 	{
-		uint32_t u32_size;
-
-		for (;;)
+		while (raw_index < rawfile->get_num_frames())
 		{
-			if (fread(&u32_size, sizeof(u32_size), 1, rawfile.get()) != 1)
-				return false;
-			packetized_data.resize(u32_size);
-			if (fread(packetized_data.data(), 1, u32_size, rawfile.get()) != u32_size)
-				return false;
+			const void *data = rawfile->map_frame(raw_index);
+			size_t size = rawfile->get_entry(raw_index).size;
+			if (!data)
+			{
+				if (!rawfile->read_frame(raw_index, packetized_data))
+					return false;
+				data = packetized_data.data();
+			}
+			raw_index++;
 
-			if (!dec.push_packet(packetized_data.data(), packetized_data.size()))
+			if (!dec.push_packet(data, size))
 				return false;
 
 			if (dec.decode_is_ready(false))
 				return true;
 		}
+
+		return false;
 	}
 
 	void render_frame(double, double elapsed_time) override
@@ -206,7 +207,7 @@ struct ViewerApplication : Granite::Application, Granite::EventHandler
 			{
 				if (!read_raw_payload())
 				{
-					fseek(rawfile.get(), strlen("PYROWAVE") + sizeof(rawparam), SEEK_SET);
+					raw_index = 0;
 					dec.clear();
 					if (!read_raw_payload())
 					{
@@ -510,22 +511,9 @@ struct ViewerApplication : Granite::Application, Granite::EventHandler
 	unsigned bit_rate_mbit = 200;
 	FlatRenderer flat_renderer;
 
-	struct RawParameters
-	{
-		int32_t width;
-		int32_t height;
-		YUV4MPEGFile::Format format;
-		PyroWave::ChromaSubsampling chroma;
-		uint32_t is_full_range;
-		int32_t frame_rate_num;
-		int32_t frame_rate_den;
-		uint32_t chroma_siting;
-	};
-	static_assert(sizeof(RawParameters) == 32, "RawParameters size mismatch.");
-	struct FILEDeleter { void operator()(FILE *f) { if (f) fclose(f); } };
-
-	std::unique_ptr<FILE, FILEDeleter> rawfile;
-	RawParameters rawparam = {};
+	std::unique_ptr<PyroWaveFileReader> rawfile;
+	PyroWaveFileParams rawparam = {};
+	size_t raw_index = 0;
 
 	int x_slide = 100;
 };
@@ -0,0 +1,62 @@
+// Copyright (c) 2026 Hans-Kristian Arntzen
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <utility>
+
+// Blocking FIFO for handing work between the pipeline stages of the offline tools.
+// Bounding is done by the caller, by recycling a fixed number of items through a second queue.
+template <typename T>
+class WorkQueue
+{
+public:
+	void push(T item)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		items.push_back(std::move(item));
+		cond.notify_one();
+	}
+
+	// Returns false once the queue is closed and drained.
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		cond.wait(holder, [this]() { return !items.empty() || closed; });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+
+	// Returns false on timeout, or once the queue is closed and drained.
+	template <typename Clock, typename Duration>
+	bool pop_until(T &item, const std::chrono::time_point<Clock, Duration> &deadline)
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		if (!cond.wait_until(holder, deadline, [this]() { return !items.empty() || closed; }))
+			return false;
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		closed = true;
+		cond.notify_all();
+	}
+
+private:
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<T> items;
+	bool closed = false;
+};
@@ -3,6 +3,69 @@
 #include "yuv4mpeg.hpp"
 #include <string.h>
 #include <stdint.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define Y4M_SIMD_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define Y4M_SIMD_NEON 1
+#endif
+
+// Rescales N-bit samples to full 16-bit range, i.e. round(x * 65535 / scale), with x clamped to scale.
+// The factor is split into integer and 0.16 fixed point parts, so the vector and scalar paths
+// compute exactly the same rounding. src may be unaligned.
+static void rescale_to_unorm16(uint16_t *dst, const void *src, size_t count, float scale)
+{
+	auto max_value = uint16_t(scale);
+	double factor = 65535.0 / double(max_value);
+	auto int_factor = uint16_t(factor);
+	auto frac_factor = uint16_t(std::min((factor - double(int_factor)) * 65536.0 + 0.5, 65535.0));
+
+	auto *in = static_cast<const uint8_t *>(src);
+	size_t i = 0;
+
+#if Y4M_SIMD_SSE2
+	const __m128i vmax = _mm_set1_epi16(int16_t(max_value));
+	const __m128i vint = _mm_set1_epi16(int16_t(int_factor));
+	const __m128i vfrac = _mm_set1_epi16(int16_t(frac_factor));
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i));
+		// min_epu16 is SSE4.1.
+		x = _mm_sub_epi16(x, _mm_subs_epu16(x, vmax));
+		__m128i lo = _mm_mullo_epi16(x, vfrac);
+		__m128i hi = _mm_mulhi_epu16(x, vfrac);
+		__m128i frac = _mm_add_epi16(hi, _mm_srli_epi16(lo, 15));
+		__m128i result = _mm_adds_epu16(_mm_mullo_epi16(x, vint), frac);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), result);
+	}
+#elif Y4M_SIMD_NEON
+	const uint16x8_t vmax = vdupq_n_u16(max_value);
+	const uint16x8_t vint = vdupq_n_u16(int_factor);
+	const uint16x4_t vfrac = vdup_n_u16(frac_factor);
+
+	for (; i + 8 <= count; i += 8)
+	{
+		uint16x8_t x = vminq_u16(vreinterpretq_u16_u8(vld1q_u8(in + 2 * i)), vmax);
+		uint16x4_t frac_lo = vrshrn_n_u32(vmull_u16(vget_low_u16(x), vfrac), 16);
+		uint16x4_t frac_hi = vrshrn_n_u32(vmull_u16(vget_high_u16(x), vfrac), 16);
+		uint16x8_t result = vqaddq_u16(vmulq_u16(x, vint), vcombine_u16(frac_lo, frac_hi));
+		vst1q_u16(dst + i, result);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		uint16_t x;
+		memcpy(&x, in + 2 * i, sizeof(x));
+		x = std::min(x, max_value);
+		uint32_t frac = (uint32_t(x) * frac_factor + 0x8000u) >> 16;
+		dst[i] = uint16_t(std::min<uint32_t>(uint32_t(x) * int_factor + frac, 0xffff));
+	}
+}
 
 bool YUV4MPEGFile::open_read(const std::string &path)
 {
@@ -44,6 +107,45 @@ bool YUV4MPEGFile::format_has_subsampling(Format format)
 bool YUV4MPEGFile::open(const std::string &path, Mode mode_)
 {
 	mode = mode_;
+	file.reset();
+	mapping.unmap();
+	frame_offsets.clear();
+	next_frame = 0;
+	read_offset = 0;
+	read_end = 0;
+
+	if (mode == Mode::Read)
+	{
+		params.clear();
+
+		if (mapping.map(path))
+		{
+			static const char magic[] = "YUV4MPEG2 ";
+			if (mapping.size() < sizeof(magic) - 1 || memcmp(mapping.data(), magic, sizeof(magic) - 1) != 0)
+			{
+				fprintf(stderr, "Invalid magic\n");
+				return false;
+			}
+
+			auto *begin = reinterpret_cast<const char *>(mapping.data()) + sizeof(magic) - 1;
+			auto *end = static_cast<const char *>(memchr(begin, '\n', mapping.size() - (sizeof(magic) - 1)));
+			if (!end)
+			{
+				fprintf(stderr, "Failed to read header.\n");
+				return false;
+			}
+
+			params.assign(begin, end);
+			params += '\n';
+
+			if (!parse_params())
+				return false;
+
+			index_frames(size_t(end + 1 - reinterpret_cast<const char *>(mapping.data())));
+			return true;
+		}
+	}
+
 	file.reset(fopen(path.c_str(), mode == Mode::Read ? "rb" : "wb"));
 	if (!file)
 	{
@@ -80,6 +182,19 @@ bool YUV4MPEGFile::open(const std::string &path, Mode mode_)
 			return false;
 	}
 
+	if (!parse_params())
+		return false;
+
+	if (mode == Mode::Read)
+		initial_position = ftell(file.get());
+
+	return true;
+}
+
+bool YUV4MPEGFile::parse_params()
+{
+	full_range = false;
+
 	auto w_pos = params.find_first_of('W');
 	if (w_pos == std::string::npos)
 		return false;
@@ -155,16 +270,108 @@ bool YUV4MPEGFile::open(const std::string &path, Mode mode_)
 	else if (params.find("XCOLORRANGE=FULL") != std::string::npos)
 		full_range = true;
 
-	if (mode == Mode::Read)
-		initial_position = ftell(file.get());
-
 	return width > 0 && height > 0;
 }
 
+void YUV4MPEGFile::index_frames(size_t offset)
+{
+	size_t frame_size = get_frame_size();
+	const uint8_t *mapped = mapping.data();
+	size_t mapped_size = mapping.size();
+
+	// Each frame is a FRAME line, optionally with parameters, followed by the planes.
+	// A truncated trailing frame is ignored.
+	while (offset + 5 < mapped_size && memcmp(mapped + offset, "FRAME", 5) == 0)
+	{
+		auto *nl = static_cast<const uint8_t *>(memchr(mapped + offset, '\n', mapped_size - offset));
+		if (!nl)
+			break;
+
+		size_t data_offset = size_t(nl + 1 - mapped);
+		if (mapped_size - data_offset < frame_size)
+			break;
+
+		frame_offsets.push_back(data_offset);
+		offset = data_offset + frame_size;
+	}
+}
+
+int YUV4MPEGFile::get_plane_width(int plane) const
+{
+	return plane != 0 && format_has_subsampling(format) ? width >> 1 : width;
+}
+
+int YUV4MPEGFile::get_plane_height(int plane) const
+{
+	return plane != 0 && format_has_subsampling(format) ? height >> 1 : height;
+}
+
+size_t YUV4MPEGFile::get_plane_size(int plane) const
+{
+	return size_t(get_plane_width(plane)) * size_t(get_plane_height(plane)) * format_to_bytes_per_component(format);
+}
+
+size_t YUV4MPEGFile::get_frame_size() const
+{
+	return get_plane_size(0) + get_plane_size(1) + get_plane_size(2);
+}
+
+size_t YUV4MPEGFile::get_num_frames() const
+{
+	return frame_offsets.size();
+}
+
+bool YUV4MPEGFile::seek_frame(size_t index)
+{
+	if (mode != Mode::Read || index >= frame_offsets.size())
+		return false;
+	next_frame = index;
+	read_offset = 0;
+	read_end = 0;
+	return true;
+}
+
+bool YUV4MPEGFile::needs_rescale() const
+{
+	return format_to_bytes_per_component(format) == 2 && unorm_scale != float(0xffff);
+}
+
+bool YUV4MPEGFile::map_frame(size_t index, FramePlanes &planes) const
+{
+	if (index >= frame_offsets.size())
+		return false;
+
+	size_t offset = frame_offsets[index];
+	for (int i = 0; i < 3; i++)
+	{
+		planes.data[i] = mapping.data() + offset;
+		planes.size[i] = get_plane_size(i);
+		offset += planes.size[i];
+	}
+
+	return true;
+}
+
+bool YUV4MPEGFile::read_frame(size_t index, void * const planes[3]) const
+{
+	FramePlanes mapped_planes;
+	if (!map_frame(index, mapped_planes))
+		return false;
+
+	for (int i = 0; i < 3; i++)
+		copy_samples(planes[i], mapped_planes.data[i], mapped_planes.size[i]);
+
+	return true;
+}
+
 bool YUV4MPEGFile::rewind()
 {
 	if (mode != Mode::Read)
 		return false;
+
+	if (mapping)
+		return seek_frame(0) || frame_offsets.empty();
+
 	return fseek(file.get(), initial_position, SEEK_SET) == 0;
 }
 
@@ -174,21 +381,57 @@ bool YUV4MPEGFile::begin_frame()
 	{
 		return fwrite("FRAME\n", 1, 6, file.get()) == 6;
 	}
+	else if (mapping)
+	{
+		if (next_frame >= frame_offsets.size())
+			return false;
+
+		read_offset = frame_offsets[next_frame++];
+		read_end = read_offset + get_frame_size();
+		return true;
+	}
 	else
 	{
-		std::string line;
-		char c;
+		// FRAME may carry parameters, which we ignore.
+		char line[256];
+		if (!fgets(line, sizeof(line), file.get()))
+			return false;
 
-		while (fread(&c, 1, 1, file.get()) == 1 && c != '\n')
-			line += c;
+		size_t len = strlen(line);
+		bool complete = len && line[len - 1] == '\n';
+		bool is_frame = strncmp(line, "FRAME", 5) == 0 && (line[5] == '\n' || line[5] == ' ');
+
+		// Drain an overly long line.
+		while (!complete && fgets(line, sizeof(line), file.get()))
+		{
+			len = strlen(line);
+			complete = len && line[len - 1] == '\n';
+		}
 
-		return line == "FRAME";
+		return is_frame;
 	}
 }
 
+void YUV4MPEGFile::copy_samples(void *dst, const void *src, size_t size) const
+{
+	if (needs_rescale())
+		rescale_to_unorm16(static_cast<uint16_t *>(dst), src, size / 2, unorm_scale);
+	else
+		memcpy(dst, src, size);
+}
+
 bool YUV4MPEGFile::read(void *pixels, size_t size)
 {
-	if (format == Format::YUV420P16)
+	if (mapping)
+	{
+		if (read_end - read_offset < size)
+			return false;
+
+		copy_samples(pixels, mapping.data() + read_offset, size);
+		read_offset += size;
+		return true;
+	}
+	else if (needs_rescale())
 	{
 		// Recale to P016.
 		auto *out = static_cast<uint16_t *>(pixels);
@@ -200,8 +443,7 @@ bool YUV4MPEGFile::read(void *pixels, size_t size)
 			auto to_read = std::min<size_t>(size, 1024);
 			if (fread(buffer, 2, to_read, file.get()) != to_read)
 				return false;
-			for (size_t i = 0; i < to_read; i++)
-				out[i] = uint16_t(std::min<float>(1.0f, float(buffer[i]) / unorm_scale) * float(0xffff) + 0.5f);
+			rescale_to_unorm16(out, buffer, to_read, unorm_scale);
 
 			size -= to_read;
 			out += to_read;
@@ -215,7 +457,7 @@ bool YUV4MPEGFile::read(void *pixels, size_t size)
 
 bool YUV4MPEGFile::write(const void *pixels, size_t size)
 {
-	if (format == Format::YUV420P16)
+	if (needs_rescale())
 	{
 		auto *inputs = static_cast<const uint16_t *>(pixels);
 		uint16_t buffer[1024];
@@ -4,12 +4,17 @@
 
 #include <memory>
 #include <string>
+#include <vector>
+#include "mapped_file.hpp"
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 
 class YUV4MPEGFile
 {
 public:
+	// Regular files are memory mapped and indexed up front, which enables random access.
+	// Anything that cannot be mapped (e.g. pipes) falls back to sequential stdio reads.
 	bool open_read(const std::string &path);
 	bool rewind();
 	bool open_write(const std::string &path, const std::string &params);
@@ -39,6 +44,29 @@ public:
 	int get_frame_rate_num() const;
 	int get_frame_rate_den() const;
 
+	int get_plane_width(int plane) const;
+	int get_plane_height(int plane) const;
+	size_t get_plane_size(int plane) const;
+
+	// Random access. Only available when the file is memory mapped, otherwise get_num_frames() returns 0.
+	size_t get_num_frames() const;
+	// The next begin_frame() will start at frame index.
+	bool seek_frame(size_t index);
+
+	// Zero-copy access to planes as stored in the file.
+	// Pointers may be unaligned and remain valid until the file is closed or reopened.
+	// 16-bit formats with fewer significant bits are not rescaled, see needs_rescale().
+	struct FramePlanes
+	{
+		const void *data[3];
+		size_t size[3];
+	};
+	bool map_frame(size_t index, FramePlanes &planes) const;
+	bool needs_rescale() const;
+
+	// Copies and rescales a frame to the layout read() provides, independent of the sequential position.
+	bool read_frame(size_t index, void * const planes[3]) const;
+
 private:
 	enum class Mode { Read, Write };
 	bool open(const std::string &path, Mode mode);
@@ -52,4 +80,15 @@ private:
 	bool full_range = false;
 	float unorm_scale = 1.0f;
 	long initial_position = -1;
+
+	MappedFile mapping;
+	std::vector<size_t> frame_offsets;
+	size_t next_frame = 0;
+	size_t read_offset = 0;
+	size_t read_end = 0;
+
+	bool parse_params();
+	void index_frames(size_t offset);
+	size_t get_frame_size() const;
+	void copy_samples(void *dst, const void *src, size_t size) const;
 };